@@ -0,0 +1,426 @@
+/*
+ * AnalogSampler
+ *
+ * Esta clase gestiona el ADC del Arduino: lecturas normales, adquisición síncrona con el encendido, vigilancia de
+ * transitorios de la presión de aceite y modo osciloscopio.
+ */
+
+#include <stdint.h>
+#include <Arduino.h>
+#include "AnalogSampler.h"
+
+AnalogSampler::AnalogSampler() {
+    for (uint8_t i = 0; i < SYNC_CHANNELS; ++i) {
+        _syncPins[i] = 0;
+        _revolutionSum[i] = 0;
+        _sampleValue[i] = 0;
+        _revolutionValue[i] = 0;
+    }
+    _isForegroundBusy = false;
+    _isSyncBusy = false;
+    _isSyncPending = false;
+    _syncChannel = 0;
+    _pendingEvent = 0;
+    _sampleEvent = 0;
+    _revolutionSamples = 0;
+    _revolutionFirstEvent = 0;
+    _revolutionEvent = 0;
+    _revolutionSequence = 0;
+    _missedSamples = 0;
+    _isTransientBusy = false;
+    _isScopeTriggerSample = false;
+    _isForegroundWaiting = false;
+    _transientThreshold = TRANSIENT_NO_THRESHOLD;
+    _transientBelowCount = 0;
+    _transientEvents = 0;
+    ResetTransientWindow();
+    for (uint8_t i = 0; i < ANALOG_CHANNELS; ++i) {
+        _lastValues[i] = 0;
+    }
+    _scopeIndex = 0;
+    _scopeStatus = SCOPE_IDLE;
+    _scopeTrigger = SCOPE_NO_TRIGGER;
+    _scopeLastSample = 0;
+    _scopeChannel = 0;
+}
+
+void AnalogSampler::Begin(uint8_t oilPressurePin, uint8_t afrPin) {
+    _syncPins[SYNC_CHANNEL_OIL_PRESSURE] = oilPressurePin;
+    _syncPins[SYNC_CHANNEL_AFR] = afrPin;
+
+    // Timer3 en modo CTC con prescaler 64 (4us por tick). La interrupción sólo se activa al programar una muestra.
+    noInterrupts();
+    TCCR3A = 0;
+    TCCR3B = _BV(WGM32) | _BV(CS31) | _BV(CS30);
+    TIMSK3 = 0;
+    // Empezamos la vigilancia de transitorios, a partir de aquí las conversiones se encadenan desde la interrupción
+    if (!_isForegroundBusy && !_isSyncBusy)
+        StartTransientConversion();
+    interrupts();
+}
+
+uint16_t AnalogSampler::Read(uint8_t pin) {
+    // El osciloscopio tiene el ADC en modo free-running, devolvemos la última lectura del canal
+    uint8_t channel = PinToChannel(pin);
+    if (IsScopeActive())
+        return _lastValues[channel];
+
+    // Si hay una secuencia síncrona o una conversión en segundo plano en marcha, esperamos a que termine (como mucho
+    // un par de conversiones). Mientras esperamos no se encadenan más conversiones en segundo plano.
+    _isForegroundWaiting = true;
+    while (true) {
+        noInterrupts();
+        // El osciloscopio armado puede dispararse con la conversión que estamos esperando
+        if (IsScopeActive()) {
+            _isForegroundWaiting = false;
+            interrupts();
+            return _lastValues[channel];
+        }
+        if (!_isSyncBusy && !_isTransientBusy) {
+            _isForegroundBusy = true;
+            interrupts();
+            break;
+        }
+        interrupts();
+    }
+
+    uint16_t value = analogRead(pin);
+    _lastValues[channel] = value;
+
+    // Si el timer ha saltado mientras leíamos, lanzamos ahora la secuencia que ha quedado pendiente.
+    // Si no, volvemos a la vigilancia de transitorios.
+    noInterrupts();
+    _isForegroundBusy = false;
+    _isForegroundWaiting = false;
+    if (_isSyncPending)
+        StartSyncSequence();
+    else
+        StartTransientConversion();
+    interrupts();
+
+    return value;
+}
+
+void AnalogSampler::ScheduleSyncSample(uint16_t eventIndex, uint32_t interval) {
+    if (!SYNC_ACQUISITION_ENABLED || !_syncPins[SYNC_CHANNEL_OIL_PRESSURE])
+        return;
+
+    // Mientras el osciloscopio ocupa el ADC no hay adquisición síncrona
+    if (IsScopeActive()) {
+        ++_missedSamples;
+        return;
+    }
+
+    // Si la muestra del encendido anterior todavía no se ha tomado, se pierde
+    if (_isSyncBusy || _isSyncPending || (TIMSK3 & _BV(OCIE3A)))
+        ++_missedSamples;
+
+    // Programamos el Timer3 para que salte a la misma fase del intervalo entre encendidos, sean cuales sean las RPM
+    uint32_t ticks = ((interval / SYNC_TIMER_US_PER_TICK) * SYNC_SAMPLE_PHASE) >> 8;
+    if (ticks < 1)
+        ticks = 1;
+    else if (ticks > 0xFFFF)
+        ticks = 0xFFFF;
+
+    _pendingEvent = eventIndex;
+    TCNT3 = 0;
+    OCR3A = ticks;
+    TIFR3 = _BV(OCF3A);
+    TIMSK3 |= _BV(OCIE3A);
+}
+
+void AnalogSampler::SyncTimerEvent() {
+    TIMSK3 &= ~_BV(OCIE3A);
+
+    if (_isSyncBusy)
+        return;
+    if (IsScopeActive()) {
+        ++_missedSamples;
+        return;
+    }
+
+    // No podemos cambiar de canal en mitad de un analogRead() o de una conversión en segundo plano, así que la
+    // secuencia espera a que termine
+    if (_isForegroundBusy || _isTransientBusy) {
+        _isSyncPending = true;
+    } else {
+        StartSyncSequence();
+    }
+}
+
+void AnalogSampler::ConversionEvent() {
+    if (IsScopeActive()) {
+        ScopeConversionEvent();
+        return;
+    }
+    if (_isTransientBusy) {
+        if (_isScopeTriggerSample)
+            ScopeTriggerEvent();
+        else
+            TransientConversionEvent();
+        return;
+    }
+
+    _sampleValue[_syncChannel] = ADC;
+    ++_syncChannel;
+    if (_syncChannel < SYNC_CHANNELS) {
+        StartConversion(_syncPins[_syncChannel]);
+        return;
+    }
+
+    // Secuencia completa, dejamos el ADC libre para las lecturas normales
+    ADCSRA &= ~_BV(ADIE);
+    _isSyncBusy = false;
+
+    // Si esta muestra ya no pertenece a la vuelta en curso (por ejemplo porque se ha perdido alguna muestra), publicamos la vuelta
+    if (_revolutionSamples > 0 && (uint16_t) (_sampleEvent - _revolutionFirstEvent) >= SYNC_EVENTS_PER_REVOLUTION)
+        PublishRevolution();
+
+    if (_revolutionSamples == 0)
+        _revolutionFirstEvent = _sampleEvent;
+    for (uint8_t i = 0; i < SYNC_CHANNELS; ++i) {
+        _revolutionSum[i] += _sampleValue[i];
+    }
+    ++_revolutionSamples;
+    _revolutionEvent = _sampleEvent;
+
+    if ((uint16_t) (_sampleEvent - _revolutionFirstEvent) >= SYNC_EVENTS_PER_REVOLUTION - 1)
+        PublishRevolution();
+
+    StartTransientConversion();
+}
+
+void AnalogSampler::StartSyncSequence() {
+    _isSyncPending = false;
+    _isSyncBusy = true;
+    _syncChannel = 0;
+    _sampleEvent = _pendingEvent;
+    StartConversion(_syncPins[0]);
+}
+
+void AnalogSampler::StartConversion(uint8_t pin) {
+    // Misma selección de canal que hace analogRead() en el Mega (referencia AVCC)
+    uint8_t channel = PinToChannel(pin);
+    ADCSRB = (ADCSRB & ~_BV(MUX5)) | (((channel >> 3) & 0x01) << MUX5);
+    ADMUX = _BV(REFS0) | (channel & 0x07);
+    ADCSRA |= _BV(ADSC) | _BV(ADIE);
+}
+
+void AnalogSampler::PublishRevolution() {
+    for (uint8_t i = 0; i < SYNC_CHANNELS; ++i) {
+        _revolutionValue[i] = _revolutionSum[i] / _revolutionSamples;
+        _revolutionSum[i] = 0;
+    }
+    _revolutionSamples = 0;
+    ++_revolutionSequence;
+}
+
+void AnalogSampler::StartTransientConversion() {
+    // Sólo si el ADC está libre y nadie está esperando para usarlo
+    if (_isForegroundWaiting || IsScopeActive())
+        return;
+
+    // Con el osciloscopio armado, una de cada dos conversiones en segundo plano es del canal del osciloscopio
+    bool isTransientEnabled = TRANSIENT_CAPTURE_ENABLED && _syncPins[SYNC_CHANNEL_OIL_PRESSURE];
+    if (_scopeStatus == SCOPE_ARMED && (!_isScopeTriggerSample || !isTransientEnabled)) {
+        _isScopeTriggerSample = true;
+        _isTransientBusy = true;
+        StartConversion(A0 + _scopeChannel);
+        return;
+    }
+    if (!isTransientEnabled)
+        return;
+
+    _isScopeTriggerSample = false;
+    _isTransientBusy = true;
+    StartConversion(_syncPins[SYNC_CHANNEL_OIL_PRESSURE]);
+}
+
+void AnalogSampler::TransientConversionEvent() {
+    uint16_t value = ADC;
+    _isTransientBusy = false;
+
+    if (value < _transientWindow.min)
+        _transientWindow.min = value;
+    if (value > _transientWindow.max)
+        _transientWindow.max = value;
+    if (_transientWindow.samples < 0xFFFF)
+        ++_transientWindow.samples;
+
+    if (_transientThreshold != TRANSIENT_NO_THRESHOLD) {
+        if (value < _transientThreshold) {
+            if (_transientWindow.samplesBelow < 0xFFFF)
+                ++_transientWindow.samplesBelow;
+            // La caída cuenta una sola vez, al llegar al mínimo de muestras seguidas
+            if (_transientBelowCount < TRANSIENT_MIN_SAMPLES) {
+                ++_transientBelowCount;
+                if (_transientBelowCount == TRANSIENT_MIN_SAMPLES) {
+                    if (_transientWindow.events < 0xFF)
+                        ++_transientWindow.events;
+                    ++_transientEvents;
+                }
+            }
+        } else if (value >= _transientThreshold + TRANSIENT_HYSTERESIS) {
+            _transientBelowCount = 0;
+        }
+    } else {
+        _transientBelowCount = 0;
+    }
+
+    // El temporizador del encendido tiene prioridad. Si no, encadenamos la siguiente conversión
+    if (_isSyncPending) {
+        StartSyncSequence();
+    } else {
+        ADCSRA &= ~_BV(ADIE);
+        StartTransientConversion();
+    }
+}
+
+void AnalogSampler::ResetTransientWindow() {
+    _transientWindow.min = 0xFFFF;
+    _transientWindow.max = 0;
+    _transientWindow.samples = 0;
+    _transientWindow.samplesBelow = 0;
+    _transientWindow.events = 0;
+}
+
+bool AnalogSampler::GetTransientWindow(TransientWindow *window) {
+    noInterrupts();
+    *window = _transientWindow;
+    ResetTransientWindow();
+    interrupts();
+    return window->samples > 0;
+}
+
+uint16_t AnalogSampler::GetRevolutionValue(SyncChannel channel) {
+    noInterrupts();
+    uint16_t value = _revolutionValue[channel];
+    interrupts();
+    return value;
+}
+
+uint16_t AnalogSampler::GetRevolutionEvent() {
+    noInterrupts();
+    uint16_t event = _revolutionEvent;
+    interrupts();
+    return event;
+}
+
+bool AnalogSampler::StartScope(uint8_t pin, int16_t trigger) {
+    if (_scopeStatus != SCOPE_IDLE)
+        return false;
+
+    _scopeChannel = PinToChannel(pin);
+    _scopeTrigger = trigger;
+    _scopeLastSample = 0xFF; // Así la primera muestra nunca dispara, hace falta un flanco de subida real
+    _scopeIndex = 0;
+
+    if (trigger != SCOPE_NO_TRIGGER) {
+        // El nivel de disparo se busca desde las conversiones en segundo plano, el ADC sigue libre hasta que dispare.
+        // Si la cadena de conversiones está parada (vigilancia de transitorios desactivada), la empezamos aquí
+        noInterrupts();
+        _scopeStatus = SCOPE_ARMED;
+        if (!_isSyncBusy && !_isTransientBusy)
+            StartTransientConversion();
+        interrupts();
+        return true;
+    }
+
+    // Esperamos a que termine la secuencia síncrona o la conversión en segundo plano en curso, las lecturas
+    // normales no pueden estar en marcha porque esta función se llama desde el loop
+    _isForegroundWaiting = true;
+    while (true) {
+        noInterrupts();
+        if (!_isSyncBusy && !_isTransientBusy)
+            break;
+        interrupts();
+    }
+    _isForegroundWaiting = false;
+    // La muestra síncrona pendiente (si la hay) se pierde
+    TIMSK3 &= ~_BV(OCIE3A);
+    _isSyncPending = false;
+    StartFreeRunning();
+    interrupts();
+
+    return true;
+}
+
+void AnalogSampler::StopScope() {
+    noInterrupts();
+    if (_scopeStatus == SCOPE_CAPTURING) {
+        StopFreeRunning();
+        _scopeStatus = SCOPE_IDLE;
+        StartTransientConversion();
+    } else if (_scopeStatus == SCOPE_ARMED) {
+        // Si hay una conversión del canal del osciloscopio en curso, ScopeTriggerEvent() ya no dispara
+        _scopeStatus = SCOPE_IDLE;
+    }
+    interrupts();
+}
+
+void AnalogSampler::FreeScope() {
+    if (_scopeStatus == SCOPE_DONE)
+        _scopeStatus = SCOPE_IDLE;
+}
+
+void AnalogSampler::ScopeTriggerEvent() {
+    // Conversión normal de 10 bits, la comparamos con el nivel de disparo en 8 bits como las muestras del buffer
+    uint8_t sample = ADC >> 2;
+    _isTransientBusy = false;
+
+    // Disparo por flanco de subida al cruzar el nivel indicado. La muestra que dispara es la primera del buffer
+    if (_scopeStatus == SCOPE_ARMED && _scopeLastSample < _scopeTrigger && sample >= _scopeTrigger) {
+        // La muestra síncrona programada o pendiente (si la hay) se pierde
+        if (_isSyncPending || (TIMSK3 & _BV(OCIE3A)))
+            ++_missedSamples;
+        TIMSK3 &= ~_BV(OCIE3A);
+        _isSyncPending = false;
+        _scopeBuffer[0] = sample;
+        _scopeIndex = 1;
+        StartFreeRunning();
+        return;
+    }
+    _scopeLastSample = sample;
+
+    // Igual que al terminar una conversión de la vigilancia de transitorios
+    if (_isSyncPending) {
+        StartSyncSequence();
+    } else {
+        ADCSRA &= ~_BV(ADIE);
+        StartTransientConversion();
+    }
+}
+
+void AnalogSampler::ScopeConversionEvent() {
+    _scopeBuffer[_scopeIndex] = ADCH;
+    ++_scopeIndex;
+    if (_scopeIndex >= SCOPE_BUFFER_SIZE) {
+        StopFreeRunning();
+        _scopeStatus = SCOPE_DONE;
+        StartTransientConversion();
+    }
+}
+
+void AnalogSampler::StartFreeRunning() {
+    _scopeStatus = SCOPE_CAPTURING;
+
+    // ADC en modo free-running, resultado ajustado a la izquierda (leemos sólo ADCH, 8 bits) y prescaler 64
+    ADCSRB = (((_scopeChannel >> 3) & 0x01) << MUX5); // ADTS = 0, free-running
+    ADMUX = _BV(REFS0) | _BV(ADLAR) | (_scopeChannel & 0x07);
+    ADCSRA = _BV(ADEN) | _BV(ADSC) | _BV(ADATE) | _BV(ADIE) | _BV(ADIF) | _BV(ADPS2) | _BV(ADPS1);
+}
+
+void AnalogSampler::StopFreeRunning() {
+    // Volvemos a la configuración de init(): ADC activado y prescaler 128. analogRead() sobreescribe ADMUX (ADLAR)
+    ADCSRA = _BV(ADEN) | _BV(ADPS2) | _BV(ADPS1) | _BV(ADPS0);
+    ADCSRB &= ~(_BV(ADTS2) | _BV(ADTS1) | _BV(ADTS0));
+    // Descartamos la conversión que se haya podido quedar a medias
+    while (ADCSRA & _BV(ADSC));
+    ADCSRA |= _BV(ADIF);
+}
+
+uint8_t AnalogSampler::PinToChannel(uint8_t pin) {
+    if (pin >= A0)
+        pin -= A0;
+    return pin & (ANALOG_CHANNELS - 1);
+}
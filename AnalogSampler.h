@@ -0,0 +1,167 @@
+/*
+ * AnalogSampler
+ *
+ * Esta clase gestiona el ADC del Arduino. Todas las lecturas analógicas del DataManager pasan por aquí,
+ * para que las lecturas normales (analogRead) no se pisen con las conversiones que se lanzan desde interrupciones.
+ *
+ * Modo de adquisición síncrona: con cada encendido de la bobina se programa el Timer3 para que, a una fase fija
+ * del intervalo entre encendidos, se lance una secuencia de conversiones (presión de aceite y AFR) dirigida por la
+ * interrupción del ADC. Cada muestra se etiqueta con el índice del encendido y al completar cada vuelta del motor
+ * se publica la media de la vuelta. Así las lecturas no dependen de cuándo llegue el loop a ellas, y no se mezclan
+ * con la pulsación propia de cada ciclo del motor.
+ *
+ * Modo osciloscopio: captura en ráfaga de un canal del ADC en modo free-running (prescaler 64, ~19.2 kHz, 8 bits)
+ * en un buffer de RAM reservado de antemano, con un nivel de disparo opcional. Mientras el osciloscopio está armado
+ * el ADC funciona normalmente: el canal del osciloscopio se convierte en segundo plano, alternándose con la presión
+ * de aceite, y el free-running sólo empieza al cruzar el nivel de disparo (la primera muestra del buffer es la que
+ * dispara). Sólo durante la captura (~53ms) las lecturas normales devuelven el último valor leído de cada canal,
+ * y la adquisición síncrona y la vigilancia de transitorios se pausan.
+ *
+ * Vigilancia de transitorios: mientras el ADC está libre, la presión de aceite se convierte en segundo plano
+ * continuamente (~9.6 kHz, una conversión lanza la siguiente desde la interrupción). Cada muestra actualiza el
+ * mínimo, el máximo y el tiempo por debajo del umbral de la ventana en curso, y cuenta las caídas de presión que
+ * duran al menos TRANSIENT_MIN_SAMPLES muestras, aunque el loop esté ocupado. Las lecturas normales y la adquisición
+ * síncrona tienen prioridad: esperan como mucho a que termine la conversión en curso (104us).
+ *
+ * OJO: el Timer3 queda reservado para esta clase (los pines PWM 2, 3 y 5 no se pueden usar con analogWrite()).
+ */
+
+#ifndef __ANALOG_SAMPLER__H__
+#define __ANALOG_SAMPLER__H__
+
+#define SYNC_ACQUISITION_ENABLED   true   // Activa la adquisición síncrona con el encendido de la presión de aceite y AFR
+#define SYNC_SAMPLE_PHASE          64     // Fase de muestreo dentro del intervalo entre encendidos (x/256, 64 = 1/4 del intervalo)
+#define SYNC_EVENTS_PER_REVOLUTION 2      // Motor de 4 cilindros, 2 encendidos por vuelta
+#define SYNC_SAMPLE_TIMEOUT        250    // Si no se publica ninguna vuelta en 250 milisegundos (< 240 RPM), volvemos a las lecturas normales
+#define SYNC_TIMER_US_PER_TICK     4      // Timer3 con prescaler 64 -> 4us por tick
+#define SYNC_CHANNELS              2      // Presión de aceite y AFR
+#define ANALOG_CHANNELS            16     // Canales del ADC del Mega (A0-A15)
+
+// Vigilancia de transitorios de la presión de aceite
+#define TRANSIENT_CAPTURE_ENABLED  true   // Activa las conversiones en segundo plano de la presión de aceite
+#define TRANSIENT_SAMPLE_PERIOD    104    // 16MHz / 128 (prescaler) / 13 ciclos por conversión, en microsegundos
+#define TRANSIENT_MIN_SAMPLES      4      // Muestras seguidas por debajo del umbral para contar una caída (~0.4ms, descarta el ruido)
+#define TRANSIENT_HYSTERESIS       8      // Valor raw (~0.1 bares) que hay que superar el umbral para dar por terminada la caída
+#define TRANSIENT_NO_THRESHOLD     0      // Umbral desactivado, sólo se registran el mínimo y el máximo
+
+// Modo osciloscopio
+#define SCOPE_BUFFER_SIZE          1024   // Muestras de 8 bits por captura
+#define SCOPE_SAMPLE_RATE          19231  // 16MHz / 64 (prescaler) / 13 ciclos por conversión, en Hz
+#define SCOPE_NO_TRIGGER           -1     // Captura inmediata, sin esperar al nivel de disparo
+#define SCOPE_TRIGGER_TIMEOUT      2000   // Si no se alcanza el nivel de disparo en 2 segundos, se cancela la captura (el ADC sigue libre mientras tanto)
+
+enum ScopeStatus {
+    SCOPE_IDLE      = 0, // Sin captura, el ADC funciona normalmente
+    SCOPE_ARMED     = 1, // Esperando al nivel de disparo (flanco de subida), con el ADC funcionando normalmente
+    SCOPE_CAPTURING = 2, // Llenando el buffer con el ADC en free-running
+    SCOPE_DONE      = 3  // Captura completa, el buffer está disponible hasta llamar a FreeScope()
+};
+
+enum SyncChannel {
+    SYNC_CHANNEL_OIL_PRESSURE = 0,
+    SYNC_CHANNEL_AFR          = 1
+};
+
+// Resumen de la vigilancia de transitorios desde la última consulta (valores raw del ADC)
+struct TransientWindow {
+    uint16_t min;
+    uint16_t max;
+    uint16_t samples;      // Muestras de la ventana (se satura en 0xFFFF)
+    uint16_t samplesBelow; // Muestras por debajo del umbral, multiplicadas por TRANSIENT_SAMPLE_PERIOD dan el tiempo
+    uint8_t events;        // Caídas por debajo del umbral que han empezado en la ventana
+};
+
+class AnalogSampler {
+    uint8_t _syncPins[SYNC_CHANNELS];   // Pines que se muestrean en cada encendido
+
+    // Estado de la secuencia de conversiones en curso
+    volatile bool _isForegroundBusy;    // Hay una lectura normal (analogRead) en curso
+    volatile bool _isSyncBusy;          // Hay una secuencia síncrona en curso
+    volatile bool _isSyncPending;       // El timer ha saltado durante una lectura normal, la secuencia empieza al terminarla
+    volatile uint8_t _syncChannel;      // Canal que se está convirtiendo
+    volatile uint16_t _pendingEvent;    // Índice del encendido asociado a la muestra programada
+    volatile uint16_t _sampleEvent;     // Índice del encendido de la muestra en curso
+    uint16_t _sampleValue[SYNC_CHANNELS]; // Valores de la muestra en curso
+
+    // Acumuladores de la vuelta en curso
+    uint32_t _revolutionSum[SYNC_CHANNELS];
+    uint8_t _revolutionSamples;
+    uint16_t _revolutionFirstEvent;
+
+    // Última vuelta completa publicada
+    volatile uint16_t _revolutionValue[SYNC_CHANNELS];
+    volatile uint16_t _revolutionEvent; // Índice del último encendido de la vuelta publicada
+    volatile uint8_t _revolutionSequence; // Se incrementa con cada vuelta publicada
+    volatile uint16_t _missedSamples;   // Muestras perdidas (por ejemplo si el encendido llega antes de terminar la anterior)
+
+    // Vigilancia de transitorios
+    volatile bool _isTransientBusy;     // Hay una conversión en segundo plano en curso
+    volatile bool _isScopeTriggerSample; // La conversión en segundo plano es del canal del osciloscopio armado
+    volatile bool _isForegroundWaiting; // Una lectura normal está esperando al ADC, no se lanzan más conversiones en segundo plano
+    volatile uint16_t _transientThreshold;
+    volatile uint8_t _transientBelowCount; // Muestras seguidas por debajo del umbral
+    volatile uint16_t _transientEvents;    // Caídas desde el arranque
+    TransientWindow _transientWindow;      // Ventana en curso, sólo se toca con las interrupciones desactivadas fuera del ISR
+
+    uint16_t _lastValues[ANALOG_CHANNELS]; // Última lectura normal de cada canal, se devuelve mientras el osciloscopio ocupa el ADC
+
+    // Modo osciloscopio
+    uint8_t _scopeBuffer[SCOPE_BUFFER_SIZE];
+    volatile uint16_t _scopeIndex;
+    volatile ScopeStatus _scopeStatus;
+    int16_t _scopeTrigger;
+    uint8_t _scopeLastSample;
+    uint8_t _scopeChannel;
+
+    void StartSyncSequence();
+    void StartConversion(uint8_t pin);
+    void StartTransientConversion();
+    void TransientConversionEvent();
+    void ResetTransientWindow();
+    void PublishRevolution();
+    void ScopeTriggerEvent();
+    void ScopeConversionEvent();
+    void StartFreeRunning();
+    void StopFreeRunning();
+    uint8_t PinToChannel(uint8_t pin);
+    // El osciloscopio ocupa el ADC (free-running) sólo mientras captura
+    bool IsScopeActive() { return _scopeStatus == SCOPE_CAPTURING; };
+
+  public:
+    AnalogSampler();
+
+    // Configura el Timer3. Hay que llamarla desde setup(), ya que init() reconfigura todos los timers antes.
+    void Begin(uint8_t oilPressurePin, uint8_t afrPin);
+
+    // Lectura analógica normal (bloqueante, igual que analogRead), compatible con las conversiones en segundo plano
+    uint16_t Read(uint8_t pin);
+
+    // Funciones llamadas desde las interrupciones
+    void ScheduleSyncSample(uint16_t eventIndex, uint32_t interval); // Interrupt de encendido
+    void SyncTimerEvent();                                           // Timer3
+    void ConversionEvent();                                          // ADC
+
+    // Resultados de la adquisición síncrona (valores raw del ADC, media de la última vuelta completa)
+    uint16_t GetRevolutionValue(SyncChannel channel);
+    uint16_t GetRevolutionEvent();
+    uint8_t GetRevolutionSequence() { return _revolutionSequence; };
+    uint16_t GetMissedSamples() { return _missedSamples; };
+
+    // Vigilancia de transitorios de la presión de aceite. El umbral (raw) lo fija el DataMonitor según las condiciones actuales
+    void SetTransientThreshold(uint16_t threshold) { _transientThreshold = threshold; };
+    // Copia la ventana en curso y empieza una nueva. Devuelve false si no se ha tomado ninguna muestra desde la última consulta
+    bool GetTransientWindow(TransientWindow *window);
+    uint16_t GetTransientEvents() { return _transientEvents; };
+    // La presión está ahora mismo por debajo del umbral (al menos TRANSIENT_MIN_SAMPLES muestras seguidas)
+    bool IsTransientBelowThreshold() { return _transientBelowCount >= TRANSIENT_MIN_SAMPLES; };
+
+    // Modo osciloscopio. El nivel de disparo (0-255) es opcional, SCOPE_NO_TRIGGER para empezar inmediatamente
+    bool StartScope(uint8_t pin, int16_t trigger);
+    void StopScope();
+    void FreeScope();
+    ScopeStatus GetScopeStatus() { return _scopeStatus; };
+    uint8_t GetScopeChannel() { return _scopeChannel; };
+    const uint8_t* GetScopeBuffer() { return _scopeBuffer; };
+};
+
+#endif
@@ -9,52 +9,99 @@
 
 #include <stdint.h>
 #include <OneWire.h>
+#include "FastGPIO.h"
+#include "EEPROMManager.h"
+#include "OneWireAsync.h"
+#include "AnalogSampler.h"
 #include "DataManager.h"
 #include "DataMonitor.h"
+#include "SafetyGuard.h"
+#include "ButtonManager.h"
 #include "AuxManager.h"
 
+// Curva de una sonda lambda de circonio caliente: AFR (* 100) y tensión (mV). Casi plana a los lados y un salto
+// de ~0.7v entre lambda 0.98 y 1.02
+static const int16_t lambdaCurveAFR[LAMBDA_CURVE_POINTS] = { 1300, 1400, 1440, 1455, 1465, 1475, 1485, 1500, 1540, 1600 };
+static const uint16_t lambdaCurveMillivolts[LAMBDA_CURVE_POINTS] = { 900, 870, 830, 760, 600, 300, 180, 140, 110, 100 };
+
 AuxManager::AuxManager() {
     _dataMonitor = NULL;
     _dataManager = NULL;
+    _safetyGuard = NULL;
+    _buttonManager = NULL;
 
     _currentECUMap = ECU_MAP_NORMAL;
     _nextCommand = COMMAND_NONE;
     _afrGaugeOn = false;
-    _controlButtonTimer = 0;
-    _controlButtonCooldownTimer = 0;
     _mapSwitchCooldownTimer = 0;
-    _isControlButtonInCooldown = false;
     _isMapSwitchInCooldown = false;
+    _isRaceMapSelected = false;
+    _isLaunchPressed = false;
     _isLimiterEnabled = false;
-
-    pinMode(INPUT_CONTROL_BUTTON, INPUT);
-    pinMode(INPUT_MAPS_SWITCH_BUTTON, INPUT);
+    _isLimiterArmed = false;
+    _limiterState = LIMITER_IDLE;
+    _limiterInterval = 0;
+    _limiterStepInterval = 0;
+    _recoveryEvents = 0;
+    _cutStartMicros = 0;
+    _cutDuration = 0;
+    _limiterCuts = 0;
+    _lastCutError = 0;
+    _maxCutError = 0;
+    _limiterRPM = 0;
+    _launchRPM = LAUNCH_RPM;
+    _isLaunchActive = false;
 
     pinMode(OUTPUT_AFR_GAUGE_VCC, OUTPUT);
     digitalWrite(OUTPUT_AFR_GAUGE_VCC, HIGH);
+    _lambdaMillivolts = LAMBDA_BIAS_MILLIVOLTS;
+    _lambdaTimer = 0;
+    _lambdaDitherTimer = 0;
+    _isLambdaDitherLean = false;
     pinMode(OUTPUT_LAMBDA, OUTPUT);
     digitalWrite(OUTPUT_LAMBDA, LOW);
     pinMode(OUTPUT_MAP_SWITCH, OUTPUT);
     digitalWrite(OUTPUT_MAP_SWITCH, LOW);
 }
 
-void AuxManager::Initialize(DataManager *dataManager, DataMonitor *dataMonitor) {
+void AuxManager::Initialize(DataManager *dataManager, DataMonitor *dataMonitor, SafetyGuard *safetyGuard, ButtonManager *buttonManager) {
     _dataManager = dataManager;
     _dataMonitor = dataMonitor;
+    _safetyGuard = safetyGuard;
+    _buttonManager = buttonManager;
+    // Los niveles al arrancar no generan eventos
+    _isRaceMapSelected = _buttonManager->IsPressed(BUTTON_MAPS_SWITCH);
+    _isLaunchPressed = _buttonManager->IsPressed(BUTTON_LAUNCH);
+
+    // Timer4 en modo CTC con prescaler 64 (4us por tick). La interrupción sólo se activa durante los cortes.
+    noInterrupts();
+    TCCR4A = 0;
+    TCCR4B = _BV(WGM42) | _BV(CS41) | _BV(CS40);
+    TIMSK4 = 0;
+    // Timer5 en fast PWM con TOP = ICR5 y salida no invertida en OC5A (pin 46), sin interrupciones
+    TCCR5A = _BV(COM5A1) | _BV(WGM51);
+    TCCR5B = _BV(WGM53) | _BV(WGM52) | _BV(CS50);
+    ICR5 = LAMBDA_PWM_TOP;
+    TIMSK5 = 0;
+    interrupts();
+    SetLambdaMillivolts(_lambdaMillivolts);
+    UpdateLimiterTarget();
 }
 
 void AuxManager::Update(uint32_t diff) {
-    if (!_dataManager || !_dataMonitor)
+    if (!_dataManager || !_dataMonitor || !_safetyGuard || !_buttonManager)
         return;
 
     // Llamamos a la función auxiliar para cálculo de las RPM
     _dataManager->RetrieveRPM(micros());
 
+    ConsumeButtonEvents();
+
     // Primero comprobamos el mapa que activar
     ECUMaps newMap = _currentECUMap;
     // Modo carreras?
     if (!_isMapSwitchInCooldown) { // Cooldown, intervalo de tiempo mínimo entre cambios de mapa
-        if (digitalRead(INPUT_MAPS_SWITCH_BUTTON) == HIGH) {
+        if (_isRaceMapSelected) {
             newMap = ECU_MAP_RACE;
         } else {
             newMap = ECU_MAP_NORMAL;
@@ -73,6 +120,9 @@ void AuxManager::Update(uint32_t diff) {
     // Comprobaciones para parámetros fuera de lo normal. Primero comprobamos si bajamos al modo normal por sobretemperatura
     if (_dataMonitor->GetEngineOilTempStatus() == STATUS_DANGER || _dataMonitor->GetGearboxOilTempStatus() == STATUS_DANGER)
         newMap = ECU_MAP_NORMAL; // Aunque estos parámetros estén en valores peligrosos, lo mejor que podemos hacer es volver al modo normal, no al de emergencia, para seguir controlando las levas
+    // Si la tendencia de las temperaturas indica que llegarán al peligro en pocos segundos, dejamos el mapa de carreras antes de llegar
+    if (newMap == ECU_MAP_RACE && _dataMonitor->IsOilTempTrendCritical())
+        newMap = ECU_MAP_NORMAL;
     // Comprobamos si nos hemos pasado de vueltas. Con los mapas de carreras, el limitador de serie no funciona, así que forzamos los mapas de calle para activar el limitador.
     if (_dataMonitor->GetRPMStatus() == STATUS_DANGER) {
         newMap = ECU_MAP_NORMAL;
@@ -82,8 +132,27 @@ void AuxManager::Update(uint32_t diff) {
     if (_dataMonitor->GetRPMStatus() == STATUS_ERROR)
         newMap = ECU_MAP_EMERGENCY;
 
+    // Acciones que el SafetyGuard ya ha tomado desde las interrupciones (el pin de los mapas ya está en calle).
+    // Aquí sólo las hacemos nuestras para que el estado del manager coincida con las salidas.
+    uint8_t trips = _safetyGuard->ConsumeTrips();
+    if (trips & SAFETY_TRIP_SIGNAL_LOSS) {
+        newMap = ECU_MAP_EMERGENCY;
+    } else if (trips & SAFETY_TRIP_OVERREV) {
+        newMap = ECU_MAP_NORMAL;
+        _isLimiterEnabled = true;
+    } else if (trips & SAFETY_TRIP_OIL_PRESSURE) {
+        newMap = ECU_MAP_NORMAL;
+    }
+
+    // El limitador de precisión sólo corta con los mapas de carreras. Lo desarmamos antes de cambiar de mapa, para que
+    // el Timer4 no vuelva a poner los de carreras después
+    UpdateLimiterTarget();
+    if (newMap != ECU_MAP_RACE)
+        SetLimiterArmed(false);
     if (newMap != _currentECUMap)
         SwitchMaps(newMap);
+    if (newMap == ECU_MAP_RACE && !_isLimiterArmed)
+        SetLimiterArmed(true);
 
     // Control de la alimentación de la sonda wideband
     if (!_afrGaugeOn && _dataManager->IsEngineOn()) {
@@ -93,68 +162,198 @@ void AuxManager::Update(uint32_t diff) {
     }
 
     // Control de la emulación de la sonda lambda
-    if (_dataMonitor->GetAFRStatus() != STATUS_COLD) {
-        float afr = _dataManager->GetAFR();
-        if (afr > 14.7) {
-            SetLambdaEmulation(true);
-        } else if (afr < 14.7) {
-            SetLambdaEmulation(false);
-        }
-    }
-
-    // Botón de control
-    if (!_isControlButtonInCooldown) {
-        if (digitalRead(INPUT_CONTROL_BUTTON) == HIGH) {
-            if (_controlButtonTimer >= INTERVAL_SWITCH_TFT_MODE) {
-                // Establecemos el comando para cambiar el modo de la pantalla TFT
-                _nextCommand = COMMAND_CHANGE_SCREEN;
-                _controlButtonTimer = 0;
-                _isControlButtonInCooldown = true; // Para no enviar otro comando a continuación por error
-            } else {
-                _controlButtonTimer += diff;
-            }
-        } else {
-            // Si el intervalo empezó a contar pero no ha llegado al límite, enviamos el comando de cambio de brillo
-            if (_controlButtonTimer > 0)
-                _nextCommand = COMMAND_CHANGE_BRIGHTNESS;
+    UpdateLambdaEmulation(diff);
+}
 
-            _controlButtonTimer = 0;
-            // _isControlButtonInCooldown = false; En este caso no es necesario ningún tipo de cooldown
-        }
-    } else {
-        if (_controlButtonCooldownTimer >= INTERVAL_COOLDOWN) {
-            _isControlButtonInCooldown = false;
-            _controlButtonCooldownTimer = 0;
-        } else {
-            _controlButtonCooldownTimer += diff;
+void AuxManager::ConsumeButtonEvents() {
+    ButtonEvent event;
+    while (_buttonManager->PopEvent(&event)) {
+        switch (event.button) {
+            case BUTTON_CONTROL:
+                // Pulsación corta: brillo de la pantalla TFT. Larga: modo de la pantalla (sin brillo al soltar)
+                if (event.type == BUTTON_EVENT_SHORT_PRESS)
+                    _nextCommand = COMMAND_CHANGE_BRIGHTNESS;
+                else if (event.type == BUTTON_EVENT_LONG_PRESS)
+                    _nextCommand = COMMAND_CHANGE_SCREEN;
+                break;
+            case BUTTON_MAPS_SWITCH:
+                if (event.type == BUTTON_EVENT_STATE_CHANGE)
+                    _isRaceMapSelected = event.isPressed;
+                break;
+            case BUTTON_LAUNCH:
+                if (event.type == BUTTON_EVENT_STATE_CHANGE)
+                    _isLaunchPressed = event.isPressed;
+                break;
+            default:
+                break;
         }
     }
 }
 
 void AuxManager::SwitchAFRGaugePower(bool on) {
     if (on)
-        digitalWrite(OUTPUT_AFR_GAUGE_VCC, LOW); // Lógica invertida
+        FastPin<OUTPUT_AFR_GAUGE_VCC>::Low(); // Lógica invertida
     else
-        digitalWrite(OUTPUT_AFR_GAUGE_VCC, HIGH);
+        FastPin<OUTPUT_AFR_GAUGE_VCC>::High();
 
     _afrGaugeOn = on;
 }
 
 void AuxManager::SwitchMaps(ECUMaps map) {
     if (map == ECU_MAP_RACE)
-        digitalWrite(OUTPUT_MAP_SWITCH, HIGH);
+        FastPin<OUTPUT_MAP_SWITCH>::High();
     else
-        digitalWrite(OUTPUT_MAP_SWITCH, LOW); // Modo emergencia y modo normal desde el punto de vista de la ECU del coche son lo mismo
+        FastPin<OUTPUT_MAP_SWITCH>::Low(); // Modo emergencia y modo normal desde el punto de vista de la ECU del coche son lo mismo
 
     _currentECUMap = map;
     _isMapSwitchInCooldown = true;
 }
 
-void AuxManager::SetLambdaEmulation(bool lean) {
-    if (lean)
-        digitalWrite(OUTPUT_LAMBDA, HIGH);
-    else
-        digitalWrite(OUTPUT_LAMBDA, LOW);    
+void AuxManager::UpdateLambdaEmulation(uint32_t diff) {
+    if (_lambdaDitherTimer >= 500 / LAMBDA_CROSS_FREQUENCY) {
+        _isLambdaDitherLean = !_isLambdaDitherLean;
+        _lambdaDitherTimer = 0;
+    } else {
+        _lambdaDitherTimer += diff;
+    }
+
+    if (_lambdaTimer < LAMBDA_UPDATE_INTERVAL) {
+        _lambdaTimer += diff;
+        return;
+    }
+    uint32_t elapsed = _lambdaTimer;
+    _lambdaTimer = 0;
+
+    uint16_t target = LAMBDA_BIAS_MILLIVOLTS;
+    ParameterStatus afrStatus = _dataMonitor->GetAFRStatus();
+    if (afrStatus != STATUS_COLD && afrStatus != STATUS_ERROR) {
+        int16_t afr = _dataManager->GetAFR() * 100;
+        if (afr > LAMBDA_STOICH_AFR - LAMBDA_DITHER_WINDOW && afr < LAMBDA_STOICH_AFR + LAMBDA_DITHER_WINDOW)
+            afr += _isLambdaDitherLean ? LAMBDA_DITHER_AMPLITUDE : -LAMBDA_DITHER_AMPLITUDE;
+        target = GetLambdaTargetMillivolts(afr);
+    }
+
+    // Primer orden con la constante de tiempo de la sonda, con el tiempo real desde la última actualización
+    int32_t delta = (int32_t) target - _lambdaMillivolts;
+    if (elapsed < LAMBDA_RESPONSE_TIME)
+        delta = delta * (int32_t) elapsed / LAMBDA_RESPONSE_TIME;
+    if (!delta && target != _lambdaMillivolts)
+        delta = target > _lambdaMillivolts ? 1 : -1;
+    SetLambdaMillivolts(_lambdaMillivolts + delta);
+}
+
+uint16_t AuxManager::GetLambdaTargetMillivolts(int16_t afr) {
+    if (afr <= lambdaCurveAFR[0])
+        return lambdaCurveMillivolts[0];
+    for (uint8_t i = 1; i < LAMBDA_CURVE_POINTS; ++i) {
+        if (afr < lambdaCurveAFR[i]) {
+            int32_t low = lambdaCurveMillivolts[i - 1];
+            int32_t high = lambdaCurveMillivolts[i];
+            return low + (high - low) * (afr - lambdaCurveAFR[i - 1]) / (lambdaCurveAFR[i] - lambdaCurveAFR[i - 1]);
+        }
+    }
+    return lambdaCurveMillivolts[LAMBDA_CURVE_POINTS - 1];
+}
+
+void AuxManager::SetLambdaMillivolts(uint16_t millivolts) {
+    _lambdaMillivolts = millivolts;
+    // OCR5A tiene doble buffer en fast PWM, el cambio se aplica al final del periodo sin glitches
+    OCR5A = (uint32_t) millivolts * LAMBDA_PWM_TOP / LAMBDA_VCC_MILLIVOLTS;
+}
+
+void AuxManager::UpdateLimiterTarget() {
+    uint16_t limit = REV_LIMITER_RPM;
+    if (LAUNCH_CONTROL_ENABLED && _isLaunchPressed && _dataManager->GetTPS() >= LAUNCH_MIN_TPS) {
+        // Las RPM de referencia se fijan al pulsar, mientras se mantiene el botón el límite no cambia
+        if (!_isLaunchActive) {
+            uint32_t rpm = _dataManager->GetRPM();
+            _launchRPM = rpm >= FLAT_SHIFT_MIN_RPM ? (rpm < REV_LIMITER_RPM ? rpm : REV_LIMITER_RPM) : LAUNCH_RPM;
+            _isLaunchActive = true;
+        }
+        limit = _launchRPM;
+    } else {
+        _isLaunchActive = false;
+    }
+
+    // Las divisiones sólo cuando cambia el límite, el interrupt trabaja con intervalos
+    if (limit == _limiterRPM)
+        return;
+
+    uint32_t limiterInterval = 30000000UL / limit;
+    uint32_t stepInterval = limiterInterval - 30000000UL / (limit + REV_LIMITER_RPM_PER_EVENT);
+    noInterrupts();
+    _limiterInterval = limiterInterval;
+    _limiterStepInterval = stepInterval;
+    interrupts();
+    _limiterRPM = limit;
+}
+
+void AuxManager::SetLimiterArmed(bool armed) {
+    noInterrupts();
+    _isLimiterArmed = REV_LIMITER_ENABLED && armed;
+    if (!_isLimiterArmed) {
+        // Si estábamos cortando, el pin se queda en calle y de ahí lo lleva SwitchMaps()
+        TIMSK4 &= ~_BV(OCIE4A);
+        _limiterState = LIMITER_IDLE;
+    }
+    interrupts();
+}
+
+void AuxManager::IgnitionEvent(uint32_t currentMicros, uint32_t interval) {
+    if (!interval || !_isLimiterArmed)
+        return;
+
+    switch (_limiterState) {
+        case LIMITER_IDLE: {
+            if (interval >= _limiterInterval)
+                break;
+            // Un encendido de corte, más uno por cada REV_LIMITER_RPM_PER_EVENT por encima del límite. Sin divisiones
+            uint32_t overshoot = _limiterInterval - interval;
+            uint8_t events = 1;
+            while (overshoot >= _limiterStepInterval && events < REV_LIMITER_MAX_CUT_EVENTS) {
+                overshoot -= _limiterStepInterval;
+                ++events;
+            }
+
+            FastPin<OUTPUT_MAP_SWITCH>::Low();
+            _cutStartMicros = currentMicros;
+            _cutDuration = interval * events;
+            // Descontamos lo que ha tardado el interrupt en llegar aquí desde el flanco
+            uint32_t elapsed = micros() - currentMicros;
+            uint32_t ticks = elapsed < _cutDuration ? (_cutDuration - elapsed) / REV_LIMITER_US_PER_TICK : 1;
+            TCNT4 = 0;
+            OCR4A = ticks > 0xFFFF ? 0xFFFF : ticks;
+            TIFR4 = _BV(OCF4A);
+            TIMSK4 |= _BV(OCIE4A);
+            _limiterState = LIMITER_CUT;
+            ++_limiterCuts;
+            break;
+        }
+        case LIMITER_RECOVERY:
+            if (!_recoveryEvents || !--_recoveryEvents)
+                _limiterState = LIMITER_IDLE;
+            break;
+        default:
+            break;
+    }
+}
+
+void AuxManager::LimiterTimerEvent() {
+    TIMSK4 &= ~_BV(OCIE4A);
+    if (_limiterState != LIMITER_CUT)
+        return;
+
+    // Si el SafetyGuard ha disparado durante el corte, los mapas se quedan en calle hasta que el loop lo recoja
+    if (_isLimiterArmed && !_safetyGuard->HasPendingTrips())
+        FastPin<OUTPUT_MAP_SWITCH>::High();
+    _limiterState = LIMITER_RECOVERY;
+    _recoveryEvents = REV_LIMITER_RECOVERY_EVENTS;
+
+    int32_t error = (int32_t) (micros() - _cutStartMicros) - (int32_t) _cutDuration;
+    _lastCutError = error > INT16_MAX ? INT16_MAX : (error < INT16_MIN ? INT16_MIN : error);
+    uint16_t absError = error < 0 ? -error : error;
+    if (absError > _maxCutError)
+        _maxCutError = absError;
 }
 
 Commands AuxManager::GetNextCommand() {
@@ -168,5 +367,5 @@ ECUMaps AuxManager::GetCurrentECUMap() {
 }
 
 bool AuxManager::IsLimiterEnabled() {
-    return _isLimiterEnabled;
+    return _isLimiterEnabled || _limiterState == LIMITER_CUT;
 }
\ No newline at end of file
@@ -5,32 +5,75 @@
  * y controlar el corte de inyección por encima de 8000 rpm cambiando entre mapas. También
  * gestiona funciones secundarias o menos relevantes como la alimentación de la controladora
  * de la sonda wideband, señal emulada de la sonda lambda, control de los botones y mapas, etc.
+ *
+ * OJO: el Timer4 queda reservado para el limitador de precisión y el Timer5 para el emulador de la sonda lambda
+ * (los pines PWM 6, 7, 8, 44 y 45 no se pueden usar con analogWrite()).
  */
 
 #ifndef __AUX_MANAGER__H__
 #define __AUX_MANAGER__H__
 
-// INPUTS
-#define INPUT_CONTROL_BUTTON           10       // Input para la señal del botón de control general (0-5v digital)
-#define INPUT_MAPS_SWITCH_BUTTON       8        // Input para la señal del botón de cambio de mapas (0-5v digital)
+// Los botones (INPUTS) están en ButtonManager.h
 
 // OUTPUTS
 #define OUTPUT_AFR_GAUGE_VCC           6       // Pin para controlar la alimentación al controlador (y por lo tanto a la sonda) wideband
-#define OUTPUT_LAMBDA                  46      // Pin para controlar la señal de salida del emulador de sondas lambda (0-5v digital)
+#define OUTPUT_LAMBDA                  46      // Pin para controlar la señal de salida del emulador de sondas lambda (PWM del Timer5, OC5A)
 #define OUTPUT_MAP_SWITCH              52      // Pin para manejar los mapas de la ECU
 
 // Intervalos
-#define INTERVAL_SWITCH_TFT_MODE       2000    // Mantener el botón de control pulsado 2 segundos para cambiar el modo del TFT
-#define INTERVAL_COOLDOWN              2000    // Tras recibir el comando de cambiar el modo, esperar 2 segundos hasta recibir un nuevo comando
-#define MAP_SWITCH_COOLDOWN            1000    // 1 segundo como mínimo entre cambio de mapas, para evitar que por interferencias al darle al botón la ECU OEM se ponga en limp mode
+// El botón de control cambia el brillo del TFT con una pulsación corta y el modo con una larga (BUTTON_LONG_PRESS_TIME)
+#define MAP_SWITCH_COOLDOWN            1000    // 1 segundo como mínimo entre cambio de mapas, para que los cambios seguidos no pongan la ECU OEM en limp mode. Los rebotes del botón ya los filtra el ButtonManager
 #define RPM_LIMITER_HYSTERESIS         250     // Tiempo (en ms) que tarda el manager en reactivar los mapas de carreras después de pasar a los de calle para "simular" un corte de inyección
 
+// Limitador de precisión con los mapas de carreras. Desde el interrupt de encendido, en cuanto un intervalo supera el
+// límite pasamos a los mapas de calle (la ECU de serie corta) durante un número de encendidos proporcional a lo que nos
+// hemos pasado, y el Timer4 devuelve los mapas de carreras justo al final del corte, sin esperar al loop. El corte se
+// mide en encendidos, así que el patrón es el mismo a cualquier régimen. Después del corte hay unos encendidos de
+// recuperación sin cortar, para que la ECU de serie tenga tiempo de volver a inyectar. Si aun así se llega a
+// EMERGENCY_REV_LIMITER, siguen actuando el SafetyGuard y el limitador por tiempo (RPM_LIMITER_HYSTERESIS) de siempre.
+#define REV_LIMITER_ENABLED            true
+#define REV_LIMITER_RPM                8300    // Por debajo de EMERGENCY_REV_LIMITER
+#define REV_LIMITER_RPM_PER_EVENT      100     // Un encendido más de corte por cada 100 RPM por encima del límite...
+#define REV_LIMITER_MAX_CUT_EVENTS     4       // ... hasta 4 encendidos
+#define REV_LIMITER_RECOVERY_EVENTS    2       // Encendidos sin cortar después de cada corte
+#define REV_LIMITER_US_PER_TICK        4       // Timer4 con prescaler 64
+// Launch control / flat shift: con el botón pulsado y el acelerador a fondo, el límite baja. Parado (por debajo de
+// FLAT_SHIFT_MIN_RPM) a LAUNCH_RPM para salir; en marcha a las RPM a las que se pulsa, para cambiar sin levantar el pie.
+// Sólo con los mapas de carreras, que es cuando funciona el limitador de precisión.
+#define LAUNCH_CONTROL_ENABLED         true
+#define LAUNCH_MIN_TPS                 80
+#define LAUNCH_RPM                     4500
+#define FLAT_SHIFT_MIN_RPM             5000
+
 enum ECUMaps {
     ECU_MAP_NORMAL    = 1, // Mapa normal, para uso en calle
     ECU_MAP_RACE      = 2, // Mapa para pista, más pensado para gasolina de 98 octanos, ganas 500 RPM antes del corte
     ECU_MAP_EMERGENCY = 3  // Modo emergencia, mapa normal + levas en el lóbulo de ALTAS (si, el de altas, no el de bajas)
 };
 
+// Emulador de sonda lambda de banda estrecha. El pin 46 da un PWM del Timer5 (~15.6 kHz) que un filtro RC (10k + 1uF,
+// ~10ms) convierte en la tensión de una sonda de circonio: ~0.9v rico, ~0.1v pobre y un salto brusco en la
+// estequiométrica. La tensión sale de la curva (ver la tabla en AuxManager.cpp) con el AFR de la wideband, y se mueve
+// hacia ella con la constante de tiempo de una sonda real. Cerca de la estequiométrica se suma una pequeña oscilación
+// del AFR, para que la ECU de serie vea cruces de 0.45v a la frecuencia que espera aunque la mezcla sea muy estable.
+// El PWM lo genera el timer, el loop sólo actualiza el ciclo de trabajo cada LAMBDA_UPDATE_INTERVAL.
+#define LAMBDA_PWM_TOP                 1023    // Fast PWM de 10 bits sin prescaler
+#define LAMBDA_VCC_MILLIVOLTS          5000
+#define LAMBDA_STOICH_AFR              1470    // AFR * 100
+#define LAMBDA_UPDATE_INTERVAL         5       // Actualización de la tensión cada 5ms
+#define LAMBDA_RESPONSE_TIME           60      // Constante de tiempo (ms) del cambio de tensión, como una sonda caliente
+#define LAMBDA_CROSS_FREQUENCY         2       // Cruces por la estequiométrica (Hz) que se fuerzan con la mezcla estable...
+#define LAMBDA_DITHER_WINDOW           30      // ... si el AFR está a menos de 0.3 de la estequiométrica (AFR * 100)...
+#define LAMBDA_DITHER_AMPLITUDE        15      // ... sumándole +-0.15 (AFR * 100)
+#define LAMBDA_BIAS_MILLIVOLTS         450     // Sonda fría o sin AFR válido: tensión de polarización, la ECU de serie va en lazo abierto
+#define LAMBDA_CURVE_POINTS            10
+
+enum LimiterState {
+    LIMITER_IDLE     = 0,
+    LIMITER_CUT      = 1, // Mapas de calle hasta que salte el Timer4
+    LIMITER_RECOVERY = 2  // Mapas de carreras, sin cortar durante REV_LIMITER_RECOVERY_EVENTS encendidos
+};
+
 enum Commands {
     COMMAND_NONE              = 0,
     COMMAND_CHANGE_BRIGHTNESS = 1,
@@ -40,34 +83,68 @@ enum Commands {
 class AuxManager {
     DataManager *_dataManager; // Puntero al DataManager, de donde recuperaremos los datos
     DataMonitor *_dataMonitor; // Puntero al DataMonitor, para recuperar el estado de los parámetros
+    SafetyGuard *_safetyGuard; // Puntero al SafetyGuard, para mantener las acciones de seguridad que ya ha tomado desde las interrupciones
+    ButtonManager *_buttonManager; // Puntero al ButtonManager, de donde recibimos los eventos de los botones
 
     ECUMaps _currentECUMap;
     bool _afrGaugeOn;
     Commands _nextCommand;
-    uint32_t _controlButtonTimer;
-    uint32_t _controlButtonCooldownTimer;
     uint32_t _mapSwitchCooldownTimer;
-    bool _isControlButtonPressed;
-    bool _isControlButtonInCooldown;
     bool _isMapSwitchInCooldown;
+    bool _isRaceMapSelected;   // Posición del interruptor de mapas, del último evento del ButtonManager
+    bool _isLaunchPressed;
     bool _isLimiterEnabled;
 
+    // Limitador de precisión, compartido con los interrupts de encendido y del Timer4
+    volatile bool _isLimiterArmed;           // Mapas de carreras activos, el interrupt puede cortar
+    volatile LimiterState _limiterState;
+    volatile uint32_t _limiterInterval;      // Intervalo (us) del límite actual
+    volatile uint32_t _limiterStepInterval;  // Intervalo equivalente a REV_LIMITER_RPM_PER_EVENT por encima del límite
+    volatile uint8_t _recoveryEvents;
+    volatile uint32_t _cutStartMicros;
+    volatile uint32_t _cutDuration;          // Duración programada del corte (us)
+    volatile uint16_t _limiterCuts;
+    volatile int16_t _lastCutError;          // Duración real del corte menos la programada (us)
+    volatile uint16_t _maxCutError;
+    uint16_t _limiterRPM;                    // Límite actual, REV_LIMITER_RPM o el del launch control / flat shift
+    uint16_t _launchRPM;                     // Límite fijado al pulsar el botón de launch control / flat shift
+    bool _isLaunchActive;
+
+    // Emulador de sonda lambda
+    uint16_t _lambdaMillivolts;              // Tensión actual de la salida
+    uint32_t _lambdaTimer;
+    uint32_t _lambdaDitherTimer;
+    bool _isLambdaDitherLean;                // Sentido actual de la oscilación alrededor de la estequiométrica
+
+    void ConsumeButtonEvents();
     void SwitchAFRGaugePower(bool on);    // Para activar/desactivar el relé que da corriente al controlador de la sonda wideband
     void SwitchMaps(ECUMaps map);         // Para cambiar entre los mapas de la ECU
-    void SetLambdaEmulation(bool lean);   // Para cambiar entre rico/pobre en el emulador de sonda lambda
+    void UpdateLambdaEmulation(uint32_t diff); // Tensión del emulador de sonda lambda a partir del AFR
+    uint16_t GetLambdaTargetMillivolts(int16_t afr); // Curva de la sonda de banda estrecha, AFR * 100
+    void SetLambdaMillivolts(uint16_t millivolts);
+    void UpdateLimiterTarget();           // Límite según el launch control / flat shift
+    void SetLimiterArmed(bool armed);
   public:
     // Constructor, en este caso sólo inicializa las variables privadas de la clase
     AuxManager();
 
     // Función de inicialización, aquí es donde realmente empieza a funcionar este manager, en cuanto el DataManager y el DataMonitor estén operativos
-    void Initialize(DataManager *dataManager, DataMonitor *dataMonitor);
+    void Initialize(DataManager *dataManager, DataMonitor *dataMonitor, SafetyGuard *safetyGuard, ButtonManager *buttonManager);
     void Update(uint32_t diff);
+    // Llamadas desde las interrupciones: encendido (intervalo aceptado, 0 si no se ha aceptado) y fin del corte (Timer4)
+    void IgnitionEvent(uint32_t currentMicros, uint32_t interval);
+    void LimiterTimerEvent();
 
     Commands GetNextCommand();
 
     ECUMaps GetCurrentECUMap();
 
     bool IsLimiterEnabled();
+    uint16_t GetLimiterCuts() { return _limiterCuts; };
+    int16_t GetLastCutError() { return _lastCutError; };
+    uint16_t GetMaxCutError() { return _maxCutError; };
+    uint16_t GetLimiterRPM() { return _limiterRPM; };
+    uint16_t GetLambdaMillivolts() { return _lambdaMillivolts; };
 };
 
 #endif
@@ -0,0 +1,158 @@
+/*
+ * ButtonManager
+ *
+ * Botones por interrupciones de cambio de pin con antirrebote y cola de eventos, ver ButtonManager.h
+ */
+
+#include <stdint.h>
+#include <OneWire.h>
+#include "FastGPIO.h"
+#include "ButtonManager.h"
+
+// Bit del puerto B (y de PCMSK0) de cada botón, en el orden de Buttons
+static const uint8_t buttonPortBits[BUTTON_COUNT] = { 4, 5, 6 };
+
+ButtonManager::ButtonManager() {
+    _rawPins = 0;
+    for (uint8_t i = 0; i < BUTTON_COUNT; ++i) {
+        _lastEdgeMicros[i] = 0;
+        _isPressed[i] = false;
+        _isLongPressReported[i] = false;
+        _pressMicros[i] = 0;
+    }
+    _edgeHead = 0;
+    _edgeCount = 0;
+    _droppedEdges = 0;
+    _queueHead = 0;
+    _queueCount = 0;
+    _droppedEvents = 0;
+}
+
+void ButtonManager::Begin() {
+    FastPin<INPUT_CONTROL_BUTTON>::SetInput();
+    FastPin<INPUT_MAPS_SWITCH_BUTTON>::SetInput();
+    FastPin<INPUT_LAUNCH_BUTTON>::SetInput();
+
+    noInterrupts();
+    _rawPins = PINB;
+    uint32_t now = micros();
+    for (uint8_t i = 0; i < BUTTON_COUNT; ++i) {
+        _isPressed[i] = _rawPins & _BV(buttonPortBits[i]);
+        // Un botón pulsado al arrancar (por ejemplo el de control para el modo fail safe) no genera pulsaciones al soltarlo
+        _isLongPressReported[i] = _isPressed[i];
+        _lastEdgeMicros[i] = now;
+        PCMSK0 |= _BV(buttonPortBits[i]);
+    }
+    PCIFR = _BV(PCIF0);
+    PCICR |= _BV(PCIE0);
+    interrupts();
+}
+
+void ButtonManager::Update(uint32_t diff) {
+    // Los tiempos salen de los flancos registrados en el ISR, diff no hace falta. Primero los tramos ya terminados...
+    while (true) {
+        noInterrupts();
+        if (!_edgeCount) {
+            interrupts();
+            break;
+        }
+        volatile ButtonEdge *edge = &_edges[_edgeHead];
+        Buttons button = (Buttons) edge->button;
+        bool isPressed = edge->isPressed;
+        uint32_t startMicros = edge->startMicros;
+        _edgeHead = (_edgeHead + 1) % BUTTON_EDGE_QUEUE_SIZE;
+        --_edgeCount;
+        interrupts();
+
+        // Si el loop no ha visto una pulsación completa, aquí aparece su tramo pulsado, y el nivel actual la cierra
+        ApplyLevel(button, isPressed, startMicros);
+    }
+
+    // ... y después el nivel actual de cada botón, si ya lleva BUTTON_DEBOUNCE_TIME estable
+    uint32_t now = micros();
+    for (uint8_t i = 0; i < BUTTON_COUNT; ++i) {
+        Buttons button = (Buttons) i;
+        noInterrupts();
+        bool isRawPressed = _rawPins & _BV(buttonPortBits[i]);
+        uint32_t lastEdge = _lastEdgeMicros[i];
+        interrupts();
+
+        if (isRawPressed != _isPressed[i] && now - lastEdge >= BUTTON_DEBOUNCE_TIME)
+            ApplyLevel(button, isRawPressed, lastEdge);
+
+        if (_isPressed[i] && !_isLongPressReported[i] && now - _pressMicros[i] >= BUTTON_LONG_PRESS_TIME) {
+            PushEvent(button, BUTTON_EVENT_LONG_PRESS, now - _pressMicros[i]);
+            _isLongPressReported[i] = true;
+        }
+    }
+}
+
+void ButtonManager::ApplyLevel(Buttons button, bool isPressed, uint32_t startMicros) {
+    if (isPressed == _isPressed[button])
+        return;
+
+    _isPressed[button] = isPressed;
+    if (isPressed) {
+        _pressMicros[button] = startMicros;
+        _isLongPressReported[button] = false;
+        PushEvent(button, BUTTON_EVENT_STATE_CHANGE, 0);
+        return;
+    }
+
+    PushEvent(button, BUTTON_EVENT_STATE_CHANGE, 0);
+    // Si el loop no ha llegado a ver la pulsación larga mientras duraba, la generamos ahora
+    if (!_isLongPressReported[button]) {
+        uint32_t duration = startMicros - _pressMicros[button];
+        PushEvent(button, duration >= BUTTON_LONG_PRESS_TIME ? BUTTON_EVENT_LONG_PRESS : BUTTON_EVENT_SHORT_PRESS, duration);
+    }
+}
+
+void ButtonManager::PinChangeEvent() {
+    uint32_t now = micros();
+    uint8_t pins = PINB;
+    uint8_t changed = pins ^ _rawPins;
+    for (uint8_t i = 0; i < BUTTON_COUNT; ++i) {
+        uint8_t mask = _BV(buttonPortBits[i]);
+        if (!(changed & mask))
+            continue;
+
+        // El nivel anterior ha estado estable hasta este flanco, lo guardamos en la cola
+        if (now - _lastEdgeMicros[i] >= BUTTON_DEBOUNCE_TIME) {
+            if (_edgeCount < BUTTON_EDGE_QUEUE_SIZE) {
+                volatile ButtonEdge *edge = &_edges[(_edgeHead + _edgeCount) % BUTTON_EDGE_QUEUE_SIZE];
+                edge->button = i;
+                edge->isPressed = _rawPins & mask;
+                edge->startMicros = _lastEdgeMicros[i];
+                ++_edgeCount;
+            } else {
+                ++_droppedEdges;
+            }
+        }
+        _lastEdgeMicros[i] = now;
+    }
+    _rawPins = pins;
+}
+
+void ButtonManager::PushEvent(Buttons button, ButtonEventType type, uint32_t duration) {
+    if (_queueCount >= BUTTON_QUEUE_SIZE) {
+        ++_droppedEvents;
+        return;
+    }
+
+    ButtonEvent *event = &_queue[(_queueHead + _queueCount) % BUTTON_QUEUE_SIZE];
+    event->button = button;
+    event->type = type;
+    event->isPressed = _isPressed[button];
+    event->duration = duration;
+    ++_queueCount;
+}
+
+bool ButtonManager::PopEvent(ButtonEvent *event) {
+    if (!_queueCount)
+        return false;
+
+    *event = _queue[_queueHead];
+    _queueHead = (_queueHead + 1) % BUTTON_QUEUE_SIZE;
+    --_queueCount;
+    return true;
+}
@@ -0,0 +1,96 @@
+/*
+ * ButtonManager
+ *
+ * Botones e interruptores del salpicadero por interrupciones de cambio de pin (PCINT0, puerto B). El ISR guarda el
+ * nivel de cada pin y el momento (micros()) de su último flanco, y el antirrebote trabaja con esos tiempos: un nivel
+ * es válido cuando el pin lo mantiene BUTTON_DEBOUNCE_TIME sin flancos, y empieza en el flanco que lo dejó estable.
+ * Cuando llega un flanco después de un nivel estable, el ISR mete ese nivel y su inicio en una cola, para
+ * que el loop no pierda las pulsaciones completas que ocurran mientras está parado (por ejemplo escribiendo la EEPROM).
+ * Así la duración de una pulsación no depende de lo que tarde el loop, y los rebotes no generan eventos.
+ *
+ * Los eventos van a una cola que consume el AuxManager:
+ *   - BUTTON_EVENT_STATE_CHANGE: en cada cambio de nivel validado (interruptores, como el de mapas).
+ *   - BUTTON_EVENT_SHORT_PRESS: al soltar antes de BUTTON_LONG_PRESS_TIME, con la duración de la pulsación.
+ *   - BUTTON_EVENT_LONG_PRESS: una vez, en cuanto la pulsación llega a BUTTON_LONG_PRESS_TIME. Al soltar ya no hay
+ *     pulsación corta.
+ *
+ * OJO: los botones tienen que estar en el puerto B (pines 10 a 13 y 50 a 53) para compartir la interrupción PCINT0.
+ */
+
+#ifndef __BUTTON_MANAGER__H__
+#define __BUTTON_MANAGER__H__
+
+// INPUTS (0-5v digital, HIGH = pulsado). PB4, PB5 y PB6 = PCINT4, PCINT5 y PCINT6
+#define INPUT_CONTROL_BUTTON           10       // Input para la señal del botón de control general
+#define INPUT_MAPS_SWITCH_BUTTON       11       // Input para la señal del botón de cambio de mapas (el pin 8 no tiene PCINT)
+#define INPUT_LAUNCH_BUTTON            12       // Input para el botón de launch control / flat shift
+
+#define BUTTON_COUNT                   3
+#define BUTTON_DEBOUNCE_TIME           20000    // 20ms sin flancos para validar un cambio de nivel (us)
+#define BUTTON_LONG_PRESS_TIME         2000000  // Mantener pulsado 2 segundos = pulsación larga (us)
+#define BUTTON_QUEUE_SIZE              8
+#define BUTTON_EDGE_QUEUE_SIZE         8
+
+enum Buttons {
+    BUTTON_CONTROL     = 0,
+    BUTTON_MAPS_SWITCH = 1,
+    BUTTON_LAUNCH      = 2
+};
+
+enum ButtonEventType {
+    BUTTON_EVENT_STATE_CHANGE = 1,
+    BUTTON_EVENT_SHORT_PRESS  = 2,
+    BUTTON_EVENT_LONG_PRESS   = 3
+};
+
+struct ButtonEvent {
+    Buttons button;
+    ButtonEventType type;
+    bool isPressed;            // Nivel después del evento
+    uint32_t duration;         // Duración de la pulsación (us), 0 en los cambios de nivel
+};
+
+// Nivel estable de un botón y su inicio, registrado desde el ISR al llegar el flanco que lo termina
+struct ButtonEdge {
+    uint8_t button;
+    bool isPressed;
+    uint32_t startMicros;
+};
+
+class ButtonManager {
+    // Compartido con el ISR
+    volatile uint8_t _rawPins;                     // Último nivel leído del puerto B
+    volatile uint32_t _lastEdgeMicros[BUTTON_COUNT];
+    volatile ButtonEdge _edges[BUTTON_EDGE_QUEUE_SIZE];
+    volatile uint8_t _edgeHead;
+    volatile uint8_t _edgeCount;
+    volatile uint8_t _droppedEdges;                // Tramos perdidos con la cola del ISR llena
+
+    bool _isPressed[BUTTON_COUNT];                 // Nivel validado
+    bool _isLongPressReported[BUTTON_COUNT];       // La pulsación actual ya ha generado su evento largo
+    uint32_t _pressMicros[BUTTON_COUNT];           // Flanco que empezó la pulsación actual
+
+    ButtonEvent _queue[BUTTON_QUEUE_SIZE];
+    uint8_t _queueHead;                            // Siguiente evento a consumir
+    uint8_t _queueCount;
+    uint16_t _droppedEvents;                       // Eventos perdidos con la cola llena
+
+    void ApplyLevel(Buttons button, bool isPressed, uint32_t startMicros);
+    void PushEvent(Buttons button, ButtonEventType type, uint32_t duration);
+
+  public:
+    ButtonManager();
+
+    // Configura los pines y la interrupción. El nivel inicial de cada botón no genera eventos
+    void Begin();
+    void Update(uint32_t diff);
+    // Llamada desde la interrupción PCINT0
+    void PinChangeEvent();
+
+    // Saca el siguiente evento de la cola, false si está vacía
+    bool PopEvent(ButtonEvent *event);
+    bool IsPressed(Buttons button) { return _isPressed[button]; };
+    uint16_t GetDroppedEvents() { return _droppedEvents + _droppedEdges; };
+};
+
+#endif
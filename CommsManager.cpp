@@ -8,10 +8,18 @@
 #include <stdint.h>
 #include <OneWire.h>
 #include "EEPROMManager.h"
+#include "OneWireAsync.h"
+#include "AnalogSampler.h"
 #include "DataManager.h"
 #include "DataMonitor.h"
+#include "SafetyGuard.h"
+#include "SensorRegistry.h"
+#include "ButtonManager.h"
 #include "AuxManager.h"
 #include "NeoVVLManager.h"
+#include "TriggerManager.h"
+#include "StatsManager.h"
+#include "HeatmapManager.h"
 #include "CommsManager.h"
 
 CommsManager::CommsManager() {
@@ -20,7 +28,20 @@ CommsManager::CommsManager() {
     _dataMonitor = NULL;
     _neoVVLManager = NULL;
     _auxManager = NULL;
+    _sensorRegistry = NULL;
+    _triggerManager = NULL;
+    _statsManager = NULL;
+    _heatmapManager = NULL;
     _intervalBetweenPacketsTimer = 0;
+    _scopeTimer = 0;
+    _scopeDumpIndex = 0;
+    _isScopeDumpHeaderSent = false;
+    _isStatsDumping = false;
+    _isStatsDumpHeaderSent = false;
+    _statsDumpIndex = 0;
+    _isHeatmapDumping = false;
+    _isHeatmapDumpHeaderSent = false;
+    _heatmapDumpIndex = 0;
     _packet = {
         .rpms = 0,
         .engOilPress = 0.0,
@@ -42,18 +63,38 @@ CommsManager::CommsManager() {
     Serial1.begin(BAUD_RATE);
 }
 
-void CommsManager::Initialize(EEPROMManager *eepromManager, DataManager *dataManager, DataMonitor *dataMonitor, AuxManager *auxManager, NeoVVLManager *neoVVLManager) {
+void CommsManager::Initialize(EEPROMManager *eepromManager, DataManager *dataManager, DataMonitor *dataMonitor, AuxManager *auxManager, NeoVVLManager *neoVVLManager, SensorRegistry *sensorRegistry, TriggerManager *triggerManager, StatsManager *statsManager, HeatmapManager *heatmapManager) {
     _eepromManager = eepromManager;
     _dataManager = dataManager;
     _dataMonitor = dataMonitor;
     _auxManager = auxManager;
     _neoVVLManager = neoVVLManager;
+    _sensorRegistry = sensorRegistry;
+    _triggerManager = triggerManager;
+    _statsManager = statsManager;
+    _heatmapManager = heatmapManager;
 }
 
 void CommsManager::Update(uint32_t diff) {
     if (!_dataManager || !_dataMonitor || !_neoVVLManager || !_auxManager)
         return;
 
+    // Si hay una captura del osciloscopio lista, el puerto serie queda reservado para el volcado hasta terminarlo
+    UpdateScope(diff);
+    if (_dataManager->GetAnalogSampler()->GetScopeStatus() == SCOPE_DONE)
+        return;
+    // Lo mismo con el volcado del mapa de residencia
+    if (_isHeatmapDumping) {
+        SendHeatmapChunk();
+        return;
+    }
+    // Y con la respuesta de las estadísticas
+    if (_isStatsDumping) {
+        SendStatsChunk();
+        return;
+    }
+    SendTriggerEvents();
+
     if (_intervalBetweenPacketsTimer >= INTERVAL_BETWEEN_PACKETS) {
         // Montamos el paquete a enviar. Con la librería Wire, el tamaño máximo de cada transmisión es de 32 bytes.
         // Primero obtenemos todos los valores que queremos enviar
@@ -87,6 +128,7 @@ void CommsManager::Update(uint32_t diff) {
         _packet.command = _auxManager->GetNextCommand();
         // Enviamos el paquete con todos los datos
         SendPacket();
+        SendExtendedPacket();
         // Llamamos a la función auxiliar para cálculo de las RPM
         _dataManager->RetrieveRPM(micros());
 
@@ -98,7 +140,75 @@ void CommsManager::Update(uint32_t diff) {
     // TODO: Habría que transformar este tocho de código en unas bonitas funciones más genéricas...
     if (Serial1.available()) {
         String usbCommand = Serial1.readStringUntil(';');
-        if (usbCommand.indexOf("set INTERVAL_BETWEEN_PACKETS") != -1) {
+        if (usbCommand.indexOf("scope") != -1) {
+            // scope <canal> [nivel de disparo], por ejemplo "scope 5 128;" para capturar A5 al cruzar 2.5v
+            String strValue = usbCommand.substring(6);
+            int16_t channel = strValue.toInt();
+            int16_t trigger = SCOPE_NO_TRIGGER;
+            int16_t separator = strValue.indexOf(' ');
+            if (separator != -1)
+                trigger = strValue.substring(separator + 1).toInt();
+            if (channel < 0 || channel >= ANALOG_CHANNELS || trigger < SCOPE_NO_TRIGGER || trigger > 255) {
+                Serial1.println("error: out of range;");
+            } else if (!_dataManager->GetAnalogSampler()->StartScope(A0 + channel, trigger)) {
+                Serial1.println("error: scope busy;");
+            } else {
+                _scopeTimer = 0;
+                Serial1.println("success;");
+            }
+        } else if (usbCommand.indexOf("trigger load") != -1) {
+            // trigger load <programa en hexadecimal>, ver el formato en TriggerManager.h. El comando puede ocupar casi
+            // 500 bytes, así que decodificamos sobre la propia cadena en vez de copiarla a otro buffer
+            uint16_t length = DecodeHex(usbCommand, 13, TRIGGER_PROGRAM_MAX_SIZE);
+            if (length && _triggerManager->StoreProgram((const uint8_t*) usbCommand.c_str() + 13, length))
+                Serial1.println("success;");
+            else
+                Serial1.println("error: invalid program;");
+        } else if (usbCommand.indexOf("trigger clear") != -1) {
+            _triggerManager->StoreProgram(NULL, 0);
+            Serial1.println("success;");
+        } else if (usbCommand.indexOf("trigger stats") != -1) {
+            // Contadores de todos los triggers, separados por espacios
+            Serial1.print("triggers");
+            for (uint8_t i = 0; i < _triggerManager->GetTriggerCount(); ++i) {
+                Serial1.print(" ");
+                Serial1.print(_triggerManager->GetCounter(i));
+            }
+            Serial1.println(";");
+        } else if (usbCommand.indexOf("cams table") != -1) {
+            // cams table <mapa> <leva> [tabla en hexadecimal], ver CamSwitchTable en NeoVVLManager.h. Sin tabla, se borra
+            String strValue = usbCommand.substring(11);
+            strValue.trim();
+            int16_t map = strValue.toInt();
+            int16_t separator = strValue.indexOf(' ');
+            int16_t cam = separator != -1 ? strValue.substring(separator + 1).toInt() : -1;
+            int16_t tableSeparator = separator != -1 ? strValue.indexOf(' ', separator + 1) : -1;
+            uint16_t length = 0;
+            bool isValid = separator != -1;
+            if (isValid && tableSeparator != -1) {
+                length = DecodeHex(strValue, tableSeparator + 1, sizeof(CamSwitchTable));
+                isValid = length != 0;
+            }
+            const uint8_t *table = (const uint8_t*) strValue.c_str() + tableSeparator + 1;
+            if (isValid && _neoVVLManager->StoreSwitchTable((ECUMaps) map, cam, table, length))
+                Serial1.println("success;");
+            else
+                Serial1.println("error: invalid table;");
+        } else if (usbCommand.indexOf("heatmap reset") != -1) {
+            _heatmapManager->Reset();
+            Serial1.println("success;");
+        } else if (usbCommand.indexOf("heatmap") != -1) {
+            // El mapa no se actualiza durante el volcado, así todas las celdas son del mismo instante
+            _heatmapManager->SetPaused(true);
+            _isHeatmapDumping = true;
+        } else if (usbCommand.indexOf("stats reset") != -1) {
+            _statsManager->Reset();
+            Serial1.println("success;");
+        } else if (usbCommand.indexOf("stats") != -1) {
+            // Las estadísticas no se actualizan durante el volcado, así todo el bloque es del mismo instante
+            _statsManager->SetPaused(true);
+            _isStatsDumping = true;
+        } else if (usbCommand.indexOf("set INTERVAL_BETWEEN_PACKETS") != -1) {
             String strValue = usbCommand.substring(29);
             int16_t value = strValue.toInt();
             if (value) {
@@ -186,6 +296,20 @@ void CommsManager::Update(uint32_t diff) {
                 }
             }
             Serial1.println("syntax error;");
+        } else if (usbCommand.indexOf("set CAMS_ACTUATION_DELAY") != -1) {
+            String strValue = usbCommand.substring(25);
+            int16_t value = strValue.toInt();
+            if (value) {
+                if (value < 1 || value > 250) {
+                    Serial1.println("error: out of range;");
+                } else {
+                    _eepromManager->SaveToEEPROM(ADDR_CAMS_ACTUATION_DELAY, value);
+                    Serial1.println("success;");
+                    _neoVVLManager->LoadCamsSwitchPointsFromEEPROM();
+                }
+            } else {
+                Serial1.println("syntax error;");
+            }
         } else if (usbCommand.indexOf("set RPM_LIMITER_HYSTERESIS") != -1) {
             String strValue = usbCommand.substring(27);
             int16_t value = strValue.toInt();
@@ -520,3 +644,211 @@ void CommsManager::SendPacket() {
 
     // Serial.println(micros() - currentMicros);
 }
+
+void CommsManager::UpdateScope(uint32_t diff) {
+    AnalogSampler *analogSampler = _dataManager->GetAnalogSampler();
+    switch (analogSampler->GetScopeStatus()) {
+        case SCOPE_ARMED:
+            if (_scopeTimer >= SCOPE_TRIGGER_TIMEOUT) {
+                analogSampler->StopScope();
+                Serial1.println("error: scope trigger timeout;");
+            } else {
+                _scopeTimer += diff;
+            }
+            break;
+        case SCOPE_DONE:
+            SendScopeChunk();
+            break;
+        default:
+            break;
+    }
+}
+
+void CommsManager::SendScopeChunk() {
+    // Sólo escribimos lo que cabe en el buffer de salida del puerto serie, así el loop nunca se bloquea.
+    // A 250000 baudios el volcado completo tarda unos 40ms, repartidos entre varias iteraciones del loop.
+    AnalogSampler *analogSampler = _dataManager->GetAnalogSampler();
+    if (!_isScopeDumpHeaderSent) {
+        if (Serial1.availableForWrite() < SCOPE_DUMP_HEADER_SIZE)
+            return;
+
+        uint16_t sampleRate = SCOPE_SAMPLE_RATE;
+        uint16_t length = SCOPE_BUFFER_SIZE;
+        Serial1.write("%"); // Byte de control, indica el comienzo del volcado
+        Serial1.write(analogSampler->GetScopeChannel());
+        Serial1.write((const uint8_t*) &sampleRate, 2);
+        Serial1.write((const uint8_t*) &length, 2);
+        _isScopeDumpHeaderSent = true;
+        _scopeDumpIndex = 0;
+    }
+
+    uint16_t available = Serial1.availableForWrite();
+    uint16_t remaining = SCOPE_BUFFER_SIZE - _scopeDumpIndex;
+    uint16_t length = min(available, remaining);
+    if (length > 0) {
+        Serial1.write(analogSampler->GetScopeBuffer() + _scopeDumpIndex, length);
+        _scopeDumpIndex += length;
+    }
+
+    if (_scopeDumpIndex >= SCOPE_BUFFER_SIZE && Serial1.availableForWrite() > 0) {
+        Serial1.write("*"); // Byte de control, indica el final de la transmisión
+        _isScopeDumpHeaderSent = false;
+        _scopeDumpIndex = 0;
+        analogSampler->FreeScope();
+    }
+}
+
+void CommsManager::SendHeatmapChunk() {
+    // Igual que el osciloscopio, sólo escribimos lo que cabe en el buffer de salida. Unos 60ms a 250000 baudios.
+    if (!_isHeatmapDumpHeaderSent) {
+        if (Serial1.availableForWrite() < HEATMAP_DUMP_HEADER_SIZE)
+            return;
+
+        Serial1.write("^"); // Byte de control, indica el comienzo del volcado
+        Serial1.write((uint8_t) HEATMAP_RPM_BINS);
+        Serial1.write((uint8_t) HEATMAP_TPS_BINS);
+        Serial1.write((uint8_t) HEATMAP_RPM_SHIFT);
+        Serial1.write(_heatmapManager->GetTPSBinLimits(), HEATMAP_TPS_BINS - 1);
+        Serial1.write((uint8_t) sizeof(HeatmapCell));
+        _isHeatmapDumpHeaderSent = true;
+        _heatmapDumpIndex = 0;
+    }
+
+    const uint8_t *cells = (const uint8_t*) _heatmapManager->GetCells();
+    uint16_t size = sizeof(HeatmapCell) * HEATMAP_RPM_BINS * HEATMAP_TPS_BINS;
+    uint16_t available = Serial1.availableForWrite();
+    uint16_t length = min(available, (uint16_t) (size - _heatmapDumpIndex));
+    if (length > 0) {
+        Serial1.write(cells + _heatmapDumpIndex, length);
+        _heatmapDumpIndex += length;
+    }
+
+    if (_heatmapDumpIndex >= size && Serial1.availableForWrite() > 0) {
+        Serial1.write("*"); // Byte de control, indica el final de la transmisión
+        _isHeatmapDumpHeaderSent = false;
+        _isHeatmapDumping = false;
+        _heatmapDumpIndex = 0;
+        _heatmapManager->SetPaused(false);
+    }
+}
+
+void CommsManager::SendStatsChunk() {
+    // Igual que el mapa de residencia, sólo escribimos lo que cabe en el buffer de salida (~8ms a 250000 baudios)
+    if (!_isStatsDumpHeaderSent) {
+        if (Serial1.availableForWrite() < STATS_DUMP_HEADER_SIZE)
+            return;
+
+        Serial1.write("&"); // Byte de control, indica el comienzo de la transmisión
+        Serial1.write((uint8_t) sizeof(StatsBlock));
+        _isStatsDumpHeaderSent = true;
+        _statsDumpIndex = 0;
+    }
+
+    const uint8_t *data = (const uint8_t*) _statsManager->GetStats();
+    uint16_t available = Serial1.availableForWrite();
+    uint16_t length = min(available, (uint16_t) (sizeof(StatsBlock) - _statsDumpIndex));
+    if (length > 0) {
+        Serial1.write(data + _statsDumpIndex, length);
+        _statsDumpIndex += length;
+    }
+
+    if (_statsDumpIndex >= sizeof(StatsBlock) && Serial1.availableForWrite() > 0) {
+        Serial1.write("*"); // Byte de control, indica el final de la transmisión
+        _isStatsDumpHeaderSent = false;
+        _isStatsDumping = false;
+        _statsDumpIndex = 0;
+        _statsManager->SetPaused(false);
+    }
+}
+
+void CommsManager::SendTriggerEvents() {
+    if (!_triggerManager)
+        return;
+
+    // Un evento por trigger, mientras quepan en el buffer de salida. Los que no caben esperan al siguiente Update()
+    uint8_t events = _triggerManager->GetPendingEvents();
+    for (uint8_t i = 0; events && i < TRIGGER_MAX_TRIGGERS; ++i) {
+        if (!(events & (1 << i)))
+            continue;
+        if (Serial1.availableForWrite() < TRIGGER_EVENT_SIZE)
+            return;
+
+        Serial1.print("trigger ");
+        Serial1.print(i);
+        Serial1.println(";");
+        _triggerManager->ClearPendingEvent(i);
+    }
+}
+
+void CommsManager::SendExtendedPacket() {
+    if (!_sensorRegistry)
+        return;
+
+    // Montamos la trama según las posiciones declaradas en la tabla de sensores
+    int16_t values[EXTENDED_PACKET_MAX_SLOTS];
+    uint8_t statuses[EXTENDED_PACKET_MAX_SLOTS];
+    uint8_t slots = 0;
+    for (uint8_t i = 0; i < EXTENDED_PACKET_MAX_SLOTS; ++i) {
+        values[i] = 0;
+        statuses[i] = STATUS_ERROR;
+    }
+    for (uint8_t i = 0; i < _sensorRegistry->GetSensorCount(); ++i) {
+        const SensorDefinition *definition = _sensorRegistry->GetDefinition((SensorId) i);
+        if (definition->telemetrySlot >= EXTENDED_PACKET_MAX_SLOTS)
+            continue;
+
+        values[definition->telemetrySlot] = (int16_t) (_sensorRegistry->GetValue((SensorId) i) * definition->telemetryScale);
+        statuses[definition->telemetrySlot] = _sensorRegistry->GetStatus((SensorId) i);
+        if (definition->telemetrySlot >= slots)
+            slots = definition->telemetrySlot + 1;
+    }
+    // Tendencia de las temperaturas del aceite (TEMP_TREND_NO_ESTIMATE se envía como -1)
+    uint16_t timeToDanger = _dataMonitor->GetEngineOilTimeToDanger();
+    values[EXTENDED_SLOT_ENG_OIL_TIME_TO_DANGER] = (int16_t) timeToDanger;
+    statuses[EXTENDED_SLOT_ENG_OIL_TIME_TO_DANGER] = timeToDanger <= TEMP_TREND_PREEMPT_TIME ? STATUS_WARNING : STATUS_OK;
+    timeToDanger = _dataMonitor->GetGearboxOilTimeToDanger();
+    values[EXTENDED_SLOT_GB_OIL_TIME_TO_DANGER] = (int16_t) timeToDanger;
+    statuses[EXTENDED_SLOT_GB_OIL_TIME_TO_DANGER] = timeToDanger <= TEMP_TREND_PREEMPT_TIME ? STATUS_WARNING : STATUS_OK;
+    if (EXTENDED_SLOT_GB_OIL_TIME_TO_DANGER >= slots)
+        slots = EXTENDED_SLOT_GB_OIL_TIME_TO_DANGER + 1;
+
+    union u_int16 {
+        byte b[2];
+        int16_t value;
+    } u;
+
+    Serial1.write("$"); // Byte de control, indica el comienzo de la trama extendida
+    Serial1.write(slots);
+    for (uint8_t i = 0; i < slots; ++i) {
+        u.value = values[i];
+        Serial1.write(u.b[0]);
+        Serial1.write(u.b[1]);
+        Serial1.write(statuses[i]);
+    }
+    Serial1.write("*"); // Byte de control, indica el final de la transmisión
+}
+
+uint16_t CommsManager::DecodeHex(String &hex, uint16_t start, uint16_t maxLength) {
+    // Saltamos los espacios de los extremos sin trim(), que movería el texto
+    uint16_t first = start;
+    uint16_t last = hex.length();
+    if (first >= last)
+        return 0;
+    while (first < last && isspace(hex.charAt(first)))
+        ++first;
+    while (last > first && isspace(hex.charAt(last - 1)))
+        --last;
+    uint16_t length = (last - first) / 2;
+    if (!length || (last - first) % 2 || length > maxLength)
+        return 0;
+
+    // Cada byte ocupa la mitad que sus dos dígitos y first >= start, así que nunca pisamos dígitos sin leer
+    for (uint16_t i = 0; i < length; ++i) {
+        char digits[3] = { hex.charAt(first + i * 2), hex.charAt(first + i * 2 + 1), '\0' };
+        char *end;
+        hex[start + i] = strtoul(digits, &end, 16);
+        if (*end != '\0')
+            return 0;
+    }
+    return length;
+}
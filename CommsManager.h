@@ -46,24 +46,69 @@ struct Packet {
     // TOTAL                      32 bytes
 };
 
+// Trama extendida con los sensores del SensorRegistry. Se envía justo después del paquete principal:
+// '$' + número de sensores + por cada posición (telemetrySlot) int16 (valor * telemetryScale) y uint8 (estado) + '*'
+#define EXTENDED_PACKET_MAX_SLOTS      8
+// Posiciones fijas de la trama extendida (las de los sensores se declaran en la tabla del SensorRegistry)
+// Segundos estimados hasta la temperatura de peligro del aceite, -1 si no sube. Estado WARNING si es inminente.
+#define EXTENDED_SLOT_ENG_OIL_TIME_TO_DANGER 6
+#define EXTENDED_SLOT_GB_OIL_TIME_TO_DANGER  7
+// Volcado del modo osciloscopio (comando "scope <canal> [nivel de disparo];"). Mientras dura no se envían los paquetes normales:
+// '%' + canal (uint8) + frecuencia de muestreo en Hz (uint16) + número de muestras (uint16) + muestras (uint8) + '*'
+#define SCOPE_DUMP_HEADER_SIZE         6
+// Respuesta binaria al comando "stats;": '&' + longitud (uint8) + StatsBlock (ver StatsManager.h) + '*'. Se reparte
+// entre varias iteraciones del loop igual que los volcados, el bloque no cabe en el buffer de salida
+#define STATS_DUMP_HEADER_SIZE         2
+// Volcado del mapa de residencia (comando "heatmap;"), también se reparte entre varias iteraciones del loop:
+// '^' + bins de RPM (uint8) + bins de TPS (uint8) + desplazamiento de las RPM (uint8) + límites de los bins de TPS
+// (HEATMAP_TPS_BINS - 1 bytes) + tamaño de celda (uint8) + celdas (HeatmapCell, ver HeatmapManager.h) + '*'
+#define HEATMAP_DUMP_HEADER_SIZE       (5 + HEATMAP_TPS_BINS - 1)
+// Eventos del TriggerManager, "trigger <n>;" + fin de línea. Se envían entre tramas, y sólo si caben en el buffer de salida
+#define TRIGGER_EVENT_SIZE             12
+
 class CommsManager {
     EEPROMManager *_eepromManager; // Puntero al EEPROMManager, para cargar/grabar datos en la memoria EEPROM de Arduino
     DataManager *_dataManager; // Puntero al DataManager, de donde recuperaremos los datos
     DataMonitor *_dataMonitor; // Puntero al DataMonitor, para recuperar el estado de los parámetros
     NeoVVLManager *_neoVVLManager; // Puntero al la clase que controla las levas, para obtener su estado
     AuxManager *_auxManager; // Puntero al AuxManager, para obtener lo mapas de la ECU
+    SensorRegistry *_sensorRegistry; // Puntero al registro de sensores secundarios, para la trama extendida
+    TriggerManager *_triggerManager; // Puntero al TriggerManager, para cargar los programas de triggers
+    StatsManager *_statsManager; // Puntero al StatsManager, para consultar las estadísticas de uso
+    HeatmapManager *_heatmapManager; // Puntero al HeatmapManager, para exportar el mapa de residencia
 
     Packet _packet;
     uint32_t _intervalBetweenPacketsTimer;
+    // Modo osciloscopio
+    uint32_t _scopeTimer;          // Tiempo esperando al nivel de disparo
+    uint16_t _scopeDumpIndex;      // Muestras ya enviadas
+    bool _isScopeDumpHeaderSent;
+    // Volcado de las estadísticas de uso
+    bool _isStatsDumping;
+    bool _isStatsDumpHeaderSent;
+    uint8_t _statsDumpIndex;       // Bytes del bloque ya enviados
+    // Volcado del mapa de residencia
+    bool _isHeatmapDumping;
+    bool _isHeatmapDumpHeaderSent;
+    uint16_t _heatmapDumpIndex;    // Bytes de las celdas ya enviados
 
     void SendPacket();
+    void SendExtendedPacket();
+    void UpdateScope(uint32_t diff);
+    void SendScopeChunk();
+    void SendHeatmapChunk();
+    void SendStatsChunk();
+    void SendTriggerEvents();
+    // Convierte a bytes la parte en hexadecimal de la cadena a partir de start, sobre el propio buffer de la cadena (los
+    // bytes quedan en hex.c_str() + start). Devuelve el número de bytes, 0 si no es válida o no cabe
+    uint16_t DecodeHex(String &hex, uint16_t start, uint16_t maxLength);
 
   public:
     // Constructor, en este caso sólo inicializa las variables privadas de la clase
     CommsManager();
 
     // Función de inicialización, aquí es donde realmente empieza a funcionar este manager, en cuanto el resto de managers estén operativas
-    void Initialize(EEPROMManager *eepromManager, DataManager *dataManager, DataMonitor *dataMonitor, AuxManager *auxManager, NeoVVLManager *neoVVLManager);
+    void Initialize(EEPROMManager *eepromManager, DataManager *dataManager, DataMonitor *dataMonitor, AuxManager *auxManager, NeoVVLManager *neoVVLManager, SensorRegistry *sensorRegistry, TriggerManager *triggerManager, StatsManager *statsManager, HeatmapManager *heatmapManager);
     // Función que controla el intervalo de envío de los paquetes
     void Update(uint32_t diff);
 };
@@ -8,39 +8,70 @@
 #include <stdint.h>
 #include <OneWire.h>
 // #include <DallasTemperature.h> // Implementación asíncrona propia, la librería normal tiene varios delays y no nos sirve para esto
+#include "EEPROMManager.h"
+#include "OneWireAsync.h"
+#include "AnalogSampler.h"
 #include "DataManager.h"
+#include "DataMonitor.h"
 
-DataManager::DataManager() : _engOilTempWire(INPUT_ENG_OIL_TEMP), _gbOilTempWire(INPUT_GEARBOX_OIL_TEMP) {
+DataManager::DataManager() {
     // Simplemente inicializamos las variables
-    _engineOilTemp = 0;
-    _gearboxOilTemp = 0;
     _engineOilPressure = 0;
     _tps = 0;
-    _tpsMinValue = analogRead(INPUT_TPS);
+    _tpsMinValue = _analogSampler.Read(INPUT_TPS);
     _tpsMaxValue = 3.5;
     _voltage = 0;
     _micros = 0;
     _lastMicros = 0;
     _rpmInterval = 0;
-    _rpmLowVoltageInputCount = 0;
+    _rpmDigitalQuality = RPM_QUALITY_MAX; // Por defecto confiamos en el interrupt, la entrada analógica tiene que ganarse su peso
+    _rpmAnalogQuality = 0;
+    _rpmMissedDigitalEdges = 0;
+    _lastRPMDigitalCount = 0;
+    _rpmDigitalCount = 0;
+    _rpmGatePredicted = 0;
+    _rpmGateConsecutive = 0;
+    _rpmGateRejectedEdges = 0;
+    _rpmGateQuarantinedEdges = 0;
+    _lastRPMGateRejectedEdges = 0;
+    _lastRPMGateQuarantinedEdges = 0;
+    _ignitionStatsCount = 0;
+    _ignitionMissingEdges = 0;
+    _ignitionExtraEdges = 0;
+    ResetIgnitionStats();
     _rpmTriggerCooldown = false;
-    _selectAuxRPMInput = false;
     _startupCheckExecuted = false;
     _secondaryDataTimer = 0;
     _startupCheckTimer = 0;
-    _tempDataTimer = TEMP_DATA_INTERVAL; // Así se solicitarán las temperaturas en la primera iteración de Update()
-    _engOilTempTimer = 0;
-    _gbOilTempTimer = 0;
-    _engOilTempRequested = false;
-    _gbOilTempRequested = false;
+    InitTempSensor(&_engOilTempSensor, INPUT_ENG_OIL_TEMP, ADDR_ENG_OIL_TEMP_SENSOR, ENGINE_OIL_TEMP_WARNING);
+    InitTempSensor(&_gbOilTempSensor, INPUT_GEARBOX_OIL_TEMP, ADDR_GEARBOX_OIL_TEMP_SENSOR, GEARBOX_OIL_TEMP_WARNING);
+    _oneWireOwner = NULL;
+    _eepromManager = NULL;
+    _firstValidRPMTime = 0;
+    _ignitionEventCount = 0;
+    _lastRevolutionSequence = 0;
+    _syncAcquisitionTimer = 0;
+    _isSyncAcquisitionActive = false;
+    _isNewRevolution = false;
     for (uint8_t i = 0; i < AVERAGE_AFR_COUNT_LIMIT; ++i) {
         _afr[i] = 0;
     }
     for (uint8_t i = 0; i < AVERAGE_RPM_COUNT_LIMIT; ++i) {
-        _rpm[i] = 0;
+        _rpmDigital[i] = 0;
+        _rpmAnalog[i] = 0;
     }
-    _rpmIndex = 0;
+    _rpmDigitalIndex = 0;
+    _rpmAnalogIndex = 0;
     _afrIndex = 0;
+    _afrSerialLength = 0;
+    _isAFRSerialLineValid = true;
+    _afrSerialValue = 0;
+    _afrSerialTimer = 0;
+    _isAFRSerialActive = false;
+    for (uint8_t i = 0; i < DATA_INPUT_COUNT; ++i) {
+        _inputValues[i] = 0;
+        _inputSequences[i] = 0;
+    }
 
     // Inicialización de los pines con los diferentes inputs
     pinMode(INPUT_ENG_OIL_PRESSURE, INPUT);
@@ -49,37 +80,59 @@ DataManager::DataManager() : _engOilTempWire(INPUT_ENG_OIL_TEMP), _gbOilTempWire
     pinMode(INPUT_TPS, INPUT);
     pinMode(INPUT_AFR, INPUT);
     pinMode(INPUT_VOLTAGE, INPUT);
+}
+
+void DataManager::Initialize(EEPROMManager *eepromManager) {
+    _eepromManager = eepromManager;
+
+    // Las sondas DS18B20 ya no se buscan al arrancar. Cargamos las que se encontraron la última vez
+    // y Update() se encarga de verificarlas en segundo plano, o de buscarlas de nuevo si no coinciden.
+    LoadTempSensor(&_engOilTempSensor);
+    LoadTempSensor(&_gbOilTempSensor);
 
-    // Inicialización de los buses OneWire
-    // OneWire _engOilTempWire(INPUT_ENG_OIL_TEMP);
-    // OneWire _gbOilTempWire(INPUT_GEARBOX_OIL_TEMP);
-    // Buscamos y almacenamos las IDs de los sensores
-    _engOilTempWire.reset_search();
-    _gbOilTempWire.reset_search();
-    _engOilTempWire.search(_engOilTempAddress);
-    _gbOilTempWire.search(_gbOilTempAddress);
-    // Ajustamos la resolución de los sensores
-    Dallas_setResolution(_engOilTempAddress, &_engOilTempWire);
-    Dallas_setResolution(_gbOilTempAddress, &_gbOilTempWire);
+    // La presión de aceite y el AFR se muestrean a una fase fija de cada encendido
+    _analogSampler.Begin(INPUT_ENG_OIL_PRESSURE, INPUT_AFR);
+
+    if (AFR_SERIAL_ENABLED)
+        AFR_SERIAL.begin(AFR_SERIAL_BAUD_RATE);
 }
 
 void DataManager::Update(uint32_t diff) {
     // Recuperamos siempre la información más reciente de los sensores más importantes
-    // Comprobamos si el voltaje de la señal de las RPM es demasiado bajo, y si se da el caso, pasamos al modo auxiliar.
-    // En caso contrario, las RPMs se calculan con interrupts.
-    uint16_t auxRPMSignal = analogRead(INPUT_RPM_SIGNAL_AUX);
-    if (auxRPMSignal <= RPM_ANALOG_MIN_VALUE && auxRPMSignal > 200) {
-        ++_rpmLowVoltageInputCount;
-        if (_rpmLowVoltageInputCount >= MAX_RPM_INPUT_LOW_VOLTAGE_ERRORS) {
-            _selectAuxRPMInput = true;
-        }
+    // Las RPMs se calculan a la vez con interrupts (entrada digital) y muestreando la entrada analógica.
+    // RetrieveRPM() se encarga de la entrada analógica y de ajustar la calidad de ambas entradas.
+    RetrieveRPM(micros());
+    // Estadísticas de los intervalos que ha registrado el interrupt desde el último Update(), antes de que
+    // la parada del motor (más abajo) vacíe el buffer
+    UpdateIgnitionStats();
+    // Si el interrupt sigue llegando sin que la entrada analógica vea encendidos perdidos, la entrada digital recupera calidad.
+    // Sólo cuentan los intervalos que ha registrado el interrupt, no los huecos que rellena el Update() con el motor parado
+    uint8_t digitalCount = _rpmDigitalCount;
+    if (digitalCount != _lastRPMDigitalCount) {
+        _lastRPMDigitalCount = digitalCount;
+        if (_rpmMissedDigitalEdges < RPM_MAX_MISSED_DIGITAL_EDGES && _rpmDigitalQuality < RPM_QUALITY_MAX)
+            _rpmDigitalQuality = min(RPM_QUALITY_MAX, _rpmDigitalQuality + RPM_DIGITAL_QUALITY_STEP);
+    }
+    // Si el AnalogSampler ha publicado una vuelta nueva usamos sus valores para la presión de aceite y el AFR.
+    // Si deja de publicarlas (motor parado o RPM muy bajas), volvemos a las lecturas normales.
+    uint8_t revolutionSequence = _analogSampler.GetRevolutionSequence();
+    _isNewRevolution = revolutionSequence != _lastRevolutionSequence;
+    if (_isNewRevolution) {
+        _lastRevolutionSequence = revolutionSequence;
+        _syncAcquisitionTimer = 0;
+        _isSyncAcquisitionActive = true;
+    } else if (_syncAcquisitionTimer >= SYNC_SAMPLE_TIMEOUT) {
+        _isSyncAcquisitionActive = false;
     } else {
-        _selectAuxRPMInput = false;
-        _rpmLowVoltageInputCount = 0;
+        _syncAcquisitionTimer += diff;
     }
-    RetrieveRPM(micros());
     RetrieveEngineOilPressure();
     RetrieveAFR();
+    RetrieveAFRSerial(diff);
+
+    // Guardamos cuándo se obtiene la primera lectura de RPM válida, para medir el tiempo de arranque
+    if (!_firstValidRPMTime && GetRPM() > 0)
+        _firstValidRPMTime = millis();
 
     // Este timer sólo se ejecuta una vez al iniciar la centralita, para dar tiempo a que la ECU del coche se inicialice
     if (!_startupCheckExecuted) {
@@ -103,80 +156,358 @@ void DataManager::Update(uint32_t diff) {
     // Esta parte es interesante, porque necesitamos varios timers para recuperar las temperaturas.
     // Las sondas DS18B20 necesitan un tiempo para procesar la respuesta desde que les llega la petición
     // de temperatura. La librería DallasTemperature espera a la respuesta utilizando delay(), pero Nosotros
-    // no podemos hacer eso, porque paralizaría la ejecución del programa. Con la implementación de abajo
-    // de la librería Dallas y estas líneas de código, convertimos esas peticiones en asíncronas con timers.
-    if (_tempDataTimer >= TEMP_DATA_INTERVAL) {
-        RetrieveEngineOilTemp(false);
-        RetrieveGearboxOilTemp(false);
-        _tempDataTimer = 0;
-    } else {
-        _tempDataTimer += diff;
-    }
+    // no podemos hacer eso, porque paralizaría la ejecución del programa. Además, todo el tráfico del bus
+    // OneWire (reset, select, lectura del scratchpad...) lo hace el motor OneWireAsync desde la interrupción
+    // del Timer1, así que aquí sólo avanzamos la máquina de estados de cada sonda.
+    UpdateTempSensor(&_engOilTempSensor, diff);
+    UpdateTempSensor(&_gbOilTempSensor, diff);
 
-    if (_engOilTempRequested) {
-        if (_engOilTempTimer >= DS18B20_UPDATE_INTERVAL) {
-            RetrieveEngineOilTemp(true);
-            _engOilTempTimer = 0;
-            _engOilTempRequested = false;
-        } else {
-            _engOilTempTimer += diff;
+    UpdateInputSequences();
+
+    noInterrupts();
+    if (_lastMicros != 0 && micros() - _lastMicros >= RPM_INPUT_INTERVAL_MAX) {
+        // Ponemos las RPM a 0 en caso de que bajen de 60. Sólo una vez, hasta que vuelva a llegar un encendido
+        for (uint8_t i = 0; i < AVERAGE_RPM_COUNT_LIMIT; ++i) {
+            _rpmDigital[i] = 0;
         }
+        _lastMicros = 0;
+        _rpmGatePredicted = 0;
+        _rpmGateConsecutive = 0;
+        ResetIgnitionStats();
     }
+    interrupts();
+}
 
-    if (_gbOilTempRequested) {
-        if (_gbOilTempTimer >= DS18B20_UPDATE_INTERVAL) {
-            RetrieveGearboxOilTemp(true);
-            _gbOilTempTimer = 0;
-            _gbOilTempRequested = false;
-        } else {
-            _gbOilTempTimer += diff;
-        }
+void DataManager::RetrieveEngineOilPressure() {
+    if (_isSyncAcquisitionActive)
+        _engineOilPressure = _analogSampler.GetRevolutionValue(SYNC_CHANNEL_OIL_PRESSURE);
+    else
+        _engineOilPressure = _analogSampler.Read(INPUT_ENG_OIL_PRESSURE);
+}
+
+void DataManager::InitTempSensor(DS18B20Sensor *sensor, uint8_t pin, EEPROMDataAddress eepromAddress, float warningTemp) {
+    sensor->pin = pin;
+    sensor->eepromAddress = eepromAddress;
+    sensor->readErrors = 0;
+    for (uint8_t i = 0; i < 8; ++i) {
+        sensor->address[i] = 0;
     }
+    sensor->state = DS18B20_DISCOVER; // Mientras no se cargue la EEPROM, no conocemos la sonda
+    sensor->timer = 0;
+    sensor->temp = 0;
+    sensor->resolution = DS18B20_RESOLUTION;
+    sensor->targetResolution = DS18B20_RESOLUTION;
+    sensor->alarmHigh = 0;
+    sensor->alarmLow = 0;
+    sensor->stableReads = 0;
+    sensor->unstableReads = 0;
+    sensor->interval = TEMP_DATA_INTERVAL;
+    sensor->intervalTimer = TEMP_DATA_INTERVAL; // Así se solicitará la temperatura en cuanto la sonda esté verificada
+    sensor->lastReadTime = 0;
+    sensor->warningTemp = (int16_t) ((warningTemp - DS18B20_WARNING_MARGIN) / DALLAS_RAW_TO_CELSIUS);
+}
 
-    if (micros() - _lastMicros >= RPM_INPUT_INTERVAL_MAX && !_selectAuxRPMInput) {
-        // Ponemos las RPM a 0 en caso de que bajen de 60
-        _rpm[_rpmIndex] = 0;
-        _lastMicros = 0;
-        ++_rpmIndex;
-        if (_rpmIndex >= AVERAGE_RPM_COUNT_LIMIT) {
-            _rpmIndex = 0;
-        }
+void DataManager::LoadTempSensor(DS18B20Sensor *sensor) {
+    // En la EEPROM se guardan 8 bytes con la ROM de la sonda y 1 byte con la resolución guardada en la propia sonda
+    uint8_t data[9];
+    _eepromManager->LoadBytesFromEEPROM(sensor->eepromAddress, data, 9);
+    if (Dallas_isAllZeros(data, 8) || OneWire::crc8(data, 7) != data[7]) {
+        sensor->state = DS18B20_DISCOVER;
+        return;
     }
+
+    for (uint8_t i = 0; i < 8; ++i) {
+        sensor->address[i] = data[i];
+    }
+    if (data[8] >= 9 && data[8] <= 12)
+        sensor->resolution = sensor->targetResolution = data[8];
+    sensor->state = DS18B20_VERIFY;
 }
 
-void DataManager::RetrieveEngineOilPressure() {
-    _engineOilPressure = analogRead(INPUT_ENG_OIL_PRESSURE);
+void DataManager::SaveTempSensor(DS18B20Sensor *sensor) {
+    if (!_eepromManager)
+        return;
+
+    uint8_t data[9];
+    for (uint8_t i = 0; i < 8; ++i) {
+        data[i] = sensor->address[i];
+    }
+    data[8] = sensor->resolution;
+    _eepromManager->SaveBytesToEEPROM(sensor->eepromAddress, data, 9);
 }
 
-void DataManager::RetrieveEngineOilTemp(bool requestCompleted) {
-    // Iniciamos una nueva petición al sensor. En la próxima llamada a la función, hay que pasar
-    // el parámetro requestCompleted como true, para indicar que ya podemos obtener la temperatura.
-    if (!requestCompleted) {
-        _engOilTempWire.reset();
-        _engOilTempWire.skip();
-        _engOilTempWire.write(STARTCONVO, false);
-        _engOilTempRequested = true;
-    } else {
-        // Aquí el sensor ya debería de estar listo para enviar la temperatura procesada.
-        _engineOilTemp = Dallas_getTemp(_engOilTempAddress, &_engOilTempWire);
+bool DataManager::StartTempSensorTransaction(DS18B20Sensor *sensor, uint8_t command, const uint8_t *data, uint8_t dataLength, uint8_t readLength) {
+    // Todas las transacciones (salvo la lectura de la ROM) seleccionan la sonda por su ROM y envían un comando
+    if (_oneWireOwner)
+        return false;
+
+    uint8_t buffer[ONEWIRE_BUFFER_SIZE] = { MATCHROM };
+    for (uint8_t i = 0; i < 8; ++i) {
+        buffer[i + 1] = sensor->address[i];
+    }
+    buffer[9] = command;
+    for (uint8_t i = 0; i < dataLength; ++i) {
+        buffer[i + 10] = data[i];
+    }
+    if (!_oneWire.Start(sensor->pin, buffer, 10 + dataLength, readLength))
+        return false;
+
+    _oneWireOwner = sensor;
+    return true;
+}
+
+bool DataManager::IsTempSensorTransactionDone(DS18B20Sensor *sensor) {
+    return _oneWireOwner == sensor && !_oneWire.IsBusy();
+}
+
+bool DataManager::ReadTempSensorScratchPad(uint8_t *scratchPad) {
+    // Mismas comprobaciones que hacía Dallas_isConnected(), pero con el scratchpad leído en segundo plano
+    const uint8_t *data = _oneWire.GetReadBuffer();
+    for (uint8_t i = 0; i < 9; ++i) {
+        scratchPad[i] = data[i];
     }
+    bool isValid = _oneWire.GetStatus() == ONEWIRE_DONE && !Dallas_isAllZeros(scratchPad)
+            && OneWire::crc8(scratchPad, 8) == scratchPad[SCRATCHPAD_CRC];
+    _oneWire.Free();
+    _oneWireOwner = NULL;
+
+    return isValid;
 }
 
-void DataManager::RetrieveGearboxOilTemp(bool requestCompleted) {
-    // Lo mismo que la función anterior
-    if (!requestCompleted) {
-        _gbOilTempWire.reset();
-        _gbOilTempWire.skip();
-        _gbOilTempWire.write(STARTCONVO, false);
-        _gbOilTempRequested = true;
+void DataManager::UpdateTempSensor(DS18B20Sensor *sensor, uint32_t diff) {
+    // Cada sonda tiene su propio intervalo, que depende del modo adaptativo
+    if (sensor->intervalTimer < sensor->interval)
+        sensor->intervalTimer += diff;
+
+    switch (sensor->state) {
+        case DS18B20_IDLE:
+            if (sensor->intervalTimer >= sensor->interval) {
+                // Antes de pedir la conversión, cambiamos la resolución si el modo adaptativo lo ha decidido
+                sensor->state = sensor->resolution != sensor->targetResolution ? DS18B20_CONFIGURE : DS18B20_CONVERT;
+                sensor->intervalTimer = 0;
+            }
+            break;
+        case DS18B20_VERIFY:
+            // Leemos el scratchpad de la sonda guardada. Si la sonda se ha cambiado, no responderá a su ROM y la lectura fallará.
+            if (StartTempSensorTransaction(sensor, READSCRATCH, NULL, 0, 9))
+                sensor->state = DS18B20_VERIFYING;
+            break;
+        case DS18B20_VERIFYING:
+            if (IsTempSensorTransactionDone(sensor)) {
+                uint8_t scratchPad[9];
+                if (ReadTempSensorScratchPad(scratchPad)) {
+                    // La temperatura del scratchpad aún no es válida (al encenderse la sonda vale 85 Cº), sólo nos interesa la configuración
+                    sensor->alarmHigh = scratchPad[HIGH_ALARM_TEMP];
+                    sensor->alarmLow = scratchPad[LOW_ALARM_TEMP];
+                    uint8_t resolution = Dallas_getResolution(scratchPad);
+                    if (resolution != sensor->resolution) {
+                        sensor->resolution = resolution;
+                        SaveTempSensor(sensor);
+                    }
+                    sensor->targetResolution = DS18B20_RESOLUTION;
+                    sensor->state = resolution != DS18B20_RESOLUTION ? DS18B20_STORE : DS18B20_IDLE;
+                } else {
+                    sensor->state = DS18B20_DISCOVER;
+                }
+            }
+            break;
+        case DS18B20_DISCOVER: {
+            // Sólo hay una sonda por bus, así que en lugar de search() (que es síncrono) leemos directamente su ROM
+            uint8_t command = READROM;
+            if (!_oneWireOwner && _oneWire.Start(sensor->pin, &command, 1, 8)) {
+                _oneWireOwner = sensor;
+                sensor->state = DS18B20_DISCOVERING;
+            }
+            break;
+        }
+        case DS18B20_DISCOVERING:
+            if (IsTempSensorTransactionDone(sensor)) {
+                const uint8_t *rom = _oneWire.GetReadBuffer();
+                bool isValid = _oneWire.GetStatus() == ONEWIRE_DONE && !Dallas_isAllZeros(rom, 8) && OneWire::crc8(rom, 7) == rom[7];
+                if (isValid) {
+                    for (uint8_t i = 0; i < 8; ++i) {
+                        sensor->address[i] = rom[i];
+                    }
+                }
+                _oneWire.Free();
+                _oneWireOwner = NULL;
+
+                if (isValid) {
+                    // Sonda nueva, la guardamos y leemos su configuración
+                    SaveTempSensor(sensor);
+                    sensor->state = DS18B20_VERIFY;
+                } else {
+                    sensor->temp = DEVICE_DISCONNECTED_RAW;
+                    sensor->timer = 0;
+                    sensor->state = DS18B20_MISSING;
+                }
+            }
+            break;
+        case DS18B20_MISSING:
+            // Volvemos a buscar la sonda cada cierto tiempo, por si se conecta o se sustituye con la centralita en marcha
+            if (sensor->timer >= DS18B20_DISCOVERY_INTERVAL) {
+                sensor->state = DS18B20_DISCOVER;
+            } else {
+                sensor->timer += diff;
+            }
+            break;
+        case DS18B20_STORE: {
+            // Guardamos la resolución por defecto en la EEPROM de la sonda, para que arranque siempre con ella
+            uint8_t data[3] = { sensor->alarmHigh, sensor->alarmLow, Dallas_resolutionToConfig(DS18B20_RESOLUTION) };
+            if (StartTempSensorTransaction(sensor, WRITESCRATCH, data, 3, 0))
+                sensor->state = DS18B20_STORING;
+            break;
+        }
+        case DS18B20_STORING:
+            if (IsTempSensorTransactionDone(sensor)) {
+                bool isDone = _oneWire.GetStatus() == ONEWIRE_DONE;
+                _oneWire.Free();
+                _oneWireOwner = NULL;
+                if (isDone && StartTempSensorTransaction(sensor, COPYSCRATCH, NULL, 0, 0)) {
+                    sensor->timer = 0;
+                    sensor->state = DS18B20_COPYING;
+                } else {
+                    sensor->state = DS18B20_VERIFY;
+                }
+            }
+            break;
+        case DS18B20_COPYING:
+            // Mantenemos el bus ocupado mientras la sonda copia el scratchpad, sin delay()
+            if (IsTempSensorTransactionDone(sensor)) {
+                if (sensor->timer >= DS18B20_COPY_INTERVAL) {
+                    _oneWire.Free();
+                    _oneWireOwner = NULL;
+                    sensor->resolution = DS18B20_RESOLUTION;
+                    SaveTempSensor(sensor);
+                    sensor->state = DS18B20_IDLE;
+                } else {
+                    sensor->timer += diff;
+                }
+            }
+            break;
+        case DS18B20_CONFIGURE: {
+            // Sólo escribimos el scratchpad (sin COPYSCRATCH), así no gastamos la EEPROM de la sonda con cada cambio de modo
+            uint8_t data[3] = { sensor->alarmHigh, sensor->alarmLow, Dallas_resolutionToConfig(sensor->targetResolution) };
+            if (StartTempSensorTransaction(sensor, WRITESCRATCH, data, 3, 0))
+                sensor->state = DS18B20_CONFIGURING;
+            break;
+        }
+        case DS18B20_CONFIGURING:
+            if (IsTempSensorTransactionDone(sensor)) {
+                if (_oneWire.GetStatus() == ONEWIRE_DONE)
+                    sensor->resolution = sensor->targetResolution;
+                _oneWire.Free();
+                _oneWireOwner = NULL;
+                sensor->state = DS18B20_CONVERT;
+            }
+            break;
+        case DS18B20_CONVERT: {
+            // Pedimos a la sonda que empiece a convertir la temperatura
+            uint8_t command[2] = { SKIPROM, STARTCONVO };
+            if (!_oneWireOwner && _oneWire.Start(sensor->pin, command, 2, 0)) {
+                _oneWireOwner = sensor;
+                sensor->timer = 0;
+                sensor->state = DS18B20_CONVERTING;
+            }
+            break;
+        }
+        case DS18B20_CONVERTING:
+            // Liberamos el bus en cuanto se haya enviado la petición, para que la otra sonda pueda usarlo
+            if (IsTempSensorTransactionDone(sensor)) {
+                if (_oneWire.GetStatus() == ONEWIRE_NO_PRESENCE) {
+                    sensor->temp = DEVICE_DISCONNECTED_RAW;
+                    sensor->state = DS18B20_DISCOVER;
+                }
+                _oneWire.Free();
+                _oneWireOwner = NULL;
+            }
+            if (sensor->state == DS18B20_CONVERTING) {
+                // El tiempo de conversión se duplica con cada bit de resolución
+                if (sensor->timer >= ((uint32_t) DS18B20_UPDATE_INTERVAL << (sensor->resolution - 9)) && _oneWireOwner != sensor) {
+                    sensor->state = DS18B20_READ;
+                } else {
+                    sensor->timer += diff;
+                }
+            }
+            break;
+        case DS18B20_READ:
+            // Aquí el sensor ya debería de estar listo para enviar la temperatura procesada.
+            if (StartTempSensorTransaction(sensor, READSCRATCH, NULL, 0, 9))
+                sensor->state = DS18B20_READING;
+            break;
+        case DS18B20_READING:
+            if (IsTempSensorTransactionDone(sensor)) {
+                uint8_t scratchPad[9];
+                sensor->state = DS18B20_IDLE;
+                if (ReadTempSensorScratchPad(scratchPad)) {
+                    sensor->readErrors = 0;
+                    sensor->alarmHigh = scratchPad[HIGH_ALARM_TEMP];
+                    sensor->alarmLow = scratchPad[LOW_ALARM_TEMP];
+                    AdaptTempSensor(sensor, Dallas_calculateTemperature(sensor->address, scratchPad));
+                } else {
+                    sensor->temp = DEVICE_DISCONNECTED_RAW;
+                    // Si falla varias veces seguidas, puede que se haya sustituido la sonda. La buscamos de nuevo.
+                    if (++sensor->readErrors >= DS18B20_MAX_READ_ERRORS) {
+                        sensor->readErrors = 0;
+                        sensor->state = DS18B20_DISCOVER;
+                    }
+                }
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+void DataManager::AdaptTempSensor(DS18B20Sensor *sensor, int16_t newTemp) {
+    uint32_t now = millis();
+    uint32_t elapsed = now - sensor->lastReadTime;
+    int16_t lastTemp = sensor->temp;
+    bool hasLastTemp = sensor->lastReadTime != 0 && lastTemp != DEVICE_DISCONNECTED_RAW;
+    sensor->temp = newTemp;
+    sensor->lastReadTime = now;
+
+    if (!DS18B20_ADAPTIVE_MODE || !hasLastTemp || elapsed == 0)
+        return;
+
+    // Cambio de la temperatura y su velocidad, en 1/128 Cº y 1/128 Cº por segundo
+    int32_t delta = newTemp - lastTemp;
+    if (delta < 0)
+        delta = -delta;
+    int32_t rate = (delta * 1000) / (int32_t) elapsed;
+    // 1 LSB de la resolución con la que se ha hecho la lectura (8 raw a 12 bits). Al cambiar de resolución, la primera
+    // lectura puede diferir de la anterior en menos de 1 LSB de la resolución anterior, y eso tampoco es un cambio real
+    int32_t lsb = 8 << (12 - sensor->resolution);
+    bool isSlowMode = sensor->interval == TEMP_DATA_SLOW_INTERVAL;
+
+    if ((rate >= DS18B20_FAST_RATE && delta > lsb) || newTemp >= sensor->warningTemp) {
+        // La temperatura sube (o baja) rápido, o estamos cerca del aviso: lecturas rápidas aunque sean menos precisas
+        sensor->targetResolution = DS18B20_FAST_RESOLUTION;
+        sensor->interval = TEMP_DATA_FAST_INTERVAL;
+        sensor->stableReads = 0;
+        sensor->unstableReads = 0;
+    } else if (rate <= DS18B20_STABLE_RATE || delta <= lsb) {
+        // Temperatura estable. Tras varias lecturas seguidas, pasamos al modo lento pero con más resolución
+        sensor->unstableReads = 0;
+        if (sensor->stableReads < DS18B20_STABLE_READS) {
+            ++sensor->stableReads;
+        } else {
+            sensor->targetResolution = DS18B20_SLOW_RESOLUTION;
+            sensor->interval = TEMP_DATA_SLOW_INTERVAL;
+        }
+    } else if (isSlowMode && ++sensor->unstableReads < DS18B20_UNSTABLE_READS) {
+        // En el modo lento una lectura suelta no basta para volver al modo normal
+        sensor->stableReads = 0;
     } else {
-        // Aquí el sensor ya debería de estar listo para enviar la temperatura procesada.
-        _gearboxOilTemp = Dallas_getTemp(_gbOilTempAddress, &_gbOilTempWire);
+        sensor->targetResolution = DS18B20_RESOLUTION;
+        sensor->interval = TEMP_DATA_INTERVAL;
+        sensor->stableReads = 0;
+        sensor->unstableReads = 0;
     }
 }
 
 void DataManager::RetrieveTPS() {
-    _tps = analogRead(INPUT_TPS);
+    _tps = _analogSampler.Read(INPUT_TPS);
 
     // Ajustamos el valor máximo si es necesario
     if (_tps * ANALOG_TO_VOLTS > _tpsMaxValue)
@@ -184,13 +515,84 @@ void DataManager::RetrieveTPS() {
 }
 
 void DataManager::RetrieveAFR() {
-    _afr[_afrIndex] = analogRead(INPUT_AFR);
+    // Con la adquisición síncrona guardamos un valor por vuelta, que ya es la media de la vuelta
+    if (_isSyncAcquisitionActive) {
+        if (!_isNewRevolution)
+            return;
+        _afr[_afrIndex] = _analogSampler.GetRevolutionValue(SYNC_CHANNEL_AFR);
+    } else {
+        _afr[_afrIndex] = _analogSampler.Read(INPUT_AFR);
+    }
     ++_afrIndex;
     if (_afrIndex >= AVERAGE_AFR_COUNT_LIMIT) {
         _afrIndex = 0;
     }
 }
 
+void DataManager::RetrieveAFRSerial(uint32_t diff) {
+    if (!AFR_SERIAL_ENABLED)
+        return;
+
+    // Procesamos sólo los caracteres que ya están en el buffer del puerto serie, nunca esperamos a que lleguen más
+    bool newValue = false;
+    while (AFR_SERIAL.available()) {
+        char c = AFR_SERIAL.read();
+        if (c == '\r' || c == '\n') {
+            if (_afrSerialLength > 0 && _isAFRSerialLineValid && ParseAFRSerialLine())
+                newValue = true;
+            _afrSerialLength = 0;
+            _isAFRSerialLineValid = true;
+        } else if (((c >= '0' && c <= '9') || c == '.') && _afrSerialLength < AFR_SERIAL_BUFFER_SIZE) {
+            _afrSerialBuffer[_afrSerialLength] = c;
+            ++_afrSerialLength;
+        } else {
+            // Cualquier otro carácter (mensajes de error del controlador, ruido...) invalida la línea entera
+            _isAFRSerialLineValid = false;
+        }
+    }
+
+    if (newValue) {
+        _afrSerialTimer = 0;
+        _isAFRSerialActive = true;
+    } else if (_afrSerialTimer >= AFR_SERIAL_TIMEOUT) {
+        _isAFRSerialActive = false;
+    } else {
+        _afrSerialTimer += diff;
+    }
+}
+
+bool DataManager::ParseAFRSerialLine() {
+    // Convertimos "14.7" o "14.73" a entero (x100) sin usar floats ni atof()
+    uint16_t value = 0;
+    int8_t decimals = -1;
+    for (uint8_t i = 0; i < _afrSerialLength; ++i) {
+        char c = _afrSerialBuffer[i];
+        if (c == '.') {
+            if (decimals >= 0)
+                return false;
+            decimals = 0;
+        } else if (decimals < 2) {
+            if (value > AFR_SERIAL_MAX_VALUE)
+                return false;
+            value = value * 10 + (c - '0');
+            if (decimals >= 0)
+                ++decimals;
+        }
+        // A partir del segundo decimal ignoramos el resto de dígitos
+    }
+    if (decimals < 0)
+        decimals = 0;
+    for (; decimals < 2; ++decimals) {
+        value *= 10;
+    }
+
+    if (value < AFR_SERIAL_MIN_VALUE || value > AFR_SERIAL_MAX_VALUE)
+        return false;
+
+    _afrSerialValue = value;
+    return true;
+}
+
 void DataManager::RetrieveRPM(uint32_t newMicros) {
     // Obtenemos los microsegundos desde la última ejecución.
     // Sólo utilizamos este tipo de precisión aquí, para calcular RPMs, en el resto del programa no es necesaria, con millis vale.
@@ -201,66 +603,281 @@ void DataManager::RetrieveRPM(uint32_t newMicros) {
         _micros = 0; // Para evitar problemas con el overflow de la variable interna de Arduino (cada 70 minutos más o menos)
     }
 
-    // A partir de aquí sólo sigue si estamos usando el sistema auxiliar para recuperar las RPM
-    if (!_selectAuxRPMInput)
-        return;
+    // La entrada analógica se muestrea siempre, aunque el interrupt funcione bien, para que si la señal digital
+    // empieza a fallar la estimación ya tenga datos de la otra entrada y el cambio sea transparente.
+    uint16_t rpmStatus = _analogSampler.Read(INPUT_RPM_SIGNAL_AUX);
+
+    // Con el voltaje del pulso ajustamos la calidad de la entrada digital. Si el pulso llega con poco voltaje
+    // es muy probable que el interrupt no salte con todos los encendidos.
+    if (rpmStatus >= RPM_INPUT_HIGH_VALUE) {
+        if (rpmStatus <= RPM_ANALOG_MIN_VALUE) {
+            _rpmDigitalQuality = _rpmDigitalQuality > RPM_DIGITAL_QUALITY_STEP ? _rpmDigitalQuality - RPM_DIGITAL_QUALITY_STEP : 0;
+        } else if (_rpmMissedDigitalEdges < RPM_MAX_MISSED_DIGITAL_EDGES && _rpmDigitalQuality < RPM_QUALITY_MAX) {
+            _rpmDigitalQuality = min(RPM_QUALITY_MAX, _rpmDigitalQuality + RPM_DIGITAL_QUALITY_STEP);
+        }
+    }
 
-    uint16_t rpmStatus = analogRead(INPUT_RPM_SIGNAL);
-    
+    _rpmInterval += microDiff;
     // La ECU del coche por defecto pone a masa este pin. Cuando la bobina se activa, la ECU corta la masa y el voltaje aumenta
     if (!_rpmTriggerCooldown && rpmStatus >= RPM_INPUT_HIGH_VALUE) {
-        // Obtenemos las RPMs con el intervalo entre encendidos
-        _rpm[_rpmIndex] = _rpmInterval;
+        // La calidad de la entrada analógica depende de lo grande que sea el periodo de muestreo (lo que tarda el loop)
+        // comparado con el intervalo entre encendidos. A altas RPM, o con un loop lento, el error es demasiado grande.
+        uint8_t quality = 0;
+        if (_rpmInterval > 0 && _rpmInterval <= RPM_INPUT_INTERVAL_MAX) {
+            uint32_t error = (microDiff * RPM_ANALOG_SAMPLE_RATIO * RPM_QUALITY_MAX) / _rpmInterval;
+            quality = error >= RPM_QUALITY_MAX ? 0 : RPM_QUALITY_MAX - error;
+            PushAnalogRPMInterval(_rpmInterval);
+        }
+        _rpmAnalogQuality = (_rpmAnalogQuality * 3 + quality) / 4;
+
+        // Si la entrada analógica ve encendidos que el interrupt no ha detectado, la entrada digital no es fiable
+        if (_rpmMissedDigitalEdges < RPM_MAX_MISSED_DIGITAL_EDGES) {
+            ++_rpmMissedDigitalEdges;
+        } else {
+            _rpmDigitalQuality = 0;
+        }
+
         // Reiniciamos las variables para esperar al siguiente encendido
         _rpmTriggerCooldown = true;
         _rpmInterval = 0;
-        ++_rpmIndex;
-        if (_rpmIndex >= AVERAGE_RPM_COUNT_LIMIT) {
-            _rpmIndex = 0;
-        }
     } else if (rpmStatus < RPM_INPUT_HIGH_VALUE) {
         // Leemos como mínimo 60 RPM
-        if (_rpmInterval <= RPM_INPUT_INTERVAL_MAX) {
-            _rpmInterval += microDiff;
-        } else {
-            _rpm[_rpmIndex] = 0;
-            ++_rpmIndex;
-            if (_rpmIndex >= AVERAGE_RPM_COUNT_LIMIT) {
-                _rpmIndex = 0;
-            }
+        if (_rpmInterval > RPM_INPUT_INTERVAL_MAX) {
+            PushAnalogRPMInterval(0);
+            _rpmInterval = RPM_INPUT_INTERVAL_MAX + 1;
         }
         _rpmTriggerCooldown = false;
     }
 }
 
-void DataManager::CalculateRPM(uint32_t currentMicros) {
-    // Comprobamos si estamos usando el sistema auxiliar.
-    if (_selectAuxRPMInput)
-        return;
+void DataManager::PushAnalogRPMInterval(uint32_t interval) {
+    _rpmAnalog[_rpmAnalogIndex] = interval;
+    ++_rpmAnalogIndex;
+    if (_rpmAnalogIndex >= AVERAGE_RPM_COUNT_LIMIT) {
+        _rpmAnalogIndex = 0;
+    }
+}
 
+uint32_t DataManager::CalculateRPM(uint32_t currentMicros) {
     // Primer encendido del coche, simplemente almacenamos el tiempo para calcular las RPM en el siguiente chispazo.
     // También comprobamos si se ha reiniciado la variable que gestiona los micros()
     if (_lastMicros == 0 || _lastMicros > currentMicros) {
+        _rpmMissedDigitalEdges = 0;
+        ++_ignitionEventCount;
         _lastMicros = currentMicros;
-        return;
+        return 0;
     }
 
-    _rpm[_rpmIndex] = currentMicros - _lastMicros;
-    ++_rpmIndex;
-    if (_rpmIndex >= AVERAGE_RPM_COUNT_LIMIT) {
-        _rpmIndex = 0;
+    uint32_t interval = currentMicros - _lastMicros;
+
+    // Ventana de predicción: el siguiente encendido tiene que llegar entre 0.625x y 1.5x el último intervalo aceptado.
+    // Sólo son desplazamientos y comparaciones de 32 bits, unas pocas decenas de ciclos por encendido.
+    uint32_t predicted = _rpmGatePredicted;
+    if (RPM_GATE_ENABLED && predicted) {
+        if (interval < predicted - (predicted >> 2) - (predicted >> 3)) {
+            // Demasiado pronto: es ruido, lo descartamos por completo (ni siquiera cuenta como referencia de tiempo)
+            ++_rpmGateRejectedEdges;
+            if (++_rpmGateConsecutive < RPM_GATE_MAX_CONSECUTIVE)
+                return 0;
+            // Demasiados seguidos: la predicción ya no sirve. El intervalo desde el último encendido bueno tampoco
+            // (puede acabar en un pico de ruido), así que sólo tomamos este flanco como referencia y volvemos a empezar
+            _rpmGateConsecutive = 0;
+            _rpmGatePredicted = 0;
+            _lastMicros = currentMicros;
+            return 0;
+        } else if (interval > predicted + (predicted >> 1)) {
+            // Demasiado tarde: probablemente se ha perdido algún encendido. El flanco es bueno y sirve de referencia
+            // para el siguiente, pero el intervalo no se usa
+            ++_rpmGateQuarantinedEdges;
+            if (++_rpmGateConsecutive < RPM_GATE_MAX_CONSECUTIVE) {
+                _rpmMissedDigitalEdges = 0;
+                ++_ignitionEventCount;
+                _lastMicros = currentMicros;
+                return 0;
+            }
+        }
+        // Si llegan RPM_GATE_MAX_CONSECUTIVE encendidos seguidos tarde, el régimen ha cambiado de verdad
+    }
+    _rpmGateConsecutive = 0;
+    _rpmGatePredicted = interval;
+
+    // El interrupt ha saltado, así que la entrada digital no ha perdido este encendido
+    _rpmMissedDigitalEdges = 0;
+    ++_ignitionEventCount;
+
+    // Programamos la muestra síncrona de este encendido con el último intervalo medido
+    _analogSampler.ScheduleSyncSample(_ignitionEventCount, interval);
+
+    _rpmDigital[_rpmDigitalIndex] = interval;
+    ++_rpmDigitalIndex;
+    if (_rpmDigitalIndex >= AVERAGE_RPM_COUNT_LIMIT) {
+        _rpmDigitalIndex = 0;
     }
+    ++_rpmDigitalCount;
     _lastMicros = currentMicros;
+    return interval;
+}
+
+void DataManager::UpdateInputSequences() {
+    for (uint8_t i = 0; i < DATA_INPUT_COUNT; ++i) {
+        int16_t value = GetInputRawValue((DataInput) i);
+        if (value != _inputValues[i]) {
+            _inputValues[i] = value;
+            ++_inputSequences[i];
+        }
+    }
+}
+
+int16_t DataManager::GetInputRawValue(DataInput input) {
+    switch (input) {
+        case DATA_INPUT_ENG_OIL_PRESSURE:
+            return _engineOilPressure;
+        case DATA_INPUT_ENG_OIL_TEMP:
+            return _engOilTempSensor.temp;
+        case DATA_INPUT_GB_OIL_TEMP:
+            return _gbOilTempSensor.temp;
+        case DATA_INPUT_AFR: {
+            // Con el AFR serie usamos el valor en negativo, así el cambio de origen también incrementa la secuencia
+            if (_isAFRSerialActive)
+                return -(int16_t) _afrSerialValue;
+            // La suma de las lecturas sólo cambia cuando cambia la media que devuelve GetAFR()
+            int16_t sum = 0;
+            for (uint8_t i = 0; i < AVERAGE_AFR_COUNT_LIMIT; ++i) {
+                sum += _afr[i];
+            }
+            return sum;
+        }
+        case DATA_INPUT_VOLTAGE:
+            return _voltage;
+        default:
+            return 0;
+    }
+}
+
+void DataManager::UpdateIgnitionStats() {
+    // Procesamos los intervalos que ha registrado el interrupt desde el último Update(). Si el loop se ha
+    // retrasado más de AVERAGE_RPM_COUNT_LIMIT encendidos, los más antiguos ya se han sobreescrito y se ignoran.
+    noInterrupts();
+    uint8_t count = _rpmDigitalCount;
+    uint8_t index = _rpmDigitalIndex;
+    uint16_t rejectedEdges = _rpmGateRejectedEdges;
+    uint16_t quarantinedEdges = _rpmGateQuarantinedEdges;
+    interrupts();
+
+    // Los encendidos filtrados por la ventana del interrupt cuentan como anomalías (falsos y perdidos)
+    uint16_t newRejected = rejectedEdges - _lastRPMGateRejectedEdges;
+    uint16_t newQuarantined = quarantinedEdges - _lastRPMGateQuarantinedEdges;
+    _lastRPMGateRejectedEdges = rejectedEdges;
+    _lastRPMGateQuarantinedEdges = quarantinedEdges;
+    _ignitionExtraEdges += newRejected;
+    _ignitionMissingEdges += newQuarantined;
+    for (uint16_t i = newRejected + newQuarantined; i > 0 && _ignitionAnomalies != 0xFFFF; --i) {
+        _ignitionAnomalies = (_ignitionAnomalies << 1) | 1;
+    }
+
+    uint8_t pending = count - _ignitionStatsCount;
+    if (pending > AVERAGE_RPM_COUNT_LIMIT)
+        pending = AVERAGE_RPM_COUNT_LIMIT;
+    _ignitionStatsCount = count;
+
+    for (uint8_t i = pending; i > 0; --i) {
+        uint8_t bufferIndex = (index + AVERAGE_RPM_COUNT_LIMIT - i) % AVERAGE_RPM_COUNT_LIMIT;
+        noInterrupts();
+        uint32_t interval = _rpmDigital[bufferIndex];
+        interrupts();
+        ProcessIgnitionInterval(interval);
+    }
+}
+
+void DataManager::ProcessIgnitionInterval(uint32_t interval) {
+    if (!interval)
+        return;
+
+    bool isAnomaly = false;
+    if (_ignitionPredictedInterval) {
+        // Ratio respecto al intervalo previsto (el último válido), x256. Un intervalo múltiplo del previsto
+        // significa que el interrupt no ha visto algún encendido, uno mucho más corto que hay ruido en la señal.
+        uint32_t ratio = (interval << 8) / _ignitionPredictedInterval;
+        if (ratio >= IGNITION_MISSING_RATIO) {
+            _ignitionMissingEdges += ((ratio + 128) >> 8) - 1; // Redondeamos, 2x el previsto = 1 encendido perdido
+            isAnomaly = true;
+        } else if (ratio <= IGNITION_EXTRA_RATIO) {
+            ++_ignitionExtraEdges;
+            isAnomaly = true;
+        } else if (_ignitionRatioStdDev > 0.0) {
+            // El ratio no depende del régimen (aceleraciones, desaceleraciones...), así que lo comparamos con
+            // su propia distribución en el último bloque: un salto fuera de lo normal también es una anomalía
+            float deviation = fabs((ratio / 256.0) - _ignitionRatioMean);
+            if (deviation > IGNITION_MAX_DEVIATION * _ignitionRatioStdDev && deviation > IGNITION_MIN_DEVIATION)
+                isAnomaly = true;
+        }
+
+        if (!isAnomaly) {
+            float x = ratio / 256.0;
+            float delta = x - _ignitionStatsRatioMean;
+            ++_ignitionStatsRatioSamples;
+            _ignitionStatsRatioMean += delta / _ignitionStatsRatioSamples;
+            _ignitionStatsRatioM2 += delta * (x - _ignitionStatsRatioMean);
+        }
+    }
+
+    _ignitionAnomalies = (_ignitionAnomalies << 1) | (isAnomaly ? 1 : 0);
+    if (isAnomaly)
+        return;
+
+    // Media y varianza de Welford del intervalo, actualizadas con cada intervalo válido
+    _ignitionPredictedInterval = interval;
+    ++_ignitionStatsSamples;
+    float delta = (float) interval - _ignitionStatsMean;
+    _ignitionStatsMean += delta / _ignitionStatsSamples;
+    _ignitionStatsM2 += delta * ((float) interval - _ignitionStatsMean);
+    if (_ignitionStatsSamples >= IGNITION_STATS_WINDOW) {
+        // Publicamos el bloque y empezamos otro, así las estadísticas siguen los cambios de régimen
+        _ignitionIntervalMean = _ignitionStatsMean;
+        _ignitionIntervalStdDev = sqrt(_ignitionStatsM2 / (_ignitionStatsSamples - 1));
+        _ignitionRatioMean = _ignitionStatsRatioMean;
+        if (_ignitionStatsRatioSamples > 1)
+            _ignitionRatioStdDev = sqrt(_ignitionStatsRatioM2 / (_ignitionStatsRatioSamples - 1));
+        _ignitionStatsSamples = 0;
+        _ignitionStatsMean = 0.0;
+        _ignitionStatsM2 = 0.0;
+        _ignitionStatsRatioSamples = 0;
+        _ignitionStatsRatioMean = 0.0;
+        _ignitionStatsRatioM2 = 0.0;
+    }
+}
+
+void DataManager::ResetIgnitionStats() {
+    _ignitionStatsSamples = 0;
+    _ignitionStatsMean = 0.0;
+    _ignitionStatsM2 = 0.0;
+    _ignitionStatsRatioSamples = 0;
+    _ignitionStatsRatioMean = 0.0;
+    _ignitionStatsRatioM2 = 0.0;
+    _ignitionIntervalMean = 0.0;
+    _ignitionIntervalStdDev = 0.0;
+    _ignitionRatioMean = 0.0;
+    _ignitionRatioStdDev = 0.0;
+    _ignitionPredictedInterval = 0;
+    _ignitionAnomalies = 0;
+}
+
+bool DataManager::IsIgnitionSignalCorrupt() {
+    uint8_t anomalies = 0;
+    for (uint16_t history = _ignitionAnomalies; history; history >>= 1) {
+        anomalies += history & 1;
+    }
+    return anomalies >= IGNITION_MAX_ANOMALIES;
 }
 
 void DataManager::RetrieveVoltage() {
-    _voltage = analogRead(INPUT_VOLTAGE);
+    _voltage = _analogSampler.Read(INPUT_VOLTAGE);
 }
 
 void DataManager::ExecuteStartupCheck() {
     // En esta función se gestiona cualquier acción que requiera que ambas centralitas (esta y la del coche)
     // estén completamente inicializadas y listas.
-    _tpsMinValue = analogRead(INPUT_TPS) * ANALOG_TO_VOLTS;
+    _tpsMinValue = _analogSampler.Read(INPUT_TPS) * ANALOG_TO_VOLTS;
     _startupCheckExecuted = true;
 }
 
@@ -268,9 +885,13 @@ float DataManager::GetEngineOilPressure(bool raw) {
     if (raw)
         return _engineOilPressure;
 
+    return ConvertEngineOilPressure(_engineOilPressure);
+}
+
+float DataManager::ConvertEngineOilPressure(uint16_t raw) {
     // El sensor envía una señal analógica y lineal de entre 0.5v @0 PSI -> 4.5v @150 PSI
     // Primero multiplicamos el valor por 0.0048828125‬ para obtener los voltios en el pin
-    float value = (float) _engineOilPressure * ANALOG_TO_VOLTS;
+    float value = (float) raw * ANALOG_TO_VOLTS;
     // Después descartamos valores por debajo o por encima de los límites del sensor
     if (value <= 0.5)
         return 0.0;
@@ -287,19 +908,42 @@ float DataManager::GetEngineOilPressure(bool raw) {
     return (value / PSI_TO_BAR);
 }
 
+void DataManager::SetOilPressureThreshold(float pressure) {
+    if (pressure <= 0.0) {
+        _analogSampler.SetTransientThreshold(TRANSIENT_NO_THRESHOLD);
+        return;
+    }
+
+    // Inversa de ConvertEngineOilPressure(): bares -> PSI -> voltios (0.5v-4.5v) -> valor raw
+    float volts = 0.5 + (pressure * PSI_TO_BAR) * 4.0 / 150.0;
+    _analogSampler.SetTransientThreshold((uint16_t) (volts / ANALOG_TO_VOLTS));
+}
+
+bool DataManager::GetOilPressureWindow(OilPressureWindow *window) {
+    TransientWindow transient;
+    if (!_analogSampler.GetTransientWindow(&transient))
+        return false;
+
+    window->min = ConvertEngineOilPressure(transient.min);
+    window->max = ConvertEngineOilPressure(transient.max);
+    window->timeBelow = (uint32_t) transient.samplesBelow * TRANSIENT_SAMPLE_PERIOD;
+    window->events = transient.events;
+    return true;
+}
+
 float DataManager::GetEngineOilTemp(bool raw) {
     if (raw)
-        return _engineOilTemp;
+        return _engOilTempSensor.temp;
 
     // Convertimos a Cº
-    return (float) _engineOilTemp * DALLAS_RAW_TO_CELSIUS;
+    return (float) _engOilTempSensor.temp * DALLAS_RAW_TO_CELSIUS;
 }
 
 float DataManager::GetGearboxOilTemp(bool raw) {
     if (raw)
-        return _gearboxOilTemp;
+        return _gbOilTempSensor.temp;
 
-    return (float) _gearboxOilTemp * DALLAS_RAW_TO_CELSIUS;
+    return (float) _gbOilTempSensor.temp * DALLAS_RAW_TO_CELSIUS;
 }
 
 uint16_t DataManager::GetTPS(bool raw) {
@@ -326,12 +970,18 @@ uint16_t DataManager::GetTPS(bool raw) {
 }
 
 float DataManager::GetAFR(bool noAverage, bool raw) {
+    uint8_t lastIndex = _afrIndex > 0 ? _afrIndex - 1 : AVERAGE_AFR_COUNT_LIMIT - 1;
     if (raw)
-        return _afr[_afrIndex - 1];
+        return _afr[lastIndex];
+
+    // El AFR digital del controlador no tiene error de masa ni ruido del ADC, y el controlador ya lo filtra,
+    // así que lo devolvemos directamente sin hacer la media
+    if (_isAFRSerialActive)
+        return _afrSerialValue / 100.0;
 
     uint32_t averageAfr = 0;
     if (noAverage) {
-        averageAfr = _afr[_afrIndex - 1];
+        averageAfr = _afr[lastIndex];
     } else {
         for (uint8_t i = 0; i < AVERAGE_AFR_COUNT_LIMIT; ++i) {
             averageAfr += _afr[i];
@@ -362,25 +1012,20 @@ float DataManager::GetAFR(bool noAverage, bool raw) {
 
 uint32_t DataManager::GetRPM(bool noAverage, bool raw) {
     // La función puede devolver las RPMs de tres formas:
-    // - Raw, o valor sin procesar.
+    // - Raw, o valor sin procesar (el último intervalo de la entrada con más calidad).
     // - Valor en ese instante, procesado para que sea legible.
     // - Valor medio entre las últimas x lecturas, donde x se define como AVERAGE_RPM_COUNT_LIMIT.
     // El último es un valor más suavizado y realista. Hay que tener en cuenta que estamos recuperando las 
     // RPM cientos de veces por segundo, por lo tanto la media entre los últimos 5 valores, por ejemplo,
     // sigue siendo sólamente la media durante unos pocos milisegundos.
-    if (raw)
-        return _rpm[_rpmIndex - 1];
-
-    uint32_t averageRpm = 0;
-    if (noAverage) {
-        averageRpm = _rpm[_rpmIndex - 1];
-    } else {
-        for (uint8_t i = 0; i < AVERAGE_RPM_COUNT_LIMIT; ++i) {
-            averageRpm += _rpm[i];
-        }
-        averageRpm = averageRpm / AVERAGE_RPM_COUNT_LIMIT;
+    if (raw) {
+        uint8_t digitalLast = (_rpmDigitalIndex + AVERAGE_RPM_COUNT_LIMIT - 1) % AVERAGE_RPM_COUNT_LIMIT;
+        uint8_t analogLast = (_rpmAnalogIndex + AVERAGE_RPM_COUNT_LIMIT - 1) % AVERAGE_RPM_COUNT_LIMIT;
+        return _rpmDigitalQuality >= _rpmAnalogQuality ? _rpmDigital[digitalLast] : _rpmAnalog[analogLast];
     }
 
+    uint32_t averageRpm = GetRPMInterval(noAverage);
+
     if (averageRpm <= 0)
         return 0;
 
@@ -390,6 +1035,61 @@ uint32_t DataManager::GetRPM(bool noAverage, bool raw) {
     return 60000000 / (averageRpm * 2);
 }
 
+uint32_t DataManager::GetRPMInterval(bool noAverage) {
+    // Estimación del intervalo entre encendidos combinando ambas entradas, ponderadas por su calidad.
+    // Como la calidad de cada entrada cambia de forma gradual, el paso de una entrada a otra no provoca saltos.
+    uint32_t digital = 0;
+    uint32_t analog = 0;
+    if (noAverage) {
+        noInterrupts();
+        digital = _rpmDigital[(_rpmDigitalIndex + AVERAGE_RPM_COUNT_LIMIT - 1) % AVERAGE_RPM_COUNT_LIMIT];
+        interrupts();
+        analog = _rpmAnalog[(_rpmAnalogIndex + AVERAGE_RPM_COUNT_LIMIT - 1) % AVERAGE_RPM_COUNT_LIMIT];
+    } else {
+        noInterrupts();
+        for (uint8_t i = 0; i < AVERAGE_RPM_COUNT_LIMIT; ++i) {
+            digital += _rpmDigital[i];
+        }
+        interrupts();
+        for (uint8_t i = 0; i < AVERAGE_RPM_COUNT_LIMIT; ++i) {
+            analog += _rpmAnalog[i];
+        }
+        digital = digital / AVERAGE_RPM_COUNT_LIMIT;
+        analog = analog / AVERAGE_RPM_COUNT_LIMIT;
+    }
+
+    // Una entrada sin datos no tiene peso, aunque su calidad sea alta (por ejemplo motor apagado)
+    uint16_t digitalWeight = digital ? _rpmDigitalQuality : 0;
+    uint16_t analogWeight = analog ? _rpmAnalogQuality : 0;
+    if (digitalWeight + analogWeight == 0)
+        return digital ? digital : analog;
+
+    return (digital * digitalWeight + analog * analogWeight) / (digitalWeight + analogWeight);
+}
+
+uint8_t DataManager::GetRPMConfidence() {
+    uint8_t confidence = max(_rpmDigitalQuality, _rpmAnalogQuality);
+
+    // Si las dos entradas son fiables pero no coinciden, alguna de ellas está mintiendo
+    if (min(_rpmDigitalQuality, _rpmAnalogQuality) >= RPM_QUALITY_MAX / 2) {
+        uint32_t digital = 0;
+        uint32_t analog = 0;
+        noInterrupts();
+        for (uint8_t i = 0; i < AVERAGE_RPM_COUNT_LIMIT; ++i) {
+            digital += _rpmDigital[i];
+        }
+        interrupts();
+        for (uint8_t i = 0; i < AVERAGE_RPM_COUNT_LIMIT; ++i) {
+            analog += _rpmAnalog[i];
+        }
+        uint32_t diff = digital > analog ? digital - analog : analog - digital;
+        if (diff * 100 > max(digital, analog) * RPM_SOURCES_MAX_DISAGREEMENT)
+            confidence /= 2;
+    }
+
+    return confidence;
+}
+
 float DataManager::GetVoltage(bool raw) {
     if (raw)
         return _voltage;
@@ -404,6 +1104,13 @@ float DataManager::GetVoltage(bool raw) {
     return vin;
 }
 
+uint32_t DataManager::GetLastIgnitionMicros() {
+    noInterrupts();
+    uint32_t lastMicros = _lastMicros;
+    interrupts();
+    return lastMicros;
+}
+
 bool DataManager::IsEngineOn() {
     if (GetRPM() > 500 || GetEngineOilPressure() >= 1.0)
         return true;
@@ -425,133 +1132,47 @@ bool DataManager::Dallas_isAllZeros(const uint8_t * const scratchPad, const size
     return true;
 }
 
-bool DataManager::Dallas_isConnected(const uint8_t* deviceAddress, uint8_t* scratchPad, OneWire *wire) {
-    bool b = Dallas_readScratchPad(deviceAddress, scratchPad, wire);
-    return b && !Dallas_isAllZeros(scratchPad) && (wire->crc8(scratchPad, 8) == scratchPad[SCRATCHPAD_CRC]);
-}
-
-bool DataManager::Dallas_readScratchPad(const uint8_t* deviceAddress, uint8_t* scratchPad, OneWire *wire) {
-    // send the reset command and fail fast
-    int b = wire->reset();
-    if (b == 0)
-        return false;
-
-    wire->select(deviceAddress);
-    wire->write(READSCRATCH);
-
-    // Read all registers in a simple loop
-    // byte 0: temperature LSB
-    // byte 1: temperature MSB
-    // byte 2: high alarm temp
-    // byte 3: low alarm temp
-    // byte 4: DS18S20: store for crc
-    //         DS18B20 & DS1822: configuration register
-    // byte 5: internal use & crc
-    // byte 6: DS18S20: COUNT_REMAIN
-    //         DS18B20 & DS1822: store for crc
-    // byte 7: DS18S20: COUNT_PER_C
-    //         DS18B20 & DS1822: store for crc
-    // byte 8: SCRATCHPAD_CRC
-    for (uint8_t i = 0; i < 9; i++) {
-        scratchPad[i] = wire->read();
-    }
-
-    b = wire->reset();
-    return (b == 1);
-}
-
 // reads scratchpad and returns fixed-point temperature, scaling factor 2^-7
 int16_t DataManager::Dallas_calculateTemperature(const uint8_t* deviceAddress, uint8_t* scratchPad) {
+    // Con menos de 12 bits de resolución los bits más bajos no están definidos, así que los descartamos
+    uint8_t resolution = Dallas_getResolution(scratchPad);
+    uint8_t lsb = scratchPad[TEMP_LSB] & (uint8_t) (0xFF << (12 - resolution));
     int16_t fpTemperature = (((int16_t) scratchPad[TEMP_MSB]) << 11)
-            | (((int16_t) scratchPad[TEMP_LSB]) << 3);
+            | (((int16_t) lsb) << 3);
 
     return fpTemperature;
 }
 
-// returns temperature in 1/128 degrees C or DEVICE_DISCONNECTED_RAW if the
-// device's scratch pad cannot be read successfully.
-// the numeric value of DEVICE_DISCONNECTED_RAW is defined in
-// DallasTemperature.h. It is a large negative number outside the
-// operating range of the device
-int16_t DataManager::Dallas_getTemp(const uint8_t* deviceAddress, OneWire *wire) {
-    uint8_t scratchPad[9];
-
-    if (Dallas_isConnected(deviceAddress, scratchPad, wire))
-        return Dallas_calculateTemperature(deviceAddress, scratchPad);
-    return DEVICE_DISCONNECTED_RAW;
-}
-
-// returns the current resolution of the device, 9-12
-// returns 0 if device not found
-uint8_t DataManager::Dallas_getResolution(const uint8_t* deviceAddress, OneWire *wire) {
-    uint8_t scratchPad[9];
-    if (Dallas_isConnected(deviceAddress, scratchPad, wire)) {
-        switch (scratchPad[CONFIGURATION]) {
-            case TEMP_12_BIT:
-                return 12;
+// returns the resolution stored in a scratchpad, 9-12
+uint8_t DataManager::Dallas_getResolution(const uint8_t* scratchPad) {
+    switch (scratchPad[CONFIGURATION]) {
+        case TEMP_12_BIT:
+            return 12;
 
-            case TEMP_11_BIT:
-                return 11;
+        case TEMP_11_BIT:
+            return 11;
 
-            case TEMP_10_BIT:
-                return 10;
+        case TEMP_10_BIT:
+            return 10;
 
-            case TEMP_9_BIT:
-                return 9;
-        }
+        case TEMP_9_BIT:
+        default:
+            return 9;
     }
-    return 0;
 }
 
-// set resolution of a device to 9, 10, 11, or 12 bits
-// if new resolution is out of range, 9 bits is used.
-bool DataManager::Dallas_setResolution(const uint8_t* deviceAddress, OneWire *wire) {
-    // Para este uso, 10 bits de resolución es más que suficiente
-    uint8_t newResolution = DS18B20_RESOLUTION;
-
-    // return when stored value == new value
-    if (Dallas_getResolution(deviceAddress, wire) == newResolution)
-        return true;
-
-    uint8_t scratchPad[9];
-    if (Dallas_isConnected(deviceAddress, scratchPad, wire)) {
-        switch (newResolution) {
-            case 12:
-                scratchPad[CONFIGURATION] = TEMP_12_BIT;
-                break;
-            case 11:
-                scratchPad[CONFIGURATION] = TEMP_11_BIT;
-                break;
-            case 10:
-                scratchPad[CONFIGURATION] = TEMP_10_BIT;
-                break;
-            case 9:
-            default:
-                scratchPad[CONFIGURATION] = TEMP_9_BIT;
-                break;
-        }
-        Dallas_writeScratchPad(deviceAddress, scratchPad, wire);
-
-        return true;  // new value set
+// configuration register for 9, 10, 11, or 12 bits
+// if the resolution is out of range, 9 bits is used.
+uint8_t DataManager::Dallas_resolutionToConfig(uint8_t resolution) {
+    switch (resolution) {
+        case 12:
+            return TEMP_12_BIT;
+        case 11:
+            return TEMP_11_BIT;
+        case 10:
+            return TEMP_10_BIT;
+        case 9:
+        default:
+            return TEMP_9_BIT;
     }
-
-    return false;
-}
-
-void DataManager::Dallas_writeScratchPad(const uint8_t* deviceAddress, const uint8_t* scratchPad, OneWire *wire) {
-    wire->reset();
-    wire->select(deviceAddress);
-    wire->write(WRITESCRATCH);
-    wire->write(scratchPad[HIGH_ALARM_TEMP]); // high alarm temp
-    wire->write(scratchPad[LOW_ALARM_TEMP]); // low alarm temp
-    wire->write(scratchPad[CONFIGURATION]);
-    wire->reset();
-
-    // save the newly written values to eeprom
-    wire->select(deviceAddress);
-    wire->write(COPYSCRATCH, false); // En este caso no usamos las sondas en parasite mode, por lo tanto parasite = false
-    // Este delay se puede dejar, ya que estas funciones sólo se llaman una vez al inicializar la centralita
-    delay(20); // <--- added 20ms delay to allow 10ms long EEPROM write operation (as specified by datasheet)
-
-    wire->reset();
 }
@@ -12,20 +12,61 @@
 #define __DATA_MAANGER__H__
 
 #define DS18B20_RESOLUTION      10             // 10 Bits
+// Modo adaptativo de las sondas DS18B20: si la temperatura sube rápido o se acerca al aviso, leemos más a menudo
+// con menos resolución (9 bits). Si está estable, leemos menos a menudo con más resolución (11 bits).
+#define DS18B20_ADAPTIVE_MODE   true           // Activa el modo adaptativo (si no, 10 bits cada TEMP_DATA_INTERVAL)
+#define DS18B20_FAST_RESOLUTION 9              // 9 Bits (0.5º), 94 milisegundos de conversión
+#define DS18B20_SLOW_RESOLUTION 11             // 11 Bits (0.125º), 375 milisegundos de conversión
+#define DS18B20_FAST_RATE       64             // 0.5 Cº/s (en valor raw, 1/128 Cº) para pasar al modo rápido
+#define DS18B20_STABLE_RATE     6              // ~0.05 Cº/s (en valor raw) para considerar la temperatura estable
+#define DS18B20_STABLE_READS    5              // Lecturas estables seguidas antes de pasar al modo lento
+#define DS18B20_UNSTABLE_READS  3              // Lecturas inestables seguidas antes de salir del modo lento
+// Los umbrales de velocidad se comparan con el cambio real de la lectura: un salto de 1 LSB de la resolución actual
+// (32 raw a 10 bits, 16 a 11 bits) es ruido de cuantización y no cuenta, sea cual sea el intervalo entre lecturas
+#define DS18B20_WARNING_MARGIN  5.0            // 5 Cº por debajo del aviso ya pasamos al modo rápido
 #define ANALOG_TO_VOLTS         0.0048828125   // Para pasar 10 bits analógicos a voltios en el pin
 #define PSI_TO_BAR              14.5038        // Para pasar PSI a bares
 #define DALLAS_RAW_TO_CELSIUS   0.0078125      // Para pasar los valores devueltos por los sensores DS18B20 a Cº
 #define RPM_INPUT_HIGH_VALUE    200            // Para el input de las RPM, consideraremos el pin analógico como HIGH a partir de este valor
 #define RPM_INPUT_INTERVAL_MAX  500000         // Máximo valor posible para el intervalo entre encendidos de bobina, en microsegundos. 500.000 (0,5 segundos) = 60 RPM.
-#define RPM_ANALOG_MIN_VALUE    610            // Mínimo valor de voltaje en el pin de la señal de RPM antes de pasar a la comprobación secundaria.
-#define MAX_RPM_INPUT_LOW_VOLTAGE_ERRORS 10
+#define RPM_ANALOG_MIN_VALUE    610            // Mínimo valor de voltaje en el pin de la señal de RPM para considerar que la señal digital es fiable.
+// Estimador de RPM con dos entradas (digital por interrupt y analógica por muestreo)
+#define RPM_QUALITY_MAX         100            // Calidad máxima de cada una de las entradas de RPM (0-100)
+#define RPM_DIGITAL_QUALITY_STEP 10            // Puntos de calidad que pierde/gana la entrada digital con cada lectura de voltaje débil/fuerte
+#define RPM_ANALOG_SAMPLE_RATIO 4              // La entrada analógica pierde calidad cuando el periodo de muestreo x4 se acerca al intervalo entre encendidos
+#define RPM_MAX_MISSED_DIGITAL_EDGES 2         // Encendidos detectados por la entrada analógica sin que salte el interrupt antes de descartar la entrada digital
+#define RPM_SOURCES_MAX_DISAGREEMENT 10        // Diferencia máxima (en %) entre ambas entradas antes de reducir la confianza de la estimación
+// Ventana de predicción del interrupt de encendido. Los límites se calculan con desplazamientos, sin divisiones.
+// El motor no puede acelerar más de ~40% ni decelerar más de ~50% de un encendido al siguiente (incluso a ralentí en punto muerto).
+#define RPM_GATE_ENABLED        true           // Activa el filtro de encendidos falsos en el interrupt
+#define RPM_GATE_MAX_CONSECUTIVE 3             // Encendidos seguidos fuera de la ventana: tarde = nuevo régimen, pronto = se reinicia la predicción
+// Estadísticas de los intervalos entre encendidos, para detectar una señal de RPM corrupta en pocos encendidos
+#define IGNITION_STATS_WINDOW   32             // Encendidos por bloque de estadísticas (media y varianza de Welford)
+#define IGNITION_MISSING_RATIO  410            // Intervalo >= 1.6x el previsto: se han perdido encendidos (x/256)
+#define IGNITION_EXTRA_RATIO    154            // Intervalo <= 0.6x el previsto: encendido falso, ruido en la señal (x/256)
+#define IGNITION_MAX_DEVIATION  4.0            // Desviaciones típicas máximas del ratio respecto a la media del último bloque
+#define IGNITION_MIN_DEVIATION  0.15           // Y además al menos un 15%, para no marcar variaciones mínimas con el motor muy estable
+#define IGNITION_MAX_ANOMALIES  3              // Encendidos anómalos en los últimos 16 para considerar la señal corrupta
 #define AVERAGE_RPM_COUNT_LIMIT 5              // Número de comprobaciones de RPM que se guardan para devolver una media entre todos los valores.
 #define AVERAGE_AFR_COUNT_LIMIT 5              // Número de comprobaciones de AFR que se guardan para devolver una media entre todos los valores.
 // TIMERS E INTERVALS
 #define SECONDARY_DATA_INTERVAL 100            // 0.1 segundos
 #define TEMP_DATA_INTERVAL      1000           // 1 segundo
-#define DS18B20_UPDATE_INTERVAL 188            // 94 milisegundos a 9 bits de resolución (0.5º), 188 a 10 bits (0.25º)
+#define TEMP_DATA_FAST_INTERVAL 250            // 0.25 segundos, en el modo rápido de las sondas DS18B20
+#define TEMP_DATA_SLOW_INTERVAL 2000           // 2 segundos, en el modo lento de las sondas DS18B20
+#define DS18B20_UPDATE_INTERVAL 94             // 94 milisegundos a 9 bits de resolución (0.5º), se duplica con cada bit adicional (188 a 10 bits)
+#define DS18B20_COPY_INTERVAL   20             // 20 milisegundos para que la sonda copie el scratchpad a su EEPROM (10 según el datasheet)
+#define DS18B20_DISCOVERY_INTERVAL 2000        // 2 segundos entre intentos de encontrar una sonda desconectada
+#define DS18B20_MAX_READ_ERRORS 3              // Lecturas fallidas seguidas antes de volver a buscar la sonda (por si se ha cambiado)
 #define STARTUP_CHECK_INTERVAL  1500           // 1.5 segundos
+// AFR digital por el puerto serie del controlador de la sonda Wideband (AEM UEGO: "14.7\r\n" a 9600 baudios)
+#define AFR_SERIAL_ENABLED      true           // Lee el AFR del puerto serie del controlador. La entrada analógica queda como respaldo
+#define AFR_SERIAL              Serial2        // UART libre a la que se conecta la salida serie del controlador (RX2, pin 17)
+#define AFR_SERIAL_BAUD_RATE    9600
+#define AFR_SERIAL_TIMEOUT      500            // Si no llega ninguna lectura válida en 0.5 segundos, volvemos a la entrada analógica
+#define AFR_SERIAL_BUFFER_SIZE  8              // Máximo de caracteres por línea ("14.7" + margen)
+#define AFR_SERIAL_MIN_VALUE    600            // 6.0:1 AFR, por debajo la lectura se descarta (x100)
+#define AFR_SERIAL_MAX_VALUE    2500           // 25.0:1 AFR, por encima la lectura se descarta (x100)
 
 // INPUTS (Nº de pin en el Arduino)
 #define INPUT_ENG_OIL_PRESSURE  A1             // Input para el sensor de presión del aceite del motor (0-5v analógica)
@@ -51,6 +92,9 @@
 #define COUNT_PER_C     7
 #define SCRATCHPAD_CRC  8
 // OneWire commands
+#define READROM         0x33  // Read the ROM of the only device on the bus
+#define SKIPROM         0xCC  // Address all devices on the bus
+#define MATCHROM        0x55  // Address a specific device
 #define STARTCONVO      0x44  // Tells device to take a temperature reading and put it on the scratchpad
 #define COPYSCRATCH     0x48  // Copy EEPROM
 #define READSCRATCH     0xBE  // Read EEPROM
@@ -65,82 +109,208 @@
 #define TEMP_12_BIT     0x7F  // 12 bit
 // Fin de las definiciones de DallasTemperature
 
+// Estados de la lectura asíncrona de las sondas DS18B20
+enum DS18B20State {
+    DS18B20_IDLE       = 0, // Esperando al siguiente intervalo de lectura
+    DS18B20_CONVERT    = 1, // Pendiente de pedir una conversión, en cuanto el bus OneWire esté libre
+    DS18B20_CONVERTING = 2, // El sensor está calculando la temperatura
+    DS18B20_READ       = 3, // Pendiente de leer el scratchpad, en cuanto el bus OneWire esté libre
+    DS18B20_READING    = 4, // Leyendo el scratchpad en segundo plano
+    DS18B20_CONFIGURE  = 5, // Pendiente de cambiar la resolución, en cuanto el bus OneWire esté libre
+    DS18B20_CONFIGURING = 6, // Escribiendo la nueva resolución en el scratchpad
+    // Descubrimiento de las sondas en segundo plano
+    DS18B20_VERIFY     = 7, // Pendiente de comprobar que la sonda guardada en la EEPROM sigue conectada
+    DS18B20_VERIFYING  = 8, // Leyendo el scratchpad de la sonda guardada en la EEPROM
+    DS18B20_DISCOVER   = 9, // Pendiente de leer la ROM de la sonda conectada al bus
+    DS18B20_DISCOVERING = 10, // Leyendo la ROM de la sonda
+    DS18B20_MISSING    = 11, // No hay ninguna sonda en el bus, esperando para volver a buscar
+    DS18B20_STORE      = 12, // Pendiente de guardar la resolución por defecto en la EEPROM de la sonda
+    DS18B20_STORING    = 13, // Escribiendo el scratchpad con la resolución por defecto
+    DS18B20_COPYING    = 14  // Esperando a que la sonda copie el scratchpad a su EEPROM
+};
+
+// Entradas con número de secuencia. El número se incrementa cada vez que cambia el valor raw de la entrada,
+// así el DataMonitor sólo vuelve a evaluar un parámetro cuando realmente ha cambiado algo.
+enum DataInput {
+    DATA_INPUT_ENG_OIL_PRESSURE = 0,
+    DATA_INPUT_ENG_OIL_TEMP     = 1,
+    DATA_INPUT_GB_OIL_TEMP      = 2,
+    DATA_INPUT_AFR              = 3,
+    DATA_INPUT_VOLTAGE          = 4,
+    DATA_INPUT_COUNT            = 5  // Siempre el último
+};
+
+// Resumen de la presión de aceite a la velocidad del ADC entre dos consultas del DataMonitor
+struct OilPressureWindow {
+    float min;            // Bares
+    float max;
+    uint32_t timeBelow;   // Microsegundos por debajo del umbral
+    uint8_t events;       // Caídas por debajo del umbral (falta de presión) en la ventana
+};
+
+struct DS18B20Sensor {
+    uint8_t pin;          // Pin del bus OneWire de la sonda
+    EEPROMDataAddress eepromAddress; // Dirección de la EEPROM donde se guarda la ROM y resolución de la sonda
+    uint8_t readErrors;   // Lecturas fallidas seguidas
+    uint8_t address[8];   // Identificador de la sonda
+    DS18B20State state;
+    uint32_t timer;       // Timer para esperar a que termine la conversión
+    int16_t temp;         // Última temperatura leída, sin procesar
+    // Modo adaptativo
+    uint8_t resolution;       // Resolución configurada en la sonda (9-12 bits)
+    uint8_t targetResolution; // Resolución que queremos según la evolución de la temperatura
+    uint8_t alarmHigh;        // Bytes TH y TL del scratchpad, hay que reenviarlos al cambiar la resolución
+    uint8_t alarmLow;
+    uint8_t stableReads;      // Lecturas seguidas con la temperatura estable
+    uint8_t unstableReads;    // Lecturas seguidas con la temperatura inestable, en el modo lento
+    uint32_t interval;        // Intervalo entre lecturas según el modo actual
+    uint32_t intervalTimer;
+    uint32_t lastReadTime;    // millis() de la última lectura válida, para calcular dT/dt
+    int16_t warningTemp;      // Temperatura de aviso (raw), cerca de ella leemos lo más rápido posible
+};
+
 class DataManager {
     // Variables para almacenar los datos de manera interna y sin procesar
-    int16_t _engineOilTemp;
-    int16_t _gearboxOilTemp;
     uint16_t _engineOilPressure;
     uint16_t _tps;
     float _tpsMinValue; // Valor mínimo del TPS, se carga al inicializar el DataManager (se supone que al dar contacto no se tiene el acelerador pisado)
     float _tpsMaxValue; // Valor máximo del TPS, por defecto 3.5v. El DataManager lo ajusta automáticamente si detecta un valor mayor
     uint16_t _afr[AVERAGE_AFR_COUNT_LIMIT];
-    uint32_t _rpm[AVERAGE_RPM_COUNT_LIMIT];
+    volatile uint32_t _rpmDigital[AVERAGE_RPM_COUNT_LIMIT]; // Intervalos entre encendidos medidos por el interrupt
+    uint32_t _rpmAnalog[AVERAGE_RPM_COUNT_LIMIT];           // Intervalos entre encendidos medidos muestreando la entrada analógica
     uint16_t _voltage;
 
     // Índices de control para obtener valores medios de RPM y AFR
-    uint8_t _rpmIndex;
+    volatile uint8_t _rpmDigitalIndex;
+    uint8_t _rpmAnalogIndex;
     uint8_t _afrIndex;
 
+    // AFR recibido por el puerto serie del controlador Wideband
+    char _afrSerialBuffer[AFR_SERIAL_BUFFER_SIZE]; // Línea en curso
+    uint8_t _afrSerialLength;
+    bool _isAFRSerialLineValid;   // La línea en curso sólo contiene caracteres válidos y cabe en el buffer
+    uint16_t _afrSerialValue;     // Último AFR válido (x100)
+    uint32_t _afrSerialTimer;     // Tiempo desde el último AFR válido
+    bool _isAFRSerialActive;      // El AFR viene del puerto serie (hay lecturas recientes)
+
     // Variables para el control de las RPMs
+    // Ambas entradas se siguen siempre en paralelo, y cada una tiene una calidad (0-100) que se usa para ponderar
+    // su peso en la estimación final. Así el paso de una a otra es gradual y no hay saltos en las RPMs.
     uint32_t _micros;           // Microsegundos desde el inicio del Arduino.
-    uint32_t _lastMicros;       // Microsegundos desde el inicio del Arduino en los que se produjo el último encendido de la bobina.
-    uint32_t _rpmInterval;      // Microsegundos entre encendidos de la bobina según la ECU del coche.
-    uint8_t _rpmLowVoltageInputCount;
+    volatile uint32_t _lastMicros; // Microsegundos desde el inicio del Arduino en los que se produjo el último encendido de la bobina.
+    uint32_t _rpmInterval;      // Microsegundos entre encendidos de la bobina según la entrada analógica.
+    uint8_t _rpmDigitalQuality;
+    uint8_t _rpmAnalogQuality;
+    volatile uint8_t _rpmMissedDigitalEdges; // Encendidos vistos por la entrada analógica desde el último interrupt
+    uint8_t _lastRPMDigitalCount; // Para saber si el interrupt ha registrado nuevos encendidos desde el último Update()
+
+    // Estadísticas incrementales de los intervalos medidos por el interrupt
+    volatile uint8_t _rpmDigitalCount; // Intervalos registrados por el interrupt (se desborda, sólo importa la diferencia)
+
+    // Ventana de predicción del interrupt
+    volatile uint32_t _rpmGatePredicted;          // Último intervalo aceptado, 0 = sin predicción (arranque)
+    volatile uint8_t _rpmGateConsecutive;         // Encendidos seguidos fuera de la ventana
+    volatile uint16_t _rpmGateRejectedEdges;      // Encendidos demasiado pronto (ruido), se descartan por completo
+    volatile uint16_t _rpmGateQuarantinedEdges;   // Encendidos demasiado tarde (se ha perdido alguno), se toman como referencia pero su intervalo no se usa
+    uint16_t _lastRPMGateRejectedEdges;           // Para pasar los eventos nuevos a las estadísticas
+    uint16_t _lastRPMGateQuarantinedEdges;
+    uint8_t _ignitionStatsCount;       // Intervalos ya procesados
+    uint8_t _ignitionStatsSamples;     // Welford: muestras del bloque en curso
+    float _ignitionStatsMean;          // Welford: media del bloque en curso
+    float _ignitionStatsM2;            // Welford: suma de cuadrados de las diferencias del bloque en curso
+    uint8_t _ignitionStatsRatioSamples;
+    float _ignitionStatsRatioMean;     // Welford: media del ratio intervalo/previsto del bloque en curso
+    float _ignitionStatsRatioM2;
+    float _ignitionIntervalMean;       // Media del último bloque completo (us)
+    float _ignitionIntervalStdDev;     // Desviación típica del último bloque completo (us)
+    float _ignitionRatioMean;          // Media del ratio intervalo/previsto del último bloque completo
+    float _ignitionRatioStdDev;        // Desviación típica del ratio del último bloque completo
+    uint32_t _ignitionPredictedInterval; // Último intervalo válido, se usa como previsión del siguiente
+    uint16_t _ignitionMissingEdges;    // Encendidos perdidos desde el arranque
+    uint16_t _ignitionExtraEdges;      // Encendidos falsos desde el arranque
+    uint16_t _ignitionAnomalies;       // Un bit por cada uno de los últimos 16 intervalos, a 1 si ha sido anómalo
     bool _rpmTriggerCooldown;
     bool _startupCheckExecuted;
-    bool _selectAuxRPMInput;
     
     // Timers internos para recuperar los datos de los sensores con diferente prioridad
     // Los datos de alta prioridad (RPMs, presión de aceite y AFR) se recuperan constantemente
     uint32_t _secondaryDataTimer; // Se consideran datos secundarios el AFR, TPS y voltaje (prioridad media)
-    uint32_t _tempDataTimer;      // Intervalo para recuperar los datos de las sondas DS18B20 (baja prioridad)
     uint32_t _startupCheckTimer;  // Este timer sólo se ejecuta una vez al arrancar la centralita, para dar tiempo a la ECU del coche a inicializarse
 
-    // Timers internos para gestionar las sondas DS18B20 de forma asíncrona
-    uint32_t _engOilTempTimer;
-    uint32_t _gbOilTempTimer;
+    // Sondas DS18B20. Las lecturas se hacen por completo en segundo plano con el motor OneWire asíncrono,
+    // que sólo puede atender una transacción a la vez, así que las dos sondas se turnan el bus.
+    DS18B20Sensor _engOilTempSensor;
+    DS18B20Sensor _gbOilTempSensor;
+    DS18B20Sensor *_oneWireOwner; // Sonda que ha iniciado la transacción OneWire en curso
+    OneWireAsync _oneWire;
 
-    // Objetos OneWire para recuperar la información de las sondas DS18B20
-    OneWire _engOilTempWire;
-    OneWire _gbOilTempWire;
+    EEPROMManager *_eepromManager; // Para guardar la ROM y resolución de las sondas, y así no tener que buscarlas en cada arranque
+    uint32_t _firstValidRPMTime;   // millis() en el que se obtuvo la primera lectura de RPM válida
 
-    // Array para guardar los identificadores de las dos sondas DS18B20
-    uint8_t _engOilTempAddress[8];
-    uint8_t _gbOilTempAddress[8];
-    
-    // Variables para guardar el estado de los timers para las sondas DS18B20
-    bool _engOilTempRequested;
-    bool _gbOilTempRequested;
+    // Adquisición síncrona con el encendido. Todas las lecturas analógicas pasan por el AnalogSampler.
+    AnalogSampler _analogSampler;
+    volatile uint16_t _ignitionEventCount; // Índice del encendido, se incrementa con cada interrupt
+    uint8_t _lastRevolutionSequence;      // Última vuelta publicada por el AnalogSampler que hemos procesado
+    uint32_t _syncAcquisitionTimer;       // Tiempo desde la última vuelta publicada
+    bool _isSyncAcquisitionActive;        // Presión de aceite y AFR vienen de la adquisición síncrona
+    bool _isNewRevolution;                // Hay una vuelta nueva en este Update()
+
+    // Último valor raw y número de secuencia de cada entrada
+    int16_t _inputValues[DATA_INPUT_COUNT];
+    uint8_t _inputSequences[DATA_INPUT_COUNT];
 
     // Funciones internas para recuperar los valores directamente de los inputs
     void RetrieveEngineOilPressure();
-    void RetrieveEngineOilTemp(bool requestCompleted);
-    void RetrieveGearboxOilTemp(bool requestCompleted);
+    float ConvertEngineOilPressure(uint16_t raw);
+    void InitTempSensor(DS18B20Sensor *sensor, uint8_t pin, EEPROMDataAddress eepromAddress, float warningTemp);
+    void LoadTempSensor(DS18B20Sensor *sensor);
+    void SaveTempSensor(DS18B20Sensor *sensor);
+    void UpdateTempSensor(DS18B20Sensor *sensor, uint32_t diff);
+    bool StartTempSensorTransaction(DS18B20Sensor *sensor, uint8_t command, const uint8_t *data, uint8_t dataLength, uint8_t readLength);
+    bool IsTempSensorTransactionDone(DS18B20Sensor *sensor);
+    bool ReadTempSensorScratchPad(uint8_t *scratchPad);
+    void AdaptTempSensor(DS18B20Sensor *sensor, int16_t newTemp);
     void RetrieveTPS();
     void RetrieveAFR();
+    void RetrieveAFRSerial(uint32_t diff);
+    bool ParseAFRSerialLine();
     void RetrieveVoltage();
     void ExecuteStartupCheck();
+    void PushAnalogRPMInterval(uint32_t interval);
+    void UpdateInputSequences();
+    void UpdateIgnitionStats();
+    void ProcessIgnitionInterval(uint32_t interval);
+    void ResetIgnitionStats();
+    int16_t GetInputRawValue(DataInput input);
+    uint32_t GetRPMInterval(bool noAverage);
 
     // Funciones importadas de la librería DallasTemperature, para una implementación asíncrona
     bool Dallas_isAllZeros(const uint8_t * const scratchPad, const size_t length = 9);
-    bool Dallas_isConnected(const uint8_t* deviceAddress, uint8_t* scratchPad, OneWire *wire);
-    bool Dallas_readScratchPad(const uint8_t* deviceAddress, uint8_t* scratchPad, OneWire *wire);
     int16_t Dallas_calculateTemperature(const uint8_t* deviceAddress, uint8_t* scratchPad);
-    int16_t Dallas_getTemp(const uint8_t* deviceAddress, OneWire *wire);
-    uint8_t Dallas_getResolution(const uint8_t* deviceAddress, OneWire *wire);
-    bool Dallas_setResolution(const uint8_t* deviceAddress, OneWire *wire);
-    void Dallas_writeScratchPad(const uint8_t* deviceAddress, const uint8_t* scratchPad, OneWire *wire);
+    uint8_t Dallas_getResolution(const uint8_t* scratchPad);
+    uint8_t Dallas_resolutionToConfig(uint8_t resolution);
 
   public:
-    // Constructor para inicializar la clase
+    // Constructor para inicializar la clase. No toca los buses OneWire, así el arranque de la centralita es inmediato.
     DataManager();
 
+    // Función de inicialización. Carga de la EEPROM las sondas DS18B20 encontradas en arranques anteriores,
+    // que se verifican (o se vuelven a buscar) en segundo plano desde Update().
+    void Initialize(EEPROMManager *eepromManager);
+
     // Función principal que gestiona los timers para recuperar la información de los sensores
     // Se llama en cada iteración de la función loop()
     void Update(uint32_t diff);
 
-    // Función llamada desde el interrupt para calcular las RPM
-    void CalculateRPM(uint32_t currentMicros);
+    // Función llamada desde la interrupción del Timer1 para avanzar el bus OneWire
+    void OneWireTimerEvent() { _oneWire.TimerEvent(); };
+    // Funciones llamadas desde las interrupciones del Timer3 y del ADC para la adquisición síncrona
+    void SyncSampleTimerEvent() { _analogSampler.SyncTimerEvent(); };
+    void ADCConversionEvent() { _analogSampler.ConversionEvent(); };
+
+    // Función llamada desde el interrupt para calcular las RPM. Devuelve el intervalo aceptado, 0 si el encendido
+    // se ha descartado o sólo sirve de referencia (para la vía rápida del SafetyGuard)
+    uint32_t CalculateRPM(uint32_t currentMicros);
     // Función auxiliar para obtener las RPM
     void RetrieveRPM(uint32_t microDiff);
 
@@ -150,11 +320,37 @@ class DataManager {
     float GetEngineOilPressure(bool raw = false);
     float GetEngineOilTemp(bool raw = false);
     float GetGearboxOilTemp(bool raw = false);
+    // millis() de la última lectura válida de cada sonda, para detectar lecturas nuevas aunque la temperatura no cambie
+    uint32_t GetEngineOilTempReadTime() { return _engOilTempSensor.lastReadTime; };
+    uint32_t GetGearboxOilTempReadTime() { return _gbOilTempSensor.lastReadTime; };
     uint16_t GetTPS(bool raw = false);
     float GetAFR(bool noAverage = false, bool raw = false);
     uint32_t GetRPM(bool noAverage = false, bool raw = false);
+    uint8_t GetRPMConfidence(); // Confianza (0-100) en el valor de RPM devuelto por GetRPM()
     float GetVoltage(bool raw = false);
     bool IsEngineOn();
+    uint32_t GetFirstValidRPMTime() { return _firstValidRPMTime; }; // Tiempo desde el arranque (ms) hasta la primera lectura de RPM válida
+    uint32_t GetLastIgnitionMicros(); // micros() del último encendido registrado por el interrupt
+    // Lectura analógica a través del AnalogSampler, para los sensores que no gestiona directamente el DataManager
+    uint16_t ReadAnalog(uint8_t pin) { return _analogSampler.Read(pin); };
+    AnalogSampler* GetAnalogSampler() { return &_analogSampler; }; // Para el modo osciloscopio del CommsManager
+    // Estadísticas de la señal de encendido
+    float GetIgnitionIntervalMean() { return _ignitionIntervalMean; };
+    float GetIgnitionIntervalStdDev() { return _ignitionIntervalStdDev; };
+    uint16_t GetIgnitionMissingEdges() { return _ignitionMissingEdges; };
+    uint16_t GetIgnitionExtraEdges() { return _ignitionExtraEdges; };
+    uint16_t GetRPMGateRejectedEdges() { return _rpmGateRejectedEdges; };
+    uint16_t GetRPMGateQuarantinedEdges() { return _rpmGateQuarantinedEdges; };
+    bool IsIgnitionSignalCorrupt();
+    uint8_t GetInputSequence(DataInput input) { return _inputSequences[input]; };
+    bool IsAFRSerialActive() { return _isAFRSerialActive; };
+    bool IsSyncAcquisitionActive() { return _isSyncAcquisitionActive; };
+    uint16_t GetSyncMissedSamples() { return _analogSampler.GetMissedSamples(); };
+    // Vigilancia de transitorios de la presión de aceite. El umbral se indica en bares, 0 para desactivarlo
+    void SetOilPressureThreshold(float pressure);
+    bool GetOilPressureWindow(OilPressureWindow *window); // false si no hay muestras nuevas
+    uint16_t GetOilPressureTransientEvents() { return _analogSampler.GetTransientEvents(); };
+    bool IsOilPressureLow() { return _analogSampler.IsTransientBelowThreshold(); }; // Se puede llamar desde las interrupciones
 };
 
 #endif
@@ -8,28 +8,99 @@
 #include <stdint.h>
 #include <OneWire.h>
 // #include <DallasTemperature.h>
+#include "EEPROMManager.h"
+#include "OneWireAsync.h"
+#include "AnalogSampler.h"
 #include "DataManager.h"
 #include "DataMonitor.h"
 
+// Tabla de reglas. Las reglas de cada parámetro van en orden de prioridad (primero las de más gravedad).
+static const MonitorRule MONITOR_RULES[] = {
+    // Presión de aceite. Sólo con el motor encendido, el mínimo depende de la temperatura del aceite y de las RPM.
+    // Con la presión de aceite no hay medias tintas, o va bien o no va. El estado DANGER se mantiene un mínimo de
+    // tiempo para asegurarnos de que el CommsManager lo pilla y envía el fallo al TFT. El umbral de estas reglas
+    // también es el de la vigilancia de transitorios del AnalogSampler (ver GetOilPressureThreshold()).
+    { MONITOR_ENG_OIL_PRESSURE, MONITOR_ENGINE_ON | MONITOR_OIL_COLD, -MONITOR_NO_LIMIT, ENGINE_OIL_PRESS_MIN, false, STATUS_DANGER, OIL_PRESS_STATUS_HYSTERESIS, 0, MIN_OIL_PRESS_DANGER_TIMER },
+    { MONITOR_ENG_OIL_PRESSURE, MONITOR_ENGINE_ON | MONITOR_OIL_HOT, -MONITOR_NO_LIMIT, ENGINE_OIL_PRESS_MIN_HOT, false, STATUS_DANGER, OIL_PRESS_STATUS_HYSTERESIS, 0, MIN_OIL_PRESS_DANGER_TIMER },
+    { MONITOR_ENG_OIL_PRESSURE, MONITOR_ENGINE_ON | MONITOR_HIGH_RPM, -MONITOR_NO_LIMIT, ENGINE_OIL_PRESS_MIN_RPMS, false, STATUS_DANGER, OIL_PRESS_STATUS_HYSTERESIS, 0, MIN_OIL_PRESS_DANGER_TIMER },
+    // Por encima de los mínimos fijos, pero bastante por debajo de lo normal para este motor (ver UpdateOilBaseline())
+    { MONITOR_ENG_OIL_PRESSURE, MONITOR_ENGINE_ON | MONITOR_OIL_PRESS_DEVIATION, -MONITOR_NO_LIMIT, MONITOR_NO_LIMIT, false, STATUS_WARNING, 0.0, 0, OIL_BASELINE_WARNING_HOLD },
+    // Temperatura del aceite del motor
+    { MONITOR_ENG_OIL_TEMP, MONITOR_ALWAYS, -MONITOR_NO_LIMIT, DS18B20_ERROR_TEMP + 1.0, false, STATUS_ERROR, 0.0, 0, 0 },
+    { MONITOR_ENG_OIL_TEMP, MONITOR_ALWAYS, ENGINE_OIL_TEMP_DANGER, MONITOR_NO_LIMIT, false, STATUS_DANGER, TEMP_STATUS_HYSTERESIS, 0, 0 },
+    { MONITOR_ENG_OIL_TEMP, MONITOR_ALWAYS, ENGINE_OIL_TEMP_WARNING, ENGINE_OIL_TEMP_DANGER, false, STATUS_WARNING, TEMP_STATUS_HYSTERESIS, 0, 0 },
+    { MONITOR_ENG_OIL_TEMP, MONITOR_ALWAYS, -MONITOR_NO_LIMIT, ENGINE_OIL_COLD_TEMP_LIMIT, false, STATUS_COLD, TEMP_STATUS_HYSTERESIS, 0, 0 },
+    // Temperatura del aceite de la caja de cambios
+    { MONITOR_GB_OIL_TEMP, MONITOR_ALWAYS, -MONITOR_NO_LIMIT, DS18B20_ERROR_TEMP + 1.0, false, STATUS_ERROR, 0.0, 0, 0 },
+    { MONITOR_GB_OIL_TEMP, MONITOR_ALWAYS, GEARBOX_OIL_TEMP_DANGER, MONITOR_NO_LIMIT, false, STATUS_DANGER, TEMP_STATUS_HYSTERESIS, 0, 0 },
+    { MONITOR_GB_OIL_TEMP, MONITOR_ALWAYS, GEARBOX_OIL_TEMP_WARNING, GEARBOX_OIL_TEMP_DANGER, false, STATUS_WARNING, TEMP_STATUS_HYSTERESIS, 0, 0 },
+    { MONITOR_GB_OIL_TEMP, MONITOR_ALWAYS, -MONITOR_NO_LIMIT, GEARBOX_OIL_COLD_TEMP_LIMIT, false, STATUS_COLD, TEMP_STATUS_HYSTERESIS, 0, 0 },
+    // AFR. Con el motor apagado o la sonda calentándose (-1.0), COLD. Las mezclas ricas se ignoran con el motor frío.
+    { MONITOR_AFR, MONITOR_ENGINE_OFF, -MONITOR_NO_LIMIT, MONITOR_NO_LIMIT, false, STATUS_COLD, 0.0, 0, 0 },
+    { MONITOR_AFR, MONITOR_ALWAYS, -MONITOR_NO_LIMIT, 0.0, false, STATUS_COLD, 0.0, 0, 0 },
+    { MONITOR_AFR, MONITOR_OIL_WARM, -MONITOR_NO_LIMIT, AFR_RICH_DANGER, true, STATUS_DANGER, AFR_STATUS_HYSTERESIS, 0, 0 },
+    { MONITOR_AFR, MONITOR_ALWAYS, AFR_LEAN_DANGER, MONITOR_NO_LIMIT, false, STATUS_DANGER, AFR_STATUS_HYSTERESIS, 0, 0 },
+    { MONITOR_AFR, MONITOR_OIL_WARM, -MONITOR_NO_LIMIT, AFR_RICH_WARNING, true, STATUS_WARNING, AFR_STATUS_HYSTERESIS, AFR_WARNING_PERSISTENCE, 0 },
+    { MONITOR_AFR, MONITOR_ALWAYS, AFR_LEAN_WARNING, MONITOR_NO_LIMIT, false, STATUS_WARNING, AFR_STATUS_HYSTERESIS, AFR_WARNING_PERSISTENCE, 0 },
+    // Voltaje. Con el motor encendido los límites bajos suben para compensar el voltaje adicional del alternador,
+    // y dar más tiempo de reacción si falla.
+    { MONITOR_VOLTAGE, MONITOR_ENGINE_ON, -MONITOR_NO_LIMIT, VOLTAGE_LOW_DANGER + ENGINE_ON_VOLTAGE_OFFSET, true, STATUS_DANGER, VOLTAGE_STATUS_HYSTERESIS, VOLTAGE_STATUS_PERSISTENCE, 0 },
+    { MONITOR_VOLTAGE, MONITOR_ENGINE_OFF, -MONITOR_NO_LIMIT, VOLTAGE_LOW_DANGER, true, STATUS_DANGER, VOLTAGE_STATUS_HYSTERESIS, VOLTAGE_STATUS_PERSISTENCE, 0 },
+    { MONITOR_VOLTAGE, MONITOR_ALWAYS, VOLTAGE_HIGH_DANGER, MONITOR_NO_LIMIT, false, STATUS_DANGER, VOLTAGE_STATUS_HYSTERESIS, VOLTAGE_STATUS_PERSISTENCE, 0 },
+    { MONITOR_VOLTAGE, MONITOR_ENGINE_ON, -MONITOR_NO_LIMIT, VOLTAGE_LOW_WARNING + ENGINE_ON_VOLTAGE_OFFSET, true, STATUS_WARNING, VOLTAGE_STATUS_HYSTERESIS, VOLTAGE_STATUS_PERSISTENCE, 0 },
+    { MONITOR_VOLTAGE, MONITOR_ENGINE_OFF, -MONITOR_NO_LIMIT, VOLTAGE_LOW_WARNING, true, STATUS_WARNING, VOLTAGE_STATUS_HYSTERESIS, VOLTAGE_STATUS_PERSISTENCE, 0 },
+    { MONITOR_VOLTAGE, MONITOR_ALWAYS, VOLTAGE_HIGH_WARNING, MONITOR_NO_LIMIT, false, STATUS_WARNING, VOLTAGE_STATUS_HYSTERESIS, VOLTAGE_STATUS_PERSISTENCE, 0 }
+};
+#define MONITOR_RULES_COUNT (sizeof(MONITOR_RULES) / sizeof(MonitorRule))
+
+// Límites superiores de las bandas de temperatura del aceite de la presión aprendida, menos la última
+static const float OIL_BASELINE_TEMP_LIMITS[OIL_BASELINE_TEMP_BANDS - 1] = { 70.0, 90.0, 110.0 };
+
 DataMonitor::DataMonitor() {
-    _engOilPressureStatus = STATUS_OK;
-    _engOilTempStatus = STATUS_OK;
-    _gbOilTempStatus = STATUS_OK;
-    _afrStatus = STATUS_OK;
+    for (uint8_t i = 0; i < MONITOR_PARAMETER_COUNT; ++i) {
+        _states[i].status = STATUS_OK;
+        _states[i].activeRule = MONITOR_NO_RULE;
+        _states[i].pendingRule = MONITOR_NO_RULE;
+        _states[i].pendingTimer = 0;
+        _states[i].holdTimer = 0;
+        _states[i].sequence = 0;
+        _states[i].isTimerRunning = false;
+    }
+    _conditions = MONITOR_ALWAYS;
     _tpsStatus = STATUS_OK;
     _rpmStatus = STATUS_OK;
-    _voltageStatus = STATUS_OK;
-    _lastRPMValue = 0;
     _rpmInputCheckTimer = 0;
     _rpmFailureResetTimer = 0;
     _rpmErrorsCount = 0;
-    _engineOilPressTimer = 0;
-    _engineOilPressStatusCooldown = false;
+    _oilPressureWindow.min = 0.0;
+    _oilPressureWindow.max = 0.0;
+    _oilPressureWindow.timeBelow = 0;
+    _oilPressureWindow.events = 0;
+    _hasOilPressureWindow = false;
+    _oilStarvationEvents = 0;
+    _oilStarvationTime = 0;
+    _oilStarvationMicros = 0;
+    InitTempTrend(&_engOilTempTrend, ENGINE_OIL_TEMP_DANGER);
+    InitTempTrend(&_gbOilTempTrend, GEARBOX_OIL_TEMP_DANGER);
+    for (uint8_t i = 0; i < OIL_BASELINE_TEMP_BANDS * OIL_BASELINE_RPM_BINS; ++i) {
+        _oilBaseline[i].pressure = 0;
+        _oilBaseline[i].samples = 0;
+    }
+    _oilBaselineCell = 0;
+    _oilBaselineTimer = 0;
+    _oilDeviationTimer = 0;
+    _isOilPressureDeviating = false;
+    _isOilBaselineChanged = false;
+    _oilBaselineSaveStep = OIL_BASELINE_NOT_SAVING;
+    _oilBaselineChecksum = 0;
     _dataManager = NULL;
+    _eepromManager = NULL;
 }
 
-void DataMonitor::Initialize(DataManager *dataManager) {
+void DataMonitor::Initialize(DataManager *dataManager, EEPROMManager *eepromManager) {
     _dataManager = dataManager;
+    _eepromManager = eepromManager;
+    LoadOilBaseline();
 }
 
 void DataMonitor::Update(uint32_t diff) {
@@ -41,72 +112,59 @@ void DataMonitor::Update(uint32_t diff) {
     // Llamamos a la función auxiliar para cálculo de las RPM
     _dataManager->RetrieveRPM(micros());
 
-    // Primero comprobamos los parámetros que no dependen necesariamente de si el motor está encendido o no
-    // Estos son las temperaturas, TPS y voltaje
-    // Temperatura del aceite del motor
+    // Condiciones de las reglas. Si cambian, hay que volver a evaluar todos los parámetros.
     float engOilTemp = _dataManager->GetEngineOilTemp();
-    if (engOilTemp == DS18B20_ERROR_TEMP) {
-        _engOilTempStatus = STATUS_ERROR;
-    } else if (engOilTemp < ENGINE_OIL_COLD_TEMP_LIMIT) {
-        _engOilTempStatus = STATUS_COLD;
-    } else if (engOilTemp < ENGINE_OIL_TEMP_WARNING) {
-        _engOilTempStatus = STATUS_OK;
-    } else if (engOilTemp < ENGINE_OIL_TEMP_DANGER) {
-        _engOilTempStatus = STATUS_WARNING;
-    } else if (engOilTemp >= ENGINE_OIL_TEMP_DANGER) {
-        _engOilTempStatus = STATUS_DANGER;
+    int16_t rpms = (int16_t) _dataManager->GetRPM();
+    UpdateOilBaseline(diff, rpms, engOilTemp);
+    uint8_t conditions = _dataManager->IsEngineOn() ? MONITOR_ENGINE_ON : MONITOR_ENGINE_OFF;
+    conditions |= engOilTemp <= ENGINE_OIL_COLD_TEMP_LIMIT ? MONITOR_OIL_COLD : MONITOR_OIL_HOT;
+    if (engOilTemp >= AFR_RICH_CHECK_OIL_TEMP)
+        conditions |= MONITOR_OIL_WARM;
+    if (rpms >= ENGINE_OIL_PRESS_RPM_CHECK)
+        conditions |= MONITOR_HIGH_RPM;
+    if (_isOilPressureDeviating)
+        conditions |= MONITOR_OIL_PRESS_DEVIATION;
+    // Al apagar el motor guardamos lo aprendido durante la sesión
+    if ((_conditions & MONITOR_ENGINE_ON) && (conditions & MONITOR_ENGINE_OFF))
+        SaveOilBaseline();
+    if (_eepromManager)
+        UpdateOilBaselineSave();
+    bool conditionsChanged = conditions != _conditions;
+    _conditions = conditions;
+
+    // El umbral de la vigilancia de transitorios de la presión de aceite sólo depende de las condiciones
+    if (conditionsChanged)
+        _dataManager->SetOilPressureThreshold(GetOilPressureThreshold());
+
+    // Resumen de la presión de aceite desde el último Update(). Las caídas cortas entre dos lecturas del loop
+    // (por ejemplo el aceite desplazándose en una curva larga) sólo se ven aquí.
+    _hasOilPressureWindow = _dataManager->GetOilPressureWindow(&_oilPressureWindow);
+    if (_hasOilPressureWindow && (_conditions & MONITOR_ENGINE_ON)) {
+        _oilStarvationEvents += _oilPressureWindow.events;
+        _oilStarvationMicros += _oilPressureWindow.timeBelow;
+        _oilStarvationTime += _oilStarvationMicros / 1000;
+        _oilStarvationMicros %= 1000;
     }
-    // Temperatura del aceite de la caja de cambios
-    float gbOilTemp = _dataManager->GetGearboxOilTemp();
-    if (gbOilTemp == DS18B20_ERROR_TEMP) {
-        _gbOilTempStatus = STATUS_ERROR;
-    } else if (gbOilTemp < GEARBOX_OIL_COLD_TEMP_LIMIT) {
-        _gbOilTempStatus = STATUS_COLD;
-    } else if (gbOilTemp < GEARBOX_OIL_TEMP_WARNING) {
-        _gbOilTempStatus = STATUS_OK;
-    } else if (gbOilTemp < GEARBOX_OIL_TEMP_DANGER) {
-        _gbOilTempStatus = STATUS_WARNING;
-    } else if (gbOilTemp >= GEARBOX_OIL_TEMP_DANGER) {
-        _gbOilTempStatus = STATUS_DANGER;
+    bool isOilStarvation = _hasOilPressureWindow && _oilPressureWindow.events > 0;
+
+    // Cada parámetro sólo se evalúa si ha cambiado su entrada, las condiciones, o si tiene un timer en marcha.
+    // La presión de aceite también si ha habido una caída en la última ventana.
+    for (uint8_t i = 0; i < MONITOR_PARAMETER_COUNT; ++i) {
+        EvaluateParameter((MonitorParameter) i, conditionsChanged || (i == MONITOR_ENG_OIL_PRESSURE && isOilStarvation), diff);
     }
+    // Tendencia de las temperaturas, sólo con cada lectura nueva de las sondas
+    UpdateTempTrend(&_engOilTempTrend, _dataManager->GetEngineOilTempReadTime(), (int16_t) _dataManager->GetEngineOilTemp(true));
+    UpdateTempTrend(&_gbOilTempTrend, _dataManager->GetGearboxOilTempReadTime(), (int16_t) _dataManager->GetGearboxOilTemp(true));
+
     // TPS. Realmente no se puede comprobar mucho en este parámetro, devolveremos siempre OK por el momento
     _tpsStatus = STATUS_OK;
-    // Voltaje. La comparación varía si el motor está encendido o no
-    float voltage = _dataManager->GetVoltage();
-    // Si el motor está encendido, sumamos 1.2v a los valores bajos definidos en DataMonitor.h
-    // para compensar el voltaje adicional del alternador, y dar más tiempo de reacción si falla.
-    if (_dataManager->IsEngineOn()) {
-        if (voltage <= VOLTAGE_LOW_DANGER + 1.2) {
-            _voltageStatus = STATUS_DANGER;
-        } else if (voltage <= VOLTAGE_LOW_WARNING + 1.2) {
-            _voltageStatus = STATUS_WARNING;
-        } else if (voltage < VOLTAGE_HIGH_WARNING) {
-            _voltageStatus = STATUS_OK;
-        } else if (voltage < VOLTAGE_HIGH_DANGER) {
-            _voltageStatus = STATUS_WARNING;
-        } else if (voltage >= VOLTAGE_HIGH_DANGER) {
-            _voltageStatus = STATUS_DANGER;
-        }
-    } else {
-        if (voltage <= VOLTAGE_LOW_DANGER) {
-            _voltageStatus = STATUS_DANGER;
-        } else if (voltage <= VOLTAGE_LOW_WARNING) {
-            _voltageStatus = STATUS_WARNING;
-        } else if (voltage < VOLTAGE_HIGH_WARNING) {
-            _voltageStatus = STATUS_OK;
-        } else if (voltage < VOLTAGE_HIGH_DANGER) {
-            _voltageStatus = STATUS_WARNING;
-        } else if (voltage >= VOLTAGE_HIGH_DANGER) {
-            _voltageStatus = STATUS_DANGER;
-        }
-    }
 
     // Comprobamos el estado de la señal de RPMs. Para ello utilizaremos dos técnicas:
-    //   1) El bucle de control de fluctuación de la señal (que no varíe demasiado en un intervalo de tiempo pequeño)
+    //   1) Las estadísticas de los intervalos entre encendidos que calcula el DataManager con cada encendido
+    //      (encendidos perdidos, falsos o saltos fuera de lo normal). Así la señal se marca en pocos encendidos.
     //   2) Si hay presión de aceite, comprobar que también haya RPMs. No puede haber presión de aceite sin RPMs!!
     //
     // En caso de fallo, la señal de RPMs queda marcada como defectuosa hasta que se reinicie el microprocesador
-    int16_t rpms = (int16_t) _dataManager->GetRPM();
     if (_rpmStatus != STATUS_ERROR) {
         // Comprobamos si no nos hemos pasado de vueltas. La ECU de serie no interpreta valores por encima de las 8000 RPM
         // aproximadamente a la hora de cortar inyección. Así que si nos hemos pasado de RPMs con los mapas de carreras
@@ -118,14 +176,13 @@ void DataMonitor::Update(uint32_t diff) {
             _rpmStatus = STATUS_OK;
         }
 
-        // Comprobamos que el valor no haya fluctuado demasiado desde la última comprobación
+        // Demasiados encendidos anómalos entre los últimos 16, la señal está corrupta. No esperamos al siguiente chequeo.
+        if (_dataManager->IsIgnitionSignalCorrupt())
+            _rpmErrorsCount = MAX_RPM_SIGNAL_ERRORS;
+
         if (_rpmInputCheckTimer >= RPM_INPUT_CHECK_INTERVAL) {
-            // Ojo que este tiene que ser int, no unsigned
-            int16_t rpmDiff = rpms - _lastRPMValue;
-            if (rpmDiff < 0)
-                rpmDiff *= -1; // Pasamos a positivo el valor
-            
-            if (rpmDiff >= MAX_RPM_DIFF_BETWEEN_CHECKS)
+            // Si ninguna de las dos entradas de RPM es fiable, también lo contamos como fallo
+            if (_dataManager->IsEngineOn() && _dataManager->GetRPMConfidence() < RPM_MIN_CONFIDENCE)
                 ++_rpmErrorsCount;
 
             // Comprobamos ahora la señal de las RPMs contra la de presión de aceite
@@ -133,7 +190,6 @@ void DataMonitor::Update(uint32_t diff) {
                 if (rpms < 100) // Por debajo de 100 RPMS es imposible tener más de 1 bar de presión de aceite a no ser que estemos en el polo norte
                     ++_rpmErrorsCount;
 
-            _lastRPMValue = rpms;
             _rpmInputCheckTimer = 0;
         } else {
             _rpmInputCheckTimer += diff;
@@ -162,65 +218,344 @@ void DataMonitor::Update(uint32_t diff) {
             _rpmFailureResetTimer += diff;
         }
     }
+}
 
-    // Ahora comprobamos parámetros que requieren que el motor esté encendido para funcionar correctamente.
-    // Estos parámetros son presión de aceite del motor, RPMs y AFR.
-    if (_dataManager->IsEngineOn()) {
-        // Presión de aceite. Es uno de los parámetros más importantes.
-        // Para comprobarla nos basaremos en las RPMs y la temperatura del aceite.
-        float oilPress = _dataManager->GetEngineOilPressure();
-        bool badOilPress = false;
-        // Comprobamos el timer de cooldown, que se activará si se detecta una caída en la presión y mantendrá el estado DANGER
-        // durante un mínimo de tiempo para asegurarnos de que el CommsManager lo pilla y envía el fallo al TFT
-        if (_engineOilPressStatusCooldown) {
-            if (_engineOilPressTimer >= MIN_OIL_PRESS_DANGER_TIMER) {
-                _engineOilPressStatusCooldown = false;
-                _engineOilPressTimer = 0;
-            } else {
-                _engineOilPressTimer += diff;
-            }
-        } else {
-            if (engOilTemp <= ENGINE_OIL_COLD_TEMP_LIMIT) {
-                if (oilPress < ENGINE_OIL_PRESS_MIN)
-                    badOilPress = true;
-            } else {
-                if (oilPress < ENGINE_OIL_PRESS_MIN_HOT)
-                    badOilPress = true;
-            }
-            // Comprobamos que a partir de ciertas RPMs la presión de aceite no caiga de cierto valor
-            if (rpms >= ENGINE_OIL_PRESS_RPM_CHECK) {
-                if (oilPress < ENGINE_OIL_PRESS_MIN_RPMS) {
-                    badOilPress = true;
-                }
-            }
+void DataMonitor::EvaluateParameter(MonitorParameter parameter, bool conditionsChanged, uint32_t diff) {
+    MonitorState *state = &_states[parameter];
+    uint8_t sequence = _dataManager->GetInputSequence(GetParameterInput(parameter));
+    if (!conditionsChanged && !state->isTimerRunning && sequence == state->sequence)
+        return;
+    state->sequence = sequence;
+
+    float value = GetParameterValue(parameter);
+
+    // Primera regla que se cumple, sin histéresis
+    uint8_t match = MONITOR_NO_RULE;
+    for (uint8_t i = 0; i < MONITOR_RULES_COUNT; ++i) {
+        if (MONITOR_RULES[i].parameter == parameter && IsRuleMatching(i, value, 0.0)) {
+            match = i;
+            break;
+        }
+    }
+    // La regla activa se mantiene mientras se cumpla con la histéresis, salvo que se cumpla otra más prioritaria
+    if (state->activeRule != MONITOR_NO_RULE && (match == MONITOR_NO_RULE || match > state->activeRule)
+        && IsRuleMatching(state->activeRule, value, MONITOR_RULES[state->activeRule].hysteresis))
+        match = state->activeRule;
+
+    state->isTimerRunning = false;
+
+    // Tiempo mínimo de la regla activa. Mientras dura, sólo una regla más prioritaria puede sustituirla.
+    if (state->activeRule != MONITOR_NO_RULE && state->holdTimer < MONITOR_RULES[state->activeRule].holdTime) {
+        state->holdTimer += diff;
+        state->isTimerRunning = true;
+        if (match == MONITOR_NO_RULE || match > state->activeRule)
+            match = state->activeRule;
+    }
+
+    if (match == state->activeRule) {
+        state->pendingRule = MONITOR_NO_RULE;
+        return;
+    }
+
+    // Persistencia de la nueva regla antes de activarla
+    uint16_t persistence = match == MONITOR_NO_RULE ? 0 : MONITOR_RULES[match].persistence;
+    if (match != state->pendingRule) {
+        state->pendingRule = match;
+        state->pendingTimer = 0;
+    } else {
+        state->pendingTimer += diff;
+    }
+    if (state->pendingTimer < persistence) {
+        state->isTimerRunning = true;
+        return;
+    }
+
+    state->activeRule = match;
+    state->pendingRule = MONITOR_NO_RULE;
+    state->holdTimer = 0;
+    state->status = match == MONITOR_NO_RULE ? STATUS_OK : MONITOR_RULES[match].status;
+    if (match != MONITOR_NO_RULE && MONITOR_RULES[match].holdTime > 0)
+        state->isTimerRunning = true;
+}
+
+bool DataMonitor::IsRuleMatching(uint8_t ruleIndex, float value, float margin) {
+    const MonitorRule *rule = &MONITOR_RULES[ruleIndex];
+    if ((_conditions & rule->conditions) != rule->conditions)
+        return false;
+
+    float high = rule->high + margin;
+    return value >= rule->low - margin && (rule->isHighInclusive ? value <= high : value < high);
+}
+
+float DataMonitor::GetParameterValue(MonitorParameter parameter) {
+    switch (parameter) {
+        case MONITOR_ENG_OIL_PRESSURE:
+            // Si ha habido una caída en la ventana, evaluamos el mínimo (ya filtrado por TRANSIENT_MIN_SAMPLES)
+            if (_hasOilPressureWindow && _oilPressureWindow.events > 0)
+                return _oilPressureWindow.min;
+            return _dataManager->GetEngineOilPressure();
+        case MONITOR_ENG_OIL_TEMP:
+            return _dataManager->GetEngineOilTemp();
+        case MONITOR_GB_OIL_TEMP:
+            return _dataManager->GetGearboxOilTemp();
+        case MONITOR_AFR:
+            return _dataManager->GetAFR();
+        case MONITOR_VOLTAGE:
+            return _dataManager->GetVoltage();
+        default:
+            return 0.0;
+    }
+}
+
+DataInput DataMonitor::GetParameterInput(MonitorParameter parameter) {
+    switch (parameter) {
+        case MONITOR_ENG_OIL_PRESSURE:
+            return DATA_INPUT_ENG_OIL_PRESSURE;
+        case MONITOR_ENG_OIL_TEMP:
+            return DATA_INPUT_ENG_OIL_TEMP;
+        case MONITOR_GB_OIL_TEMP:
+            return DATA_INPUT_GB_OIL_TEMP;
+        case MONITOR_AFR:
+            return DATA_INPUT_AFR;
+        case MONITOR_VOLTAGE:
+        default:
+            return DATA_INPUT_VOLTAGE;
+    }
+}
+
+float DataMonitor::GetOilPressureThreshold() {
+    // La presión mínima más alta de las reglas que se aplican con las condiciones actuales. 0 si no se aplica ninguna
+    float threshold = 0.0;
+    for (uint8_t i = 0; i < MONITOR_RULES_COUNT; ++i) {
+        const MonitorRule *rule = &MONITOR_RULES[i];
+        if (rule->parameter != MONITOR_ENG_OIL_PRESSURE || rule->status != STATUS_DANGER)
+            continue;
+        if ((_conditions & rule->conditions) == rule->conditions && rule->high > threshold)
+            threshold = rule->high;
+    }
+    return threshold;
+}
+
+void DataMonitor::InitTempTrend(TempTrend *trend, float dangerTemp) {
+    trend->dangerTemp = (int16_t) (dangerTemp / DALLAS_RAW_TO_CELSIUS);
+    trend->lastReadTime = 0;
+    ResetTempTrend(trend);
+}
+
+void DataMonitor::ResetTempTrend(TempTrend *trend) {
+    trend->head = 0;
+    trend->count = 0;
+    trend->sumX = 0;
+    trend->sumY = 0;
+    trend->sumXX = 0;
+    trend->sumXY = 0;
+    trend->timeToDanger = TEMP_TREND_NO_ESTIMATE;
+    trend->isCritical = false;
+}
+
+void DataMonitor::UpdateTempTrend(TempTrend *trend, uint32_t readTime, int16_t temp) {
+    if (readTime == trend->lastReadTime)
+        return;
+
+    // Sonda desconectada o demasiado tiempo sin lecturas, la tendencia anterior ya no sirve
+    bool isError = temp <= (int16_t) ((DS18B20_ERROR_TEMP + 1.0) / DALLAS_RAW_TO_CELSIUS);
+    if (isError || (trend->count > 0 && readTime - trend->lastReadTime > TEMP_TREND_MAX_GAP))
+        ResetTempTrend(trend);
+    trend->lastReadTime = readTime;
+    if (isError)
+        return;
+
+    uint32_t time = readTime / TEMP_TREND_TIME_UNIT;
+    uint8_t tail = (trend->head + trend->count) % TEMP_TREND_SAMPLES;
+    if (trend->count == TEMP_TREND_SAMPLES) {
+        // Quitamos la lectura más antigua (x = 0, sólo cuenta en sumY) y movemos el origen de tiempos a la siguiente:
+        // con x' = x - d, sum(x') = sum(x) - n·d, sum(x'²) = sum(x²) - 2·d·sum(x) + n·d², sum(x'·y) = sum(x·y) - d·sum(y)
+        trend->sumY -= trend->temps[trend->head];
+        trend->head = (trend->head + 1) % TEMP_TREND_SAMPLES;
+        --trend->count;
+        int32_t d = trend->times[trend->head] - trend->times[tail];
+        int32_t n = trend->count;
+        trend->sumXX -= 2 * d * trend->sumX - n * d * d;
+        trend->sumXY -= d * trend->sumY;
+        trend->sumX -= n * d;
+    }
+
+    int32_t x = trend->count > 0 ? (int32_t) (time - trend->times[trend->head]) : 0;
+    trend->temps[tail] = temp;
+    trend->times[tail] = time;
+    ++trend->count;
+    trend->sumX += x;
+    trend->sumY += temp;
+    trend->sumXX += x * x;
+    trend->sumXY += x * temp;
+
+    UpdateTimeToDanger(trend);
+}
 
-            if (badOilPress) {
-                _engOilPressureStatus = STATUS_DANGER; // Con la presión de aceite no hay medias tintas, o va bien o no va.
-                _engineOilPressStatusCooldown = true;
+void DataMonitor::UpdateTimeToDanger(TempTrend *trend) {
+    trend->timeToDanger = TEMP_TREND_NO_ESTIMATE;
+    if (trend->count >= TEMP_TREND_MIN_SAMPLES) {
+        // Pendiente = (n·sum(xy) - sum(x)·sum(y)) / (n·sum(x²) - sum(x)²), en 1/128 Cº por unidad de tiempo
+        int64_t n = trend->count;
+        int64_t numerator = n * trend->sumXY - (int64_t) trend->sumX * trend->sumY;
+        int64_t denominator = n * trend->sumXX - (int64_t) trend->sumX * trend->sumX;
+        if (numerator > 0 && denominator > 0) {
+            int16_t temp = trend->temps[(trend->head + trend->count - 1) % TEMP_TREND_SAMPLES];
+            int64_t margin = trend->dangerTemp - temp;
+            if (margin <= 0) {
+                trend->timeToDanger = 0;
             } else {
-                _engOilPressureStatus = STATUS_OK;
+                // Tiempo = margen / pendiente, en unidades de TEMP_TREND_TIME_UNIT, y de ahí a segundos
+                int64_t seconds = margin * denominator / numerator / (1000 / TEMP_TREND_TIME_UNIT);
+                trend->timeToDanger = seconds >= TEMP_TREND_NO_ESTIMATE ? TEMP_TREND_NO_ESTIMATE - 1 : (uint16_t) seconds;
             }
         }
+    }
+
+    if (trend->timeToDanger <= TEMP_TREND_PREEMPT_TIME)
+        trend->isCritical = true;
+    else if (trend->timeToDanger > TEMP_TREND_RELEASE_TIME)
+        trend->isCritical = false;
+}
+
+void DataMonitor::UpdateOilBaseline(uint32_t diff, int16_t rpms, float engOilTemp) {
+    if (!OIL_BASELINE_ENABLED)
+        return;
+
+    if (_oilBaselineTimer < OIL_BASELINE_SAMPLE_INTERVAL) {
+        _oilBaselineTimer += diff;
+        return;
+    }
+    uint32_t elapsed = _oilBaselineTimer;
+    _oilBaselineTimer = 0;
+
+    // Sin motor o sin la sonda de temperatura no sabemos qué presión es la normal
+    if (!_dataManager->IsEngineOn() || engOilTemp <= DS18B20_ERROR_TEMP + 1.0 || rpms <= 0) {
+        _isOilPressureDeviating = false;
+        _oilDeviationTimer = 0;
+        return;
+    }
+
+    uint8_t band = 0;
+    while (band < OIL_BASELINE_TEMP_BANDS - 1 && engOilTemp >= OIL_BASELINE_TEMP_LIMITS[band]) {
+        ++band;
+    }
+    uint8_t bin = rpms >> OIL_BASELINE_RPM_SHIFT;
+    if (bin >= OIL_BASELINE_RPM_BINS)
+        bin = OIL_BASELINE_RPM_BINS - 1;
+    _oilBaselineCell = band * OIL_BASELINE_RPM_BINS + bin;
+    OilBaselineCell *cell = &_oilBaseline[_oilBaselineCell];
+
+    int32_t pressure = _dataManager->GetEngineOilPressure() * 100;
+    if (pressure < 0)
+        pressure = 0;
 
-        // AFR. Comprobamos si la sonda Wideband todavía está calentándose o fuera de parámetros.
-        float afr = _dataManager->GetAFR();
-        if (afr == -1.0) {
-            _afrStatus = STATUS_COLD; // Sonda calentándose
+    // Comparamos en la escala de la presión aprendida: p * 100 < aprendida * (100 - desviación)
+    if (cell->samples >= OIL_BASELINE_MIN_SAMPLES) {
+        int32_t scaled = (pressure << OIL_BASELINE_MEAN_SHIFT) * 100;
+        uint8_t deviation = _isOilPressureDeviating ? OIL_BASELINE_DEVIATION - OIL_BASELINE_HYSTERESIS : OIL_BASELINE_DEVIATION;
+        if (scaled < (int32_t) cell->pressure * (100 - deviation)) {
+            if (_oilDeviationTimer >= OIL_BASELINE_PERSISTENCE)
+                _isOilPressureDeviating = true;
+            else
+                _oilDeviationTimer += elapsed;
         } else {
-            if (afr <= AFR_RICH_DANGER) {
-                _afrStatus = engOilTemp >= 50.0 ? STATUS_DANGER : STATUS_OK;  // Ignoramos valores demasiado ricos si el motor está frío
-            } else if (afr <= AFR_RICH_WARNING) {
-                _afrStatus = engOilTemp >= 50.0 ? STATUS_WARNING : STATUS_OK; // Ídem
-            } else if (afr < AFR_LEAN_WARNING) {
-                _afrStatus = STATUS_OK;
-            } else if (afr < AFR_LEAN_DANGER) {
-                _afrStatus = STATUS_WARNING;
-            } else if (afr >= AFR_LEAN_DANGER) {
-                _afrStatus = STATUS_DANGER;
-            }
+            _isOilPressureDeviating = false;
+            _oilDeviationTimer = 0;
         }
     } else {
-        _afrStatus = STATUS_COLD;
-        _engOilPressureStatus = STATUS_OK;
+        _isOilPressureDeviating = false;
+        _oilDeviationTimer = 0;
+    }
+
+    // Sólo aprendemos mientras la presión es normal, si no la anomalía acabaría siendo la referencia.
+    // Tampoco mientras se está guardando en la EEPROM, para que no cambie a mitad de la escritura
+    if (_isOilPressureDeviating || _oilDeviationTimer > 0 || _oilBaselineSaveStep != OIL_BASELINE_NOT_SAVING)
+        return;
+    int32_t value = pressure << OIL_BASELINE_MEAN_SHIFT;
+    if (value > 0xFFFF)
+        value = 0xFFFF;
+    if (!cell->samples) {
+        cell->pressure = value;
+    } else {
+        // Redondeo simétrico: con el desplazamiento aritmético las diferencias negativas siempre restan
+        // al menos 1 y las positivas pequeñas no suman nada, y la media se iría deslizando hacia abajo
+        int32_t delta = value - (int32_t) cell->pressure;
+        cell->pressure += (delta + (delta >= 0 ? OIL_BASELINE_EMA_ROUND : -OIL_BASELINE_EMA_ROUND)) / (1 << OIL_BASELINE_EMA_SHIFT);
+    }
+    if (cell->samples < 0xFF)
+        ++cell->samples;
+    _isOilBaselineChanged = true;
+}
+
+float DataMonitor::GetOilPressureBaseline() {
+    const OilBaselineCell *cell = &_oilBaseline[_oilBaselineCell];
+    if (cell->samples < OIL_BASELINE_MIN_SAMPLES)
+        return 0.0;
+    return (cell->pressure >> OIL_BASELINE_MEAN_SHIFT) / 100.0;
+}
+
+void DataMonitor::LoadOilBaseline() {
+    if (!_eepromManager)
+        return;
+
+    // Marca + checksum (suma de todos los bytes de las celdas)
+    uint8_t header[2];
+    _eepromManager->LoadBytesFromEEPROM(ADDR_OIL_BASELINE, header, 2);
+    if (header[0] != OIL_BASELINE_MAGIC)
+        return;
+
+    OilBaselineCell cells[OIL_BASELINE_TEMP_BANDS * OIL_BASELINE_RPM_BINS];
+    _eepromManager->LoadBytesFromEEPROM((EEPROMDataAddress) (ADDR_OIL_BASELINE + 2), (uint8_t*) cells, sizeof(cells));
+    uint8_t checksum = 0;
+    for (uint8_t i = 0; i < sizeof(cells); ++i) {
+        checksum += ((uint8_t*) cells)[i];
+    }
+    if (checksum != header[1])
+        return;
+
+    for (uint8_t i = 0; i < OIL_BASELINE_TEMP_BANDS * OIL_BASELINE_RPM_BINS; ++i) {
+        _oilBaseline[i] = cells[i];
+    }
+}
+
+void DataMonitor::SaveOilBaseline() {
+    if (!_eepromManager || !_isOilBaselineChanged)
+        return;
+
+    // No se puede esperar a la EEPROM (3.3 ms por byte), el motor puede haberse calado en marcha. La escritura
+    // se reparte entre los siguientes Update() y mientras tanto no se aprende, así el checksum sigue siendo válido
+    _oilBaselineChecksum = 0;
+    for (uint8_t i = 0; i < sizeof(_oilBaseline); ++i) {
+        _oilBaselineChecksum += ((uint8_t*) _oilBaseline)[i];
+    }
+    _oilBaselineSaveStep = 0;
+    _isOilBaselineChanged = false;
+}
+
+void DataMonitor::UpdateOilBaselineSave() {
+    // Orden de escritura: marca inválida, celdas, checksum y por último la marca válida, por si se corta
+    // la corriente a mitad. Sólo se escriben los bytes que cambian, así que las celdas sin cambios no esperan
+    while (_oilBaselineSaveStep != OIL_BASELINE_NOT_SAVING && _eepromManager->IsEEPROMReady()) {
+        uint8_t value;
+        EEPROMDataAddress address;
+        if (_oilBaselineSaveStep == 0) {
+            value = 0;
+            address = ADDR_OIL_BASELINE;
+        } else if (_oilBaselineSaveStep <= sizeof(_oilBaseline)) {
+            value = ((uint8_t*) _oilBaseline)[_oilBaselineSaveStep - 1];
+            address = (EEPROMDataAddress) (ADDR_OIL_BASELINE + 1 + _oilBaselineSaveStep);
+        } else if (_oilBaselineSaveStep == sizeof(_oilBaseline) + 1) {
+            value = _oilBaselineChecksum;
+            address = (EEPROMDataAddress) (ADDR_OIL_BASELINE + 1);
+        } else {
+            value = OIL_BASELINE_MAGIC;
+            address = ADDR_OIL_BASELINE;
+        }
+        _eepromManager->SaveBytesToEEPROM(address, &value, 1);
+        if (_oilBaselineSaveStep > sizeof(_oilBaseline) + 1)
+            _oilBaselineSaveStep = OIL_BASELINE_NOT_SAVING;
+        else
+            ++_oilBaselineSaveStep;
     }
 }
@@ -10,11 +10,11 @@
 
 #define DS18B20_ERROR_TEMP          -55.0 // Valor devuelto por las funciones del DataManager si hay algún problema con la conexión de los sensores
 // Para el controlador de señal de RPMs
-#define MAX_RPM_DIFF_BETWEEN_CHECKS 5000  // Máxima variación permitida de RPMs en x tiempo definido a continuación
 #define RPM_INPUT_CHECK_INTERVAL    100   // 0.1 segundos
 #define RPM_FAILURES_RESET_TIMER    5000  // 5 segundos entre reseteo de errores en el algoritmo de RPMs, para evitar falsos positivos
 #define MIN_OIL_PRESS_DANGER_TIMER  200   // 0.2 segundos, tiempo suficiente para asegurar que al menos un paquete con el estado DANGER será enviado al TFT
 #define MAX_RPM_SIGNAL_ERRORS       10    // 10 fallos detectados en la integridad de la señal de RPMs
+#define RPM_MIN_CONFIDENCE          30    // Por debajo de esta confianza (0-100) en la estimación de RPM, se cuenta como fallo en la señal
 #define EMERGENCY_REV_LIMITER       8500  // 8800 son las máximas RPMs permitidas, si se pasa de vueltas, pasamos a los mapas de calle para activar el limitador.
 // Temperaturas del aceite del motor
 #define ENGINE_OIL_COLD_TEMP_LIMIT  70.0  // 70 Cº
@@ -39,6 +39,41 @@
 #define ENGINE_OIL_PRESS_MIN_HOT    0.6   // 0.6 bares a partir de 80º
 #define ENGINE_OIL_PRESS_RPM_CHECK  4000  // 4000 RPMs
 #define ENGINE_OIL_PRESS_MIN_RPMS   3.0   // 3.0 bares a partir de 4000 RPMs mínimo
+#define AFR_RICH_CHECK_OIL_TEMP     50.0  // Por debajo de 50 Cº de aceite se ignoran las mezclas ricas (motor frío)
+#define ENGINE_ON_VOLTAGE_OFFSET    1.2   // Con el motor encendido, los límites bajos de voltaje suben 1.2v por el alternador
+// Histéresis y persistencia de las reglas del monitor
+#define TEMP_STATUS_HYSTERESIS      2.0   // 2 Cº
+#define VOLTAGE_STATUS_HYSTERESIS   0.2   // 0.2 voltios
+#define AFR_STATUS_HYSTERESIS       0.2   // 0.2 AFR
+#define OIL_PRESS_STATUS_HYSTERESIS 0.1   // 0.1 bares
+#define VOLTAGE_STATUS_PERSISTENCE  250   // Los cambios de voltaje tienen que mantenerse 0.25 segundos (picos al arrancar, ventiladores...)
+#define AFR_WARNING_PERSISTENCE     100   // Los avisos de AFR tienen que mantenerse 0.1 segundos, los de peligro son inmediatos
+// Tendencia de las temperaturas del aceite (regresión por mínimos cuadrados de las últimas lecturas)
+#define TEMP_TREND_SAMPLES          16    // Lecturas de la regresión
+#define TEMP_TREND_MIN_SAMPLES      4     // Lecturas mínimas para dar una estimación
+#define TEMP_TREND_TIME_UNIT        100   // Unidad de tiempo de la regresión (ms)
+#define TEMP_TREND_MAX_GAP          10000 // Si pasan más de 10 segundos entre lecturas (sonda perdida), se empieza de nuevo
+#define TEMP_TREND_NO_ESTIMATE      0xFFFF // La temperatura no sube, no hay tiempo estimado hasta el peligro
+#define TEMP_TREND_PREEMPT_TIME     30    // Segundos hasta el peligro para abandonar el mapa de carreras antes de llegar
+#define TEMP_TREND_RELEASE_TIME     60    // Segundos hasta el peligro para volver a permitirlo (histéresis)
+// Presión de aceite aprendida (curva presión-RPM por banda de temperatura del aceite)
+#define OIL_BASELINE_ENABLED        true
+#define OIL_BASELINE_RPM_BINS       8     // Bins de 1024 RPM (RPM >> OIL_BASELINE_RPM_SHIFT), el último incluye todo lo que está por encima
+#define OIL_BASELINE_RPM_SHIFT      10
+#define OIL_BASELINE_TEMP_BANDS     4     // < 70 Cº, 70-90 Cº, 90-110 Cº, > 110 Cº
+#define OIL_BASELINE_SAMPLE_INTERVAL 100  // Una muestra cada 0.1 segundos
+#define OIL_BASELINE_EMA_SHIFT      8     // Media móvil exponencial con peso 1/256 (~25 segundos de muestras en el mismo bin)
+#define OIL_BASELINE_EMA_ROUND      (1 << (OIL_BASELINE_EMA_SHIFT - 1))
+#define OIL_BASELINE_MEAN_SHIFT     4     // Decimales extra (x16) de la presión aprendida
+#define OIL_BASELINE_MIN_SAMPLES    200   // Muestras mínimas de un bin (~20 segundos) antes de usarlo para vigilar
+#define OIL_BASELINE_DEVIATION      25    // Presión un 25% por debajo de la aprendida = anomalía
+#define OIL_BASELINE_HYSTERESIS     5     // Para salir de la anomalía, tiene que volver a estar a menos del 20%
+#define OIL_BASELINE_PERSISTENCE    1000  // La anomalía tiene que mantenerse 1 segundo (las caídas cortas ya las vigila el AnalogSampler)
+#define OIL_BASELINE_WARNING_HOLD   1000  // Tiempo mínimo del WARNING, para asegurarnos de que llega al TFT
+#define OIL_BASELINE_MAGIC          0x42  // Marca de bloque válido en la EEPROM ('B')
+#define OIL_BASELINE_NOT_SAVING     0xFF  // Paso de escritura en la EEPROM cuando no se está guardando
+#define MONITOR_NO_RULE             0xFF
+#define MONITOR_NO_LIMIT            10000.0
 
 // Posibles estados de los parámetros
 enum ParameterStatus {
@@ -49,36 +84,130 @@ enum ParameterStatus {
     STATUS_ERROR   = 5, // Hay algún error con el sensor (por ejemplo se ha perdido la conexión)
 };
 
+// Parámetros evaluados con la tabla de reglas
+enum MonitorParameter {
+    MONITOR_ENG_OIL_PRESSURE = 0,
+    MONITOR_ENG_OIL_TEMP     = 1,
+    MONITOR_GB_OIL_TEMP      = 2,
+    MONITOR_AFR              = 3,
+    MONITOR_VOLTAGE          = 4,
+    MONITOR_PARAMETER_COUNT  = 5  // Siempre el último
+};
+
+// Condiciones de las reglas (máscara de bits). Una regla sólo se aplica si se cumplen todas sus condiciones.
+enum MonitorCondition {
+    MONITOR_ALWAYS     = 0,
+    MONITOR_ENGINE_ON  = 1,
+    MONITOR_ENGINE_OFF = 2,
+    MONITOR_OIL_COLD   = 4,  // Aceite del motor por debajo de ENGINE_OIL_COLD_TEMP_LIMIT
+    MONITOR_OIL_HOT    = 8,
+    MONITOR_HIGH_RPM   = 16, // Por encima de ENGINE_OIL_PRESS_RPM_CHECK
+    MONITOR_OIL_WARM   = 32, // Aceite del motor por encima de AFR_RICH_CHECK_OIL_TEMP
+    MONITOR_OIL_PRESS_DEVIATION = 64  // Presión de aceite por debajo de la aprendida para estas RPM y temperatura
+};
+
+// Regla del monitor: si se cumplen las condiciones y el valor está en [low, high) ([low, high] con isHighInclusive),
+// el parámetro pasa al estado indicado.
+// Las reglas de cada parámetro se evalúan en orden y gana la primera que se cumple. Si ninguna se cumple, STATUS_OK.
+struct MonitorRule {
+    MonitorParameter parameter;
+    uint8_t conditions;
+    float low;
+    float high;
+    bool isHighInclusive;    // El límite también cuenta (AFR rico y voltaje bajo siempre se han comparado con <=)
+    ParameterStatus status;
+    float hysteresis;        // Para salir de la regla activa el valor tiene que salir de [low - hysteresis, high + hysteresis)
+    uint16_t persistence;    // Tiempo (ms) que se tiene que cumplir la regla antes de activarla
+    uint16_t holdTime;       // Tiempo (ms) mínimo que la regla se mantiene activa, para asegurarnos de que llega al TFT
+};
+
+// Estado de la evaluación de cada parámetro
+struct MonitorState {
+    ParameterStatus status;
+    uint8_t activeRule;      // Regla que ha fijado el estado actual (MONITOR_NO_RULE = STATUS_OK)
+    uint8_t pendingRule;     // Regla que está esperando a cumplir su persistencia
+    uint32_t pendingTimer;
+    uint32_t holdTimer;
+    uint8_t sequence;        // Última secuencia de la entrada del DataManager evaluada
+    bool isTimerRunning;     // Hay una persistencia o un tiempo mínimo en curso, hay que evaluar aunque no cambie la entrada
+};
+
+// Regresión incremental de la temperatura frente al tiempo. Sumas acumuladas en enteros, O(1) por lectura:
+// al añadir una lectura se suma y se resta la más antigua, y el origen de tiempos se mueve a la nueva más antigua.
+struct TempTrend {
+    int16_t temps[TEMP_TREND_SAMPLES];  // Valores raw (1/128 Cº)
+    uint32_t times[TEMP_TREND_SAMPLES]; // millis() / TEMP_TREND_TIME_UNIT
+    uint8_t head;                       // Posición de la lectura más antigua
+    uint8_t count;
+    uint32_t lastReadTime;              // Última lectura procesada (millis() del DataManager)
+    int32_t sumX;                       // x = tiempo desde la lectura más antigua (TEMP_TREND_TIME_UNIT)
+    int32_t sumY;
+    int32_t sumXX;
+    int32_t sumXY;
+    int16_t dangerTemp;                 // Temperatura de peligro (raw)
+    uint16_t timeToDanger;              // Segundos estimados hasta la temperatura de peligro
+    bool isCritical;                    // Tiempo hasta el peligro por debajo de TEMP_TREND_PREEMPT_TIME (con histéresis)
+};
+
+// Presión de aceite aprendida en un bin de RPM y temperatura (3 bytes en la EEPROM)
+struct OilBaselineCell {
+    uint16_t pressure;       // Bares * 100 << OIL_BASELINE_MEAN_SHIFT
+    uint8_t samples;         // Muestras aprendidas, se satura en 255
+};
+
 class DataMonitor {
     DataManager *_dataManager; // Puntero al DataManager, de donde recuperaremos los datos
+    EEPROMManager *_eepromManager; // Puntero al EEPROMManager, para guardar la presión de aceite aprendida
 
     // Almacenamos el estado de cada parámetro
-    ParameterStatus _engOilPressureStatus;
-    ParameterStatus _engOilTempStatus;
-    ParameterStatus _gbOilTempStatus;
-    ParameterStatus _afrStatus;
+    MonitorState _states[MONITOR_PARAMETER_COUNT];
+    uint8_t _conditions;     // Condiciones actuales (motor, temperatura del aceite, RPM)
     ParameterStatus _tpsStatus;
     ParameterStatus _rpmStatus;
-    ParameterStatus _voltageStatus;
-    // Con estas dos variables controlaremos la entrada de datos de las RPM
-    // Si varían de forma abrupta demasiado, por ejemplo más de 3000 RPM cada
-    // décima de segundo, es muy probable que la señal esté corrupta y recibiendo
-    // interferencias. Es muy importante detectar esto por si falla algo, no cargarse
-    // el tren de vávulas jugando con el NeoVVL!!
-    uint16_t _lastRPMValue;
+    // Con estas variables controlaremos la entrada de datos de las RPM. Si la señal está corrupta y recibiendo
+    // interferencias, es muy importante detectarlo por si falla algo, no cargarse el tren de vávulas jugando con el NeoVVL!!
     uint32_t _rpmInputCheckTimer;
     uint32_t _rpmFailureResetTimer;
     uint8_t _rpmErrorsCount;
-    // Timer para mantener el status de la presión de aceite durante un mínimo de ms para asegurarnos de que al menos se manda la señal al TFT
-    uint32_t _engineOilPressTimer;
-    bool _engineOilPressStatusCooldown;
+    // Presión de aceite a la velocidad del ADC: resumen de la última ventana y caídas (falta de presión) acumuladas
+    OilPressureWindow _oilPressureWindow;
+    bool _hasOilPressureWindow;        // Se ha recibido una ventana nueva en este Update()
+    uint16_t _oilStarvationEvents;     // Caídas de presión con el motor encendido desde el arranque
+    uint32_t _oilStarvationTime;       // Tiempo total (ms) por debajo de la presión mínima con el motor encendido
+    uint32_t _oilStarvationMicros;     // Resto en microsegundos de _oilStarvationTime
+    // Tendencia de las temperaturas del aceite del motor y de la caja de cambios
+    TempTrend _engOilTempTrend;
+    TempTrend _gbOilTempTrend;
+    // Presión de aceite aprendida
+    OilBaselineCell _oilBaseline[OIL_BASELINE_TEMP_BANDS * OIL_BASELINE_RPM_BINS]; // Por bandas: celda = banda * OIL_BASELINE_RPM_BINS + bin RPM
+    uint8_t _oilBaselineCell;          // Celda de la última muestra
+    uint32_t _oilBaselineTimer;
+    uint32_t _oilDeviationTimer;       // Tiempo seguido por debajo de la presión aprendida
+    bool _isOilPressureDeviating;
+    bool _isOilBaselineChanged;        // Hay que guardarla en la EEPROM al apagar el motor
+    uint8_t _oilBaselineSaveStep;      // Siguiente byte a escribir en la EEPROM (OIL_BASELINE_NOT_SAVING si no se está guardando)
+    uint8_t _oilBaselineChecksum;      // Checksum de las celdas que se están guardando
+
+    void EvaluateParameter(MonitorParameter parameter, bool conditionsChanged, uint32_t diff);
+    bool IsRuleMatching(uint8_t ruleIndex, float value, float margin);
+    float GetParameterValue(MonitorParameter parameter);
+    DataInput GetParameterInput(MonitorParameter parameter);
+    float GetOilPressureThreshold();
+    void InitTempTrend(TempTrend *trend, float dangerTemp);
+    void ResetTempTrend(TempTrend *trend);
+    void UpdateTempTrend(TempTrend *trend, uint32_t readTime, int16_t temp);
+    void UpdateTimeToDanger(TempTrend *trend);
+    void UpdateOilBaseline(uint32_t diff, int16_t rpms, float engOilTemp);
+    void LoadOilBaseline();
+    void SaveOilBaseline();
+    void UpdateOilBaselineSave();
 
   public:
     // Constructor, en este caso sólo inicializa las variables privadas de la clase
     DataMonitor();
 
     // Función de inicialización, como el resto de Managers, necesita esperar a que el DataManager esté operativo
-    void Initialize(DataManager *dataManager);
+    void Initialize(DataManager *dataManager, EEPROMManager *eepromManager);
     // En el Update() se actualiza el estado de todos los parámetros.
     // El DataMonitor no toma ninguna acción específica si se alcanzan valores peligrosos, sin embargo el AuxManager utiliza
     // estos valores para decidir si permanecer en el mapa de alto rendimiento de la ECU o volver al mapa de calle.
@@ -86,14 +215,28 @@ class DataMonitor {
     void Update(uint32_t diff);
 
     // Funciones para devolver el estado de cada parámetro monitoreado. Son simples "Getters", así que ya hacemos la declaración inline.
-    ParameterStatus GetEngineOilPressureStatus() { return _engOilPressureStatus; };
-    ParameterStatus GetEngineOilTempStatus() { return _engOilTempStatus; };
-    ParameterStatus GetGearboxOilTempStatus() { return _gbOilTempStatus; };
-    ParameterStatus GetAFRStatus() { return _afrStatus; };
+    ParameterStatus GetEngineOilPressureStatus() { return _states[MONITOR_ENG_OIL_PRESSURE].status; };
+    ParameterStatus GetEngineOilTempStatus() { return _states[MONITOR_ENG_OIL_TEMP].status; };
+    ParameterStatus GetGearboxOilTempStatus() { return _states[MONITOR_GB_OIL_TEMP].status; };
+    ParameterStatus GetAFRStatus() { return _states[MONITOR_AFR].status; };
     ParameterStatus GetTPSStatus() { return _tpsStatus; };
     ParameterStatus GetRPMStatus() { return _rpmStatus; };
-    ParameterStatus GetVoltageStatus() { return _voltageStatus; };
+    ParameterStatus GetVoltageStatus() { return _states[MONITOR_VOLTAGE].status; };
     uint8_t GetTotalRPMInputErrors() { return _rpmErrorsCount; };
+    // Segundos estimados hasta la temperatura de peligro según la tendencia (TEMP_TREND_NO_ESTIMATE si no sube)
+    uint16_t GetEngineOilTimeToDanger() { return _engOilTempTrend.timeToDanger; };
+    uint16_t GetGearboxOilTimeToDanger() { return _gbOilTempTrend.timeToDanger; };
+    // La temperatura llegará al peligro en menos de TEMP_TREND_PREEMPT_TIME segundos
+    bool IsOilTempTrendCritical() { return _engOilTempTrend.isCritical || _gbOilTempTrend.isCritical; };
+    uint16_t GetOilStarvationEvents() { return _oilStarvationEvents; };
+    uint32_t GetOilStarvationTime() { return _oilStarvationTime; };
+    // Mínimo y máximo de la presión de aceite en la última ventana (entre dos Update())
+    float GetOilPressureWindowMin() { return _oilPressureWindow.min; };
+    float GetOilPressureWindowMax() { return _oilPressureWindow.max; };
+    // La presión de aceite lleva OIL_BASELINE_PERSISTENCE por debajo de la aprendida (estado WARNING)
+    bool IsOilPressureDeviating() { return _isOilPressureDeviating; };
+    // Presión aprendida (bares) para las RPM y la temperatura actuales, 0 si todavía no hay suficientes muestras
+    float GetOilPressureBaseline();
 };
 
 #endif
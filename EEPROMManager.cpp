@@ -7,6 +7,7 @@
 #include <stdint.h>
 #include <OneWire.h>
 #include <EEPROM.h>
+#include "ecu_software.h"
 #include "EEPROMManager.h"
 
 EEPROMManager::EEPROMManager() {}
@@ -62,6 +63,17 @@ bool EEPROMManager::SaveToEEPROM(EEPROMDataAddress addr, float value) {
     return true;
 }
 
+bool EEPROMManager::SaveBytesToEEPROM(EEPROMDataAddress addr, const uint8_t *data, uint8_t length) {
+    if (!ENABLE_EEPROM_USAGE)
+        return false;
+
+    for (uint8_t i = 0; i < length; ++i) {
+        EEPROM.update(addr + i, data[i]);
+    }
+
+    return true;
+}
+
 int8_t EEPROMManager::LoadInt8FromEEPROM(EEPROMDataAddress addr) {
     return EEPROM.read(addr);
 }
@@ -73,7 +85,7 @@ int16_t EEPROMManager::LoadInt16FromEEPROM(EEPROMDataAddress addr) {
     } u;
 
     for (uint8_t i = 0; i < 2; ++i) {
-        EEPROM.read(addr + i);
+        u.b[i] = EEPROM.read(addr + i);
     }
 
     return u.value;
@@ -82,11 +94,11 @@ int16_t EEPROMManager::LoadInt16FromEEPROM(EEPROMDataAddress addr) {
 int32_t EEPROMManager::LoadInt32FromEEPROM(EEPROMDataAddress addr) {
     union u_int32 {
         byte b[4];
-        int16_t value;
+        int32_t value;
     } u;
 
     for (uint8_t i = 0; i < 4; ++i) {
-        EEPROM.read(addr + i);
+        u.b[i] = EEPROM.read(addr + i);
     }
 
     return u.value;
@@ -99,8 +111,18 @@ float EEPROMManager::LoadFloatFromEEPROM(EEPROMDataAddress addr) {
     } u;
 
     for (uint8_t i = 0; i < 4; ++i) {
-        EEPROM.read(addr + i);
+        u.b[i] = EEPROM.read(addr + i);
     }
 
     return u.value;
 }
+
+void EEPROMManager::LoadBytesFromEEPROM(EEPROMDataAddress addr, uint8_t *data, uint8_t length) {
+    for (uint8_t i = 0; i < length; ++i) {
+        data[i] = EEPROM.read(addr + i);
+    }
+}
+
+bool EEPROMManager::IsEEPROMReady() {
+    return eeprom_is_ready();
+}
@@ -22,6 +22,7 @@ enum EEPROMDataAddress {
     ADDR_MAX_RPM_SIGNAL_ERRORS         = 40,  // int8
     ADDR_EMERGENCY_REV_LIMITER         = 44,  // int16
     ADDR_CAMS_SWITCHOVER_COOLDOWN      = 48,  // int16
+    ADDR_CAMS_ACTUATION_DELAY          = 52,  // int16
     // ... siguientes 256 para floats.
     ADDR_ENGINE_OIL_COLD_TEMP_LIMIT    = 256,
     ADDR_ENGINE_OIL_TEMP_WARNING       = 260,
@@ -39,7 +40,14 @@ enum EEPROMDataAddress {
     ADDR_VOLTAGE_HIGH_DANGER           = 308,
     ADDR_ENGINE_OIL_PRESS_MIN          = 312,
     ADDR_ENGINE_OIL_PRESS_MIN_HOT      = 316,
-    ADDR_ENGINE_OIL_PRESS_MIN_RPMS     = 320
+    ADDR_ENGINE_OIL_PRESS_MIN_RPMS     = 320,
+    // ... y a partir del 512, bloques de bytes.
+    ADDR_ENG_OIL_TEMP_SENSOR           = 512, // 9 bytes: ROM (8) + resolución (1) de la sonda DS18B20
+    ADDR_GEARBOX_OIL_TEMP_SENSOR       = 528, // 9 bytes: ROM (8) + resolución (1) de la sonda DS18B20
+    ADDR_TRIGGER_PROGRAM               = 1024, // 243 bytes: cabecera (3) + programa de triggers del TriggerManager (240)
+    ADDR_OIL_BASELINE                  = 1280, // 98 bytes: marca (1) + checksum (1) + presión de aceite aprendida del DataMonitor (32 x 3)
+    ADDR_CAM_SWITCH_TABLES             = 1536, // 296 bytes: 4 tablas del NeoVVLManager (2 mapas x 2 levas) de marca (1) + checksum (1) + tabla (72)
+    ADDR_STATS                         = 2048  // 1920 bytes: anillo de 10 posiciones de 192 bytes con las estadísticas del StatsManager
 };
 
 class EEPROMManager {
@@ -52,12 +60,18 @@ class EEPROMManager {
     bool SaveToEEPROM(EEPROMDataAddress addr, int32_t value);
     // Float
     bool SaveToEEPROM(EEPROMDataAddress addr, float value);
+    // Bloques de bytes. Sólo se escriben los bytes que cambian, para ahorrar usos de la EEPROM
+    bool SaveBytesToEEPROM(EEPROMDataAddress addr, const uint8_t *data, uint8_t length);
 
     // Para recuperar los datos
     int8_t LoadInt8FromEEPROM(EEPROMDataAddress addr);
     int16_t LoadInt16FromEEPROM(EEPROMDataAddress addr);
     int32_t LoadInt32FromEEPROM(EEPROMDataAddress addr);
     float LoadFloatFromEEPROM(EEPROMDataAddress addr);
+    void LoadBytesFromEEPROM(EEPROMDataAddress addr, uint8_t *data, uint8_t length);
+
+    // La EEPROM no está escribiendo ningún byte, la siguiente escritura no bloquea (~3.3ms por byte)
+    bool IsEEPROMReady();
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,71 @@
+/*
+ * FastGPIO
+ *
+ * Acceso a los pines digitales resuelto en tiempo de compilación para el Arduino Mega 2560. digitalWrite() y
+ * digitalRead() buscan el puerto y la máscara del pin en tablas de la flash y desactivan las interrupciones en cada
+ * llamada (~4us). Con FastPin<pin> el puerto y el bit son constantes, así que en los puertos A-G cada operación es
+ * una única instrucción sbi/cbi (2 ciclos) o sbis/sbic. Los puertos H-L están fuera del espacio de E/S: la escritura
+ * es lds/ori/sts y se hace con las interrupciones desactivadas, para que ningún ISR pise otro bit del mismo puerto.
+ *
+ *   FastPin<OUTPUT_INTAKE_SOLENOID>::High();
+ *   if (FastPin<INPUT_CONTROL_BUTTON>::Read()) ...
+ *   FastPinPair<OUTPUT_INTAKE_SOLENOID, OUTPUT_EXHAUST_SOLENOID>::Write(true, true); // Los dos a la vez
+ *
+ * Un pin sin especialización (por ejemplo los analógicos) no compila. OJO: FastPin no desconecta el PWM del timer
+ * del pin como hace digitalWrite(), en los pines con PWM hay que desconectarlo antes desde el registro del timer.
+ */
+
+#ifndef __FAST_GPIO__H__
+#define __FAST_GPIO__H__
+
+// Escritura de un bit, atómica aunque el registro no admita sbi/cbi
+#define FAST_GPIO_SET(reg, bit) do { \
+        if (_SFR_IO_REG_P(reg)) { reg |= _BV(bit); } \
+        else { uint8_t sreg = SREG; cli(); reg |= _BV(bit); SREG = sreg; } \
+    } while (0)
+#define FAST_GPIO_CLEAR(reg, bit) do { \
+        if (_SFR_IO_REG_P(reg)) { reg &= ~_BV(bit); } \
+        else { uint8_t sreg = SREG; cli(); reg &= ~_BV(bit); SREG = sreg; } \
+    } while (0)
+
+template <uint8_t pin> struct FastPin;
+
+#define FAST_GPIO_PIN(number, port, bit) \
+    template <> struct FastPin<number> { \
+        static inline void High() { FAST_GPIO_SET(PORT##port, bit); } \
+        static inline void Low() { FAST_GPIO_CLEAR(PORT##port, bit); } \
+        static inline void Write(bool value) { if (value) High(); else Low(); } \
+        static inline bool Read() { return PIN##port & _BV(bit); } \
+        static inline void SetOutput() { FAST_GPIO_SET(DDR##port, bit); } \
+        static inline void SetInput() { FAST_GPIO_CLEAR(DDR##port, bit); FAST_GPIO_CLEAR(PORT##port, bit); } \
+    }
+
+// Mapa de pines del Arduino Mega 2560
+FAST_GPIO_PIN(0, E, 0);   FAST_GPIO_PIN(1, E, 1);   FAST_GPIO_PIN(2, E, 4);   FAST_GPIO_PIN(3, E, 5);
+FAST_GPIO_PIN(4, G, 5);   FAST_GPIO_PIN(5, E, 3);   FAST_GPIO_PIN(6, H, 3);   FAST_GPIO_PIN(7, H, 4);
+FAST_GPIO_PIN(8, H, 5);   FAST_GPIO_PIN(9, H, 6);   FAST_GPIO_PIN(10, B, 4);  FAST_GPIO_PIN(11, B, 5);
+FAST_GPIO_PIN(12, B, 6);  FAST_GPIO_PIN(13, B, 7);  FAST_GPIO_PIN(14, J, 1);  FAST_GPIO_PIN(15, J, 0);
+FAST_GPIO_PIN(16, H, 1);  FAST_GPIO_PIN(17, H, 0);  FAST_GPIO_PIN(18, D, 3);  FAST_GPIO_PIN(19, D, 2);
+FAST_GPIO_PIN(20, D, 1);  FAST_GPIO_PIN(21, D, 0);  FAST_GPIO_PIN(22, A, 0);  FAST_GPIO_PIN(23, A, 1);
+FAST_GPIO_PIN(24, A, 2);  FAST_GPIO_PIN(25, A, 3);  FAST_GPIO_PIN(26, A, 4);  FAST_GPIO_PIN(27, A, 5);
+FAST_GPIO_PIN(28, A, 6);  FAST_GPIO_PIN(29, A, 7);  FAST_GPIO_PIN(30, C, 7);  FAST_GPIO_PIN(31, C, 6);
+FAST_GPIO_PIN(32, C, 5);  FAST_GPIO_PIN(33, C, 4);  FAST_GPIO_PIN(34, C, 3);  FAST_GPIO_PIN(35, C, 2);
+FAST_GPIO_PIN(36, C, 1);  FAST_GPIO_PIN(37, C, 0);  FAST_GPIO_PIN(38, D, 7);  FAST_GPIO_PIN(39, G, 2);
+FAST_GPIO_PIN(40, G, 1);  FAST_GPIO_PIN(41, G, 0);  FAST_GPIO_PIN(42, L, 7);  FAST_GPIO_PIN(43, L, 6);
+FAST_GPIO_PIN(44, L, 5);  FAST_GPIO_PIN(45, L, 4);  FAST_GPIO_PIN(46, L, 3);  FAST_GPIO_PIN(47, L, 2);
+FAST_GPIO_PIN(48, L, 1);  FAST_GPIO_PIN(49, L, 0);  FAST_GPIO_PIN(50, B, 3);  FAST_GPIO_PIN(51, B, 2);
+FAST_GPIO_PIN(52, B, 1);  FAST_GPIO_PIN(53, B, 0);
+
+// Dos pines que tienen que cambiar juntos (por ejemplo los dos solenoides del NeoVVL): con las interrupciones
+// desactivadas ningún ISR ve uno cambiado y el otro no. Si los dos están en los puertos A-G son 2 instrucciones seguidas.
+template <uint8_t pinA, uint8_t pinB> struct FastPinPair {
+    static inline void Write(bool valueA, bool valueB) {
+        uint8_t sreg = SREG;
+        cli();
+        FastPin<pinA>::Write(valueA);
+        FastPin<pinB>::Write(valueB);
+        SREG = sreg;
+    }
+};
+
+#endif
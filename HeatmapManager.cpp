@@ -0,0 +1,114 @@
+/*
+ * HeatmapManager
+ *
+ * Mapa de residencia RPM x TPS con el AFR y la presión de aceite, ver HeatmapManager.h
+ */
+
+#include <stdint.h>
+#include <OneWire.h>
+#include "EEPROMManager.h"
+#include "OneWireAsync.h"
+#include "AnalogSampler.h"
+#include "DataManager.h"
+#include "DataMonitor.h"
+#include "HeatmapManager.h"
+
+// Límite superior (incluido) de cada bin de TPS menos el último. Más resolución con poco acelerador, que es donde
+// más cambia la carga del motor
+static const uint8_t tpsBinLimits[HEATMAP_TPS_BINS - 1] = { 5, 10, 20, 30, 45, 60, 80 };
+
+HeatmapManager::HeatmapManager() {
+    _dataManager = NULL;
+    _dataMonitor = NULL;
+    _sampleTimer = 0;
+    _isPaused = false;
+    Reset();
+}
+
+void HeatmapManager::Initialize(DataManager *dataManager, DataMonitor *dataMonitor) {
+    _dataManager = dataManager;
+    _dataMonitor = dataMonitor;
+}
+
+void HeatmapManager::Update(uint32_t diff) {
+    if (!HEATMAP_ENABLED || !_dataManager || !_dataMonitor)
+        return;
+
+    if (_sampleTimer >= HEATMAP_SAMPLE_INTERVAL) {
+        if (!_isPaused && _dataManager->IsEngineOn())
+            Sample();
+        _sampleTimer = 0;
+    } else {
+        _sampleTimer += diff;
+    }
+}
+
+void HeatmapManager::Sample() {
+    HeatmapCell *cell = &_cells[GetRPMBin(_dataManager->GetRPM()) * HEATMAP_TPS_BINS + GetTPSBin(_dataManager->GetTPS())];
+    if (cell->time < 0xFFFF)
+        ++cell->time;
+
+    if (_dataMonitor->GetEngineOilPressureStatus() != STATUS_ERROR) {
+        if (cell->oilPressureSamples < 0xFF)
+            ++cell->oilPressureSamples;
+        int32_t oilPressure = _dataManager->GetEngineOilPressure() * HEATMAP_VALUE_SCALE;
+        UpdateStatistic(&cell->oilPressureMean, &cell->oilPressureVariance, cell->oilPressureSamples, oilPressure < 0 ? 0 : oilPressure);
+    }
+
+    // Con la sonda wideband calentándose el AFR no es válido
+    ParameterStatus afrStatus = _dataMonitor->GetAFRStatus();
+    if (afrStatus != STATUS_ERROR && afrStatus != STATUS_COLD) {
+        if (cell->afrSamples < 0xFF)
+            ++cell->afrSamples;
+        int32_t afr = _dataManager->GetAFR() * HEATMAP_VALUE_SCALE;
+        UpdateStatistic(&cell->afrMean, &cell->afrVariance, cell->afrSamples, afr < 0 ? 0 : afr);
+    }
+}
+
+void HeatmapManager::UpdateStatistic(uint16_t *mean, uint16_t *variance, uint8_t samples, int32_t value) {
+    int32_t n = samples > HEATMAP_MAX_WEIGHT ? HEATMAP_MAX_WEIGHT : samples;
+    int32_t x = value << HEATMAP_MEAN_SHIFT;
+    if (x > 0xFFFF)
+        x = 0xFFFF;
+
+    int32_t delta = x - *mean;
+    int32_t newMean = *mean + RoundedDivide(delta, n);
+    // delta * (x - media) está en la escala de las medias al cuadrado, lo devolvemos a (valor * HEATMAP_VALUE_SCALE)^2
+    int32_t newVariance = *variance + RoundedDivide((int32_t) (((int64_t) delta * (x - newMean)) >> (HEATMAP_MEAN_SHIFT * 2)) - *variance, n);
+    *mean = newMean;
+    *variance = newVariance < 0 ? 0 : (newVariance > 0xFFFF ? 0xFFFF : newVariance);
+}
+
+int32_t HeatmapManager::RoundedDivide(int32_t value, int32_t divisor) {
+    // Redondeo simétrico, truncando las diferencias pequeñas siempre se quedarían en 0
+    return (value + (value >= 0 ? divisor / 2 : -divisor / 2)) / divisor;
+}
+
+uint8_t HeatmapManager::GetRPMBin(uint32_t rpm) {
+    uint32_t bin = rpm >> HEATMAP_RPM_SHIFT;
+    return bin >= HEATMAP_RPM_BINS ? HEATMAP_RPM_BINS - 1 : bin;
+}
+
+uint8_t HeatmapManager::GetTPSBin(uint16_t tps) {
+    uint8_t bin = 0;
+    while (bin < HEATMAP_TPS_BINS - 1 && tps > tpsBinLimits[bin]) {
+        ++bin;
+    }
+    return bin;
+}
+
+void HeatmapManager::Reset() {
+    for (uint8_t i = 0; i < HEATMAP_RPM_BINS * HEATMAP_TPS_BINS; ++i) {
+        _cells[i].time = 0;
+        _cells[i].afrSamples = 0;
+        _cells[i].oilPressureSamples = 0;
+        _cells[i].afrMean = 0;
+        _cells[i].afrVariance = 0;
+        _cells[i].oilPressureMean = 0;
+        _cells[i].oilPressureVariance = 0;
+    }
+}
+
+const uint8_t* HeatmapManager::GetTPSBinLimits() {
+    return tpsBinLimits;
+}
@@ -0,0 +1,70 @@
+/*
+ * HeatmapManager
+ *
+ * Mapa de residencia RPM x TPS para ajustar los puntos de cambio de levas y el mapa de carreras con datos reales.
+ * Cada celda guarda el tiempo que el motor ha pasado en ella y la media y la varianza del AFR y de la presión de
+ * aceite, actualizadas en cada muestra con el algoritmo de Welford en enteros:
+ *
+ *   delta = x - media;  media += delta / n;  varianza += (delta * (x - media) - varianza) / n
+ *
+ * n se limita a HEATMAP_MAX_WEIGHT, a partir de ahí la media y la varianza se comportan como una media móvil
+ * exponencial. Las medias se guardan con 4 bits de decimales extra y las divisiones se redondean, así que con el peso
+ * máximo la media todavía se mueve con una diferencia de 0.02 (HEATMAP_MAX_WEIGHT / 2 >> HEATMAP_MEAN_SHIFT) y la
+ * varianza con una desviación de ~0.06. Con más peso las celdas en las que más tiempo pasa el motor se congelarían.
+ *
+ * Las celdas se buscan sin divisiones: el bin de RPM es un desplazamiento (HEATMAP_RPM_SHIFT, 512 RPM por bin) y el
+ * de TPS una tabla de límites, más estrecha con poco acelerador. El mapa sólo está en RAM, se exporta con "heatmap;"
+ * y se borra con "heatmap reset;" (ver CommsManager.h).
+ */
+
+#ifndef __HEATMAP_MANAGER__H__
+#define __HEATMAP_MANAGER__H__
+
+#define HEATMAP_ENABLED                true
+#define HEATMAP_SAMPLE_INTERVAL        100     // Una muestra cada 0.1 segundos con el motor encendido
+#define HEATMAP_RPM_BINS               16
+#define HEATMAP_TPS_BINS               8
+#define HEATMAP_RPM_SHIFT              9       // RPM >> 9 = bin de 512 RPM, el último (> 7680 RPM) incluye todo lo que está por encima
+#define HEATMAP_MAX_WEIGHT             64      // Peso máximo de las muestras antiguas en la media y la varianza (~6s en la celda)
+#define HEATMAP_MEAN_SHIFT             4       // Decimales extra (x16) de las medias
+#define HEATMAP_VALUE_SCALE            100     // AFR y presión de aceite como enteros (valor * 100)
+
+// Celda del mapa (12 bytes). Medias en (valor * HEATMAP_VALUE_SCALE) << HEATMAP_MEAN_SHIFT, varianzas en (valor * HEATMAP_VALUE_SCALE)^2
+struct HeatmapCell {
+    uint16_t time;             // Muestras en la celda (HEATMAP_SAMPLE_INTERVAL), se satura en 0xFFFF (~1.8 horas)
+    uint8_t afrSamples;        // Muestras con un AFR válido (sonda wideband caliente), se satura en 0xFF (sólo pesa hasta HEATMAP_MAX_WEIGHT)
+    uint8_t oilPressureSamples; // Muestras con la presión de aceite válida (sin error), se satura en 0xFF
+    uint16_t afrMean;
+    uint16_t afrVariance;      // Se satura en 0xFFFF (desviación de 2.55 AFR)
+    uint16_t oilPressureMean;
+    uint16_t oilPressureVariance;
+};
+
+class HeatmapManager {
+    DataManager *_dataManager;  // Puntero al DataManager, de donde recuperaremos los datos
+    DataMonitor *_dataMonitor;  // Puntero al DataMonitor, para saber si el AFR es válido
+
+    HeatmapCell _cells[HEATMAP_RPM_BINS * HEATMAP_TPS_BINS]; // Por filas de RPM: celda = bin RPM * HEATMAP_TPS_BINS + bin TPS
+    uint32_t _sampleTimer;
+    bool _isPaused;             // No se actualiza mientras se exporta, para que el bloque sea coherente
+
+    void Sample();
+    void UpdateStatistic(uint16_t *mean, uint16_t *variance, uint8_t samples, int32_t value);
+    int32_t RoundedDivide(int32_t value, int32_t divisor);
+    uint8_t GetRPMBin(uint32_t rpm);
+    uint8_t GetTPSBin(uint16_t tps);
+
+  public:
+    HeatmapManager();
+
+    void Initialize(DataManager *dataManager, DataMonitor *dataMonitor);
+    void Update(uint32_t diff);
+
+    void Reset();
+    void SetPaused(bool isPaused) { _isPaused = isPaused; };
+    const HeatmapCell* GetCells() { return _cells; };
+    // Límites superiores de los bins de TPS, para la cabecera del volcado
+    const uint8_t* GetTPSBinLimits();
+};
+
+#endif
@@ -7,93 +7,156 @@
 
 #include <stdint.h>
 #include <OneWire.h>
+#include "FastGPIO.h"
+#include "EEPROMManager.h"
+#include "OneWireAsync.h"
+#include "AnalogSampler.h"
 #include "DataManager.h"
 #include "DataMonitor.h"
+#include "SafetyGuard.h"
+#include "ButtonManager.h"
 #include "AuxManager.h"
-#include "EEPROMManager.h"
 #include "NeoVVLManager.h"
 
 NeoVVLManager::NeoVVLManager() {
     _isIntakeEnabled = false;
     _isExhaustEnabled = false;
+    _isIntakeInCooldown = false;
+    _isExhaustInCooldown = false;
     _intakeCamCooldownTimer = 0;
     _exhaustCamCooldownTimer = 0;
+    _isEventArmed = false;
+    _intakeOnInterval = 0;
+    _exhaustOnInterval = 0;
+    _intakeOffInterval = 0;
+    _exhaustOffInterval = 0;
+    _lastSwitchLatency = 0;
+    _maxSwitchLatency = 0;
+    for (uint8_t i = 0; i < CAMS_PREDICT_EVENTS; ++i) {
+        _eventMicros[i] = 0;
+        _eventIntervals[i] = 0;
+    }
+    _eventIndex = 0;
+    _eventCount = 0;
+    _rpmRate = 0.0;
+    _predictedLead = 0;
+    _lastTableMicros = 0;
+    _maxTableMicros = 0;
+    _storeSlot = 0;
+    _storeStep = CAMS_TABLE_NOT_STORING;
+    _storeChecksum = 0;
+    _isStoreErase = false;
+    _pendingTables = 0;
+    _pendingErases = 0;
     _dataManager = NULL;
     _auxManager = NULL;
+    _safetyGuard = NULL;
+    _eepromManager = NULL;
+
+    // Valores por defecto hasta que Initialize() cargue los de la EEPROM
+    _intakeSwitchNormal = INTAKE_RPM_SWITCHOVER_NORMAL;
+    _exhaustSwitchNormal = EXHAUST_RPM_SWITCHOVER_NORMAL;
+    _intakeSwitchRace = INTAKE_RPM_SWITCHOVER_RACE;
+    _exhaustSwitchRace = EXHAUST_RPM_SWITCHOVER_RACE;
+    _actuationDelay = CAMS_ACTUATION_DELAY;
+    for (uint8_t map = 0; map < CAMS_TABLE_MAPS; ++map) {
+        LoadDefaultSwitchTable(map, CAMS_TABLE_INTAKE);
+        LoadDefaultSwitchTable(map, CAMS_TABLE_EXHAUST);
+    }
 
     // Inicializamos los pines y solenoides
     pinMode(OUTPUT_INTAKE_SOLENOID, OUTPUT);
     pinMode(OUTPUT_EXHAUST_SOLENOID, OUTPUT);
-    SwitchIntakeCam(false);
-    SwitchExhaustCam(false);
-
-    // Cargamos las variables desde la EEPROM si las hay
-    LoadCamsSwitchPointsFromEEPROM();
+    SwitchCams(false, false);
 }
 
-void NeoVVLManager::Initialize(DataManager *dataManager, AuxManager *auxManager, EEPROMManager *eepromManager) {
+void NeoVVLManager::Initialize(DataManager *dataManager, AuxManager *auxManager, SafetyGuard *safetyGuard, EEPROMManager *eepromManager) {
     _dataManager = dataManager;
     _auxManager = auxManager;
+    _safetyGuard = safetyGuard;
     _eepromManager = eepromManager;
+
+    // Cargamos las variables desde la EEPROM si las hay
+    LoadCamsSwitchPointsFromEEPROM();
 }
 
 void NeoVVLManager::Update(uint32_t diff) {
     // Aquí no hay timers, las levas son controladas constantemente, es uno de los puntos más relevantes
     // De todas formas pasamos el parámetro diff por si se quiere utilizar en un futuro
-    if (!_dataManager)
+    if (!_dataManager || !_safetyGuard)
         return;
 
     // Llamamos a la función auxiliar para cálculo de las RPM
     _dataManager->RetrieveRPM(micros());
 
+    UpdateStore();
+
     // Comprobamos que hacer en función de los mapas activos en la ECU.
     ECUMaps currentMap = _auxManager->GetCurrentECUMap();
+    // Si no nos podemos fiar de las RPMs, mejor no tocar las levas. El DataMonitor acabará marcando la señal
+    // como defectuosa si la situación se mantiene, y entonces el AuxManager activará el modo emergencia.
+    // Si el SafetyGuard ha detectado la pérdida de la señal desde el interrupt, ya ha puesto las levas en altas
+    bool isRPMReliable = _dataManager->GetRPMConfidence() >= CAMS_MIN_RPM_CONFIDENCE
+        && !(_safetyGuard->GetActiveTrips() & SAFETY_TRIP_SIGNAL_LOSS);
 
     switch (currentMap) {
         case ECU_MAP_NORMAL:
+        case ECU_MAP_RACE:
             // Comprobar que el motor esté encendido. Obviamente no podemos jugar con las levas con el motor apagado.
-            // Modo normal, operación estándar de las levas.
-            if (_dataManager->IsEngineOn()) {
-                uint16_t rpm = _dataManager->GetRPM();
-
-                if (rpm >= INTAKE_RPM_SWITCHOVER_NORMAL && !_isIntakeEnabled) {
-                    SwitchIntakeCam(true);
-                } else if (rpm < INTAKE_RPM_SWITCHOVER_NORMAL && _isIntakeEnabled) {
-                    SwitchIntakeCam(false);
-                }
+            // En el modo normal, operación estándar de las levas. El modo carrera es igual pero cambian los puntos de activación.
+            if (_dataManager->IsEngineOn() && isRPMReliable) {
+                UpdatePrediction();
 
-                if (rpm >= EXHAUST_RPM_SWITCHOVER_NORMAL && !_isExhaustEnabled) {
-                    SwitchExhaustCam(true);
-                } else if (rpm < EXHAUST_RPM_SWITCHOVER_NORMAL && _isExhaustEnabled) {
-                    SwitchExhaustCam(false);
-                }
-            }
-            break;
-        case ECU_MAP_RACE:
-            // Modo carrera, igual al modo normal pero cambian los puntos de activación de las levas.
-            if (_dataManager->IsEngineOn()) {
-                uint16_t rpm = _dataManager->GetRPM();
-
-                if (rpm >= INTAKE_RPM_SWITCHOVER_RACE && !_isIntakeEnabled) {
-                    SwitchIntakeCam(true);
-                } else if (rpm < INTAKE_RPM_SWITCHOVER_RACE && _isIntakeEnabled) {
-                    SwitchIntakeCam(false);
-                }
+                // Posición en los ejes de las tablas (parte entera = índice, 8 bits de fracción), común a las cuatro curvas.
+                // Sin temperatura del aceite fiable usamos la fila más caliente, la de los puntos de cambio habituales.
+                // Medimos desde aquí, lo que costaría evaluar las tablas con el TPS y la temperatura ya leídos
+                uint16_t tps = _dataManager->GetTPS();
+                float oilTemp = _dataManager->GetEngineOilTemp();
+                int16_t temp = oilTemp > DS18B20_ERROR_TEMP + 1.0 ? (int16_t) oilTemp - CAMS_TABLE_TEMP_START : 0xFF;
+                uint32_t tableMicros = micros();
+                uint16_t tpsPosition = ((uint32_t) tps * CAMS_TABLE_TPS_STEP_INVERSE) >> 8;
+                uint16_t tempPosition = temp <= 0 ? 0 : ((uint32_t) temp * CAMS_TABLE_TEMP_STEP_INVERSE) >> 8;
+                const CamSwitchTable *tables = _switchTables[currentMap - ECU_MAP_NORMAL];
+                int16_t intakeOn = InterpolateTable(tables[CAMS_TABLE_INTAKE].on, tempPosition, tpsPosition) - _predictedLead;
+                int16_t intakeOff = InterpolateTable(tables[CAMS_TABLE_INTAKE].off, tempPosition, tpsPosition) - _predictedLead;
+                int16_t exhaustOn = InterpolateTable(tables[CAMS_TABLE_EXHAUST].on, tempPosition, tpsPosition) - _predictedLead;
+                int16_t exhaustOff = InterpolateTable(tables[CAMS_TABLE_EXHAUST].off, tempPosition, tpsPosition) - _predictedLead;
+                tableMicros = micros() - tableMicros;
+                _lastTableMicros = tableMicros > 0xFFFF ? 0xFFFF : tableMicros;
+                if (_lastTableMicros > _maxTableMicros)
+                    _maxTableMicros = _lastTableMicros;
+
+                uint32_t intakeOnInterval = CAMS_RPM_TO_INTERVAL(intakeOn);
+                uint32_t intakeOffInterval = CAMS_RPM_TO_INTERVAL(intakeOff);
+                uint32_t exhaustOnInterval = CAMS_RPM_TO_INTERVAL(exhaustOn);
+                uint32_t exhaustOffInterval = CAMS_RPM_TO_INTERVAL(exhaustOff);
+                noInterrupts();
+                _intakeOnInterval = intakeOnInterval;
+                _intakeOffInterval = intakeOffInterval;
+                _exhaustOnInterval = exhaustOnInterval;
+                _exhaustOffInterval = exhaustOffInterval;
+                _isEventArmed = CAMS_EVENT_DRIVEN;
+                interrupts();
 
-                if (rpm >= EXHAUST_RPM_SWITCHOVER_RACE && !_isExhaustEnabled) {
-                    SwitchExhaustCam(true);
-                } else if (rpm < EXHAUST_RPM_SWITCHOVER_RACE && _isExhaustEnabled) {
-                    SwitchExhaustCam(false);
+                // Sin el modo por eventos, decidimos aquí con las RPM del DataManager
+                if (!CAMS_EVENT_DRIVEN) {
+                    uint32_t rpm = _dataManager->GetRPM();
+                    if (rpm)
+                        EvaluateCams(CAMS_RPM_TO_INTERVAL(rpm), _dataManager->GetLastIgnitionMicros());
                 }
+            } else {
+                _isEventArmed = false;
             }
             break;
         case ECU_MAP_EMERGENCY:
             // En el modo emergencia, las levas quedan activadas permanentemente en ALTAS.
             // Esto es debido a que si las levas de bajas entran a altas vueltas, el tren de válvulas puede sufrir daños.
-            SwitchIntakeCam(true);
-            SwitchExhaustCam(true);
+            // Primero dejamos de decidir desde el interrupt, para que no nos las vuelva a cambiar.
+            _isEventArmed = false;
+            SwitchCams(true, true);
             break;
         default:
+            _isEventArmed = false;
             break;
     }
 
@@ -116,6 +179,119 @@ void NeoVVLManager::Update(uint32_t diff) {
     }
 }
 
+void NeoVVLManager::IgnitionEvent(uint32_t currentMicros, uint32_t interval) {
+    if (!interval)
+        return;
+
+    // Registramos el encendido para estimar la aceleración desde el loop
+    _eventMicros[_eventIndex] = currentMicros;
+    _eventIntervals[_eventIndex] = interval;
+    _eventIndex = (_eventIndex + 1) % CAMS_PREDICT_EVENTS;
+    if (_eventCount < CAMS_PREDICT_EVENTS)
+        ++_eventCount;
+
+    if (!CAMS_EVENT_DRIVEN || !_isEventArmed)
+        return;
+
+    EvaluateCams(interval, currentMicros);
+}
+
+void NeoVVLManager::EvaluateCams(uint32_t interval, uint32_t edgeMicros) {
+    // Intervalo más corto = más RPM. Con las levas en cooldown no se cambian, la siguiente evaluación lo volverá a intentar.
+    // Con las levas de altas puestas, aguantan hasta la curva off (histéresis)
+    bool isIntakeOn = interval <= (_isIntakeEnabled ? _intakeOffInterval : _intakeOnInterval);
+    bool isExhaustOn = interval <= (_isExhaustEnabled ? _exhaustOffInterval : _exhaustOnInterval);
+    bool isIntakeSwitched = isIntakeOn != _isIntakeEnabled && !_isIntakeInCooldown;
+    bool isExhaustSwitched = isExhaustOn != _isExhaustEnabled && !_isExhaustInCooldown;
+    if (isIntakeSwitched && isExhaustSwitched)
+        SwitchCams(isIntakeOn, isExhaustOn);
+    else if (isIntakeSwitched)
+        SwitchIntakeCam(isIntakeOn);
+    else if (isExhaustSwitched)
+        SwitchExhaustCam(isExhaustOn);
+
+    if (isIntakeSwitched || isExhaustSwitched) {
+        uint32_t latency = micros() - edgeMicros;
+        _lastSwitchLatency = latency > 0xFFFF ? 0xFFFF : latency;
+        if (_lastSwitchLatency > _maxSwitchLatency)
+            _maxSwitchLatency = _lastSwitchLatency;
+    }
+}
+
+void NeoVVLManager::UpdatePrediction() {
+    _rpmRate = 0.0;
+    _predictedLead = 0;
+    if (!CAMS_PREDICTIVE_SWITCHOVER)
+        return;
+
+    // Copiamos los dos encendidos más antiguos y los dos más recientes
+    noInterrupts();
+    uint8_t count = _eventCount;
+    uint8_t oldest = _eventIndex;
+    uint8_t second = (oldest + 1) % CAMS_PREDICT_EVENTS;
+    uint8_t previous = (oldest + CAMS_PREDICT_EVENTS - 2) % CAMS_PREDICT_EVENTS;
+    uint8_t newest = (oldest + CAMS_PREDICT_EVENTS - 1) % CAMS_PREDICT_EVENTS;
+    uint32_t oldPairMicros = _eventMicros[second];
+    uint32_t oldPairInterval = _eventIntervals[oldest] + _eventIntervals[second];
+    uint32_t newPairMicros = _eventMicros[newest];
+    uint32_t newPairInterval = _eventIntervals[previous] + _eventIntervals[newest];
+    interrupts();
+
+    if (count < CAMS_PREDICT_EVENTS || micros() - newPairMicros > CAMS_PREDICT_MAX_AGE)
+        return;
+
+    // RPM medias de cada pareja de intervalos, situadas en el centro de la pareja
+    float oldRPM = 60000000.0 / oldPairInterval;
+    float newRPM = 60000000.0 / newPairInterval;
+    float elapsed = (float) (newPairMicros - oldPairMicros) - (newPairInterval / 2.0) + (oldPairInterval / 2.0);
+    if (elapsed <= 0.0)
+        return;
+    _rpmRate = (newRPM - oldRPM) * 1000000.0 / elapsed;
+
+    float lead = _rpmRate * GetActuationDelay() / 1000.0;
+    if (lead > CAMS_PREDICT_MAX_LEAD)
+        lead = CAMS_PREDICT_MAX_LEAD;
+    else if (lead < -CAMS_PREDICT_MAX_LEAD)
+        lead = -CAMS_PREDICT_MAX_LEAD;
+    _predictedLead = lead;
+}
+
+int16_t NeoVVLManager::InterpolateTable(const int16_t values[CAMS_TABLE_TEMP_POINTS][CAMS_TABLE_TPS_POINTS], uint16_t tempPosition, uint16_t tpsPosition) {
+    // Fuera de la tabla nos quedamos en el borde: último tramo con fracción 256
+    uint8_t row = tempPosition >> 8;
+    uint16_t rowFraction = tempPosition & 0xFF;
+    if (row >= CAMS_TABLE_TEMP_POINTS - 1) {
+        row = CAMS_TABLE_TEMP_POINTS - 2;
+        rowFraction = 256;
+    }
+    uint8_t column = tpsPosition >> 8;
+    uint16_t columnFraction = tpsPosition & 0xFF;
+    if (column >= CAMS_TABLE_TPS_POINTS - 1) {
+        column = CAMS_TABLE_TPS_POINTS - 2;
+        columnFraction = 256;
+    }
+
+    // Primero a lo largo del TPS en las dos filas y luego entre ellas. Como mucho 8000 * 256 * 256, cabe en un int32
+    int32_t low = (int32_t) values[row][column] * (256 - columnFraction) + (int32_t) values[row][column + 1] * columnFraction;
+    int32_t high = (int32_t) values[row + 1][column] * (256 - columnFraction) + (int32_t) values[row + 1][column + 1] * columnFraction;
+    return (low * (256 - rowFraction) + high * rowFraction) >> 16;
+}
+
+float NeoVVLManager::GetActuationDelay() {
+    float delay = _actuationDelay;
+
+    float oilTemp = _dataManager->GetEngineOilTemp();
+    if (oilTemp > DS18B20_ERROR_TEMP + 1.0 && oilTemp < CAMS_DELAY_REFERENCE_TEMP)
+        delay *= 1.0 + (CAMS_DELAY_REFERENCE_TEMP - oilTemp) * CAMS_DELAY_TEMP_FACTOR;
+
+    float voltage = _dataManager->GetVoltage();
+    if (voltage < CAMS_DELAY_MIN_VOLTAGE)
+        voltage = CAMS_DELAY_MIN_VOLTAGE;
+    delay *= CAMS_DELAY_REFERENCE_VOLTAGE / voltage;
+
+    return delay;
+}
+
 /****************************************************************************************************************************
  * Respecto a las funciones para cambiar entre las diferentes levas:                                                        *
  *                                                                                                                          *
@@ -132,11 +308,11 @@ void NeoVVLManager::SwitchIntakeCam(bool on) {
 
     if (on) {
         //Desactivamos el relé
-        digitalWrite(OUTPUT_INTAKE_SOLENOID, HIGH);
+        FastPin<OUTPUT_INTAKE_SOLENOID>::High();
         _isIntakeEnabled = true;
     } else {
         // Activamos el relé
-        digitalWrite(OUTPUT_INTAKE_SOLENOID, LOW);
+        FastPin<OUTPUT_INTAKE_SOLENOID>::Low();
         _isIntakeEnabled = false;
     }
     _isIntakeInCooldown = true;
@@ -148,16 +324,32 @@ void NeoVVLManager::SwitchExhaustCam(bool on) {
 
     if (on) {
         //Desactivamos el relé
-        digitalWrite(OUTPUT_EXHAUST_SOLENOID, HIGH);
+        FastPin<OUTPUT_EXHAUST_SOLENOID>::High();
         _isExhaustEnabled = true;
     } else {
         // Activamos el relé
-        digitalWrite(OUTPUT_EXHAUST_SOLENOID, LOW);
+        FastPin<OUTPUT_EXHAUST_SOLENOID>::Low();
         _isExhaustEnabled = false;
     }
     _isExhaustInCooldown = true;
 }
 
+void NeoVVLManager::SwitchCams(bool intakeOn, bool exhaustOn) {
+    // Con alguna de las levas en cooldown, cada una por su lado (la que está en cooldown no cambia)
+    if (_isIntakeInCooldown || _isExhaustInCooldown) {
+        SwitchIntakeCam(intakeOn);
+        SwitchExhaustCam(exhaustOn);
+        return;
+    }
+
+    // Los dos relés en el mismo instante, misma lógica invertida que arriba
+    FastPinPair<OUTPUT_INTAKE_SOLENOID, OUTPUT_EXHAUST_SOLENOID>::Write(intakeOn, exhaustOn);
+    _isIntakeEnabled = intakeOn;
+    _isExhaustEnabled = exhaustOn;
+    _isIntakeInCooldown = true;
+    _isExhaustInCooldown = true;
+}
+
 int8_t NeoVVLManager::GetIntakeCamStatus() {
     if (_isIntakeEnabled) {
         return CAM_STATUS_ENABLED;
@@ -175,10 +367,14 @@ int8_t NeoVVLManager::GetExhaustCamStatus() {
 }
 
 void NeoVVLManager::LoadCamsSwitchPointsFromEEPROM() {
+    if (!_eepromManager)
+        return;
+
     _intakeSwitchNormal = _eepromManager->LoadInt16FromEEPROM(ADDR_INTAKE_RPM_SWITCHOVER_NORMAL);
     _exhaustSwitchNormal = _eepromManager->LoadInt16FromEEPROM(ADDR_EXHAUST_RPM_SWITCHOVER_NORMAL);
     _intakeSwitchRace = _eepromManager->LoadInt16FromEEPROM(ADDR_INTAKE_RPM_SWITCHOVER_RACE);
     _exhaustSwitchRace = _eepromManager->LoadInt16FromEEPROM(ADDR_EXHAUST_RPM_SWITCHOVER_RACE);
+    _actuationDelay = _eepromManager->LoadInt16FromEEPROM(ADDR_CAMS_ACTUATION_DELAY);
 
     // Veirificamos que los valores son correctos
     if (_intakeSwitchNormal > 7000 || _intakeSwitchNormal < 2000) {
@@ -196,4 +392,145 @@ void NeoVVLManager::LoadCamsSwitchPointsFromEEPROM() {
     if (_exhaustSwitchRace > 7000 || _exhaustSwitchRace < 2000) {
         _exhaustSwitchRace = EXHAUST_RPM_SWITCHOVER_RACE;
     }
+    if (_actuationDelay > 250 || _actuationDelay < 1) {
+        _actuationDelay = CAMS_ACTUATION_DELAY;
+    }
+
+    LoadCamsSwitchTablesFromEEPROM();
+}
+
+void NeoVVLManager::LoadCamsSwitchTablesFromEEPROM() {
+    for (uint8_t map = 0; map < CAMS_TABLE_MAPS; ++map) {
+        for (uint8_t cam = CAMS_TABLE_INTAKE; cam <= CAMS_TABLE_EXHAUST; ++cam) {
+            // Las tablas que se están guardando todavía no están enteras en la EEPROM, la buena es la de la RAM
+            uint8_t slot = map * 2 + cam;
+            bool isStoring = _storeStep != CAMS_TABLE_NOT_STORING && _storeSlot == slot;
+            if ((_pendingTables & (1 << slot)) || (isStoring && !_isStoreErase))
+                continue;
+            // Marca + checksum (suma de todos los bytes de la tabla). Si no es válida, tabla plana con el punto de cambio simple
+            LoadDefaultSwitchTable(map, cam);
+            if ((_pendingErases & (1 << slot)) || isStoring)
+                continue;
+            uint8_t header[2];
+            _eepromManager->LoadBytesFromEEPROM(GetSwitchTableAddress(map, cam), header, 2);
+            if (header[0] != CAMS_TABLE_MAGIC)
+                continue;
+
+            CamSwitchTable table;
+            _eepromManager->LoadBytesFromEEPROM((EEPROMDataAddress) (GetSwitchTableAddress(map, cam) + 2), (uint8_t*) &table, sizeof(CamSwitchTable));
+            uint8_t checksum = 0;
+            for (uint8_t i = 0; i < sizeof(CamSwitchTable); ++i) {
+                checksum += ((uint8_t*) &table)[i];
+            }
+            if (checksum == header[1])
+                _switchTables[map][cam] = table;
+        }
+    }
+}
+
+void NeoVVLManager::LoadDefaultSwitchTable(uint8_t map, uint8_t cam) {
+    int16_t switchPoint;
+    if (map == ECU_MAP_RACE - ECU_MAP_NORMAL)
+        switchPoint = cam == CAMS_TABLE_INTAKE ? _intakeSwitchRace : _exhaustSwitchRace;
+    else
+        switchPoint = cam == CAMS_TABLE_INTAKE ? _intakeSwitchNormal : _exhaustSwitchNormal;
+
+    CamSwitchTable *table = &_switchTables[map][cam];
+    for (uint8_t row = 0; row < CAMS_TABLE_TEMP_POINTS; ++row) {
+        for (uint8_t column = 0; column < CAMS_TABLE_TPS_POINTS; ++column) {
+            table->on[row][column] = switchPoint;
+            table->off[row][column] = switchPoint - CAMS_TABLE_HYSTERESIS;
+        }
+    }
+}
+
+bool NeoVVLManager::StoreSwitchTable(ECUMaps map, uint8_t cam, const uint8_t *data, uint8_t length) {
+    if (!_eepromManager || (map != ECU_MAP_NORMAL && map != ECU_MAP_RACE) || cam > CAMS_TABLE_EXHAUST)
+        return false;
+
+    uint8_t index = map - ECU_MAP_NORMAL;
+    uint8_t slot = index * 2 + cam;
+    if (!length) {
+        LoadDefaultSwitchTable(index, cam);
+        _pendingTables &= ~(1 << slot);
+        _pendingErases |= 1 << slot;
+        UpdateStore();
+        return true;
+    }
+    if (length != sizeof(CamSwitchTable))
+        return false;
+
+    // Todos los puntos dentro de los límites, y la vuelta a bajas nunca por encima del cambio a altas
+    CamSwitchTable table;
+    memcpy(&table, data, sizeof(CamSwitchTable));
+    for (uint8_t row = 0; row < CAMS_TABLE_TEMP_POINTS; ++row) {
+        for (uint8_t column = 0; column < CAMS_TABLE_TPS_POINTS; ++column) {
+            int16_t on = table.on[row][column];
+            int16_t off = table.off[row][column];
+            if (on < CAMS_TABLE_MIN_RPM || on > CAMS_TABLE_MAX_RPM || off < CAMS_TABLE_MIN_RPM || off > on)
+                return false;
+        }
+    }
+
+    // El loop no se interrumpe aquí, así que la tabla nueva se usa entera desde la siguiente evaluación. La EEPROM
+    // (~3.3ms por byte) se escribe desde Update(); si esta tabla ya se estaba guardando, se vuelve a guardar al terminar
+    _switchTables[index][cam] = table;
+    _pendingErases &= ~(1 << slot);
+    _pendingTables |= 1 << slot;
+    UpdateStore();
+    return true;
+}
+
+void NeoVVLManager::UpdateStore() {
+    if (!_eepromManager)
+        return;
+
+    if (_storeStep == CAMS_TABLE_NOT_STORING) {
+        // Siguiente tabla pendiente, copiando la de la RAM
+        uint8_t pending = _pendingTables | _pendingErases;
+        if (!pending)
+            return;
+        _storeSlot = 0;
+        while (!(pending & (1 << _storeSlot)))
+            ++_storeSlot;
+        _isStoreErase = _pendingErases & (1 << _storeSlot);
+        _pendingTables &= ~(1 << _storeSlot);
+        _pendingErases &= ~(1 << _storeSlot);
+        _storeTable = _switchTables[_storeSlot / 2][_storeSlot % 2];
+        _storeChecksum = 0;
+        for (uint8_t i = 0; i < sizeof(CamSwitchTable); ++i) {
+            _storeChecksum += ((const uint8_t*) &_storeTable)[i];
+        }
+        _storeStep = 0;
+    }
+
+    // Pasos: marca borrada, tabla, checksum y por último la marca, por si se corta la corriente a mitad. Un byte cada
+    // vez que la EEPROM está libre, los que no cambian no esperan. Para borrar la tabla basta con el primer paso
+    EEPROMDataAddress address = GetSwitchTableAddress(_storeSlot / 2, _storeSlot % 2);
+    uint8_t last = _isStoreErase ? 0 : sizeof(CamSwitchTable) + 2;
+    while (_storeStep <= last && _eepromManager->IsEEPROMReady()) {
+        uint8_t offset;
+        uint8_t value;
+        if (_storeStep == 0) {
+            offset = 0;
+            value = 0;
+        } else if (_storeStep <= sizeof(CamSwitchTable)) {
+            offset = _storeStep + 1;
+            value = ((const uint8_t*) &_storeTable)[_storeStep - 1];
+        } else if (_storeStep < last) {
+            offset = 1;
+            value = _storeChecksum;
+        } else {
+            offset = 0;
+            value = CAMS_TABLE_MAGIC;
+        }
+        _eepromManager->SaveBytesToEEPROM((EEPROMDataAddress) (address + offset), &value, 1);
+        ++_storeStep;
+    }
+    if (_storeStep > last)
+        _storeStep = CAMS_TABLE_NOT_STORING;
+}
+
+EEPROMDataAddress NeoVVLManager::GetSwitchTableAddress(uint8_t map, uint8_t cam) {
+    return (EEPROMDataAddress) (ADDR_CAM_SWITCH_TABLES + (map * 2 + cam) * (sizeof(CamSwitchTable) + 2));
 }
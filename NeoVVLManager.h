@@ -16,6 +16,43 @@
 
 // Timer, o cooldown, entre cambios en las levas, para evitar cambios demasiado rápidos, por ejemplo al mantener las RPM en el límite de activación.
 #define CAMS_SWITCHOVER_COOLDOWN       500  // 500 milisegundos
+// Confianza mínima (0-100) en la estimación de RPM para mover las levas. Por debajo, las levas se quedan como están.
+#define CAMS_MIN_RPM_CONFIDENCE        50
+// Decisión de las levas en el interrupt de encendido, en cuanto hay un intervalo nuevo, en vez de en el loop (que
+// depende de lo que tarden el resto de managers). El loop sigue decidiendo cuándo se puede (motor, mapa, confianza
+// en las RPM) y con qué puntos de cambio, y gestiona los cooldowns. En el interrupt sólo se comparan intervalos.
+#define CAMS_EVENT_DRIVEN              true
+#define CAMS_RPM_TO_INTERVAL(rpm)      (30000000UL / (rpm)) // Intervalo entre encendidos (us) equivalente a unas RPM
+// Cambio predictivo: el lóbulo no cambia hasta que el solenoide abre y el aceite mueve los balancines, y mientras tanto
+// las RPM siguen subiendo (en marchas cortas, cientos de RPM). Con la aceleración de los últimos encendidos adelantamos
+// el punto de cambio lo que van a subir las RPM durante ese retraso, para que el cambio efectivo sea en el punto de cambio.
+// Igual al bajar de vueltas, volviendo antes a las levas de bajas.
+#define CAMS_PREDICTIVE_SWITCHOVER     true
+#define CAMS_ACTUATION_DELAY           40     // Retraso (ms) del cambio efectivo con el aceite caliente y 13.5v. Configurable en la EEPROM
+#define CAMS_DELAY_REFERENCE_TEMP      80.0   // Por debajo de 80 Cº el aceite es más viscoso y el cambio más lento...
+#define CAMS_DELAY_TEMP_FACTOR         0.02   // ... un 2% por cada Cº
+#define CAMS_DELAY_REFERENCE_VOLTAGE   13.5   // Con menos voltaje el solenoide tarda más en abrir, retraso proporcional
+#define CAMS_DELAY_MIN_VOLTAGE         9.0
+#define CAMS_PREDICT_EVENTS            8      // Encendidos para estimar la aceleración (media de los dos primeros contra los dos últimos)
+#define CAMS_PREDICT_MAX_AGE           100000 // Si el último encendido tiene más de 100ms, no hay aceleración fiable
+#define CAMS_PREDICT_MAX_LEAD          600    // Adelanto máximo (RPM), por si la estimación se dispara
+// Tablas de puntos de cambio: para cada mapa de la ECU y cada leva, RPM de activación (on) y de vuelta a bajas (off, por
+// debajo de on para tener histéresis) en función del TPS y de la temperatura del aceite. Se interpolan en punto fijo
+// (bilineal, fracciones de 8 bits) sin divisiones: los ejes son uniformes y la posición se calcula multiplicando por el
+// inverso del paso. Si no hay tabla en la EEPROM, se construye una plana con los puntos de cambio simples de arriba.
+#define CAMS_TABLE_TPS_POINTS          6      // TPS 0, 20, 40, 60, 80 y 100%
+#define CAMS_TABLE_TPS_STEP_INVERSE    3277   // 65536 / 20
+#define CAMS_TABLE_TEMP_POINTS         3      // Aceite a 40, 70 y 100 Cº
+#define CAMS_TABLE_TEMP_START          40
+#define CAMS_TABLE_TEMP_STEP_INVERSE   2185   // 65536 / 30
+#define CAMS_TABLE_MAPS                2      // ECU_MAP_NORMAL y ECU_MAP_RACE, en emergencia las levas van fijas en altas
+#define CAMS_TABLE_INTAKE              0
+#define CAMS_TABLE_EXHAUST             1
+#define CAMS_TABLE_MIN_RPM             2000
+#define CAMS_TABLE_MAX_RPM             8000
+#define CAMS_TABLE_HYSTERESIS          150    // Tablas por defecto: vuelta a bajas 150 RPM por debajo del punto de cambio
+#define CAMS_TABLE_MAGIC               0x43   // Marca de tabla válida en la EEPROM ('C')
+#define CAMS_TABLE_NOT_STORING         0xFF   // _storeStep sin guardado en curso
 
 // Pines necesarios para controlar los solenoides
 #define OUTPUT_INTAKE_SOLENOID  4    // Pin para controlar el relé del solenoide de las levas de admisión (0-5v digital)
@@ -27,40 +64,100 @@
 #define CAM_STATUS_ENGINE_OFF   3    // Motor apagado
 #define CAM_STATUS_ERROR        -1   // Hay algún problema en el sistema
 
+// Tabla de puntos de cambio de una leva en un mapa (72 bytes). RPM por filas de temperatura: [temperatura][TPS]
+struct CamSwitchTable {
+    int16_t on[CAMS_TABLE_TEMP_POINTS][CAMS_TABLE_TPS_POINTS];
+    int16_t off[CAMS_TABLE_TEMP_POINTS][CAMS_TABLE_TPS_POINTS];
+};
+
 class NeoVVLManager {
     DataManager *_dataManager;    // Puntero al DataManager, de donde recuperaremos los datos
     AuxManager *_auxManager;      // Puntero al AuxManager, para obtener los mapas activos en la ECU
+    SafetyGuard *_safetyGuard;    // Puntero al SafetyGuard, si ha perdido la señal de RPM las levas ya están en altas
     EEPROMManager *_eepromManager;
 
     int16_t _intakeSwitchNormal;  // Variables que guardan los puntos en los que cambian las levas si se cargan desde la EEPROM
     int16_t _exhaustSwitchNormal; // Si no, se utlizan los valores de arriba.
     int16_t _intakeSwitchRace;
     int16_t _exhaustSwitchRace;
+    int16_t _actuationDelay;      // Retraso del cambio efectivo (ms), de la EEPROM o CAMS_ACTUATION_DELAY
+    CamSwitchTable _switchTables[CAMS_TABLE_MAPS][2]; // [mapa - ECU_MAP_NORMAL][CAMS_TABLE_INTAKE o CAMS_TABLE_EXHAUST]
+    uint16_t _lastTableMicros;    // Tiempo de la última evaluación de las tablas (las cuatro curvas)
+    uint16_t _maxTableMicros;
+    // Guardado de las tablas en la EEPROM, un byte cada vez que está libre. Las tablas se identifican con map * 2 + cam
+    CamSwitchTable _storeTable;   // Copia que se está escribiendo, para que el checksum coincida aunque llegue otra tabla
+    uint8_t _storeSlot;
+    uint8_t _storeStep;           // Siguiente paso del guardado, CAMS_TABLE_NOT_STORING si no hay guardado en curso
+    uint8_t _storeChecksum;
+    bool _isStoreErase;           // Sólo hay que borrar la marca (vuelta a la tabla por defecto)
+    uint8_t _pendingTables;       // Tablas pendientes de guardar (bit = map * 2 + cam)
+    uint8_t _pendingErases;       // Tablas pendientes de borrar
+
+    volatile bool _isIntakeEnabled;    // Variables de control para saber si las levas de altas están o no activadas
+    volatile bool _isExhaustEnabled;
+    volatile bool _isIntakeInCooldown; // Variables para controlar el cooldown entre cambios en las levas
+    volatile bool _isExhaustInCooldown;
 
-    bool _isIntakeEnabled;        // Variables de control para saber si las levas de altas están o no activadas
-    bool _isExhaustEnabled;
-    bool _isIntakeInCooldown;     // Variables para controlar el cooldown entre cambios en las levas
-    bool _isExhaustInCooldown;
+    // Modo por eventos (CAMS_EVENT_DRIVEN)
+    volatile bool _isEventArmed;       // El loop permite decidir desde el interrupt de encendido
+    volatile uint32_t _intakeOnInterval;  // Intervalo (us) por debajo del cual van las levas de altas
+    volatile uint32_t _exhaustOnInterval;
+    volatile uint32_t _intakeOffInterval; // Intervalo (us) por encima del cual vuelven las levas de bajas
+    volatile uint32_t _exhaustOffInterval;
+    // Latencia desde el encendido que cruza el punto de cambio hasta el cambio del pin
+    volatile uint16_t _lastSwitchLatency;
+    volatile uint16_t _maxSwitchLatency;
+
+    // Cambio predictivo (CAMS_PREDICTIVE_SWITCHOVER). Últimos encendidos, registrados desde el interrupt
+    volatile uint32_t _eventMicros[CAMS_PREDICT_EVENTS];
+    volatile uint32_t _eventIntervals[CAMS_PREDICT_EVENTS];
+    volatile uint8_t _eventIndex;     // Posición del encendido más antiguo (y del siguiente que se registra)
+    volatile uint8_t _eventCount;
+    float _rpmRate;                   // Aceleración estimada (RPM/s)
+    int16_t _predictedLead;           // Adelanto aplicado a los puntos de cambio (RPM, negativo al bajar de vueltas)
 
     uint32_t _intakeCamCooldownTimer;
     uint32_t _exhaustCamCooldownTimer;
 
+    void EvaluateCams(uint32_t interval, uint32_t edgeMicros);
+    void UpdatePrediction();
+    float GetActuationDelay();
+    int16_t InterpolateTable(const int16_t values[CAMS_TABLE_TEMP_POINTS][CAMS_TABLE_TPS_POINTS], uint16_t tempPosition, uint16_t tpsPosition);
+    void LoadDefaultSwitchTable(uint8_t map, uint8_t cam);
+    void LoadCamsSwitchTablesFromEEPROM();
+    void UpdateStore();
+    EEPROMDataAddress GetSwitchTableAddress(uint8_t map, uint8_t cam);
+
   public:
     // Constructor, en este caso sólo inicializa las variables privadas de la clase
     NeoVVLManager();
 
     // Función de inicialización, aquí es donde realmente empieza a funcionar este manager, en cuanto el DataManager y el AuxManager estén operativos
-    void Initialize(DataManager *dataManager, AuxManager *auxManager, EEPROMManager *eepromManager);
+    void Initialize(DataManager *dataManager, AuxManager *auxManager, SafetyGuard *safetyGuard, EEPROMManager *eepromManager);
     // Función que controla la activación/desactivación de las levas en función de las RPMs
     void Update(uint32_t diff);
+    // Llamada desde el interrupt de encendido con el intervalo aceptado (0 si no se ha aceptado)
+    void IgnitionEvent(uint32_t currentMicros, uint32_t interval);
     // Funciones para cambiar las levas
     void SwitchIntakeCam(bool on);
     void SwitchExhaustCam(bool on);
+    void SwitchCams(bool intakeOn, bool exhaustOn); // Las dos levas a la vez, si ninguna está en cooldown
     // Funciones para recuperar el estado de las levas de forma externa
     int8_t GetIntakeCamStatus();
     int8_t GetExhaustCamStatus();
+    // Latencia (us) desde el encendido que cruza el punto de cambio hasta el cambio de las levas (modo debug)
+    uint16_t GetLastSwitchLatency() { return _lastSwitchLatency; };
+    uint16_t GetMaxSwitchLatency() { return _maxSwitchLatency; };
+    float GetRPMRate() { return _rpmRate; };
+    int16_t GetPredictedLead() { return _predictedLead; };
+    uint16_t GetLastTableMicros() { return _lastTableMicros; };
+    uint16_t GetMaxTableMicros() { return _maxTableMicros; };
     // Funciones para cargar valores dinámicos de la EEPROM
     void LoadCamsSwitchPointsFromEEPROM();
+    // Guarda la tabla de una leva (sizeof(CamSwitchTable) bytes) para ECU_MAP_NORMAL o ECU_MAP_RACE. Con length 0 se
+    // borra y se vuelve a la tabla plana de los puntos de cambio simples. false si la tabla no es válida.
+    // La tabla se usa desde la siguiente evaluación, y se guarda en la EEPROM en segundo plano desde Update()
+    bool StoreSwitchTable(ECUMaps map, uint8_t cam, const uint8_t *data, uint8_t length);
 };
 
 #endif
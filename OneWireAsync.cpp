@@ -0,0 +1,146 @@
+/*
+ * OneWireAsync
+ *
+ * Implementación del protocolo OneWire completamente asíncrona, dirigida por la interrupción del Timer1.
+ */
+
+#include <stdint.h>
+#include <Arduino.h>
+#include "OneWireAsync.h"
+
+OneWireAsync::OneWireAsync() {
+    _inputReg = NULL;
+    _modeReg = NULL;
+    _outputReg = NULL;
+    _bitMask = 0;
+    _writeLength = 0;
+    _readLength = 0;
+    _bitIndex = 0;
+    _status = ONEWIRE_IDLE;
+    _phase = ONEWIRE_PHASE_RESET_RELEASE;
+}
+
+bool OneWireAsync::Start(uint8_t pin, const uint8_t *data, uint8_t writeLength, uint8_t readLength) {
+    if (_status != ONEWIRE_IDLE || writeLength + readLength > ONEWIRE_BUFFER_SIZE)
+        return false;
+
+    uint8_t port = digitalPinToPort(pin);
+    _inputReg = portInputRegister(port);
+    _modeReg = portModeRegister(port);
+    _outputReg = portOutputRegister(port);
+    _bitMask = digitalPinToBitMask(pin);
+
+    for (uint8_t i = 0; i < writeLength; ++i) {
+        _buffer[i] = data[i];
+    }
+    for (uint8_t i = writeLength; i < writeLength + readLength; ++i) {
+        _buffer[i] = 0;
+    }
+    _writeLength = writeLength;
+    _readLength = readLength;
+    _bitIndex = 0;
+    _status = ONEWIRE_BUSY;
+
+    // El Timer1 se configura en cada transacción, así no dependemos de lo que haya hecho init() antes de setup()
+    // Modo CTC, prescaler 8 (0.5us por tick)
+    noInterrupts();
+    TCCR1A = 0;
+    TCCR1B = _BV(WGM12) | _BV(CS11);
+    // Empezamos con el pulso de reset
+    DriveLow();
+    _phase = ONEWIRE_PHASE_RESET_RELEASE;
+    Schedule(ONEWIRE_RESET_LOW);
+    TIFR1 = _BV(OCF1A);
+    TIMSK1 |= _BV(OCIE1A);
+    interrupts();
+
+    return true;
+}
+
+void OneWireAsync::Free() {
+    if (_status != ONEWIRE_BUSY)
+        _status = ONEWIRE_IDLE;
+}
+
+void OneWireAsync::TimerEvent() {
+    switch (_phase) {
+        case ONEWIRE_PHASE_RESET_RELEASE:
+            Release();
+            _phase = ONEWIRE_PHASE_RESET_SAMPLE;
+            Schedule(ONEWIRE_PRESENCE_WAIT);
+            break;
+        case ONEWIRE_PHASE_RESET_SAMPLE:
+            // El dispositivo responde al reset poniendo el bus a masa (presence pulse)
+            _phase = ReadPin() ? ONEWIRE_PHASE_RESET_END : ONEWIRE_PHASE_NEXT_SLOT;
+            Schedule(ONEWIRE_RESET_RECOVERY);
+            break;
+        case ONEWIRE_PHASE_RESET_END:
+            Finish(ONEWIRE_NO_PRESENCE);
+            break;
+        case ONEWIRE_PHASE_WRITE_ZERO_RELEASE:
+            Release();
+            _phase = ONEWIRE_PHASE_NEXT_SLOT;
+            Schedule(ONEWIRE_WRITE_ZERO_HIGH);
+            break;
+        case ONEWIRE_PHASE_NEXT_SLOT:
+        default: {
+            uint8_t byteIndex = _bitIndex >> 3;
+            uint8_t bit = _bitIndex & 7;
+            if (byteIndex >= _writeLength + _readLength) {
+                Finish(ONEWIRE_DONE);
+                return;
+            }
+            ++_bitIndex;
+
+            if (byteIndex < _writeLength) {
+                if (_buffer[byteIndex] & (1 << bit)) {
+                    // Escribir un 1: pulso corto, el único tramo en el que esperamos dentro de la interrupción
+                    DriveLow();
+                    delayMicroseconds(ONEWIRE_WRITE_ONE_LOW);
+                    Release();
+                    Schedule(ONEWIRE_WRITE_ONE_HIGH);
+                } else {
+                    // Escribir un 0: el pulso largo lo mide el timer
+                    DriveLow();
+                    _phase = ONEWIRE_PHASE_WRITE_ZERO_RELEASE;
+                    Schedule(ONEWIRE_WRITE_ZERO_LOW);
+                }
+            } else {
+                // Slot de lectura, hay que muestrear el bus unos pocos microsegundos después del pulso
+                DriveLow();
+                delayMicroseconds(ONEWIRE_READ_LOW);
+                Release();
+                delayMicroseconds(ONEWIRE_READ_SAMPLE);
+                if (ReadPin())
+                    _buffer[byteIndex] |= (1 << bit);
+                Schedule(ONEWIRE_READ_RECOVERY);
+            }
+            break;
+        }
+    }
+}
+
+void OneWireAsync::DriveLow() {
+    *_outputReg &= ~_bitMask;
+    *_modeReg |= _bitMask;
+}
+
+void OneWireAsync::Release() {
+    // El bus vuelve a nivel alto gracias a la resistencia de pull-up externa
+    *_modeReg &= ~_bitMask;
+}
+
+bool OneWireAsync::ReadPin() {
+    return (*_inputReg & _bitMask) != 0;
+}
+
+void OneWireAsync::Schedule(uint16_t us) {
+    OCR1A = (us * ONEWIRE_TICKS_PER_US) - 1;
+    TCNT1 = 0;
+}
+
+void OneWireAsync::Finish(OneWireStatus status) {
+    TIMSK1 &= ~_BV(OCIE1A);
+    Release();
+    _status = status;
+}
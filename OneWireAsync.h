@@ -0,0 +1,85 @@
+/*
+ * OneWireAsync
+ *
+ * Implementación del protocolo OneWire completamente asíncrona. Cada slot de bit (reset, escritura o lectura)
+ * se ejecuta desde la interrupción de comparación del Timer1, así que una transacción completa (por ejemplo
+ * reset + match ROM + READSCRATCH + 9 bytes) termina en segundo plano sin bloquear el loop.
+ *
+ * Sólo las partes del slot que necesitan precisión de microsegundos (pulsos de 1-15us) se hacen dentro de la
+ * interrupción, el resto de tiempos los mide el timer. La interrupción más larga (slot de lectura) dura unos 15us,
+ * que es el máximo retraso que puede ver el interrupt de encendido por culpa del bus OneWire.
+ *
+ * OJO: el Timer1 queda reservado para este motor (los pines PWM 11 y 12 no se pueden usar con analogWrite()).
+ */
+
+#ifndef __ONEWIRE_ASYNC__H__
+#define __ONEWIRE_ASYNC__H__
+
+#define ONEWIRE_BUFFER_SIZE     16    // Máximo de bytes a escribir/leer en una misma transacción
+#define ONEWIRE_TICKS_PER_US    2     // Timer1 con prescaler 8 -> 0.5us por tick
+
+// Tiempos del protocolo OneWire, en microsegundos
+#define ONEWIRE_RESET_LOW       480
+#define ONEWIRE_PRESENCE_WAIT   70
+#define ONEWIRE_RESET_RECOVERY  410
+#define ONEWIRE_WRITE_ONE_LOW   6
+#define ONEWIRE_WRITE_ONE_HIGH  64
+#define ONEWIRE_WRITE_ZERO_LOW  60
+#define ONEWIRE_WRITE_ZERO_HIGH 10
+#define ONEWIRE_READ_LOW        3
+#define ONEWIRE_READ_SAMPLE     10
+#define ONEWIRE_READ_RECOVERY   53
+
+enum OneWireStatus {
+    ONEWIRE_IDLE        = 0, // Bus libre, se puede iniciar una transacción
+    ONEWIRE_BUSY        = 1, // Transacción en curso
+    ONEWIRE_DONE        = 2, // Transacción completada, los datos leídos están disponibles hasta llamar a Release()
+    ONEWIRE_NO_PRESENCE = 3  // Ningún dispositivo ha respondido al reset
+};
+
+enum OneWirePhase {
+    ONEWIRE_PHASE_RESET_RELEASE,
+    ONEWIRE_PHASE_RESET_SAMPLE,
+    ONEWIRE_PHASE_RESET_END,
+    ONEWIRE_PHASE_NEXT_SLOT,
+    ONEWIRE_PHASE_WRITE_ZERO_RELEASE
+};
+
+class OneWireAsync {
+    // Registros del pin del bus activo
+    volatile uint8_t *_inputReg;
+    volatile uint8_t *_modeReg;
+    volatile uint8_t *_outputReg;
+    uint8_t _bitMask;
+
+    uint8_t _buffer[ONEWIRE_BUFFER_SIZE]; // Primero los bytes a escribir, a continuación se guardan los bytes leídos
+    uint8_t _writeLength;
+    uint8_t _readLength;
+    uint8_t _bitIndex;
+    volatile OneWireStatus _status;
+    volatile OneWirePhase _phase;
+
+    void DriveLow();
+    void Release();
+    bool ReadPin();
+    void Schedule(uint16_t us);
+    void Finish(OneWireStatus status);
+
+  public:
+    OneWireAsync();
+
+    // Inicia una transacción (reset + escritura + lectura) en el pin indicado.
+    // Devuelve false si el bus no está libre (ocupado o con un resultado pendiente de recoger).
+    bool Start(uint8_t pin, const uint8_t *data, uint8_t writeLength, uint8_t readLength);
+    // Libera el resultado de la última transacción para poder iniciar otra
+    void Free();
+    OneWireStatus GetStatus() { return _status; };
+    bool IsBusy() { return _status == ONEWIRE_BUSY; };
+    // Bytes leídos en la última transacción
+    const uint8_t* GetReadBuffer() { return _buffer + _writeLength; };
+
+    // Función llamada desde la interrupción del Timer1
+    void TimerEvent();
+};
+
+#endif
@@ -0,0 +1,121 @@
+/*
+ * SafetyGuard
+ *
+ * Vía rápida de las acciones de seguridad, ver SafetyGuard.h
+ */
+
+#include <stdint.h>
+#include <OneWire.h>
+#include "EEPROMManager.h"
+#include "OneWireAsync.h"
+#include "AnalogSampler.h"
+#include "DataManager.h"
+#include "DataMonitor.h"
+#include "SafetyGuard.h"
+
+SafetyGuard::SafetyGuard() {
+    _mapSwitchReg = NULL;
+    _mapSwitchMask = 0;
+    _intakeReg = NULL;
+    _intakeMask = 0;
+    _exhaustReg = NULL;
+    _exhaustMask = 0;
+    _isCamsControlEnabled = false;
+    _lastEdgeMicros = 0;
+    _lastInterval = 0;
+    _overRevEvents = 0;
+    _ticks = 0;
+    _activeTrips = SAFETY_TRIP_NONE;
+    _latchedTrips = SAFETY_TRIP_NONE;
+    _tripCount = 0;
+    _lastReactionMicros = 0;
+    _maxReactionMicros = 0;
+}
+
+void SafetyGuard::Begin(uint8_t mapSwitchPin, uint8_t intakePin, uint8_t exhaustPin, bool controlCams) {
+    noInterrupts();
+    _mapSwitchReg = portOutputRegister(digitalPinToPort(mapSwitchPin));
+    _mapSwitchMask = digitalPinToBitMask(mapSwitchPin);
+    _intakeReg = portOutputRegister(digitalPinToPort(intakePin));
+    _intakeMask = digitalPinToBitMask(intakePin);
+    _exhaustReg = portOutputRegister(digitalPinToPort(exhaustPin));
+    _exhaustMask = digitalPinToBitMask(exhaustPin);
+    _isCamsControlEnabled = controlCams;
+    interrupts();
+}
+
+void SafetyGuard::IgnitionEvent(uint32_t currentMicros, uint32_t interval) {
+    // Los encendidos descartados por la ventana de predicción (ruido) no cuentan, ni siquiera como señal presente
+    if (!SAFETY_GUARD_ENABLED || !interval)
+        return;
+
+    _lastEdgeMicros = currentMicros;
+    _lastInterval = interval;
+    _activeTrips &= ~SAFETY_TRIP_SIGNAL_LOSS;
+
+    if (interval < SAFETY_OVERREV_INTERVAL) {
+        if (_overRevEvents < SAFETY_OVERREV_EVENTS && ++_overRevEvents == SAFETY_OVERREV_EVENTS)
+            Trip(SAFETY_TRIP_OVERREV, currentMicros);
+    } else {
+        _overRevEvents = 0;
+        _activeTrips &= ~SAFETY_TRIP_OVERREV;
+    }
+}
+
+void SafetyGuard::Tick(bool isOilPressureLow) {
+    // Sólo vigilamos con el motor a régimen alto (y con referencia de encendido)
+    uint32_t interval = _lastInterval;
+    if (!SAFETY_GUARD_ENABLED || !interval || interval > SAFETY_HIGH_RPM_INTERVAL) {
+        _activeTrips &= ~SAFETY_TRIP_OIL_PRESSURE;
+        return;
+    }
+
+    if (++_ticks >= SAFETY_SIGNAL_LOSS_TICKS) {
+        _ticks = 0;
+        if (!(_activeTrips & SAFETY_TRIP_SIGNAL_LOSS)) {
+            uint32_t timeout = interval * SAFETY_SIGNAL_LOSS_INTERVALS;
+            if (timeout < SAFETY_SIGNAL_LOSS_MIN_TIME)
+                timeout = SAFETY_SIGNAL_LOSS_MIN_TIME;
+            if (micros() - _lastEdgeMicros > timeout)
+                Trip(SAFETY_TRIP_SIGNAL_LOSS, _lastEdgeMicros + timeout);
+        }
+    }
+
+    // La presión baja ya la detecta la vigilancia de transitorios en cada conversión, aquí sólo miramos el resultado
+    if (isOilPressureLow) {
+        if (!(_activeTrips & SAFETY_TRIP_OIL_PRESSURE))
+            Trip(SAFETY_TRIP_OIL_PRESSURE, micros());
+    } else {
+        _activeTrips &= ~SAFETY_TRIP_OIL_PRESSURE;
+    }
+}
+
+void SafetyGuard::Trip(SafetyTrip trip, uint32_t detectionMicros) {
+    if (!_mapSwitchReg)
+        return;
+
+    // Mapas de calle: la ECU de serie vuelve a aplicar su limitador y sus avances conservadores
+    *_mapSwitchReg &= ~_mapSwitchMask;
+    // Sin señal de RPM no sabemos dónde están las levas, así que pasamos a las de altas (relé desactivado, ver NeoVVLManager)
+    if (trip == SAFETY_TRIP_SIGNAL_LOSS && _isCamsControlEnabled) {
+        *_intakeReg |= _intakeMask;
+        *_exhaustReg |= _exhaustMask;
+    }
+
+    uint32_t reaction = micros() - detectionMicros;
+    _lastReactionMicros = reaction > 0xFFFF ? 0xFFFF : reaction;
+    if (_lastReactionMicros > _maxReactionMicros)
+        _maxReactionMicros = _lastReactionMicros;
+
+    _activeTrips |= trip;
+    _latchedTrips |= trip;
+    ++_tripCount;
+}
+
+uint8_t SafetyGuard::ConsumeTrips() {
+    noInterrupts();
+    uint8_t trips = _latchedTrips | _activeTrips;
+    _latchedTrips = SAFETY_TRIP_NONE;
+    interrupts();
+    return trips;
+}
@@ -0,0 +1,90 @@
+/*
+ * SafetyGuard
+ *
+ * Vía rápida de las acciones de seguridad. Las condiciones más graves se comprueban directamente desde las
+ * interrupciones de adquisición, y la salida de protección se activa en el mismo ISR, sin pasar por el loop
+ * (DataMonitor -> AuxManager -> SwitchMaps -> NeoVVLManager), que puede estar parado en una lectura o en un comando:
+ *
+ *   - Pasado de vueltas: desde el interrupt de encendido. Mapas de calle (limitador de serie).
+ *   - Pérdida de la señal de RPM a régimen alto: desde la interrupción del ADC (~9.6 kHz). Mapas de calle y levas de altas.
+ *   - Caída de la presión de aceite a régimen alto: desde la interrupción del ADC. Mapas de calle.
+ *
+ * El disparo queda registrado hasta que el AuxManager lo recoge con ConsumeTrips(), que a partir de ahí mantiene
+ * las salidas con su lógica normal (cooldowns, limitador, modo emergencia...).
+ *
+ * Tiempo de reacción en el peor caso (16 MHz), desde que la condición es detectable hasta que cambia el pin:
+ *   - Pasado de vueltas: ~40us desde el flanco de encendido (ISR más largo que puede retrasarlo: slot de lectura
+ *     OneWire, ~16us; CalculateRPM + la comprobación, ~20us). Hasta ~130us si justo termina una captura del
+ *     osciloscopio (StopFreeRunning() espera a la conversión en curso dentro del ISR).
+ *   - Pérdida de señal: el plazo (SAFETY_SIGNAL_LOSS_INTERVALS intervalos, mínimo SAFETY_SIGNAL_LOSS_MIN_TIME)
+ *     más ~1.1ms: SAFETY_SIGNAL_LOSS_TICKS conversiones y el hueco máximo entre interrupciones del ADC (~250us, un
+ *     analogRead() normal esperando a la conversión en curso). Tick() corre con cada conversión (~9.6 kHz), así que
+ *     sólo llama a micros() en esa comprobación, para no retrasar a los ISR del encendido y del limitador.
+ *   - Presión de aceite: ~650us desde el inicio de la caída (TRANSIENT_MIN_SAMPLES conversiones más el mismo hueco),
+ *     ~1.1ms con el osciloscopio armado, que alterna sus conversiones con las de la presión.
+ * El tiempo real medido en el ISR se guarda en GetLastReactionMicros()/GetMaxReactionMicros() para verificarlo en el coche.
+ */
+
+#ifndef __SAFETY_GUARD__H__
+#define __SAFETY_GUARD__H__
+
+#define SAFETY_GUARD_ENABLED          true
+// Intervalos entre encendidos (us) equivalentes a las RPM de los límites del DataMonitor. RPM = 30.000.000 / intervalo
+#define SAFETY_OVERREV_INTERVAL       (30000000UL / EMERGENCY_REV_LIMITER)        // ~3529us a 8500 RPM
+#define SAFETY_HIGH_RPM_INTERVAL      (30000000UL / ENGINE_OIL_PRESS_RPM_CHECK)   // 7500us a 4000 RPM
+#define SAFETY_OVERREV_EVENTS         2      // Intervalos seguidos por encima del límite para disparar (un único intervalo puede ser ruido)
+#define SAFETY_SIGNAL_LOSS_INTERVALS  4      // Sin encendidos durante 4 intervalos a régimen alto, la señal se ha perdido (el motor no puede pararse tan rápido)
+#define SAFETY_SIGNAL_LOSS_MIN_TIME   5000   // Plazo mínimo (us) para la pérdida de señal
+#define SAFETY_SIGNAL_LOSS_TICKS      8      // La pérdida de señal (micros()) se comprueba cada 8 interrupciones del ADC, ~0.8ms
+
+// Disparos (máscara de bits)
+enum SafetyTrip {
+    SAFETY_TRIP_NONE         = 0,
+    SAFETY_TRIP_OVERREV      = 1,
+    SAFETY_TRIP_SIGNAL_LOSS  = 2,
+    SAFETY_TRIP_OIL_PRESSURE = 4
+};
+
+class SafetyGuard {
+    // Registros de los pines de salida, para cambiarlos en pocos ciclos desde el ISR
+    volatile uint8_t *_mapSwitchReg;
+    uint8_t _mapSwitchMask;
+    volatile uint8_t *_intakeReg;
+    uint8_t _intakeMask;
+    volatile uint8_t *_exhaustReg;
+    uint8_t _exhaustMask;
+    bool _isCamsControlEnabled;       // En el modo fail safe las levas no se tocan
+
+    volatile uint32_t _lastEdgeMicros;    // Último encendido aceptado por la ventana de predicción
+    volatile uint32_t _lastInterval;      // Último intervalo aceptado, 0 = sin referencia
+    volatile uint8_t _overRevEvents;      // Intervalos seguidos por encima del límite
+    uint8_t _ticks;                       // Interrupciones del ADC desde la última comprobación de la pérdida de señal
+    volatile uint8_t _activeTrips;        // Condiciones que se cumplen ahora mismo
+    volatile uint8_t _latchedTrips;       // Disparos pendientes de recoger por el AuxManager
+    volatile uint16_t _tripCount;         // Disparos desde el arranque
+    volatile uint16_t _lastReactionMicros;
+    volatile uint16_t _maxReactionMicros;
+
+    void Trip(SafetyTrip trip, uint32_t detectionMicros);
+
+  public:
+    SafetyGuard();
+
+    // Configura los pines de salida. Hay que llamarla después de que el AuxManager y el NeoVVLManager los configuren
+    void Begin(uint8_t mapSwitchPin, uint8_t intakePin, uint8_t exhaustPin, bool controlCams);
+
+    // Funciones llamadas desde las interrupciones
+    void IgnitionEvent(uint32_t currentMicros, uint32_t interval); // Interrupt de encendido, intervalo aceptado (0 si no se ha aceptado)
+    void Tick(bool isOilPressureLow);                              // ADC
+
+    // Devuelve los disparos desde la última llamada, y los que siguen activos
+    uint8_t ConsumeTrips();
+    uint8_t GetActiveTrips() { return _activeTrips; };
+    // Hay disparos activos o sin recoger (el pin de los mapas tiene que seguir en calle)
+    bool HasPendingTrips() { return (_activeTrips | _latchedTrips) != SAFETY_TRIP_NONE; };
+    uint16_t GetTripCount() { return _tripCount; };
+    uint16_t GetLastReactionMicros() { return _lastReactionMicros; };
+    uint16_t GetMaxReactionMicros() { return _maxReactionMicros; };
+};
+
+#endif
@@ -0,0 +1,197 @@
+/*
+ * SensorRegistry
+ *
+ * Registro genérico de sensores secundarios, ver SensorRegistry.h
+ */
+
+#include <stdint.h>
+#include <OneWire.h>
+#include "EEPROMManager.h"
+#include "OneWireAsync.h"
+#include "AnalogSampler.h"
+#include "DataManager.h"
+#include "DataMonitor.h"
+#include "SensorRegistry.h"
+
+// Conversiones de valores raw a unidades
+static float ConvertFuelPressure(int16_t raw) {
+    // Sensor lineal de 0.5v @0 bares -> 4.5v @7 bares. Por debajo de 0.25v el sensor está desconectado
+    float value = (float) raw * ANALOG_TO_VOLTS;
+    if (value < 0.25)
+        return NAN;
+    return (value - 0.5) * 7.0 / 4.0;
+}
+
+static float ConvertCoolantTemp(int16_t raw) {
+    // NTC con resistencia de pull-up, ecuación beta. En los extremos el sensor está desconectado o en corto
+    if (raw <= 5 || raw >= 1018)
+        return NAN;
+    float resistance = COOLANT_NTC_PULLUP * raw / (1023.0 - raw);
+    return 1.0 / ((1.0 / 298.15) + (log(resistance / COOLANT_NTC_R25) / COOLANT_NTC_BETA)) - 273.15;
+}
+
+static float ConvertEGT(int16_t raw) {
+    // El MAX31855 devuelve la temperatura en pasos de 0.25 Cº
+    return raw * 0.25;
+}
+
+// Tabla de sensores. Para añadir un sensor nuevo basta con añadir su id a SensorId y su entrada aquí.
+static const SensorDefinition SENSOR_DEFINITIONS[SENSOR_COUNT] = {
+    // SENSOR_FUEL_PRESSURE (bares)
+    { SENSOR_SOURCE_ANALOG, INPUT_FUEL_PRESSURE, 50, ConvertFuelPressure, 64, true,
+      SENSOR_NO_LOW_LIMIT, 2.0, 2.5, 4.0, 4.5, 0, 100 },
+    // SENSOR_COOLANT_TEMP (Cº)
+    { SENSOR_SOURCE_ANALOG, INPUT_COOLANT_TEMP, 500, ConvertCoolantTemp, 128, false,
+      70.0, SENSOR_NO_LOW_LIMIT, SENSOR_NO_LOW_LIMIT, 100.0, 108.0, 1, 10 },
+    // SENSOR_EGT (Cº). El MAX31855 tarda 100ms en cada conversión, no tiene sentido leerlo más rápido
+    { SENSOR_SOURCE_MAX31855, OUTPUT_EGT_CS, 250, ConvertEGT, SENSOR_FILTER_NONE, true,
+      SENSOR_NO_LOW_LIMIT, SENSOR_NO_LOW_LIMIT, SENSOR_NO_LOW_LIMIT, 900.0, 950.0, 2, 1 }
+};
+
+SensorRegistry::SensorRegistry() {
+    _dataManager = NULL;
+    _updateMicros = 0;
+    _maxUpdateMicros = 0;
+    for (uint8_t i = 0; i < SENSOR_COUNT; ++i) {
+        _channels[i].raw = 0;
+        _channels[i].value = 0.0;
+        // Repartimos las primeras lecturas para que no coincidan todas en el mismo loop
+        _channels[i].timer = (uint32_t) SENSOR_DEFINITIONS[i].interval * i / SENSOR_COUNT;
+        _channels[i].isValid = false;
+        _channels[i].status = STATUS_OK;
+
+        if (SENSOR_DEFINITIONS[i].source == SENSOR_SOURCE_ANALOG) {
+            pinMode(SENSOR_DEFINITIONS[i].pin, INPUT);
+        } else if (SENSOR_DEFINITIONS[i].source == SENSOR_SOURCE_MAX31855) {
+            pinMode(SENSOR_DEFINITIONS[i].pin, OUTPUT);
+            digitalWrite(SENSOR_DEFINITIONS[i].pin, HIGH);
+        }
+    }
+    pinMode(OUTPUT_EGT_SCK, OUTPUT);
+    digitalWrite(OUTPUT_EGT_SCK, LOW);
+    pinMode(INPUT_EGT_MISO, INPUT);
+}
+
+void SensorRegistry::Initialize(DataManager *dataManager) {
+    _dataManager = dataManager;
+}
+
+void SensorRegistry::Update(uint32_t diff) {
+    if (!_dataManager)
+        return;
+
+    uint32_t startMicros = micros();
+    for (uint8_t i = 0; i < SENSOR_COUNT; ++i) {
+        const SensorDefinition *definition = &SENSOR_DEFINITIONS[i];
+        SensorChannel *channel = &_channels[i];
+
+        if (channel->timer < definition->interval) {
+            channel->timer += diff;
+            continue;
+        }
+        channel->timer = 0;
+
+        int16_t raw;
+        float value = NAN;
+        if (ReadRaw(definition, &raw))
+            value = definition->convert(raw);
+
+        if (isnan(value)) {
+            channel->isValid = false;
+        } else {
+            channel->raw = raw;
+            // Filtro exponencial. La primera lectura válida se toma directamente
+            if (!channel->isValid || definition->filter >= SENSOR_FILTER_NONE)
+                channel->value = value;
+            else
+                channel->value += (value - channel->value) * definition->filter / 256.0;
+            channel->isValid = true;
+        }
+        UpdateStatus(definition, channel);
+    }
+
+    _updateMicros = micros() - startMicros;
+    if (_updateMicros > _maxUpdateMicros)
+        _maxUpdateMicros = _updateMicros;
+}
+
+bool SensorRegistry::ReadRaw(const SensorDefinition *definition, int16_t *raw) {
+    switch (definition->source) {
+        case SENSOR_SOURCE_ANALOG:
+            *raw = _dataManager->ReadAnalog(definition->pin);
+            return true;
+        case SENSOR_SOURCE_MAX31855: {
+            int16_t value = ReadMAX31855(definition->pin);
+            if (value == INT16_MIN)
+                return false;
+            *raw = value;
+            return true;
+        }
+        default:
+            return false;
+    }
+}
+
+int16_t SensorRegistry::ReadMAX31855(uint8_t csPin) {
+    // Accedemos directamente a los registros de los pines, con digitalWrite/digitalRead los 32 bits tardan demasiado
+    volatile uint8_t *sckReg = portOutputRegister(digitalPinToPort(OUTPUT_EGT_SCK));
+    uint8_t sckMask = digitalPinToBitMask(OUTPUT_EGT_SCK);
+    volatile uint8_t *misoReg = portInputRegister(digitalPinToPort(INPUT_EGT_MISO));
+    uint8_t misoMask = digitalPinToBitMask(INPUT_EGT_MISO);
+
+    // El MAX31855 saca el bit 31 al bajar el chip select, y el resto con cada flanco de bajada del reloj
+    uint32_t data = 0;
+    digitalWrite(csPin, LOW);
+    delayMicroseconds(1);
+    for (uint8_t i = 0; i < 32; ++i) {
+        data <<= 1;
+        if (*misoReg & misoMask)
+            data |= 1;
+        *sckReg |= sckMask;
+        delayMicroseconds(1);
+        *sckReg &= ~sckMask;
+        delayMicroseconds(1);
+    }
+    digitalWrite(csPin, HIGH);
+
+    // Bit 16: fallo del termopar, y bits 0-2 su causa (abierto, corto a GND o a VCC). Si todo son 1 el chip no responde
+    // (MISO flotando). Todo a 0 es una lectura válida, 0 Cº en las dos uniones
+    if ((data & 0x00010007) || data == 0xFFFFFFFF)
+        return INT16_MIN;
+
+    // Bits 31-18: temperatura del termopar, 14 bits con signo
+    return (int16_t) ((int32_t) data >> 18);
+}
+
+void SensorRegistry::UpdateStatus(const SensorDefinition *definition, SensorChannel *channel) {
+    if (!channel->isValid) {
+        channel->status = STATUS_ERROR;
+        return;
+    }
+    if (definition->requiresEngineOn && !_dataManager->IsEngineOn()) {
+        channel->status = STATUS_OK;
+        return;
+    }
+
+    float value = channel->value;
+    if (value <= definition->lowDanger || value >= definition->highDanger) {
+        channel->status = STATUS_DANGER;
+    } else if (value <= definition->lowWarning || value >= definition->highWarning) {
+        channel->status = STATUS_WARNING;
+    } else if (value < definition->coldLimit) {
+        channel->status = STATUS_COLD;
+    } else {
+        channel->status = STATUS_OK;
+    }
+}
+
+const SensorDefinition* SensorRegistry::GetDefinition(SensorId id) {
+    return &SENSOR_DEFINITIONS[id];
+}
+
+float SensorRegistry::GetValue(SensorId id, bool raw) {
+    if (raw)
+        return _channels[id].raw;
+
+    return _channels[id].value;
+}
@@ -0,0 +1,101 @@
+/*
+ * SensorRegistry
+ *
+ * Registro genérico de sensores secundarios. Cada sensor se declara con una única entrada en la tabla
+ * SENSOR_DEFINITIONS (SensorRegistry.cpp): origen de la lectura, intervalo, conversión, filtro, límites y
+ * posición en la trama de telemetría extendida. Un único bucle recorre la tabla en cada Update(), así que
+ * añadir un sensor nuevo sólo requiere añadir su id al enum SensorId y su entrada en la tabla.
+ *
+ * Los sensores críticos (RPM, presión/temperatura de aceite, AFR...) siguen en el DataManager, aquí van
+ * los sensores que sólo se monitorean y se envían al TFT.
+ */
+
+#ifndef __SENSOR_REGISTRY__H__
+#define __SENSOR_REGISTRY__H__
+
+// INPUTS
+#define INPUT_FUEL_PRESSURE     A6             // Input para el sensor de presión de gasolina (0-5v analógica)
+#define INPUT_COOLANT_TEMP      A7             // Input para el sensor de temperatura del refrigerante (NTC con resistencia de pull-up)
+#define INPUT_EGT_MISO          25             // Datos del bus SPI del MAX31855 (termopar tipo K de los gases de escape)
+
+// OUTPUTS
+#define OUTPUT_EGT_CS           26             // Chip select del MAX31855
+#define OUTPUT_EGT_SCK          24             // Reloj del bus SPI del MAX31855. El SPI hardware no se puede usar, el pin 52 (SCK) es OUTPUT_MAP_SWITCH
+
+// Sensor NTC del refrigerante
+#define COOLANT_NTC_PULLUP      2490.0         // Resistencia de pull-up a 5v (ohmios)
+#define COOLANT_NTC_R25         2796.0         // Resistencia del sensor a 25 Cº (ohmios)
+#define COOLANT_NTC_BETA        3950.0         // Coeficiente beta del sensor
+
+// Valores para desactivar un límite de la tabla
+#define SENSOR_NO_LOW_LIMIT     -10000.0
+#define SENSOR_NO_HIGH_LIMIT    10000.0
+#define SENSOR_NO_TELEMETRY     0xFF           // El sensor no se envía en la trama extendida
+#define SENSOR_FILTER_NONE      256            // Peso de la lectura nueva en el filtro (x/256), 256 = sin filtrar
+
+enum SensorId {
+    SENSOR_FUEL_PRESSURE = 0,
+    SENSOR_COOLANT_TEMP  = 1,
+    SENSOR_EGT           = 2,
+    SENSOR_COUNT         = 3  // Siempre el último
+};
+
+enum SensorSource {
+    SENSOR_SOURCE_ANALOG   = 0, // Entrada analógica, leída a través del AnalogSampler del DataManager
+    SENSOR_SOURCE_MAX31855 = 1  // Conversor de termopar MAX31855 por SPI (bit-bang)
+};
+
+// Entrada de la tabla de sensores. Todo lo que define un sensor está aquí.
+struct SensorDefinition {
+    SensorSource source;
+    uint8_t pin;                       // Pin analógico o chip select
+    uint16_t interval;                 // Intervalo entre lecturas (ms)
+    float (*convert)(int16_t raw);     // Conversión del valor raw a unidades (bares, Cº...). Devuelve NAN si la lectura no es válida
+    uint16_t filter;                   // Filtro exponencial, peso de la lectura nueva (x/256)
+    bool requiresEngineOn;             // Sólo se comprueban los límites con el motor encendido
+    float coldLimit;                   // Por debajo, STATUS_COLD
+    float lowDanger;
+    float lowWarning;
+    float highWarning;
+    float highDanger;
+    uint8_t telemetrySlot;             // Posición en la trama extendida del CommsManager
+    uint8_t telemetryScale;            // El valor se envía como int16 multiplicado por este factor
+};
+
+// Estado de cada sensor en tiempo de ejecución
+struct SensorChannel {
+    int16_t raw;
+    float value;
+    uint32_t timer;
+    bool isValid;                      // Se ha obtenido al menos una lectura correcta y la última no ha fallado
+    ParameterStatus status;
+};
+
+class SensorRegistry {
+    DataManager *_dataManager; // Puntero al DataManager, para leer las entradas analógicas a través de su AnalogSampler
+
+    SensorChannel _channels[SENSOR_COUNT];
+    uint16_t _updateMicros;    // Coste del último Update() en microsegundos
+    uint16_t _maxUpdateMicros; // Coste máximo de Update() desde el arranque
+
+    bool ReadRaw(const SensorDefinition *definition, int16_t *raw);
+    int16_t ReadMAX31855(uint8_t csPin);
+    void UpdateStatus(const SensorDefinition *definition, SensorChannel *channel);
+
+  public:
+    SensorRegistry();
+
+    void Initialize(DataManager *dataManager);
+    void Update(uint32_t diff);
+
+    const SensorDefinition* GetDefinition(SensorId id);
+    float GetValue(SensorId id, bool raw = false);
+    bool IsValid(SensorId id) { return _channels[id].isValid; };
+    ParameterStatus GetStatus(SensorId id) { return _channels[id].status; };
+    uint8_t GetSensorCount() { return SENSOR_COUNT; };
+    // Coste del bucle de sondeo, para medirlo según el número de canales (modo debug)
+    uint16_t GetUpdateMicros() { return _updateMicros; };
+    uint16_t GetMaxUpdateMicros() { return _maxUpdateMicros; };
+};
+
+#endif
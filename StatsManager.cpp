@@ -0,0 +1,242 @@
+/*
+ * StatsManager
+ *
+ * Estadísticas de uso del motor persistentes en la EEPROM, ver StatsManager.h
+ */
+
+#include <stdint.h>
+#include <OneWire.h>
+#include "EEPROMManager.h"
+#include "OneWireAsync.h"
+#include "AnalogSampler.h"
+#include "DataManager.h"
+#include "DataMonitor.h"
+#include "SafetyGuard.h"
+#include "ButtonManager.h"
+#include "AuxManager.h"
+#include "NeoVVLManager.h"
+#include "StatsManager.h"
+
+StatsManager::StatsManager() {
+    _eepromManager = NULL;
+    _dataManager = NULL;
+    _dataMonitor = NULL;
+    _auxManager = NULL;
+    _neoVVLManager = NULL;
+    ResetBlock();
+    _stats.sequence = 0;
+    _slot = STATS_SLOT_COUNT - 1;
+    _flushOffset = STATS_NOT_FLUSHING;
+    _isFlushPending = false;
+    _isPaused = false;
+    _sampleTimer = 0;
+    _flushTimer = 0;
+    _wasEngineOn = false;
+    _wasLimiterEnabled = false;
+    _wasIntakeEnabled = false;
+    _wasExhaustEnabled = false;
+}
+
+void StatsManager::Initialize(EEPROMManager *eepromManager, DataManager *dataManager, DataMonitor *dataMonitor, AuxManager *auxManager, NeoVVLManager *neoVVLManager) {
+    _eepromManager = eepromManager;
+    _dataManager = dataManager;
+    _dataMonitor = dataMonitor;
+    _auxManager = auxManager;
+    _neoVVLManager = neoVVLManager;
+    if (STATS_ENABLED)
+        LoadStats();
+}
+
+void StatsManager::Update(uint32_t diff) {
+    if (!STATS_ENABLED || !_dataManager || !_dataMonitor || !_auxManager || !_neoVVLManager)
+        return;
+
+    // Mientras se envía el bloque (unos pocos ms) sólo avanza el guardado, que usa su propia copia. Las transiciones
+    // se detectan al terminar, porque el estado anterior no cambia, y la muestra pendiente se toma en cuanto acaba
+    if (_isPaused) {
+        _sampleTimer += diff;
+        UpdateFlush();
+        return;
+    }
+
+    // Las transiciones se comprueban en cada Update(), para no perder ninguna entre muestras
+    bool isEngineOn = _dataManager->IsEngineOn();
+    if (isEngineOn != _wasEngineOn) {
+        if (isEngineOn) {
+            if (_stats.sessions < 0xFFFF)
+                ++_stats.sessions;
+            _flushTimer = 0;
+        } else {
+            // Motor apagado, guardamos la sesión
+            StartFlush();
+        }
+        _wasEngineOn = isEngineOn;
+    }
+
+    bool isLimiterEnabled = _auxManager->IsLimiterEnabled();
+    if (isLimiterEnabled && !_wasLimiterEnabled && _stats.limiterHits < 0xFFFF)
+        ++_stats.limiterHits;
+    _wasLimiterEnabled = isLimiterEnabled;
+
+    bool isIntakeEnabled = _neoVVLManager->GetIntakeCamStatus() == CAM_STATUS_ENABLED;
+    if (isIntakeEnabled && !_wasIntakeEnabled && _stats.intakeCamSwitches < 0xFFFF)
+        ++_stats.intakeCamSwitches;
+    _wasIntakeEnabled = isIntakeEnabled;
+
+    bool isExhaustEnabled = _neoVVLManager->GetExhaustCamStatus() == CAM_STATUS_ENABLED;
+    if (isExhaustEnabled && !_wasExhaustEnabled && _stats.exhaustCamSwitches < 0xFFFF)
+        ++_stats.exhaustCamSwitches;
+    _wasExhaustEnabled = isExhaustEnabled;
+
+    if (_sampleTimer >= STATS_SAMPLE_INTERVAL) {
+        if (isEngineOn)
+            Sample();
+        _sampleTimer = 0;
+    } else {
+        _sampleTimer += diff;
+    }
+
+    if (isEngineOn) {
+        if (_flushTimer >= STATS_FLUSH_INTERVAL) {
+            StartFlush();
+            _flushTimer = 0;
+        } else {
+            _flushTimer += diff;
+        }
+    }
+
+    UpdateFlush();
+}
+
+void StatsManager::Sample() {
+    ++_stats.engineOnTime;
+
+    // Los valores de los sensores con error no cuentan, pero el tiempo en STATUS_ERROR sí
+    ParameterStatus status = _dataMonitor->GetEngineOilPressureStatus();
+    SampleParameter(&_stats.parameters[MONITOR_ENG_OIL_PRESSURE], _dataManager->GetEngineOilPressure(), status, status != STATUS_ERROR);
+    status = _dataMonitor->GetEngineOilTempStatus();
+    SampleParameter(&_stats.parameters[MONITOR_ENG_OIL_TEMP], _dataManager->GetEngineOilTemp(), status, status != STATUS_ERROR);
+    status = _dataMonitor->GetGearboxOilTempStatus();
+    SampleParameter(&_stats.parameters[MONITOR_GB_OIL_TEMP], _dataManager->GetGearboxOilTemp(), status, status != STATUS_ERROR);
+    // Con la sonda wideband calentándose (STATUS_COLD) el AFR no es válido
+    status = _dataMonitor->GetAFRStatus();
+    SampleParameter(&_stats.parameters[MONITOR_AFR], _dataManager->GetAFR(), status, status != STATUS_ERROR && status != STATUS_COLD);
+    status = _dataMonitor->GetVoltageStatus();
+    SampleParameter(&_stats.parameters[MONITOR_VOLTAGE], _dataManager->GetVoltage(), status, status != STATUS_ERROR);
+
+    uint32_t rpm = _dataManager->GetRPM();
+    if (rpm > _stats.maxRPM)
+        _stats.maxRPM = rpm > 0xFFFF ? 0xFFFF : rpm;
+    // El mínimo de la ventana del ADC incluye las caídas cortas entre muestras
+    if (rpm >= ENGINE_OIL_PRESS_RPM_CHECK && _dataMonitor->GetEngineOilPressureStatus() != STATUS_ERROR) {
+        int16_t pressure = _dataMonitor->GetOilPressureWindowMin() * STATS_VALUE_SCALE;
+        if (pressure < _stats.minOilPressureHighRPM)
+            _stats.minOilPressureHighRPM = pressure;
+    }
+}
+
+void StatsManager::SampleParameter(ParameterStats *parameter, float value, ParameterStatus status, bool isValid) {
+    if (status >= STATUS_OK && status <= STATUS_ERROR)
+        ++parameter->timeInStatus[status - STATUS_OK];
+    if (!isValid)
+        return;
+
+    int16_t scaled = value * STATS_VALUE_SCALE;
+    if (scaled < parameter->min)
+        parameter->min = scaled;
+    if (scaled > parameter->max)
+        parameter->max = scaled;
+    ++parameter->samples;
+    parameter->mean += (value - parameter->mean) / parameter->samples;
+}
+
+void StatsManager::Reset() {
+    // Mantenemos la secuencia, para que el bloque vacío sea el más reciente
+    uint16_t sequence = _stats.sequence;
+    ResetBlock();
+    _stats.sequence = sequence;
+    StartFlush();
+}
+
+void StatsManager::ResetBlock() {
+    _stats.magic = STATS_MAGIC;
+    _stats.sessions = 0;
+    _stats.engineOnTime = 0;
+    for (uint8_t i = 0; i < MONITOR_PARAMETER_COUNT; ++i) {
+        ParameterStats *parameter = &_stats.parameters[i];
+        parameter->min = INT16_MAX;
+        parameter->max = INT16_MIN;
+        parameter->mean = 0.0;
+        parameter->samples = 0;
+        for (uint8_t j = 0; j < STATS_STATUS_COUNT; ++j) {
+            parameter->timeInStatus[j] = 0;
+        }
+    }
+    _stats.minOilPressureHighRPM = INT16_MAX;
+    _stats.maxRPM = 0;
+    _stats.limiterHits = 0;
+    _stats.intakeCamSwitches = 0;
+    _stats.exhaustCamSwitches = 0;
+    _stats.checksum = 0;
+}
+
+void StatsManager::LoadStats() {
+    // Buscamos la posición válida con la secuencia más reciente. _flushBlock sirve de buffer temporal
+    bool isFound = false;
+    for (uint8_t slot = 0; slot < STATS_SLOT_COUNT; ++slot) {
+        _eepromManager->LoadBytesFromEEPROM(GetSlotAddress(slot, 0), (uint8_t*) &_flushBlock, sizeof(StatsBlock));
+        if (_flushBlock.magic != STATS_MAGIC || _flushBlock.checksum != CalculateChecksum(&_flushBlock))
+            continue;
+        // Comparación con signo, por si la secuencia ha dado la vuelta
+        if (!isFound || (int16_t) (_flushBlock.sequence - _stats.sequence) > 0) {
+            _stats = _flushBlock;
+            _slot = slot;
+            isFound = true;
+        }
+    }
+}
+
+void StatsManager::StartFlush() {
+    if (IsFlushing()) {
+        _isFlushPending = true;
+        return;
+    }
+
+    ++_stats.sequence;
+    _stats.checksum = CalculateChecksum(&_stats);
+    _flushBlock = _stats;
+    _slot = (_slot + 1) % STATS_SLOT_COUNT;
+    _flushOffset = 0;
+    _isFlushPending = false;
+}
+
+void StatsManager::UpdateFlush() {
+    if (!IsFlushing()) {
+        if (_isFlushPending)
+            StartFlush();
+        return;
+    }
+
+    // EEPROM.update() no escribe los bytes que no cambian, así que avanzamos hasta el primero que empieza
+    // una escritura. El siguiente Update() sigue cuando la EEPROM termine, sin esperarla.
+    const uint8_t *data = (const uint8_t*) &_flushBlock;
+    while (_flushOffset < sizeof(StatsBlock) && _eepromManager->IsEEPROMReady()) {
+        _eepromManager->SaveBytesToEEPROM(GetSlotAddress(_slot, _flushOffset), &data[_flushOffset], 1);
+        ++_flushOffset;
+    }
+    if (_flushOffset >= sizeof(StatsBlock))
+        _flushOffset = STATS_NOT_FLUSHING;
+}
+
+uint8_t StatsManager::CalculateChecksum(const StatsBlock *block) {
+    const uint8_t *data = (const uint8_t*) block;
+    uint8_t checksum = 0;
+    for (uint8_t i = 0; i < offsetof(StatsBlock, checksum); ++i) {
+        checksum += data[i];
+    }
+    return checksum;
+}
+
+EEPROMDataAddress StatsManager::GetSlotAddress(uint8_t slot, uint8_t offset) {
+    return (EEPROMDataAddress) (ADDR_STATS + slot * STATS_SLOT_SIZE + offset);
+}
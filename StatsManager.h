@@ -0,0 +1,99 @@
+/*
+ * StatsManager
+ *
+ * Estadísticas de uso del motor acumuladas entre sesiones (hasta que se borran con "stats reset;"): mínimo, máximo,
+ * media y tiempo en cada ParameterStatus de cada parámetro del DataMonitor, presión de aceite mínima a régimen alto,
+ * RPM máximas, entradas al limitador y cambios de levas. Cada muestra cuesta lo mismo (O(1)), sin buffers.
+ *
+ * El bloque se guarda en la EEPROM en un anillo de STATS_SLOT_COUNT posiciones: cada guardado va a la siguiente
+ * posición con un número de secuencia mayor, y al arrancar se carga la más reciente con el checksum correcto.
+ * Así cada posición se escribe 1/STATS_SLOT_COUNT de las veces, y si se corta la corriente a mitad de un guardado
+ * queda la anterior. La escritura es incremental: como mucho un byte por Update() (~3.3ms por byte en segundo plano),
+ * sin bloquear el loop. Se guarda al apagar el motor y cada STATS_FLUSH_INTERVAL con el motor encendido, por si
+ * se quita el contacto directamente.
+ *
+ * Consulta binaria por Serial1 con "stats;", ver CommsManager.h.
+ */
+
+#ifndef __STATS_MANAGER__H__
+#define __STATS_MANAGER__H__
+
+#define STATS_ENABLED                  true
+#define STATS_SAMPLE_INTERVAL          100     // Una muestra cada 0.1 segundos con el motor encendido
+#define STATS_FLUSH_INTERVAL           300000  // Guardado periódico cada 5 minutos con el motor encendido
+#define STATS_SLOT_COUNT               10      // Posiciones del anillo en la EEPROM
+#define STATS_SLOT_SIZE                192     // Bytes reservados por posición (>= sizeof(StatsBlock))
+#define STATS_MAGIC                    0x53    // Marca de bloque válido ('S')
+#define STATS_STATUS_COUNT             5       // ParameterStatus, de STATUS_OK a STATUS_ERROR
+#define STATS_VALUE_SCALE              100     // Mínimos y máximos guardados como int16 (valor * 100)
+#define STATS_NOT_FLUSHING             0xFF
+
+// Estadísticas de un parámetro. Los tiempos en número de muestras (STATS_SAMPLE_INTERVAL)
+struct ParameterStats {
+    int16_t min;                                  // Valor * STATS_VALUE_SCALE
+    int16_t max;
+    float mean;                                   // Media acumulada, mean += (valor - mean) / muestras
+    uint32_t samples;                             // Muestras con un valor válido (sensor sin error)
+    uint32_t timeInStatus[STATS_STATUS_COUNT];    // Muestras en cada ParameterStatus (índice = estado - 1)
+};
+
+// Bloque que se guarda en la EEPROM (180 bytes en el AVR, sin relleno entre campos)
+struct StatsBlock {
+    uint8_t magic;
+    uint16_t sequence;                            // Número de guardado, la posición con el mayor es la más reciente
+    uint16_t sessions;                            // Arranques del motor
+    uint32_t engineOnTime;                        // Muestras con el motor encendido
+    ParameterStats parameters[MONITOR_PARAMETER_COUNT];
+    int16_t minOilPressureHighRPM;                // Presión mínima por encima de ENGINE_OIL_PRESS_RPM_CHECK (* STATS_VALUE_SCALE)
+    uint16_t maxRPM;
+    uint16_t limiterHits;                         // Entradas al limitador del AuxManager
+    uint16_t intakeCamSwitches;                   // Cambios a las levas de altas
+    uint16_t exhaustCamSwitches;
+    uint8_t checksum;                             // Suma de todos los bytes anteriores
+};
+static_assert(sizeof(StatsBlock) <= STATS_SLOT_SIZE, "StatsBlock no cabe en STATS_SLOT_SIZE, las posiciones se solaparían");
+
+class StatsManager {
+    EEPROMManager *_eepromManager;
+    DataManager *_dataManager;
+    DataMonitor *_dataMonitor;
+    AuxManager *_auxManager;
+    NeoVVLManager *_neoVVLManager;
+
+    StatsBlock _stats;
+    StatsBlock _flushBlock;       // Copia que se está escribiendo, para que el checksum coincida aunque siga el muestreo
+    uint8_t _slot;                // Posición del último guardado
+    uint8_t _flushOffset;         // Siguiente byte a escribir, STATS_NOT_FLUSHING si no hay guardado en curso
+    bool _isFlushPending;         // Se ha pedido un guardado mientras había otro en curso
+    bool _isPaused;               // El CommsManager está enviando el bloque, no se modifica
+    uint32_t _sampleTimer;
+    uint32_t _flushTimer;
+    // Estado anterior, para contar transiciones
+    bool _wasEngineOn;
+    bool _wasLimiterEnabled;
+    bool _wasIntakeEnabled;
+    bool _wasExhaustEnabled;
+
+    void LoadStats();
+    void ResetBlock();
+    void Sample();
+    void SampleParameter(ParameterStats *parameter, float value, ParameterStatus status, bool isValid);
+    void StartFlush();
+    void UpdateFlush();
+    uint8_t CalculateChecksum(const StatsBlock *block);
+    EEPROMDataAddress GetSlotAddress(uint8_t slot, uint8_t offset);
+
+  public:
+    StatsManager();
+
+    void Initialize(EEPROMManager *eepromManager, DataManager *dataManager, DataMonitor *dataMonitor, AuxManager *auxManager, NeoVVLManager *neoVVLManager);
+    void Update(uint32_t diff);
+
+    // Borra las estadísticas acumuladas (se guarda un bloque vacío)
+    void Reset();
+    const StatsBlock* GetStats() { return &_stats; };
+    bool IsFlushing() { return _flushOffset != STATS_NOT_FLUSHING; };
+    void SetPaused(bool isPaused) { _isPaused = isPaused; };
+};
+
+#endif
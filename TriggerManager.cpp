@@ -0,0 +1,358 @@
+/*
+ * TriggerManager
+ *
+ * Intérprete de las condiciones de diagnóstico definidas por el usuario, ver TriggerManager.h
+ */
+
+#include <stdint.h>
+#include <OneWire.h>
+#include "EEPROMManager.h"
+#include "OneWireAsync.h"
+#include "AnalogSampler.h"
+#include "DataManager.h"
+#include "DataMonitor.h"
+#include "SafetyGuard.h"
+#include "ButtonManager.h"
+#include "AuxManager.h"
+#include "NeoVVLManager.h"
+#include "TriggerManager.h"
+
+TriggerManager::TriggerManager() {
+    _eepromManager = NULL;
+    _dataManager = NULL;
+    _dataMonitor = NULL;
+    _auxManager = NULL;
+    _neoVVLManager = NULL;
+    _triggerCount = 0;
+    _programLength = 0;
+    _programChecksum = 0;
+    _storeIndex = TRIGGER_NOT_STORING;
+    for (uint8_t i = 0; i < TRIGGER_INPUT_COUNT; ++i) {
+        _inputs[i] = 0;
+        _lastInputs[i] = 0;
+    }
+    _hasInputs = false;
+    _nextTrigger = 0;
+    _pendingEvents = 0;
+    _roundTimer = 0;
+    _roundDiff = 0;
+    _maxUpdateMicros = 0;
+}
+
+void TriggerManager::Initialize(EEPROMManager *eepromManager, DataManager *dataManager, DataMonitor *dataMonitor, AuxManager *auxManager, NeoVVLManager *neoVVLManager) {
+    _eepromManager = eepromManager;
+    _dataManager = dataManager;
+    _dataMonitor = dataMonitor;
+    _auxManager = auxManager;
+    _neoVVLManager = neoVVLManager;
+    LoadProgram();
+}
+
+void TriggerManager::Update(uint32_t diff) {
+    if (!_dataManager || !_dataMonitor || !_auxManager || !_neoVVLManager)
+        return;
+
+    UpdateStore();
+
+    _roundTimer += diff;
+    if (!_triggerCount)
+        return;
+
+    uint32_t startMicros = micros();
+    if (_nextTrigger == 0) {
+        ReadInputs();
+        _roundDiff = _roundTimer;
+        _roundTimer = 0;
+    }
+
+    // Evaluamos triggers hasta agotar el presupuesto de instrucciones. El resto de la ronda sigue en el próximo Update()
+    uint8_t budget = TRIGGER_INSTRUCTION_BUDGET;
+    while (_nextTrigger < _triggerCount) {
+        Trigger *trigger = &_triggers[_nextTrigger];
+        if (trigger->codeLength > budget)
+            break;
+        budget -= trigger->codeLength;
+
+        if (Evaluate(trigger)) {
+            if (trigger->isTrue) {
+                trigger->holdTimer += _roundDiff;
+            } else {
+                trigger->isTrue = true;
+                trigger->holdTimer = 0;
+            }
+            // Cada vez que se cumple cuenta una sola vez, hasta que deje de cumplirse
+            if (!trigger->isMatched && trigger->holdTimer >= trigger->holdTime) {
+                trigger->isMatched = true;
+                if ((trigger->actions & TRIGGER_ACTION_COUNT) && trigger->counter < 0xFFFF)
+                    ++trigger->counter;
+                if (trigger->actions & TRIGGER_ACTION_EVENT)
+                    _pendingEvents |= 1 << _nextTrigger;
+            }
+        } else {
+            trigger->isTrue = false;
+            trigger->isMatched = false;
+        }
+        ++_nextTrigger;
+    }
+    if (_nextTrigger >= _triggerCount)
+        _nextTrigger = 0;
+
+    uint32_t updateMicros = micros() - startMicros;
+    if (updateMicros > _maxUpdateMicros)
+        _maxUpdateMicros = updateMicros;
+}
+
+void TriggerManager::ReadInputs() {
+    for (uint8_t i = 0; i < TRIGGER_INPUT_COUNT; ++i) {
+        _lastInputs[i] = _inputs[i];
+    }
+
+    uint32_t rpm = _dataManager->GetRPM();
+    _inputs[TRIGGER_INPUT_RPM] = rpm > 0x7FFF ? 0x7FFF : (int16_t) rpm;
+    _inputs[TRIGGER_INPUT_OIL_PRESSURE] = (int16_t) (_dataManager->GetEngineOilPressure() * 100);
+    _inputs[TRIGGER_INPUT_ENG_OIL_TEMP] = (int16_t) (_dataManager->GetEngineOilTemp() * 10);
+    _inputs[TRIGGER_INPUT_GB_OIL_TEMP] = (int16_t) (_dataManager->GetGearboxOilTemp() * 10);
+    _inputs[TRIGGER_INPUT_AFR] = (int16_t) (_dataManager->GetAFR() * 100);
+    _inputs[TRIGGER_INPUT_VOLTAGE] = (int16_t) (_dataManager->GetVoltage() * 100);
+    _inputs[TRIGGER_INPUT_TPS] = _dataManager->GetTPS();
+    _inputs[TRIGGER_INPUT_INTAKE_CAM] = _neoVVLManager->GetIntakeCamStatus() == CAM_STATUS_ENABLED;
+    _inputs[TRIGGER_INPUT_EXHAUST_CAM] = _neoVVLManager->GetExhaustCamStatus() == CAM_STATUS_ENABLED;
+    _inputs[TRIGGER_INPUT_ECU_MAP] = _auxManager->GetCurrentECUMap();
+    _inputs[TRIGGER_INPUT_ENGINE_ON] = _dataManager->IsEngineOn();
+    _inputs[TRIGGER_INPUT_OIL_PRESS_STATUS] = _dataMonitor->GetEngineOilPressureStatus();
+
+    // En la primera ronda no hay valores anteriores, las diferencias empiezan en 0
+    if (!_hasInputs) {
+        for (uint8_t i = 0; i < TRIGGER_INPUT_COUNT; ++i) {
+            _lastInputs[i] = _inputs[i];
+        }
+        _hasInputs = true;
+    }
+}
+
+bool TriggerManager::Evaluate(Trigger *trigger) {
+    // El código ya está validado, no hace falta comprobar la pila ni los índices
+    int16_t stack[TRIGGER_STACK_SIZE];
+    uint8_t top = 0;
+    const uint8_t *code = &_program[trigger->codeOffset];
+    uint8_t index = 0;
+    while (index < trigger->codeLength) {
+        uint8_t op = code[index++];
+        int32_t result;
+        switch (op) {
+            case TRIGGER_OP_CONST:
+                stack[top++] = (int16_t) (code[index] | (code[index + 1] << 8));
+                index += 2;
+                continue;
+            case TRIGGER_OP_INPUT:
+                stack[top++] = _inputs[code[index++]];
+                continue;
+            case TRIGGER_OP_DELTA:
+                result = (int32_t) _inputs[code[index]] - _lastInputs[code[index]];
+                ++index;
+                break;
+            case TRIGGER_OP_ABS:
+                result = stack[--top];
+                if (result < 0)
+                    result = -result;
+                break;
+            case TRIGGER_OP_NOT:
+                result = !stack[--top];
+                break;
+            default: {
+                // Operaciones binarias
+                int16_t b = stack[--top];
+                int16_t a = stack[--top];
+                switch (op) {
+                    case TRIGGER_OP_ADD: result = (int32_t) a + b; break;
+                    case TRIGGER_OP_SUB: result = (int32_t) a - b; break;
+                    case TRIGGER_OP_LT:  result = a < b; break;
+                    case TRIGGER_OP_LE:  result = a <= b; break;
+                    case TRIGGER_OP_GT:  result = a > b; break;
+                    case TRIGGER_OP_GE:  result = a >= b; break;
+                    case TRIGGER_OP_EQ:  result = a == b; break;
+                    case TRIGGER_OP_NE:  result = a != b; break;
+                    case TRIGGER_OP_AND: result = a && b; break;
+                    case TRIGGER_OP_OR:  result = a || b; break;
+                    default:             result = 0; break;
+                }
+                break;
+            }
+        }
+        // Saturamos en vez de desbordar
+        if (result > 0x7FFF)
+            result = 0x7FFF;
+        else if (result < -0x8000)
+            result = -0x8000;
+        stack[top++] = (int16_t) result;
+    }
+
+    return stack[0] != 0;
+}
+
+bool TriggerManager::StoreProgram(const uint8_t *program, uint8_t length) {
+    if (length > TRIGGER_PROGRAM_MAX_SIZE || !ParseProgram(program, length, false))
+        return false;
+
+    _programLength = length;
+    _programChecksum = length;
+    for (uint8_t i = 0; i < length; ++i) {
+        _program[i] = program[i];
+        _programChecksum += program[i];
+    }
+    ParseProgram(_program, length, true);
+
+    // Si ya había un guardado en curso, empieza de nuevo (borrando la marca) con el programa nuevo
+    _storeIndex = 0;
+    UpdateStore();
+    return true;
+}
+
+void TriggerManager::UpdateStore() {
+    if (!IsStoring())
+        return;
+
+    // Pasos: marca borrada, longitud, checksum, programa y por último la marca. Un byte cada vez que la EEPROM está
+    // libre, los que no cambian no esperan
+    uint8_t last = TRIGGER_HEADER_SIZE + _programLength;
+    while (_storeIndex <= last && _eepromManager->IsEEPROMReady()) {
+        uint8_t address = _storeIndex;
+        uint8_t value;
+        if (_storeIndex == 0) {
+            value = 0;
+        } else if (_storeIndex == 1) {
+            value = _programLength;
+        } else if (_storeIndex == 2) {
+            value = _programChecksum;
+        } else if (_storeIndex < last) {
+            value = _program[_storeIndex - TRIGGER_HEADER_SIZE];
+        } else {
+            // Sin programa la marca se queda borrada
+            address = 0;
+            value = _programLength ? TRIGGER_PROGRAM_MAGIC : 0;
+        }
+        _eepromManager->SaveBytesToEEPROM((EEPROMDataAddress) (ADDR_TRIGGER_PROGRAM + address), &value, 1);
+        ++_storeIndex;
+    }
+    if (_storeIndex > last)
+        _storeIndex = TRIGGER_NOT_STORING;
+}
+
+void TriggerManager::LoadProgram() {
+    _triggerCount = 0;
+
+    uint8_t header[TRIGGER_HEADER_SIZE];
+    _eepromManager->LoadBytesFromEEPROM(ADDR_TRIGGER_PROGRAM, header, TRIGGER_HEADER_SIZE);
+    uint8_t length = header[1];
+    if (header[0] != TRIGGER_PROGRAM_MAGIC || length > TRIGGER_PROGRAM_MAX_SIZE)
+        return;
+
+    // El programa se lee directamente en _program, sin buffer intermedio
+    _eepromManager->LoadBytesFromEEPROM((EEPROMDataAddress) (ADDR_TRIGGER_PROGRAM + TRIGGER_HEADER_SIZE), _program, length);
+    uint8_t checksum = length;
+    for (uint8_t i = 0; i < length; ++i) {
+        checksum += _program[i];
+    }
+    if (checksum != header[2])
+        return;
+
+    if (ParseProgram(_program, length, true)) {
+        _programLength = length;
+        _programChecksum = checksum;
+    }
+}
+
+bool TriggerManager::ParseProgram(const uint8_t *program, uint8_t length, bool apply) {
+    if (apply) {
+        _triggerCount = 0;
+        _nextTrigger = 0;
+        _pendingEvents = 0;
+        _hasInputs = false;
+    }
+    // Programa vacío, sin triggers
+    if (!length)
+        return true;
+
+    uint8_t count = program[0];
+    if (!count || count > TRIGGER_MAX_TRIGGERS)
+        return false;
+
+    uint8_t offset = 1;
+    for (uint8_t i = 0; i < count; ++i) {
+        if (offset + TRIGGER_HEADER_SIZE_PER_TRIGGER > length)
+            return false;
+        uint8_t codeLength = program[offset + 3];
+        uint8_t codeOffset = offset + TRIGGER_HEADER_SIZE_PER_TRIGGER;
+        // Cada trigger tiene que caber entero en el presupuesto de un Update()
+        if (!codeLength || codeLength > TRIGGER_INSTRUCTION_BUDGET || codeOffset + codeLength > length)
+            return false;
+        if (!ValidateCode(&program[codeOffset], codeLength))
+            return false;
+
+        if (apply) {
+            _triggers[i].actions = program[offset];
+            _triggers[i].holdTime = program[offset + 1] | (program[offset + 2] << 8);
+            _triggers[i].codeOffset = codeOffset;
+            _triggers[i].codeLength = codeLength;
+            _triggers[i].holdTimer = 0;
+            _triggers[i].isTrue = false;
+            _triggers[i].isMatched = false;
+            _triggers[i].counter = 0;
+        }
+        offset = codeOffset + codeLength;
+    }
+    if (offset != length)
+        return false;
+
+    if (apply)
+        _triggerCount = count;
+    return true;
+}
+
+bool TriggerManager::ValidateCode(const uint8_t *code, uint8_t length) {
+    // Simulamos la profundidad de la pila: ninguna instrucción puede quedarse sin operandos ni desbordarla,
+    // y al final tiene que quedar un único valor
+    uint8_t depth = 0;
+    uint8_t index = 0;
+    while (index < length) {
+        uint8_t op = code[index++];
+        switch (op) {
+            case TRIGGER_OP_CONST:
+                if (index + 2 > length || depth >= TRIGGER_STACK_SIZE)
+                    return false;
+                index += 2;
+                ++depth;
+                break;
+            case TRIGGER_OP_INPUT:
+            case TRIGGER_OP_DELTA:
+                if (index >= length || code[index] >= TRIGGER_INPUT_COUNT || depth >= TRIGGER_STACK_SIZE)
+                    return false;
+                ++index;
+                ++depth;
+                break;
+            case TRIGGER_OP_ABS:
+            case TRIGGER_OP_NOT:
+                if (depth < 1)
+                    return false;
+                break;
+            case TRIGGER_OP_ADD:
+            case TRIGGER_OP_SUB:
+            case TRIGGER_OP_LT:
+            case TRIGGER_OP_LE:
+            case TRIGGER_OP_GT:
+            case TRIGGER_OP_GE:
+            case TRIGGER_OP_EQ:
+            case TRIGGER_OP_NE:
+            case TRIGGER_OP_AND:
+            case TRIGGER_OP_OR:
+                if (depth < 2)
+                    return false;
+                --depth;
+                break;
+            default:
+                return false;
+        }
+    }
+
+    return depth == 1;
+}
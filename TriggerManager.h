@@ -0,0 +1,143 @@
+/*
+ * TriggerManager
+ *
+ * Condiciones de diagnóstico definidas por el usuario, sin tener que cambiar el firmware. Cada condición
+ * ("RPM > 7000 y presión de aceite < 3.5 bares durante 50ms", "cambio de levas con el TPS < 30%"...) se compila
+ * en el ordenador con tools/trigger_compiler.py a un bytecode de pila muy compacto, se sube por Serial1
+ * ("trigger load <hex>;", el hexadecimal sin espacios), se guarda en la EEPROM y se interpreta en cada Update() con
+ * los valores de los sensores de ese momento. Cuando una condición
+ * se cumple (durante su tiempo mínimo), incrementa su contador y/o emite un evento por Serial1 ("trigger <n>;").
+ * Los eventos se marcan en una máscara de bits y los envía el CommsManager entre sus tramas, para que no se mezclen
+ * con los volcados binarios ni bloqueen el loop con el buffer de salida lleno. Si un trigger vuelve a cumplirse antes
+ * de enviar su evento, se envía uno solo.
+ *
+ * Formato del programa (todos los enteros en little endian):
+ *   [número de triggers]
+ *   por cada trigger: [acciones (TriggerAction)] [tiempo mínimo en ms (uint16)] [longitud del código] [código]
+ *
+ * El programa se activa en cuanto se valida, y se guarda en la EEPROM en segundo plano, un byte cada vez que la EEPROM
+ * está libre (~3.3ms por byte), como las estadísticas del StatsManager. Primero se borra la marca y se escribe al final,
+ * así un corte a mitad del guardado deja la EEPROM sin programa, nunca con uno a medias.
+ *
+ * El código es una expresión en notación polaca inversa sobre una pila de int16. Al terminar tiene que quedar un
+ * único valor, distinto de 0 si la condición se cumple. No hay saltos ni bucles, así que cada instrucción cuesta un
+ * tiempo fijo y el coste de un trigger es como mucho la longitud de su código. El programa se valida entero
+ * (instrucciones, entradas y profundidad de la pila) antes de guardarlo y al cargarlo de la EEPROM.
+ *
+ * Ejemplo, "count 50ms: rpm > 7000 && oil_pressure < 350" en el compilador:
+ *   01 | 01 32 00 | 0D | 02 00  01 58 1B  22  02 01  01 5E 01  20  30
+ */
+
+#ifndef __TRIGGER_MANAGER__H__
+#define __TRIGGER_MANAGER__H__
+
+#define TRIGGER_MAX_TRIGGERS           8
+#define TRIGGER_PROGRAM_MAX_SIZE       240     // Bytes del programa (cabecera aparte)
+#define TRIGGER_STACK_SIZE             8
+#define TRIGGER_INSTRUCTION_BUDGET     64      // Instrucciones como máximo por Update(), ~150us en el peor caso. Un trigger no puede ser más largo
+#define TRIGGER_PROGRAM_MAGIC          0x54    // Marca de programa válido en la EEPROM ('T')
+#define TRIGGER_HEADER_SIZE            3       // Marca + longitud + checksum
+#define TRIGGER_HEADER_SIZE_PER_TRIGGER 4      // Acciones + tiempo mínimo + longitud del código
+#define TRIGGER_NOT_STORING            0xFF    // _storeIndex sin guardado en curso
+
+// Instrucciones del bytecode
+#define TRIGGER_OP_CONST               0x01    // + int16: apila una constante
+#define TRIGGER_OP_INPUT               0x02    // + índice: apila el valor de una entrada
+#define TRIGGER_OP_DELTA               0x03    // + índice: apila el cambio de una entrada desde la evaluación anterior
+#define TRIGGER_OP_ADD                 0x10
+#define TRIGGER_OP_SUB                 0x11
+#define TRIGGER_OP_ABS                 0x12
+#define TRIGGER_OP_LT                  0x20
+#define TRIGGER_OP_LE                  0x21
+#define TRIGGER_OP_GT                  0x22
+#define TRIGGER_OP_GE                  0x23
+#define TRIGGER_OP_EQ                  0x24
+#define TRIGGER_OP_NE                  0x25
+#define TRIGGER_OP_AND                 0x30
+#define TRIGGER_OP_OR                  0x31
+#define TRIGGER_OP_NOT                 0x32
+
+// Entradas disponibles para las expresiones, todas como int16 con la escala indicada
+enum TriggerInput {
+    TRIGGER_INPUT_RPM              = 0,  // RPM
+    TRIGGER_INPUT_OIL_PRESSURE     = 1,  // Bares x100
+    TRIGGER_INPUT_ENG_OIL_TEMP     = 2,  // Cº x10
+    TRIGGER_INPUT_GB_OIL_TEMP      = 3,  // Cº x10
+    TRIGGER_INPUT_AFR              = 4,  // AFR x100
+    TRIGGER_INPUT_VOLTAGE          = 5,  // Voltios x100
+    TRIGGER_INPUT_TPS              = 6,  // Porcentaje
+    TRIGGER_INPUT_INTAKE_CAM       = 7,  // 1 = levas de altas
+    TRIGGER_INPUT_EXHAUST_CAM      = 8,  // 1 = levas de altas
+    TRIGGER_INPUT_ECU_MAP          = 9,  // ECUMaps
+    TRIGGER_INPUT_ENGINE_ON        = 10, // 1 = motor encendido
+    TRIGGER_INPUT_OIL_PRESS_STATUS = 11, // ParameterStatus
+    TRIGGER_INPUT_COUNT            = 12  // Siempre el último
+};
+
+// Acciones al cumplirse la condición (máscara de bits)
+enum TriggerAction {
+    TRIGGER_ACTION_COUNT = 1, // Incrementa el contador del trigger
+    TRIGGER_ACTION_EVENT = 2  // Envía "trigger <n>;" por Serial1 (desde el CommsManager)
+};
+
+struct Trigger {
+    uint8_t actions;
+    uint16_t holdTime;         // Tiempo (ms) que se tiene que cumplir la condición
+    uint8_t codeOffset;        // Posición del código en el programa
+    uint8_t codeLength;
+    // Estado en tiempo de ejecución
+    uint32_t holdTimer;
+    bool isTrue;               // La condición se cumplía en la evaluación anterior
+    bool isMatched;            // La condición se ha cumplido y no ha dejado de cumplirse (sólo cuenta una vez)
+    uint16_t counter;
+};
+
+class TriggerManager {
+    EEPROMManager *_eepromManager;
+    DataManager *_dataManager;
+    DataMonitor *_dataMonitor;
+    AuxManager *_auxManager;
+    NeoVVLManager *_neoVVLManager;
+
+    uint8_t _program[TRIGGER_PROGRAM_MAX_SIZE];
+    uint8_t _programLength;
+    uint8_t _programChecksum;  // Suma de la longitud y de todos los bytes del programa
+    uint8_t _storeIndex;       // Siguiente paso del guardado en la EEPROM, TRIGGER_NOT_STORING si no hay guardado en curso
+    Trigger _triggers[TRIGGER_MAX_TRIGGERS];
+    uint8_t _triggerCount;
+
+    // Las entradas se toman una vez por ronda (todos los triggers evaluados), así todos ven los mismos valores
+    int16_t _inputs[TRIGGER_INPUT_COUNT];
+    int16_t _lastInputs[TRIGGER_INPUT_COUNT];
+    bool _hasInputs;           // Ya hay una ronda anterior, para las diferencias (TRIGGER_OP_DELTA)
+    uint8_t _nextTrigger;      // Siguiente trigger a evaluar, si la ronda anterior no cupo en el presupuesto
+    uint8_t _pendingEvents;    // Eventos pendientes de enviar (bit n = trigger n), TRIGGER_MAX_TRIGGERS <= 8
+    uint32_t _roundTimer;      // Tiempo acumulado desde el inicio de la ronda anterior
+    uint32_t _roundDiff;       // Tiempo de la ronda en curso, para los tiempos mínimos
+    uint16_t _maxUpdateMicros; // Coste máximo de Update(), para verificar el presupuesto (modo debug)
+
+    void LoadProgram();
+    void UpdateStore();
+    bool ParseProgram(const uint8_t *program, uint8_t length, bool apply);
+    bool ValidateCode(const uint8_t *code, uint8_t length);
+    void ReadInputs();
+    bool Evaluate(Trigger *trigger);
+
+  public:
+    TriggerManager();
+
+    void Initialize(EEPROMManager *eepromManager, DataManager *dataManager, DataMonitor *dataMonitor, AuxManager *auxManager, NeoVVLManager *neoVVLManager);
+    void Update(uint32_t diff);
+
+    // Valida el programa y si es correcto lo activa y empieza a guardarlo en la EEPROM. Longitud 0 para borrarlo
+    bool StoreProgram(const uint8_t *program, uint8_t length);
+    bool IsStoring() { return _storeIndex != TRIGGER_NOT_STORING; };
+    uint8_t GetTriggerCount() { return _triggerCount; };
+    uint16_t GetCounter(uint8_t index) { return index < _triggerCount ? _triggers[index].counter : 0; };
+    uint16_t GetMaxUpdateMicros() { return _maxUpdateMicros; };
+    // Eventos pendientes, el CommsManager borra cada uno al enviarlo
+    uint8_t GetPendingEvents() { return _pendingEvents; };
+    void ClearPendingEvent(uint8_t index) { _pendingEvents &= ~(1 << index); };
+};
+
+#endif
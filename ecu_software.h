@@ -9,6 +9,7 @@
  *   - Monitorear la posición de la mariposa (TPS)
  *   - Monitorear la mezcla de aire/combustible (AFR) con la señal de una sonda Wideband externa (en mi caso una AEM UEGO)
  *   - Monitorear el voltaje de la batería/alternador.
+ *   - Monitorear sensores secundarios (presión de gasolina, temperatura del refrigerante, EGT) desde un registro genérico de sensores.
  *   - Controlar el encendido de la propia sonda Wideband, para evitar que se encienda con el motor apagado y alagar su vida útil.
  *   - Emitir una señal tipo 0-1v para emular una sonda lambda (para conectarla después a la ECU de origen si es necesario).
  *   - Controlar los mapas seleccionados en la ECU del motor si esta está equipada con una daughterboard debidamente modificada/configurada.
@@ -9,6 +9,7 @@
  *   - Monitorear la posición de la mariposa (TPS)
  *   - Monitorear la mezcla de aire/combustible (AFR) con la señal de una sonda Wideband externa (en mi caso una AEM UEGO)
  *   - Monitorear el voltaje de la batería/alternador.
+ *   - Monitorear sensores secundarios (presión de gasolina, temperatura del refrigerante, EGT) desde un registro genérico de sensores.
  *   - Controlar el encendido de la propia sonda Wideband, para evitar que se encienda con el motor apagado y alagar su vida útil.
  *   - Emitir una señal tipo 0-1v para emular una sonda lambda (para conectarla después a la ECU de origen si es necesario).
  *   - Controlar los mapas seleccionados en la ECU del motor si esta está equipada con una daughterboard debidamente modificada/configurada.
@@ -18,17 +19,31 @@
 #include <OneWire.h>
 #include "ecu_software.h"
 #include "EEPROMManager.h"
+#include "OneWireAsync.h"
+#include "AnalogSampler.h"
 #include "DataManager.h"
 #include "DataMonitor.h"
+#include "SafetyGuard.h"
+#include "SensorRegistry.h"
+#include "ButtonManager.h"
 #include "AuxManager.h"
 #include "NeoVVLManager.h"
+#include "TriggerManager.h"
+#include "StatsManager.h"
+#include "HeatmapManager.h"
 #include "CommsManager.h"
 
 EEPROMManager eepromManager;
 DataManager dataManager;
 DataMonitor dataMonitor;
+SensorRegistry sensorRegistry;
+SafetyGuard safetyGuard;
+ButtonManager buttonManager;
 AuxManager auxManager;
 NeoVVLManager neoVVLManager;
+TriggerManager triggerManager;
+StatsManager statsManager;
+HeatmapManager heatmapManager;
 CommsManager commsManager;
 
 unsigned long time;
@@ -36,11 +51,14 @@ unsigned long microseconds;
 bool isFailSafeModeEnabled;
 bool isDebugEnabled;
 uint32_t debugTimer;
+uint32_t startupMicros;
+bool isStartupReported;
 
 void setup()
 {
     debugTimer = 0;
     isDebugEnabled = false;
+    isStartupReported = false;
     if (DEBUG) {
         isDebugEnabled = true;
         Serial.begin(9600);
@@ -49,12 +67,19 @@ void setup()
 
     // Configuramos un interrupt que se ejecutará cada vez que la ECU mande una señal de encendido a la bobina.
     attachInterrupt(digitalPinToInterrupt(INPUT_RPM_SIGNAL), IgnitionEvent, RISING);
-    // Recordemos que el DataManager no tiene función Initialize(), es el primero y no depende de otros Managers,
-    // por lo tanto el constructor inicializa todo lo necesario.
-    dataMonitor.Initialize(&dataManager);
-    auxManager.Initialize(&dataManager, &dataMonitor);
-    neoVVLManager.Initialize(&dataManager, &auxManager, &eepromManager);
-    commsManager.Initialize(&eepromManager, &dataManager, &dataMonitor, &auxManager, &neoVVLManager);
+    // El DataManager es el primero y sólo depende de la EEPROM. Las sondas DS18B20 se verifican en segundo plano,
+    // así que esta llamada no retrasa el arranque.
+    dataManager.Initialize(&eepromManager);
+    dataMonitor.Initialize(&dataManager, &eepromManager);
+    sensorRegistry.Initialize(&dataManager);
+    // Los botones antes que el AuxManager, que parte de su nivel al arrancar
+    buttonManager.Begin();
+    auxManager.Initialize(&dataManager, &dataMonitor, &safetyGuard, &buttonManager);
+    neoVVLManager.Initialize(&dataManager, &auxManager, &safetyGuard, &eepromManager);
+    triggerManager.Initialize(&eepromManager, &dataManager, &dataMonitor, &auxManager, &neoVVLManager);
+    statsManager.Initialize(&eepromManager, &dataManager, &dataMonitor, &auxManager, &neoVVLManager);
+    heatmapManager.Initialize(&dataManager, &dataMonitor);
+    commsManager.Initialize(&eepromManager, &dataManager, &dataMonitor, &auxManager, &neoVVLManager, &sensorRegistry, &triggerManager, &statsManager, &heatmapManager);
 
     time = millis();
 
@@ -76,13 +101,20 @@ void setup()
      * No se hasta que punto esto es cierto, lo que si se es que con las levas de altas y muelles de serie, puedes
      * superar las 9000 RPM y no explota :) jiji
      */
-    if (digitalRead(INPUT_CONTROL_BUTTON) == HIGH) {
+    if (buttonManager.IsPressed(BUTTON_CONTROL)) {
         isFailSafeModeEnabled = true;
         isDebugEnabled = true; // Activamos también el modo Debug, de todas formas al no funcionar el NeoVVL los lagazos del Serial nos dan un poco igual.
     } else {
         isFailSafeModeEnabled = false;
     }
     pinMode(13, OUTPUT);
+
+    // Vía rápida de seguridad. Los pines ya los han configurado el AuxManager y el NeoVVLManager en sus constructores.
+    // En el modo fail safe las levas no se tocan, tampoco desde las interrupciones.
+    safetyGuard.Begin(OUTPUT_MAP_SWITCH, OUTPUT_INTAKE_SOLENOID, OUTPUT_EXHAUST_SOLENOID, !isFailSafeModeEnabled);
+
+    // Tiempo de arranque, se muestra en el modo debug junto al tiempo hasta la primera lectura de RPM válida
+    startupMicros = micros();
 }
 
 void loop()
@@ -96,11 +128,21 @@ void loop()
     dataManager.Update(diff);
     // Justo después de actualizar los valores de los sensores, llamamos al DataMonitor para que los compruebe
     dataMonitor.Update(diff);
+    // Sensores secundarios (presión de gasolina, refrigerante, EGT...)
+    sensorRegistry.Update(diff);
+    // Eventos de los botones, antes del AuxManager que los consume
+    buttonManager.Update(diff);
     // Ahora actualizamos el manager de funciones auxiliares
     auxManager.Update(diff);
     // Ajustamos el estado de los árboles de levas, si no estamos en modo fail safe
     if (!isFailSafeModeEnabled)
         neoVVLManager.Update(diff);
+    // Condiciones de diagnóstico definidas por el usuario, con los valores ya actualizados
+    triggerManager.Update(diff);
+    // Estadísticas de uso, se guardan en la EEPROM en segundo plano
+    statsManager.Update(diff);
+    // Mapa de residencia RPM x TPS
+    heatmapManager.Update(diff);
     // Y por último nos comunicamos con el Arduino que controla el TFT
     commsManager.Update(diff);
 
@@ -108,9 +150,66 @@ void loop()
     // OJO, este modo debug tiene que ser activado manualmente en el código o activando la centralita en modo
     // fail safe, porque causa latencia entre ciclos y puede hacer que la centralita vaya a saltos.
     if (isDebugEnabled) {
+        if (!isStartupReported && dataManager.GetFirstValidRPMTime()) {
+            Serial.print("Startup (uS): ");
+            Serial.println(startupMicros);
+            Serial.print("First valid RPM (ms): ");
+            Serial.println(dataManager.GetFirstValidRPMTime());
+            isStartupReported = true;
+        }
         if (debugTimer >= 1000) {
             Serial.print("Diff: ");
             Serial.println(diff);
+            Serial.print("Sensors (uS): ");
+            Serial.print(sensorRegistry.GetUpdateMicros());
+            Serial.print(" / max ");
+            Serial.print(sensorRegistry.GetMaxUpdateMicros());
+            Serial.print(" / channels ");
+            Serial.println(sensorRegistry.GetSensorCount());
+            Serial.print("RPM gate rejected/quarantined: ");
+            Serial.print(dataManager.GetRPMGateRejectedEdges());
+            Serial.print(" / ");
+            Serial.println(dataManager.GetRPMGateQuarantinedEdges());
+            Serial.print("Oil press. min/max/drops: ");
+            Serial.print(dataMonitor.GetOilPressureWindowMin());
+            Serial.print(" / ");
+            Serial.print(dataMonitor.GetOilPressureWindowMax());
+            Serial.print(" / ");
+            Serial.println(dataMonitor.GetOilStarvationEvents());
+            Serial.print("Safety trips/reaction (uS): ");
+            Serial.print(safetyGuard.GetTripCount());
+            Serial.print(" / ");
+            Serial.print(safetyGuard.GetLastReactionMicros());
+            Serial.print(" / max ");
+            Serial.println(safetyGuard.GetMaxReactionMicros());
+            Serial.print("Cams switch latency (uS): ");
+            Serial.print(neoVVLManager.GetLastSwitchLatency());
+            Serial.print(" / max ");
+            Serial.println(neoVVLManager.GetMaxSwitchLatency());
+            Serial.print("Cams RPM rate/lead: ");
+            Serial.print(neoVVLManager.GetRPMRate());
+            Serial.print(" / ");
+            Serial.println(neoVVLManager.GetPredictedLead());
+            Serial.print("Cams tables (uS): ");
+            Serial.print(neoVVLManager.GetLastTableMicros());
+            Serial.print(" / max ");
+            Serial.println(neoVVLManager.GetMaxTableMicros());
+            Serial.print("Limiter RPM/cuts/cut error (uS): ");
+            Serial.print(auxManager.GetLimiterRPM());
+            Serial.print(" / ");
+            Serial.print(auxManager.GetLimiterCuts());
+            Serial.print(" / ");
+            Serial.print(auxManager.GetLastCutError());
+            Serial.print(" / max ");
+            Serial.println(auxManager.GetMaxCutError());
+            Serial.print("Lambda emulation (mV): ");
+            Serial.println(auxManager.GetLambdaMillivolts());
+            Serial.print("Button events dropped: ");
+            Serial.println(buttonManager.GetDroppedEvents());
+            Serial.print("Triggers/max (uS): ");
+            Serial.print(triggerManager.GetTriggerCount());
+            Serial.print(" / ");
+            Serial.println(triggerManager.GetMaxUpdateMicros());
             //Serial.print("Diff (uS): ");
             //Serial.println(microsDiff);
             // Aquí podemos llamar a las funciones de los diferentes managers para analizar los datos
@@ -143,5 +242,38 @@ void loop()
 }
 
 void IgnitionEvent() {
-    dataManager.CalculateRPM(micros());
+    uint32_t currentMicros = micros();
+    uint32_t interval = dataManager.CalculateRPM(currentMicros);
+    safetyGuard.IgnitionEvent(currentMicros, interval);
+    // Las levas se deciden en cuanto hay un intervalo nuevo, salvo en el modo fail safe (el loop no las arma)
+    neoVVLManager.IgnitionEvent(currentMicros, interval);
+    // Limitador de precisión, después del SafetyGuard para no deshacer sus acciones
+    auxManager.IgnitionEvent(currentMicros, interval);
+}
+
+// Interrupción del Timer1, cada slot de bit del bus OneWire de las sondas DS18B20 se ejecuta aquí
+ISR(TIMER1_COMPA_vect) {
+    dataManager.OneWireTimerEvent();
+}
+
+// Interrupción del Timer3, marca el momento de tomar la muestra síncrona después de cada encendido
+ISR(TIMER3_COMPA_vect) {
+    dataManager.SyncSampleTimerEvent();
+}
+
+// Interrupción del Timer4, fin de cada corte del limitador de precisión
+ISR(TIMER4_COMPA_vect) {
+    auxManager.LimiterTimerEvent();
+}
+
+// Interrupción de cambio de pin del puerto B, flancos de los botones
+ISR(PCINT0_vect) {
+    buttonManager.PinChangeEvent();
+}
+
+// Interrupción del ADC, fin de cada conversión (secuencia síncrona, vigilancia de transitorios u osciloscopio).
+// Con la vigilancia de transitorios salta continuamente, así que también sirve de reloj a la vía rápida de seguridad.
+ISR(ADC_vect) {
+    dataManager.ADCConversionEvent();
+    safetyGuard.Tick(dataManager.IsOilPressureLow());
 }
@@ -0,0 +1,221 @@
+/*
+ * Arduino.h para el ordenador
+ *
+ * Lo mínimo del core de Arduino y de los registros del ATmega2560 para compilar los Managers con g++ y probarlos
+ * sin la placa. Los registros son variables normales, el tiempo avanza sólo cuando lo pide la prueba (HostAdvance)
+ * y cada pin es un "puerto" propio de un solo bit, así los accesos directos a los registros (portOutputRegister...)
+ * se pueden simular igual que digitalRead/digitalWrite.
+ */
+
+#ifndef __HOST_ARDUINO__H__
+#define __HOST_ARDUINO__H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <stdio.h>
+#include <math.h>
+#include <string>
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+#define CHANGE 1
+#define FALLING 2
+#define RISING 3
+#define DEC 10
+#define HEX 16
+#define NOT_A_PIN 0
+#define A0 54
+#define A1 55
+#define A2 56
+#define A3 57
+#define A4 58
+#define A5 59
+#define A6 60
+#define A7 61
+#define A8 62
+#define A15 69
+#define HOST_PIN_COUNT 70
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+#define abs(x) ((x) > 0 ? (x) : -(x))
+#define _BV(bit) (1 << (bit))
+#define _SFR_IO_REG_P(reg) 1
+
+// Estado simulado, lo manejan las pruebas
+extern uint32_t hostMicros;
+extern uint8_t hostPins[HOST_PIN_COUNT];        // Valor de cada pin (salida escrita o entrada simulada)
+extern int16_t hostAnalog[16];                  // Lectura de cada entrada analógica (A0-A15)
+extern void (*hostPinHook)();                   // Se llama en cada digitalWrite() y delayMicroseconds(), para simular dispositivos
+extern void (*hostADCInterrupt)();              // ISR(ADC_vect), se llama desde interrupts() si hay una conversión en marcha
+void HostAdvance(uint32_t micros);
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+int analogRead(uint8_t pin);
+void analogWrite(uint8_t pin, int value);
+int digitalRead(uint8_t pin);
+void digitalWrite(uint8_t pin, uint8_t value);
+void pinMode(uint8_t pin, uint8_t mode);
+void attachInterrupt(uint8_t interrupt, void (*callback)(), int mode);
+void noInterrupts();
+void interrupts();
+#define cli() noInterrupts()
+#define sei() interrupts()
+#define digitalPinToInterrupt(pin) (pin)
+#define analogPinToChannel(pin) (pin)
+#define ISR(vector) extern "C" void vector()
+
+// Cada pin es su propio puerto, con el bit 0
+#define digitalPinToPort(pin) (pin)
+#define digitalPinToBitMask(pin) 1
+volatile uint8_t* portOutputRegister(uint8_t port);
+volatile uint8_t* portInputRegister(uint8_t port);
+volatile uint8_t* portModeRegister(uint8_t port);
+
+// Registros que usan los Managers
+#define HOST_REGISTERS_8(X) \
+    X(SREG) X(TCCR1A) X(TCCR1B) X(TIMSK1) X(TIFR1) X(TCCR3A) X(TCCR3B) X(TIMSK3) X(TIFR3) \
+    X(TCCR4A) X(TCCR4B) X(TIMSK4) X(TIFR4) X(TCCR5A) X(TCCR5B) X(TIMSK5) X(TIFR5) \
+    X(ADCSRA) X(ADCSRB) X(ADMUX) X(ADCL) X(ADCH) X(DIDR0) X(PCICR) X(PCMSK0) X(PCIFR) \
+    X(PINA) X(PORTA) X(DDRA) X(PINB) X(PORTB) X(DDRB) X(PINC) X(PORTC) X(DDRC) X(PIND) X(PORTD) X(DDRD) \
+    X(PINE) X(PORTE) X(DDRE) X(PING) X(PORTG) X(DDRG) X(PINH) X(PORTH) X(DDRH) X(PINJ) X(PORTJ) X(DDRJ) \
+    X(PINL) X(PORTL) X(DDRL)
+#define HOST_REGISTERS_16(X) \
+    X(OCR1A) X(OCR1B) X(TCNT1) X(ICR1) X(OCR3A) X(OCR3B) X(TCNT3) X(ICR3) \
+    X(OCR4A) X(OCR4B) X(TCNT4) X(ICR4) X(OCR5A) X(OCR5B) X(TCNT5) X(ICR5) X(ADC)
+#define HOST_DECLARE_8(name) extern volatile uint8_t name;
+#define HOST_DECLARE_16(name) extern volatile uint16_t name;
+HOST_REGISTERS_8(HOST_DECLARE_8)
+HOST_REGISTERS_16(HOST_DECLARE_16)
+
+// Bits de los registros
+#define WGM10 0
+#define WGM11 1
+#define WGM12 3
+#define WGM13 4
+#define CS10 0
+#define CS11 1
+#define CS12 2
+#define OCIE1A 1
+#define OCIE1B 2
+#define OCF1A 1
+#define WGM30 0
+#define WGM31 1
+#define WGM32 3
+#define WGM33 4
+#define CS30 0
+#define CS31 1
+#define CS32 2
+#define OCIE3A 1
+#define OCF3A 1
+#define WGM40 0
+#define WGM41 1
+#define WGM42 3
+#define WGM43 4
+#define CS40 0
+#define CS41 1
+#define CS42 2
+#define OCIE4A 1
+#define OCF4A 1
+#define WGM50 0
+#define WGM51 1
+#define WGM52 3
+#define WGM53 4
+#define CS50 0
+#define CS51 1
+#define CS52 2
+#define COM5A0 6
+#define COM5A1 7
+#define TOIE5 0
+#define OCIE5A 1
+#define ADPS0 0
+#define ADPS1 1
+#define ADPS2 2
+#define ADIE 3
+#define ADIF 4
+#define ADATE 5
+#define ADSC 6
+#define ADEN 7
+#define ADTS0 0
+#define ADTS1 1
+#define ADTS2 2
+#define MUX5 3
+#define ADLAR 5
+#define REFS0 6
+#define PCIE0 0
+#define PCIF0 0
+#define PCINT4 4
+#define PCINT5 5
+#define PCINT6 6
+
+class String {
+    std::string _value;
+
+  public:
+    String(const char *value = "") : _value(value) {}
+    String(const std::string &value) : _value(value) {}
+    unsigned int length() const { return _value.length(); }
+    const char* c_str() const { return _value.c_str(); }
+    char charAt(unsigned int index) const { return index < _value.length() ? _value[index] : 0; }
+    char operator[](unsigned int index) const { return charAt(index); }
+    char& operator[](unsigned int index) { return _value[index]; }
+    int indexOf(char c, unsigned int from = 0) const { size_t i = _value.find(c, from); return i == std::string::npos ? -1 : (int) i; }
+    int indexOf(const char *s, unsigned int from = 0) const { size_t i = _value.find(s, from); return i == std::string::npos ? -1 : (int) i; }
+    String substring(unsigned int from) const { return from < _value.length() ? String(_value.substr(from)) : String(); }
+    String substring(unsigned int from, unsigned int to) const { return from < to && from < _value.length() ? String(_value.substr(from, to - from)) : String(); }
+    bool startsWith(const char *prefix) const { return _value.compare(0, strlen(prefix), prefix) == 0; }
+    long toInt() const { return atol(_value.c_str()); }
+    float toFloat() const { return atof(_value.c_str()); }
+    void trim() { size_t first = _value.find_first_not_of(" \t\r\n"); size_t last = _value.find_last_not_of(" \t\r\n"); _value = first == std::string::npos ? "" : _value.substr(first, last - first + 1); }
+};
+
+// Puerto serie: lo que se escribe va a output, lo que se añade a input (HostFeed) se lee con read()
+class HardwareSerial {
+  public:
+    std::string input;
+    std::string output;
+
+    void begin(unsigned long) {}
+    void HostFeed(const char *data) { input += data; }
+    int available() { return input.length(); }
+    int availableForWrite() { return 63; }
+    int read() { if (input.empty()) return -1; int c = (uint8_t) input[0]; input.erase(0, 1); return c; }
+    int peek() { return input.empty() ? -1 : (uint8_t) input[0]; }
+    void flush() {}
+    size_t write(uint8_t c) { output += (char) c; return 1; }
+    size_t write(const uint8_t *data, size_t length) { output.append((const char*) data, length); return length; }
+    size_t write(const char *data) { output += data; return strlen(data); }
+    size_t print(const char *value) { return write(value); }
+    size_t print(const String &value) { return write(value.c_str()); }
+    size_t print(char value) { return write((uint8_t) value); }
+    size_t print(long value, int base = DEC) { char buffer[24]; snprintf(buffer, sizeof(buffer), base == HEX ? "%lX" : "%ld", value); return write(buffer); }
+    size_t print(int value, int base = DEC) { return print((long) value, base); }
+    size_t print(unsigned long value, int base = DEC) { char buffer[24]; snprintf(buffer, sizeof(buffer), base == HEX ? "%lX" : "%lu", value); return write(buffer); }
+    size_t print(unsigned int value, int base = DEC) { return print((unsigned long) value, base); }
+    size_t print(unsigned char value, int base = DEC) { return print((unsigned long) value, base); }
+    size_t print(double value, int decimals = 2) { char buffer[32]; snprintf(buffer, sizeof(buffer), "%.*f", decimals, value); return write(buffer); }
+    template <class T> size_t println(T value) { size_t n = print(value); return n + write("\r\n"); }
+    template <class T> size_t println(T value, int format) { size_t n = print(value, format); return n + write("\r\n"); }
+    size_t println() { return write("\r\n"); }
+    String readStringUntil(char terminator) { size_t i = input.find(terminator); std::string line = input.substr(0, i); input.erase(0, i == std::string::npos ? i : i + 1); return String(line); }
+};
+
+extern HardwareSerial Serial;
+extern HardwareSerial Serial1;
+extern HardwareSerial Serial2;
+extern HardwareSerial Serial3;
+
+#endif
@@ -0,0 +1,35 @@
+/*
+ * EEPROM.h para el ordenador
+ *
+ * 4KB en memoria. Como en el ATmega2560, cada byte que cambia deja la EEPROM ocupada (eeprom_is_ready() devuelve false)
+ * hasta que la prueba llama a HostEEPROMReady(), que hace de los ~3.3ms de la escritura. update() no escribe los bytes
+ * que no cambian.
+ */
+
+#ifndef __HOST_EEPROM__H__
+#define __HOST_EEPROM__H__
+
+#include "Arduino.h"
+
+#define HOST_EEPROM_SIZE 4096
+
+extern uint8_t hostEEPROM[HOST_EEPROM_SIZE];
+extern bool hostEEPROMBusy;
+extern uint32_t hostEEPROMWrites;   // Bytes escritos de verdad (cada uno cuesta ~3.3ms en la placa)
+void HostEEPROMReady();
+
+class EEPROMClass {
+  public:
+    uint8_t read(int address) { return hostEEPROM[address]; }
+    void write(int address, uint8_t value) { hostEEPROM[address] = value; hostEEPROMBusy = true; ++hostEEPROMWrites; }
+    void update(int address, uint8_t value) { if (hostEEPROM[address] != value) write(address, value); }
+    uint16_t length() { return HOST_EEPROM_SIZE; }
+};
+
+extern EEPROMClass EEPROM;
+
+inline bool eeprom_is_ready() {
+    return !hostEEPROMBusy;
+}
+
+#endif
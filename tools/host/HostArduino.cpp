@@ -0,0 +1,119 @@
+/*
+ * HostArduino
+ *
+ * Implementación en el ordenador de Arduino.h y EEPROM.h, ver la descripción en cada cabecera
+ */
+
+#include "Arduino.h"
+#include "EEPROM.h"
+
+#define HOST_DEFINE_8(name) volatile uint8_t name;
+#define HOST_DEFINE_16(name) volatile uint16_t name;
+HOST_REGISTERS_8(HOST_DEFINE_8)
+HOST_REGISTERS_16(HOST_DEFINE_16)
+
+uint32_t hostMicros = 0;
+uint8_t hostPins[HOST_PIN_COUNT];
+int16_t hostAnalog[16];
+void (*hostPinHook)() = NULL;
+void (*hostADCInterrupt)() = NULL;
+static uint8_t hostModes[HOST_PIN_COUNT];
+
+HardwareSerial Serial;
+HardwareSerial Serial1;
+HardwareSerial Serial2;
+HardwareSerial Serial3;
+
+uint8_t hostEEPROM[HOST_EEPROM_SIZE];
+bool hostEEPROMBusy = false;
+uint32_t hostEEPROMWrites = 0;
+EEPROMClass EEPROM;
+
+void HostAdvance(uint32_t micros) {
+    hostMicros += micros;
+}
+
+void HostEEPROMReady() {
+    hostEEPROMBusy = false;
+}
+
+unsigned long millis() {
+    return hostMicros / 1000;
+}
+
+unsigned long micros() {
+    return hostMicros;
+}
+
+void delay(unsigned long ms) {
+    hostMicros += ms * 1000;
+}
+
+void delayMicroseconds(unsigned int us) {
+    hostMicros += us;
+    if (hostPinHook)
+        hostPinHook();
+}
+
+int analogRead(uint8_t pin) {
+    uint8_t channel = pin >= A0 ? pin - A0 : pin;
+    return channel < 16 ? hostAnalog[channel] : 0;
+}
+
+void analogWrite(uint8_t pin, int value) {
+    if (pin < HOST_PIN_COUNT)
+        hostPins[pin] = value ? HIGH : LOW;
+}
+
+int digitalRead(uint8_t pin) {
+    return pin < HOST_PIN_COUNT ? hostPins[pin] : LOW;
+}
+
+void digitalWrite(uint8_t pin, uint8_t value) {
+    if (pin < HOST_PIN_COUNT)
+        hostPins[pin] = value ? HIGH : LOW;
+    if (hostPinHook)
+        hostPinHook();
+}
+
+void pinMode(uint8_t pin, uint8_t mode) {
+    if (pin < HOST_PIN_COUNT)
+        hostModes[pin] = mode;
+}
+
+void attachInterrupt(uint8_t, void (*)(), int) {
+}
+
+void noInterrupts() {
+}
+
+void interrupts() {
+    // La conversión en marcha termina en cuanto se vuelven a permitir las interrupciones
+    static bool isInInterrupt = false;
+    if (isInInterrupt || !hostADCInterrupt)
+        return;
+    if ((ADCSRA & (_BV(ADSC) | _BV(ADIE))) != (_BV(ADSC) | _BV(ADIE)))
+        return;
+    uint8_t channel = (ADMUX & 0x07) | (ADCSRB & _BV(MUX5) ? 0x08 : 0);
+    ADC = ADMUX & _BV(ADLAR) ? hostAnalog[channel] << 6 : hostAnalog[channel];
+    ADCH = ADMUX & _BV(ADLAR) ? hostAnalog[channel] >> 2 : hostAnalog[channel] >> 8;
+    ADCL = ADC & 0xFF;
+    // En free-running (ADATE) la siguiente conversión empieza sola
+    if (!(ADCSRA & _BV(ADATE)))
+        ADCSRA &= ~_BV(ADSC);
+    isInInterrupt = true;
+    hostADCInterrupt();
+    isInInterrupt = false;
+}
+
+volatile uint8_t* portOutputRegister(uint8_t port) {
+    return (volatile uint8_t*) &hostPins[port];
+}
+
+volatile uint8_t* portInputRegister(uint8_t port) {
+    return (volatile uint8_t*) &hostPins[port];
+}
+
+volatile uint8_t* portModeRegister(uint8_t port) {
+    return (volatile uint8_t*) &hostModes[port];
+}
@@ -0,0 +1,34 @@
+/*
+ * HostTest
+ *
+ * Comprobaciones mínimas para las pruebas en el ordenador. Cada prueba es un programa con su propio main() que
+ * devuelve HOST_TEST_RESULT(), distinto de 0 si ha fallado alguna comprobación.
+ */
+
+#ifndef __HOST_TEST__H__
+#define __HOST_TEST__H__
+
+#include <stdio.h>
+
+static int hostTestFailures = 0;
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            printf("%s:%d: falla %s\n", __FILE__, __LINE__, #condition); \
+            ++hostTestFailures; \
+        } \
+    } while (0)
+
+#define CHECK_NEAR(value, expected, tolerance) \
+    do { \
+        double hostValue = (value); \
+        if (fabs(hostValue - (expected)) > (tolerance)) { \
+            printf("%s:%d: falla %s = %f, se esperaba %f\n", __FILE__, __LINE__, #value, hostValue, (double) (expected)); \
+            ++hostTestFailures; \
+        } \
+    } while (0)
+
+#define HOST_TEST_RESULT() (printf("%s: %s\n", __FILE__, hostTestFailures ? "FALLO" : "ok"), hostTestFailures != 0)
+
+#endif
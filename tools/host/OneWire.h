@@ -0,0 +1,28 @@
+/*
+ * OneWire.h para el ordenador. El bus lo maneja OneWireAsync, de la librería sólo se usa el CRC
+ */
+
+#ifndef __HOST_ONEWIRE__H__
+#define __HOST_ONEWIRE__H__
+
+#include "Arduino.h"
+
+class OneWire {
+  public:
+    static uint8_t crc8(const uint8_t *data, uint8_t length) {
+        uint8_t crc = 0;
+        while (length--) {
+            uint8_t byte = *data++;
+            for (uint8_t i = 0; i < 8; ++i) {
+                uint8_t mix = (crc ^ byte) & 0x01;
+                crc >>= 1;
+                if (mix)
+                    crc ^= 0x8C;
+                byte >>= 1;
+            }
+        }
+        return crc;
+    }
+};
+
+#endif
@@ -0,0 +1,32 @@
+#!/bin/sh
+#
+# Compila los Managers para el ordenador con el Arduino.h simulado de esta carpeta y ejecuta las pruebas
+# (test_*.cpp). Uso: tools/host/run_tests.sh [pruebas...]
+#
+
+HOST_DIR=$(cd "$(dirname "$0")" && pwd)
+REPO_DIR=$(cd "$HOST_DIR/../.." && pwd)
+BUILD_DIR=${BUILD_DIR:-/tmp/ecu_host_tests}
+CXX=${CXX:-g++}
+CXXFLAGS="-std=gnu++11 -O1 -g -Wall -I$HOST_DIR -I$REPO_DIR"
+
+mkdir -p "$BUILD_DIR" || exit 1
+
+OBJECTS=""
+for SOURCE in "$REPO_DIR"/*.cpp "$HOST_DIR/HostArduino.cpp"; do
+    OBJECT="$BUILD_DIR/$(basename "$SOURCE" .cpp).o"
+    $CXX $CXXFLAGS -c "$SOURCE" -o "$OBJECT" || exit 1
+    OBJECTS="$OBJECTS $OBJECT"
+done
+
+TESTS="$*"
+[ -n "$TESTS" ] || TESTS=$(ls "$HOST_DIR"/test_*.cpp)
+
+FAILED=0
+for TEST in $TESTS; do
+    NAME=$(basename "$TEST" .cpp)
+    $CXX $CXXFLAGS "$HOST_DIR/$NAME.cpp" $OBJECTS -o "$BUILD_DIR/$NAME" || { FAILED=1; continue; }
+    timeout 60 "$BUILD_DIR/$NAME" || FAILED=1
+done
+
+exit $FAILED
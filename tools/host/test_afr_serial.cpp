@@ -0,0 +1,88 @@
+/*
+ * AFR digital del controlador de la sonda wideband (DataManager, AFR_SERIAL)
+ *
+ * Un controlador falso envía por Serial2 una grabación de la salida de una AEM UEGO (líneas "14.7\r\n" a 9600 baudios,
+ * ~10 por segundo), con líneas corruptas y mensajes del controlador mezclados. Se comprueba el valor en punto fijo, que
+ * las líneas inválidas no cambian la lectura, y la vuelta a la entrada analógica cuando el flujo se corta.
+ */
+
+#include <stdint.h>
+#include <OneWire.h>
+#include "EEPROMManager.h"
+#include "OneWireAsync.h"
+#include "AnalogSampler.h"
+#include "DataManager.h"
+#include "HostTest.h"
+
+// Grabación: arranque del controlador (calentando la sonda) y ralentí. Cada línea llega cada 100ms
+static const char *RECORDED_STREAM[] = {
+    "WARMUP\r\n",
+    "14.7\r\n",
+    "14.68\r\n",
+    "14.735\r\n",     // El tercer decimal se ignora
+    "1#.2\r\n",       // Ruido en la línea, se descarta entera
+    "13.9\r\n",
+    "99.9\r\n",       // Fuera de 6-25:1
+    "12.3.4\r\n",     // Dos puntos decimales
+    "123456789\r\n",  // Más larga que el buffer
+    "\r\n",
+    "12.5\n",         // Sólo '\n'
+    "13\r\n",         // Sin decimales
+};
+static const float EXPECTED_AFR[] = { -1.0, 14.7, 14.68, 14.73, 14.73, 13.9, 13.9, 13.9, 13.9, 13.9, 12.5, 13.0 };
+
+static EEPROMManager eepromManager;
+static DataManager dataManager;
+
+static void ADCInterrupt() {
+    dataManager.ADCConversionEvent();
+}
+
+static void Loop(uint32_t ms) {
+    // El loop de la centralita da muchas vueltas entre dos líneas del controlador
+    for (uint32_t i = 0; i < ms; ++i) {
+        HostAdvance(1000);
+        dataManager.Update(1);
+    }
+}
+
+int main() {
+    hostADCInterrupt = ADCInterrupt;
+    // Entrada analógica de respaldo a 2.5v
+    hostAnalog[INPUT_AFR - A0] = 512;
+    dataManager.Initialize(&eepromManager);
+    Loop(100);
+    float analogAFR = dataManager.GetAFR();
+    CHECK(analogAFR > 8.5 && analogAFR < 18.0);
+
+    for (uint8_t i = 0; i < sizeof(RECORDED_STREAM) / sizeof(RECORDED_STREAM[0]); ++i) {
+        Serial2.HostFeed(RECORDED_STREAM[i]);
+        Loop(100);
+        if (EXPECTED_AFR[i] < 0.0)
+            CHECK_NEAR(dataManager.GetAFR(), analogAFR, 0.001);
+        else
+            CHECK_NEAR(dataManager.GetAFR(), EXPECTED_AFR[i], 0.001);
+        CHECK(Serial2.available() == 0);
+    }
+
+    // Una línea partida entre dos vueltas del loop
+    Serial2.HostFeed("14.");
+    Loop(1);
+    Serial2.HostFeed("2\r\n");
+    Loop(1);
+    CHECK_NEAR(dataManager.GetAFR(), 14.2, 0.001);
+
+    // Sin líneas válidas durante AFR_SERIAL_TIMEOUT volvemos a la entrada analógica
+    Loop(AFR_SERIAL_TIMEOUT - 10);
+    CHECK_NEAR(dataManager.GetAFR(), 14.2, 0.001);
+    Serial2.HostFeed("ERROR\r\n");
+    Loop(20);
+    CHECK_NEAR(dataManager.GetAFR(), analogAFR, 0.001);
+
+    // Y en cuanto vuelve a llegar una lectura, otra vez la digital
+    Serial2.HostFeed("15.1\r\n");
+    Loop(1);
+    CHECK_NEAR(dataManager.GetAFR(), 15.1, 0.001);
+
+    return HOST_TEST_RESULT();
+}
@@ -0,0 +1,126 @@
+/*
+ * Cambio predictivo de las levas (NeoVVLManager, CAMS_PREDICTIVE_SWITCHOVER)
+ *
+ * Se registran encendidos de una rampa sintética de RPM constante, como lo haría el interrupt de encendido, y se
+ * comprueba la aceleración estimada, el adelanto de los puntos de cambio (aceleración x retraso de actuación), el
+ * límite CAMS_PREDICT_MAX_LEAD y los casos sin estimación fiable. También la interpolación de las tablas de cambio.
+ */
+
+#include <stdint.h>
+#include <OneWire.h>
+// UpdatePrediction(), InterpolateTable() y el estado que leen son privados, los abrimos sólo para la prueba
+#define class struct
+#include "FastGPIO.h"
+#include "EEPROMManager.h"
+#include "OneWireAsync.h"
+#include "AnalogSampler.h"
+#include "DataManager.h"
+#include "DataMonitor.h"
+#include "SafetyGuard.h"
+#include "ButtonManager.h"
+#include "AuxManager.h"
+#include "NeoVVLManager.h"
+#undef class
+#include "HostTest.h"
+
+static DataManager dataManager;
+
+// Aceite caliente y 13.5v (divisor de 100k/9.85k, 248 = 13.51v)
+static void SetNominalConditions() {
+    dataManager._engOilTempSensor.temp = 90.0 / DALLAS_RAW_TO_CELSIUS;
+    dataManager._voltage = 248;
+}
+
+// Encendidos (dos por vuelta) desde startRPM con una aceleración constante de rate RPM/s. Devuelve las RPM finales
+static float FeedRamp(NeoVVLManager *manager, float startRPM, float rate, uint8_t events) {
+    float rpm = startRPM;
+    for (uint8_t i = 0; i < events; ++i) {
+        uint32_t interval = CAMS_RPM_TO_INTERVAL(rpm);
+        HostAdvance(interval);
+        manager->IgnitionEvent(micros(), interval);
+        rpm += rate * interval / 1000000.0;
+    }
+    return rpm;
+}
+
+static void CheckRamp(float startRPM, float rate) {
+    NeoVVLManager manager;
+    manager._dataManager = &dataManager;
+    FeedRamp(&manager, startRPM, rate, 20);
+    manager.UpdatePrediction();
+
+    float expectedLead = rate * manager.GetActuationDelay() / 1000.0;
+    expectedLead = constrain(expectedLead, -CAMS_PREDICT_MAX_LEAD, CAMS_PREDICT_MAX_LEAD);
+    printf("  %.0f RPM, %.0f RPM/s: estimación %.0f RPM/s, adelanto %d RPM con %.1fms\n",
+        startRPM, rate, manager.GetRPMRate(), manager.GetPredictedLead(), manager.GetActuationDelay());
+    // La media de cada pareja de intervalos se desvía un poco de la rampa, ~1% en las más bruscas
+    CHECK_NEAR(manager.GetRPMRate(), rate, fabs(rate) * 0.02);
+    CHECK_NEAR(manager.GetPredictedLead(), expectedLead, fabs(expectedLead) * 0.02 + 1.0);
+}
+
+static void CheckInterpolation() {
+    NeoVVLManager manager;
+    // Tabla lineal en los dos ejes, la interpolación bilineal tiene que ser exacta
+    int16_t values[CAMS_TABLE_TEMP_POINTS][CAMS_TABLE_TPS_POINTS];
+    for (uint8_t row = 0; row < CAMS_TABLE_TEMP_POINTS; ++row) {
+        for (uint8_t column = 0; column < CAMS_TABLE_TPS_POINTS; ++column)
+            values[row][column] = 5000 + 300 * row + 100 * column;
+    }
+    CHECK(manager.InterpolateTable(values, 0, 0) == 5000);
+    CHECK(manager.InterpolateTable(values, 0x0100, 0x0300) == 5600);
+    CHECK(manager.InterpolateTable(values, 0x0180, 0x0240) == 5675);
+    // Fuera de la tabla se queda en el borde
+    CHECK(manager.InterpolateTable(values, 0x0200, 0x0500) == 6100);
+    CHECK(manager.InterpolateTable(values, 0x0700, 0x0900) == 6100);
+
+    // Un único punto distinto sólo afecta a los tramos que lo tocan
+    values[1][2] += 256;
+    CHECK(manager.InterpolateTable(values, 0x0100, 0x0200) == 5500 + 256);
+    CHECK(manager.InterpolateTable(values, 0x0080, 0x0200) == 5350 + 128);
+    CHECK(manager.InterpolateTable(values, 0x0180, 0x0180) == 5600 + 64);
+    CHECK(manager.InterpolateTable(values, 0x0100, 0x0300) == 5600);
+
+    // Posición de la tabla desde el TPS (%) y la temperatura del aceite, igual que en Update(): 55 Cº y 50% de TPS
+    uint16_t tpsPosition = ((uint32_t) 50 * CAMS_TABLE_TPS_STEP_INVERSE) >> 8;
+    uint16_t tempPosition = ((uint32_t) (55 - CAMS_TABLE_TEMP_START) * CAMS_TABLE_TEMP_STEP_INVERSE) >> 8;
+    CHECK(tpsPosition == 0x0280);
+    CHECK(tempPosition == 0x0080);
+}
+
+int main() {
+    SetNominalConditions();
+
+    // Retraso de actuación: nominal, aceite frío y voltaje bajo (limitado a CAMS_DELAY_MIN_VOLTAGE)
+    NeoVVLManager manager;
+    manager._dataManager = &dataManager;
+    CHECK_NEAR(manager.GetActuationDelay(), CAMS_ACTUATION_DELAY * CAMS_DELAY_REFERENCE_VOLTAGE / dataManager.GetVoltage(), 0.001);
+    CHECK_NEAR(manager.GetActuationDelay(), CAMS_ACTUATION_DELAY, 0.1);
+    dataManager._engOilTempSensor.temp = 50.0 / DALLAS_RAW_TO_CELSIUS;
+    CHECK_NEAR(manager.GetActuationDelay(), CAMS_ACTUATION_DELAY * 1.6, 0.1);
+    dataManager._voltage = 100;
+    CHECK_NEAR(manager.GetActuationDelay(), CAMS_ACTUATION_DELAY * 1.6 * CAMS_DELAY_REFERENCE_VOLTAGE / CAMS_DELAY_MIN_VOLTAGE, 0.1);
+    SetNominalConditions();
+
+    // Rampas sintéticas: subiendo, bajando, sin aceleración y una que supera el adelanto máximo
+    CheckRamp(4000.0, 10000.0);
+    CheckRamp(6500.0, -8000.0);
+    CheckRamp(5000.0, 0.0);
+    CheckRamp(3000.0, 25000.0);
+
+    // Sin encendidos suficientes o con el último demasiado antiguo no hay predicción
+    NeoVVLManager few;
+    few._dataManager = &dataManager;
+    float rpm = FeedRamp(&few, 4000.0, 10000.0, CAMS_PREDICT_EVENTS - 1);
+    few.UpdatePrediction();
+    CHECK(few.GetRPMRate() == 0.0 && few.GetPredictedLead() == 0);
+    FeedRamp(&few, rpm, 10000.0, 1);
+    few.UpdatePrediction();
+    CHECK(few.GetPredictedLead() > 0);
+    HostAdvance(CAMS_PREDICT_MAX_AGE + 1);
+    few.UpdatePrediction();
+    CHECK(few.GetRPMRate() == 0.0 && few.GetPredictedLead() == 0);
+
+    CheckInterpolation();
+
+    return HOST_TEST_RESULT();
+}
@@ -0,0 +1,132 @@
+/*
+ * Registro de sensores secundarios (SensorRegistry)
+ *
+ * Un MAX31855 falso responde en los pines del bus SPI bit-bang, que se comprueban en cada digitalWrite() y
+ * delayMicroseconds(). Se comprueba la decodificación de la temperatura del termopar, los fallos (bits 16 y 0-2, MISO flotando), que una
+ * trama a 0 es una lectura válida, las entradas analógicas de la tabla y el reparto de las lecturas entre loops.
+ */
+
+#include <stdint.h>
+#include <OneWire.h>
+#include "EEPROMManager.h"
+#include "OneWireAsync.h"
+#include "AnalogSampler.h"
+#include "DataManager.h"
+#include "DataMonitor.h"
+#include "SensorRegistry.h"
+#include "HostTest.h"
+
+static EEPROMManager eepromManager;
+static DataManager dataManager;
+static SensorRegistry sensorRegistry;
+
+static void ADCInterrupt() {
+    dataManager.ADCConversionEvent();
+}
+
+// MAX31855 falso: saca el bit 31 al bajar el chip select y el siguiente con cada flanco de bajada del reloj
+static uint32_t max31855Frame;
+static uint8_t max31855Bit;
+static uint8_t lastCS = HIGH;
+static uint8_t lastSCK = LOW;
+static uint8_t max31855Reads;
+
+static void MAX31855Hook() {
+    uint8_t cs = hostPins[OUTPUT_EGT_CS];
+    uint8_t sck = hostPins[OUTPUT_EGT_SCK];
+    if (cs == LOW && lastCS == HIGH) {
+        max31855Bit = 31;
+        ++max31855Reads;
+    } else if (cs == LOW && sck == LOW && lastSCK == HIGH && max31855Bit > 0) {
+        --max31855Bit;
+    }
+    hostPins[INPUT_EGT_MISO] = cs == LOW ? (max31855Frame >> max31855Bit) & 1 : HIGH;
+    lastCS = cs;
+    lastSCK = sck;
+}
+
+// Trama con la temperatura del termopar (pasos de 0.25 Cº) y de la unión fría (pasos de 0.0625 Cº)
+static uint32_t MAX31855Frame(float thermocouple, float internal) {
+    uint32_t frame = ((uint32_t) (int32_t) (thermocouple * 4) & 0x3FFF) << 18;
+    frame |= ((uint32_t) (int32_t) (internal * 16) & 0x0FFF) << 4;
+    return frame;
+}
+
+static void Loop(uint32_t ms) {
+    for (uint32_t i = 0; i < ms; ++i) {
+        HostAdvance(1000);
+        sensorRegistry.Update(1);
+    }
+}
+
+// Loops de 1ms hasta la siguiente lectura del MAX31855
+static float ReadEGT(uint32_t frame) {
+    max31855Frame = frame;
+    uint8_t reads = max31855Reads;
+    for (uint16_t i = 0; i < 1000 && max31855Reads == reads; ++i)
+        Loop(1);
+    CHECK(max31855Reads == reads + 1);
+    return sensorRegistry.GetValue(SENSOR_EGT);
+}
+
+int main() {
+    hostADCInterrupt = ADCInterrupt;
+    hostPinHook = MAX31855Hook;
+    dataManager.Initialize(&eepromManager);
+    sensorRegistry.Initialize(&dataManager);
+    // Presión de gasolina a 2.5v (3.5 bares) y refrigerante a 90 Cº (261 ohmios en la NTC)
+    hostAnalog[INPUT_FUEL_PRESSURE - A0] = 512;
+    hostAnalog[INPUT_COOLANT_TEMP - A0] = 97;
+
+    // Temperaturas positivas, negativas y cero (trama todo a 0, que no es un fallo)
+    CHECK_NEAR(ReadEGT(MAX31855Frame(850.25, 35.5)), 850.25, 0.001);
+    CHECK(sensorRegistry.IsValid(SENSOR_EGT));
+    CHECK_NEAR(ReadEGT(MAX31855Frame(-12.75, -5.0)), -12.75, 0.001);
+    CHECK_NEAR(ReadEGT(0), 0.0, 0.001);
+    CHECK(sensorRegistry.IsValid(SENSOR_EGT));
+    CHECK_NEAR(ReadEGT(MAX31855Frame(1372.0, 25.0)), 1372.0, 0.001);
+    // El motor está apagado, así que los límites no se aplican
+    CHECK(sensorRegistry.GetStatus(SENSOR_EGT) == STATUS_OK);
+
+    // Fallos del termopar: abierto, corto a GND, corto a VCC y chip que no responde
+    ReadEGT(MAX31855Frame(850.0, 25.0) | 0x00010001);
+    CHECK(!sensorRegistry.IsValid(SENSOR_EGT));
+    CHECK(sensorRegistry.GetStatus(SENSOR_EGT) == STATUS_ERROR);
+    ReadEGT(MAX31855Frame(850.0, 25.0) | 0x00010002);
+    CHECK(!sensorRegistry.IsValid(SENSOR_EGT));
+    ReadEGT(MAX31855Frame(850.0, 25.0) | 0x00010004);
+    CHECK(!sensorRegistry.IsValid(SENSOR_EGT));
+    ReadEGT(0xFFFFFFFF);
+    CHECK(!sensorRegistry.IsValid(SENSOR_EGT));
+    // Y vuelve en cuanto la lectura es correcta
+    CHECK_NEAR(ReadEGT(MAX31855Frame(420.5, 25.0)), 420.5, 0.001);
+    CHECK(sensorRegistry.IsValid(SENSOR_EGT));
+
+    // Entradas analógicas de la tabla
+    CHECK(sensorRegistry.IsValid(SENSOR_FUEL_PRESSURE));
+    CHECK_NEAR(sensorRegistry.GetValue(SENSOR_FUEL_PRESSURE), 3.5, 0.05);
+    CHECK(sensorRegistry.IsValid(SENSOR_COOLANT_TEMP));
+    CHECK_NEAR(sensorRegistry.GetValue(SENSOR_COOLANT_TEMP), 90.0, 0.5);
+    // Sensor de presión desconectado (por debajo de 0.25v)
+    hostAnalog[INPUT_FUEL_PRESSURE - A0] = 10;
+    Loop(sensorRegistry.GetDefinition(SENSOR_FUEL_PRESSURE)->interval + 1);
+    CHECK(!sensorRegistry.IsValid(SENSOR_FUEL_PRESSURE));
+    CHECK(sensorRegistry.GetStatus(SENSOR_FUEL_PRESSURE) == STATUS_ERROR);
+
+    // Cada canal se lee una vez por intervalo, repartidos entre loops de 1ms
+    SensorRegistry staggered;
+    staggered.Initialize(&dataManager);
+    uint16_t egtReads = 0;
+    uint8_t reads = max31855Reads;
+    max31855Frame = MAX31855Frame(500.0, 25.0);
+    for (uint16_t i = 0; i < 1000; ++i) {
+        HostAdvance(1000);
+        staggered.Update(1);
+        egtReads += (uint8_t) (max31855Reads - reads);
+        reads = max31855Reads;
+    }
+    uint16_t interval = staggered.GetDefinition(SENSOR_EGT)->interval;
+    CHECK(egtReads == 1000 / interval || egtReads == 1000 / interval - 1);
+
+    return HOST_TEST_RESULT();
+}
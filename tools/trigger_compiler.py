@@ -0,0 +1,398 @@
+#!/usr/bin/env python3
+"""
+Compilador de triggers para el TriggerManager
+
+Traduce las condiciones escritas como expresiones al bytecode de pila que interpreta la centralita (ver el formato
+en TriggerManager.h) y genera el comando "trigger load <hex>;" listo para enviar por Serial1.
+
+Cada línea del fichero es un trigger (las líneas vacías y lo que va detrás de '#' se ignoran):
+
+    <acciones> [<tiempo mínimo>ms]: <expresión>
+
+    count 50ms: rpm > 7000 && oil_pressure < 350
+    count, event: delta(intake_cam) != 0 && tps < 30
+
+Acciones: count (incrementa el contador), event (envía "trigger <n>;"), o las dos separadas por comas.
+
+Expresiones, de menor a mayor precedencia:
+    a || b
+    a && b
+    a < b, a <= b, a > b, a >= b, a == b, a != b
+    a + b, a - b
+    !a, -a
+    números enteros, entradas, abs(expresión), delta(entrada), (expresión)
+
+Todos los valores son int16 con la escala de la entrada, sin decimales (presión de aceite 3.5 bares = 350).
+Las operaciones saturan en vez de desbordar, como en la centralita.
+
+Uso:
+    trigger_compiler.py triggers.txt       Compila el fichero y escribe el comando
+    trigger_compiler.py -                  Lee las condiciones de la entrada estándar
+    trigger_compiler.py --self-test        Compila el ejemplo de TriggerManager.h y evalúa unas expresiones de prueba
+"""
+
+import re
+import sys
+
+# Constantes de TriggerManager.h, tienen que coincidir con las del firmware
+TRIGGER_MAX_TRIGGERS = 8
+TRIGGER_PROGRAM_MAX_SIZE = 240
+TRIGGER_STACK_SIZE = 8
+TRIGGER_INSTRUCTION_BUDGET = 64
+
+TRIGGER_OP_CONST = 0x01
+TRIGGER_OP_INPUT = 0x02
+TRIGGER_OP_DELTA = 0x03
+TRIGGER_OP_ADD = 0x10
+TRIGGER_OP_SUB = 0x11
+TRIGGER_OP_ABS = 0x12
+TRIGGER_OP_LT = 0x20
+TRIGGER_OP_LE = 0x21
+TRIGGER_OP_GT = 0x22
+TRIGGER_OP_GE = 0x23
+TRIGGER_OP_EQ = 0x24
+TRIGGER_OP_NE = 0x25
+TRIGGER_OP_AND = 0x30
+TRIGGER_OP_OR = 0x31
+TRIGGER_OP_NOT = 0x32
+
+TRIGGER_ACTION_COUNT = 1
+TRIGGER_ACTION_EVENT = 2
+
+# TriggerInput
+INPUTS = {
+    'rpm': 0,               # RPM
+    'oil_pressure': 1,      # Bares x100
+    'eng_oil_temp': 2,      # Cº x10
+    'gb_oil_temp': 3,       # Cº x10
+    'afr': 4,               # AFR x100
+    'voltage': 5,           # Voltios x100
+    'tps': 6,               # Porcentaje
+    'intake_cam': 7,        # 1 = levas de altas
+    'exhaust_cam': 8,       # 1 = levas de altas
+    'ecu_map': 9,           # ECUMaps
+    'engine_on': 10,        # 1 = motor encendido
+    'oil_press_status': 11, # ParameterStatus
+}
+
+# Constantes con nombre, para no tener que recordar los valores de los enums
+CONSTANTS = {
+    'ECU_MAP_NORMAL': 1,
+    'ECU_MAP_RACE': 2,
+    'ECU_MAP_EMERGENCY': 3,
+    'STATUS_OK': 1,
+    'STATUS_WARNING': 2,
+    'STATUS_DANGER': 3,
+    'STATUS_COLD': 4,
+    'STATUS_ERROR': 5,
+}
+
+COMPARISONS = {
+    '<': TRIGGER_OP_LT,
+    '<=': TRIGGER_OP_LE,
+    '>': TRIGGER_OP_GT,
+    '>=': TRIGGER_OP_GE,
+    '==': TRIGGER_OP_EQ,
+    '!=': TRIGGER_OP_NE,
+}
+
+TOKEN = re.compile(r'\s*(?:(\d+)|([A-Za-z_]\w*)|(\|\||&&|<=|>=|==|!=|[<>!+\-()]))')
+
+
+class CompileError(Exception):
+    pass
+
+
+class Parser:
+    def __init__(self, text):
+        self.tokens = []
+        position = 0
+        text = text.rstrip()
+        while position < len(text):
+            match = TOKEN.match(text, position)
+            if not match:
+                raise CompileError("carácter inesperado '%s'" % text[position:].strip()[0])
+            if match.group(1):
+                self.tokens.append(('number', int(match.group(1))))
+            elif match.group(2):
+                self.tokens.append(('name', match.group(2)))
+            else:
+                self.tokens.append(('op', match.group(3)))
+            position = match.end()
+        self.index = 0
+        self.code = bytearray()
+
+    def peek(self):
+        return self.tokens[self.index] if self.index < len(self.tokens) else (None, None)
+
+    def accept(self, value):
+        if self.peek() == ('op', value):
+            self.index += 1
+            return True
+        return False
+
+    def expect(self, value):
+        if not self.accept(value):
+            raise CompileError("se esperaba '%s'" % value)
+
+    def emit_const(self, value):
+        if value < -0x8000 or value > 0x7FFF:
+            raise CompileError('la constante %d no cabe en un int16' % value)
+        self.code += bytes([TRIGGER_OP_CONST]) + (value & 0xFFFF).to_bytes(2, 'little')
+
+    def compile(self):
+        self.parse_or()
+        if self.index != len(self.tokens):
+            raise CompileError("sobra '%s'" % self.tokens[self.index][1])
+        return bytes(self.code)
+
+    def parse_or(self):
+        self.parse_and()
+        while self.accept('||'):
+            self.parse_and()
+            self.code.append(TRIGGER_OP_OR)
+
+    def parse_and(self):
+        self.parse_comparison()
+        while self.accept('&&'):
+            self.parse_comparison()
+            self.code.append(TRIGGER_OP_AND)
+
+    def parse_comparison(self):
+        self.parse_sum()
+        kind, value = self.peek()
+        if kind == 'op' and value in COMPARISONS:
+            self.index += 1
+            self.parse_sum()
+            self.code.append(COMPARISONS[value])
+
+    def parse_sum(self):
+        self.parse_unary()
+        while True:
+            if self.accept('+'):
+                self.parse_unary()
+                self.code.append(TRIGGER_OP_ADD)
+            elif self.accept('-'):
+                self.parse_unary()
+                self.code.append(TRIGGER_OP_SUB)
+            else:
+                return
+
+    def parse_unary(self):
+        if self.accept('!'):
+            self.parse_unary()
+            self.code.append(TRIGGER_OP_NOT)
+        elif self.accept('-'):
+            # Las constantes negativas van directamente en la instrucción
+            kind, value = self.peek()
+            if kind == 'number':
+                self.index += 1
+                self.emit_const(-value)
+            else:
+                self.emit_const(0)
+                self.parse_unary()
+                self.code.append(TRIGGER_OP_SUB)
+        else:
+            self.parse_primary()
+
+    def parse_primary(self):
+        kind, value = self.peek()
+        self.index += 1
+        if kind == 'number':
+            self.emit_const(value)
+        elif kind == 'name' and value == 'abs':
+            self.expect('(')
+            self.parse_or()
+            self.expect(')')
+            self.code.append(TRIGGER_OP_ABS)
+        elif kind == 'name' and value == 'delta':
+            self.expect('(')
+            kind, name = self.peek()
+            if kind != 'name' or name not in INPUTS:
+                raise CompileError('delta() sólo admite una entrada')
+            self.index += 1
+            self.expect(')')
+            self.code += bytes([TRIGGER_OP_DELTA, INPUTS[name]])
+        elif kind == 'name' and value in INPUTS:
+            self.code += bytes([TRIGGER_OP_INPUT, INPUTS[value]])
+        elif kind == 'name' and value in CONSTANTS:
+            self.emit_const(CONSTANTS[value])
+        elif kind == 'op' and value == '(':
+            self.parse_or()
+            self.expect(')')
+        elif kind is None:
+            raise CompileError('la expresión está incompleta')
+        else:
+            raise CompileError("'%s' no es una entrada ni una constante" % value)
+
+
+def stack_depth(code):
+    # Misma comprobación que TriggerManager::ValidateCode()
+    depth = 0
+    maximum = 0
+    index = 0
+    while index < len(code):
+        op = code[index]
+        index += 1
+        if op == TRIGGER_OP_CONST:
+            index += 2
+            depth += 1
+        elif op in (TRIGGER_OP_INPUT, TRIGGER_OP_DELTA):
+            index += 1
+            depth += 1
+        elif op not in (TRIGGER_OP_ABS, TRIGGER_OP_NOT):
+            depth -= 1
+        maximum = max(maximum, depth)
+    return maximum
+
+
+def compile_trigger(line):
+    header, separator, expression = line.partition(':')
+    if not separator:
+        raise CompileError("falta ':' entre las acciones y la expresión")
+    words = header.replace(',', ' ').split()
+    actions = 0
+    hold = 0
+    for word in words:
+        if word == 'count':
+            actions |= TRIGGER_ACTION_COUNT
+        elif word == 'event':
+            actions |= TRIGGER_ACTION_EVENT
+        elif re.fullmatch(r'\d+ms', word):
+            hold = int(word[:-2])
+            if hold > 0xFFFF:
+                raise CompileError('el tiempo mínimo no puede pasar de 65535ms')
+        else:
+            raise CompileError("acción desconocida '%s'" % word)
+    if not actions:
+        raise CompileError('el trigger no tiene acciones (count, event)')
+
+    code = Parser(expression).compile()
+    if not code:
+        raise CompileError('la expresión está vacía')
+    if len(code) > TRIGGER_INSTRUCTION_BUDGET:
+        raise CompileError('el código ocupa %d bytes, el máximo es %d' % (len(code), TRIGGER_INSTRUCTION_BUDGET))
+    if stack_depth(code) > TRIGGER_STACK_SIZE:
+        raise CompileError('la expresión necesita más de %d niveles de pila' % TRIGGER_STACK_SIZE)
+    return bytes([actions]) + hold.to_bytes(2, 'little') + bytes([len(code)]) + code
+
+
+def compile_program(lines):
+    triggers = []
+    for number, line in enumerate(lines, 1):
+        line = line.split('#', 1)[0].strip()
+        if not line:
+            continue
+        try:
+            triggers.append(compile_trigger(line))
+        except CompileError as error:
+            raise CompileError('línea %d: %s' % (number, error))
+    if not triggers:
+        raise CompileError('no hay ningún trigger')
+    if len(triggers) > TRIGGER_MAX_TRIGGERS:
+        raise CompileError('hay %d triggers, el máximo es %d' % (len(triggers), TRIGGER_MAX_TRIGGERS))
+    program = bytes([len(triggers)]) + b''.join(triggers)
+    if len(program) > TRIGGER_PROGRAM_MAX_SIZE:
+        raise CompileError('el programa ocupa %d bytes, el máximo es %d' % (len(program), TRIGGER_PROGRAM_MAX_SIZE))
+    return program
+
+
+def evaluate(code, inputs, last_inputs):
+    # Réplica de TriggerManager::Evaluate(), sólo para las pruebas
+    def saturate(value):
+        return max(-0x8000, min(0x7FFF, value))
+
+    binary = {
+        TRIGGER_OP_ADD: lambda a, b: a + b,
+        TRIGGER_OP_SUB: lambda a, b: a - b,
+        TRIGGER_OP_LT: lambda a, b: int(a < b),
+        TRIGGER_OP_LE: lambda a, b: int(a <= b),
+        TRIGGER_OP_GT: lambda a, b: int(a > b),
+        TRIGGER_OP_GE: lambda a, b: int(a >= b),
+        TRIGGER_OP_EQ: lambda a, b: int(a == b),
+        TRIGGER_OP_NE: lambda a, b: int(a != b),
+        TRIGGER_OP_AND: lambda a, b: int(bool(a) and bool(b)),
+        TRIGGER_OP_OR: lambda a, b: int(bool(a) or bool(b)),
+    }
+    stack = []
+    index = 0
+    while index < len(code):
+        op = code[index]
+        index += 1
+        if op == TRIGGER_OP_CONST:
+            stack.append(int.from_bytes(code[index:index + 2], 'little', signed=True))
+            index += 2
+        elif op == TRIGGER_OP_INPUT:
+            stack.append(inputs[code[index]])
+            index += 1
+        elif op == TRIGGER_OP_DELTA:
+            stack.append(saturate(inputs[code[index]] - last_inputs[code[index]]))
+            index += 1
+        elif op == TRIGGER_OP_ABS:
+            stack.append(saturate(abs(stack.pop())))
+        elif op == TRIGGER_OP_NOT:
+            stack.append(int(not stack.pop()))
+        else:
+            b = stack.pop()
+            a = stack.pop()
+            stack.append(saturate(binary[op](a, b)))
+    return stack[0] != 0
+
+
+def self_test():
+    # El ejemplo de TriggerManager.h
+    expected = bytes.fromhex('01 01 32 00 0D 02 00 01 58 1B 22 02 01 01 5E 01 20 30')
+    program = compile_program(['count 50ms: rpm > 7000 && oil_pressure < 350'])
+    assert program == expected, program.hex(' ')
+
+    inputs = [0] * len(INPUTS)
+    last_inputs = [0] * len(INPUTS)
+    cases = [
+        ('rpm > 7000 && oil_pressure < 350', {'rpm': 7200, 'oil_pressure': 300}, True),
+        ('rpm > 7000 && oil_pressure < 350', {'rpm': 7200, 'oil_pressure': 350}, False),
+        ('rpm > 7000 || !engine_on', {'rpm': 800, 'engine_on': 0}, True),
+        ('abs(delta(rpm)) >= 500', {'rpm': 3000}, True),
+        ('-afr + 1470 > 100', {'afr': 1300}, True),
+        ('1 + 2 - 3 == 0 && -(tps) == -30', {'tps': 30}, True),
+        ('ecu_map == ECU_MAP_RACE && oil_press_status != STATUS_OK', {'ecu_map': 2, 'oil_press_status': 1}, False),
+        ('32767 + 1 == 32767', {}, True),
+    ]
+    last_inputs[INPUTS['rpm']] = 3600
+    for expression, values, result in cases:
+        for name, value in values.items():
+            inputs[INPUTS[name]] = value
+        code = Parser(expression).compile()
+        assert stack_depth(code) <= TRIGGER_STACK_SIZE, expression
+        assert evaluate(code, inputs, last_inputs) == result, expression
+
+    for line in ['count: rpm >', 'count: rpm > 70000', 'nothing: rpm', 'count rpm', 'count: foo > 1', 'count: (rpm']:
+        try:
+            compile_program([line])
+        except CompileError:
+            continue
+        raise AssertionError(line)
+    print('ok')
+
+
+def main():
+    if len(sys.argv) != 2:
+        print(__doc__.strip(), file=sys.stderr)
+        return 2
+    if sys.argv[1] == '--self-test':
+        self_test()
+        return 0
+
+    source = sys.stdin if sys.argv[1] == '-' else open(sys.argv[1], encoding='utf-8')
+    try:
+        program = compile_program(source.read().splitlines())
+    except CompileError as error:
+        print('error: %s' % error, file=sys.stderr)
+        return 1
+    finally:
+        source.close()
+    print('trigger load %s;' % program.hex().upper())
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())